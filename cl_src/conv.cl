@@ -1,60 +1,861 @@
 // kernels for forward/backwarding in convolution layers
 
-__kernel void conv_forward_relu_zeropad(__read_only image3d_t prev_a,
-        __write_only image3d_t cur_z,
-        __write_only image3d_t cur_a,
-        __read_only image3d_t weight,
-        __read_only image3d_t bias,
+/* forward kernels, for any padding: output pixel (x, y) reads the inputs from
+ * (x + in_off - recep_size + 1, y + in_off - recep_size + 1) on, i.e. in_off is
+ * recep_size - 1 - recep_size / 2 with zero padding and recep_size - 1 without it,
+ * as in the backward kernels below. inputs outside of the image count as zeros */
+
+// z of one output pixel.
+// weight holds (recep_size x recep_size) kernels of (cur map, prev map) pairs,
+// bias a (out_width x out_height) map per output map
+float conv_z(__read_only image3d_t prev_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int4 out_pos,
         const int in_width,
-        const int out_width)
+        const int out_width,
+        const int recep_size,
+        const int in_off)
 {
-    const int4 out_pos = {get_global_id(0), get_global_id(1),
-        get_global_id(2), 0};
     const int4 in_dim = get_image_dim(prev_a);
-    const int4 out_dim = get_image_dim(cur_a);
-    const int4 w_dim = get_image_dim(weight);
 
     const int in_height = in_dim.x / in_width;
-    const int out_x = out_pos.x % in_width;
-    const int out_y = out_pos.x / in_width;
+    const int out_x = out_pos.x % out_width;
+    const int out_y = out_pos.x / out_width;
 
-    const int recep_size = (int)(sqrt((float)(w_dim.x)));
-    const int recep_hw = (recep_size - 1) / 2;
+    // the input pixel under kernel position (0, 0)
+    const int start_x = out_x + in_off - (recep_size - 1);
+    const int start_y = out_y + in_off - (recep_size - 1);
+    const int recep_area = recep_size * recep_size;
 
     sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
             CLK_ADDRESS_CLAMP_TO_EDGE |
             CLK_FILTER_NEAREST;
 
+    const int min_cx = max(0, -start_x);
+    const int max_cx = min(recep_size, in_width - start_x);
+    const int min_cy = max(0, -start_y);
+    const int max_cy = min(recep_size, in_height - start_y);
+
     float cz_val = 0;
     for (int idxpm = 0; idxpm < in_dim.y; idxpm++)
     {
-        int min_cx = max(0, recep_hw - out_x);
-        int max_cx = min(recep_size, in_width + recep_hw - out_x);
-        int min_cy = max(0, recep_hw - out_y);
-        int max_cy = min(recep_size, in_height + recep_hw - out_y);
+        __global const float *w_map = weight + (out_pos.y * in_dim.y + idxpm) * recep_area;
         for (int conv_y = min_cy; conv_y < max_cy; conv_y++)
         {
             for (int conv_x = min_cx; conv_x < max_cx; conv_x++)
             {
-                int prev_x = out_x + conv_x - recep_hw;
-                int prev_y = out_y + conv_y - recep_hw;
+                int prev_x = start_x + conv_x;
+                int prev_y = start_y + conv_y;
                 float4 pa_val = read_imagef(prev_a, sampler,
                         (int4)(prev_y * in_width + prev_x, idxpm,
                             out_pos.z, 0));
-                float4 w_val = read_imagef(weight, sampler,
-                        (int4)(recep_size - 1 - conv_x +
-                            (recep_size - 1 - conv_y) * recep_size,
-                            idxpm, out_pos.y, 0));
-                cz_val += (pa_val.x * w_val.x);
+                cz_val += pa_val.x * w_map[recep_size - 1 - conv_x +
+                    (recep_size - 1 - conv_y) * recep_size];
             }
         }
     }
 
-    float4 bias_val = read_imagef(bias, sampler,
-            (int4)(out_x, out_y, out_pos.y, 0));
-    cz_val += bias_val.x;
+    return cz_val + bias[out_pos.y * get_global_size(0) + out_pos.x];
+}
+
+__kernel void conv_forward_relu(__read_only image3d_t prev_a,
+        __write_only image3d_t cur_z,
+        __write_only image3d_t cur_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int in_width,
+        const int out_width,
+        const int recep_size,
+        const int in_off)
+{
+    const int4 out_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+
+    float cz_val = conv_z(prev_a, weight, bias, out_pos, in_width, out_width,
+            recep_size, in_off);
     write_imagef(cur_z, out_pos, (float4)(cz_val));
 
     float tmp_z = fabs(cz_val);
     write_imagef(cur_a, out_pos, (float4)((cz_val + tmp_z) / 2.0));
 }
+
+// conv_forward_relu for inference-only data, which has no cur_z
+__kernel void conv_forward_relu_infer(__read_only image3d_t prev_a,
+        __write_only image3d_t cur_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int in_width,
+        const int out_width,
+        const int recep_size,
+        const int in_off)
+{
+    const int4 out_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+
+    float cz_val = conv_z(prev_a, weight, bias, out_pos, in_width, out_width,
+            recep_size, in_off);
+    write_imagef(cur_a, out_pos, (float4)(fmax(cz_val, 0.0f)));
+}
+
+__kernel void conv_forward_sigmoid(__read_only image3d_t prev_a,
+        __write_only image3d_t cur_z,
+        __write_only image3d_t cur_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int in_width,
+        const int out_width,
+        const int recep_size,
+        const int in_off)
+{
+    const int4 out_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+
+    float cz_val = conv_z(prev_a, weight, bias, out_pos, in_width, out_width,
+            recep_size, in_off);
+    write_imagef(cur_z, out_pos, (float4)(cz_val));
+    write_imagef(cur_a, out_pos, (float4)(1.0f / (1.0f + exp(-cz_val))));
+}
+
+// conv_forward_sigmoid for inference-only data, which has no cur_z
+__kernel void conv_forward_sigmoid_infer(__read_only image3d_t prev_a,
+        __write_only image3d_t cur_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int in_width,
+        const int out_width,
+        const int recep_size,
+        const int in_off)
+{
+    const int4 out_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+
+    float cz_val = conv_z(prev_a, weight, bias, out_pos, in_width, out_width,
+            recep_size, in_off);
+    write_imagef(cur_a, out_pos, (float4)(1.0f / (1.0f + exp(-cz_val))));
+}
+
+/* tiled forward kernels. a work-group covers (local width) x (local height *
+ * CONV_TILE_ROWS) output pixels of one output map of one sample, and each work-item
+ * computes CONV_TILE_ROWS of them, local height rows apart. for each input map the
+ * work-group first loads the input tile with its halo and the kernel of the map
+ * pair into local memory. global size is (groups x local width, groups x local
+ * height, cur_maps x train_num); the host sizes tile and w_tile accordingly.
+ * func is the value of the host's Activation enum: 0 for sigmoid, 1 for ReLU */
+
+// the number of output rows of each work-item; ConvLayer::TILE_ROWS on the host
+#define CONV_TILE_ROWS 4
+
+float conv_activation(const float z, const int func)
+{
+    if (func == 0)
+        return 1.0f / (1.0f + exp(-z));
+    return fmax(z, 0.0f);
+}
+
+// z of the output pixels of this work-item, into z in the order of the rows
+void conv_tiled_z(__read_only image3d_t prev_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int in_width,
+        const int out_width,
+        const int out_height,
+        const int recep_size,
+        const int in_off,
+        const int cur_maps,
+        __local float *tile,
+        __local float *w_tile,
+        float *z)
+{
+    const int4 in_dim = get_image_dim(prev_a);
+    const int in_height = in_dim.x / in_width;
+
+    const int lx = get_local_id(0), ly = get_local_id(1);
+    const int lw = get_local_size(0), lh = get_local_size(1);
+    const int lid = ly * lw + lx;
+    const int map = get_global_id(2) % cur_maps;
+    const int idxt = get_global_id(2) / cur_maps;
+
+    // the tile starts at the input pixel under kernel position (0, 0) of the
+    // work-group's first output pixel
+    const int tile_w = lw + recep_size - 1;
+    const int tile_h = lh * CONV_TILE_ROWS + recep_size - 1;
+    const int tile_x = get_group_id(0) * lw + in_off - (recep_size - 1);
+    const int tile_y = get_group_id(1) * lh * CONV_TILE_ROWS + in_off - (recep_size - 1);
+    const int recep_area = recep_size * recep_size;
+
+    sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
+            CLK_ADDRESS_CLAMP_TO_EDGE |
+            CLK_FILTER_NEAREST;
+
+    for (int k = 0; k < CONV_TILE_ROWS; k++)
+        z[k] = 0;
+
+    for (int idxpm = 0; idxpm < in_dim.y; idxpm++)
+    {
+        // the previous map's tiles are still read until every work-item is done
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (int i = lid; i < tile_w * tile_h; i += lw * lh)
+        {
+            const int prev_x = tile_x + i % tile_w;
+            const int prev_y = tile_y + i / tile_w;
+            float pa_val = 0;
+            if (prev_x >= 0 && prev_x < in_width && prev_y >= 0 && prev_y < in_height)
+            {
+                pa_val = read_imagef(prev_a, sampler,
+                        (int4)(prev_y * in_width + prev_x, idxpm, idxt, 0)).x;
+            }
+            tile[i] = pa_val;
+        }
+        __global const float *w_map = weight + (map * in_dim.y + idxpm) * recep_area;
+        for (int i = lid; i < recep_area; i += lw * lh)
+            w_tile[i] = w_map[i];
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int k = 0; k < CONV_TILE_ROWS; k++)
+        {
+            __local const float *t_row = tile + (ly + k * lh) * tile_w + lx;
+            float cz_val = 0;
+            for (int conv_y = 0; conv_y < recep_size; conv_y++)
+            {
+                __local const float *w_row = w_tile + (recep_size - 1 - conv_y) * recep_size;
+                for (int conv_x = 0; conv_x < recep_size; conv_x++)
+                    cz_val += t_row[conv_y * tile_w + conv_x] * w_row[recep_size - 1 - conv_x];
+            }
+            z[k] += cz_val;
+        }
+    }
+
+    const int out_x = get_global_id(0);
+    for (int k = 0; k < CONV_TILE_ROWS; k++)
+    {
+        const int out_y = get_group_id(1) * lh * CONV_TILE_ROWS + ly + k * lh;
+        if (out_x < out_width && out_y < out_height)
+            z[k] += bias[(map * out_height + out_y) * out_width + out_x];
+    }
+}
+
+__kernel void conv_forward_tiled(__read_only image3d_t prev_a,
+        __write_only image3d_t cur_z,
+        __write_only image3d_t cur_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int in_width,
+        const int out_width,
+        const int out_height,
+        const int recep_size,
+        const int in_off,
+        const int cur_maps,
+        const int func,
+        __local float *tile,
+        __local float *w_tile)
+{
+    float z[CONV_TILE_ROWS];
+    conv_tiled_z(prev_a, weight, bias, in_width, out_width, out_height, recep_size,
+            in_off, cur_maps, tile, w_tile, z);
+
+    // the work-items past the edges only helped loading the tiles
+    const int out_x = get_global_id(0);
+    for (int k = 0; k < CONV_TILE_ROWS; k++)
+    {
+        const int out_y = get_group_id(1) * get_local_size(1) * CONV_TILE_ROWS
+            + get_local_id(1) + k * get_local_size(1);
+        if (out_x >= out_width || out_y >= out_height)
+            continue;
+
+        const int4 out_pos = {out_y * out_width + out_x, get_global_id(2) % cur_maps,
+            get_global_id(2) / cur_maps, 0};
+        write_imagef(cur_z, out_pos, (float4)(z[k]));
+        write_imagef(cur_a, out_pos, (float4)(conv_activation(z[k], func)));
+    }
+}
+
+// conv_forward_tiled for inference-only data, which has no cur_z
+__kernel void conv_forward_tiled_infer(__read_only image3d_t prev_a,
+        __write_only image3d_t cur_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int in_width,
+        const int out_width,
+        const int out_height,
+        const int recep_size,
+        const int in_off,
+        const int cur_maps,
+        const int func,
+        __local float *tile,
+        __local float *w_tile)
+{
+    float z[CONV_TILE_ROWS];
+    conv_tiled_z(prev_a, weight, bias, in_width, out_width, out_height, recep_size,
+            in_off, cur_maps, tile, w_tile, z);
+
+    const int out_x = get_global_id(0);
+    for (int k = 0; k < CONV_TILE_ROWS; k++)
+    {
+        const int out_y = get_group_id(1) * get_local_size(1) * CONV_TILE_ROWS
+            + get_local_id(1) + k * get_local_size(1);
+        if (out_x >= out_width || out_y >= out_height)
+            continue;
+
+        const int4 out_pos = {out_y * out_width + out_x, get_global_id(2) % cur_maps,
+            get_global_id(2) / cur_maps, 0};
+        write_imagef(cur_a, out_pos, (float4)(conv_activation(z[k], func)));
+    }
+}
+
+/* packed forward kernels, for the RGBA layout of CLImageLayerData: texel (pixel,
+ * group, sample) holds maps 4 * group to 4 * group + 3 in its lanes, zero past the
+ * last map. a work-item computes the four output maps of one texel, and each
+ * fetch of the input serves four input maps. global size is (output pixels,
+ * output groups, train_num) */
+
+// lane l of a texel
+float conv_lane(const float4 val, const int l)
+{
+    return (l == 0) ? val.x : (l == 1) ? val.y : (l == 2) ? val.z : val.w;
+}
+
+// (w[first], w[first + stride], ...) for num values, zero past them
+float4 conv_weight_lanes(__global const float *weight,
+        const int first,
+        const int stride,
+        const int num)
+{
+    float4 w = (float4)(0.0f);
+    w.x = weight[first];
+    if (num > 1)
+        w.y = weight[first + stride];
+    if (num > 2)
+        w.z = weight[first + 2 * stride];
+    if (num > 3)
+        w.w = weight[first + 3 * stride];
+    return w;
+}
+
+// z of the four output maps of one texel; the lanes past cur_maps are zero
+float4 conv_packed_z(__read_only image3d_t prev_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int4 out_pos,
+        const int in_width,
+        const int out_width,
+        const int recep_size,
+        const int in_off,
+        const int prev_maps,
+        const int cur_maps)
+{
+    const int4 in_dim = get_image_dim(prev_a);
+
+    const int in_height = in_dim.x / in_width;
+    const int out_x = out_pos.x % out_width;
+    const int out_y = out_pos.x / out_width;
+
+    const int start_x = out_x + in_off - (recep_size - 1);
+    const int start_y = out_y + in_off - (recep_size - 1);
+    const int recep_area = recep_size * recep_size;
+    const int first_cm = out_pos.y * 4;
+    const int lanes = min(4, cur_maps - first_cm);
+
+    sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
+            CLK_ADDRESS_CLAMP_TO_EDGE |
+            CLK_FILTER_NEAREST;
+
+    const int min_cx = max(0, -start_x);
+    const int max_cx = min(recep_size, in_width - start_x);
+    const int min_cy = max(0, -start_y);
+    const int max_cy = min(recep_size, in_height - start_y);
+
+    float z[4] = {0, 0, 0, 0};
+    for (int idxpg = 0; idxpg < in_dim.y; idxpg++)
+    {
+        for (int conv_y = min_cy; conv_y < max_cy; conv_y++)
+        {
+            for (int conv_x = min_cx; conv_x < max_cx; conv_x++)
+            {
+                float4 pa_val = read_imagef(prev_a, sampler,
+                        (int4)((start_y + conv_y) * in_width + start_x + conv_x,
+                            idxpg, out_pos.z, 0));
+                const int k = recep_size - 1 - conv_x
+                    + (recep_size - 1 - conv_y) * recep_size;
+
+                // the kernels of the four input maps of the texel
+                for (int l = 0; l < lanes; l++)
+                {
+                    z[l] += dot(pa_val, conv_weight_lanes(weight,
+                                ((first_cm + l) * prev_maps + idxpg * 4) * recep_area + k,
+                                recep_area, prev_maps - idxpg * 4));
+                }
+            }
+        }
+    }
+
+    for (int l = 0; l < lanes; l++)
+        z[l] += bias[(first_cm + l) * get_global_size(0) + out_pos.x];
+    return (float4)(z[0], z[1], z[2], z[3]);
+}
+
+// the activations of z, zero in the lanes past cur_maps
+float4 conv_packed_activation(const float4 z, const int first_cm, const int cur_maps,
+        const int func)
+{
+    float4 a = (func == 0) ? 1.0f / (1.0f + exp(-z)) : fmax(z, 0.0f);
+    const int4 lane = (int4)(0, 1, 2, 3) + first_cm;
+    return select((float4)(0.0f), a, lane < cur_maps);
+}
+
+__kernel void conv_forward_packed(__read_only image3d_t prev_a,
+        __write_only image3d_t cur_z,
+        __write_only image3d_t cur_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int in_width,
+        const int out_width,
+        const int recep_size,
+        const int in_off,
+        const int prev_maps,
+        const int cur_maps,
+        const int func)
+{
+    const int4 out_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+
+    float4 cz_val = conv_packed_z(prev_a, weight, bias, out_pos, in_width, out_width,
+            recep_size, in_off, prev_maps, cur_maps);
+    write_imagef(cur_z, out_pos, cz_val);
+    write_imagef(cur_a, out_pos,
+            conv_packed_activation(cz_val, out_pos.y * 4, cur_maps, func));
+}
+
+// conv_forward_packed for inference-only data, which has no cur_z
+__kernel void conv_forward_packed_infer(__read_only image3d_t prev_a,
+        __write_only image3d_t cur_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int in_width,
+        const int out_width,
+        const int recep_size,
+        const int in_off,
+        const int prev_maps,
+        const int cur_maps,
+        const int func)
+{
+    const int4 out_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+
+    float4 cz_val = conv_packed_z(prev_a, weight, bias, out_pos, in_width, out_width,
+            recep_size, in_off, prev_maps, cur_maps);
+    write_imagef(cur_a, out_pos,
+            conv_packed_activation(cz_val, out_pos.y * 4, cur_maps, func));
+}
+
+// backward kernels, with in_off and func as in the forward ones. the weight and bias
+// kernels read the maps in either layout
+
+// f'(z) of the activation function
+float conv_activation_prime(const float z, const int func)
+{
+    if (func == 0)
+    {
+        const float s = 1.0f / (1.0f + exp(-z));
+        return s * (1.0f - s);
+    }
+    return (z > 0.0f) ? 1.0f : 0.0f;
+}
+
+// the value of one map at a pixel of sample idxt, in either layout of the maps
+float conv_read_map(__read_only image3d_t img,
+        const int pixel,
+        const int map,
+        const int idxt)
+{
+    sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
+            CLK_ADDRESS_CLAMP_TO_EDGE |
+            CLK_FILTER_NEAREST;
+
+    if (get_image_channel_order(img) != CLK_RGBA)
+        return read_imagef(img, sampler, (int4)(pixel, map, idxt, 0)).x;
+    return conv_lane(read_imagef(img, sampler, (int4)(pixel, map / 4, idxt, 0)), map % 4);
+}
+
+// prev_e = (sum of cur_e convolved with the kernels) .* f'(prev_z), one input pixel each
+__kernel void conv_backward_error(__read_only image3d_t cur_e,
+        __read_only image3d_t prev_z,
+        __write_only image3d_t prev_e,
+        __global const float *weight,
+        const int in_width,
+        const int out_width,
+        const int out_height,
+        const int recep_size,
+        const int in_off,
+        const int func)
+{
+    const int4 in_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+    const int prev_maps = get_global_size(1);
+    const int cur_maps = get_image_dim(cur_e).y;
+    const int recep_area = recep_size * recep_size;
+
+    const int in_x = in_pos.x % in_width;
+    const int in_y = in_pos.x / in_width;
+
+    sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
+            CLK_ADDRESS_CLAMP_TO_EDGE |
+            CLK_FILTER_NEAREST;
+
+    float pe_val = 0;
+    for (int idxcm = 0; idxcm < cur_maps; idxcm++)
+    {
+        __global const float *w_map = weight + (idxcm * prev_maps + in_pos.y) * recep_area;
+        for (int ky = 0; ky < recep_size; ky++)
+        {
+            const int out_y = in_y - in_off + ky;
+            if (out_y < 0 || out_y >= out_height)
+                continue;
+
+            for (int kx = 0; kx < recep_size; kx++)
+            {
+                const int out_x = in_x - in_off + kx;
+                if (out_x < 0 || out_x >= out_width)
+                    continue;
+
+                float4 ce_val = read_imagef(cur_e, sampler,
+                        (int4)(out_y * out_width + out_x, idxcm, in_pos.z, 0));
+                pe_val += ce_val.x * w_map[ky * recep_size + kx];
+            }
+        }
+    }
+
+    float4 pz_val = read_imagef(prev_z, sampler, in_pos);
+    write_imagef(prev_e, in_pos, (float4)(pe_val * conv_activation_prime(pz_val.x, func)));
+}
+
+/* conv_backward_error for packed maps: the errors of the four input maps of one
+ * texel, with each fetch of cur_e serving four output maps. global size is
+ * (input pixels, input groups, train_num) */
+__kernel void conv_backward_error_packed(__read_only image3d_t cur_e,
+        __read_only image3d_t prev_z,
+        __write_only image3d_t prev_e,
+        __global const float *weight,
+        const int in_width,
+        const int out_width,
+        const int out_height,
+        const int recep_size,
+        const int in_off,
+        const int prev_maps,
+        const int cur_maps,
+        const int func)
+{
+    const int4 in_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+    const int cur_groups = get_image_dim(cur_e).y;
+    const int recep_area = recep_size * recep_size;
+    const int first_pm = in_pos.y * 4;
+    const int lanes = min(4, prev_maps - first_pm);
+
+    const int in_x = in_pos.x % in_width;
+    const int in_y = in_pos.x / in_width;
+
+    sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
+            CLK_ADDRESS_CLAMP_TO_EDGE |
+            CLK_FILTER_NEAREST;
+
+    float pe[4] = {0, 0, 0, 0};
+    for (int idxcg = 0; idxcg < cur_groups; idxcg++)
+    {
+        for (int ky = 0; ky < recep_size; ky++)
+        {
+            const int out_y = in_y - in_off + ky;
+            if (out_y < 0 || out_y >= out_height)
+                continue;
+
+            for (int kx = 0; kx < recep_size; kx++)
+            {
+                const int out_x = in_x - in_off + kx;
+                if (out_x < 0 || out_x >= out_width)
+                    continue;
+
+                float4 ce_val = read_imagef(cur_e, sampler,
+                        (int4)(out_y * out_width + out_x, idxcg, in_pos.z, 0));
+
+                // the kernels from the four output maps of the texel
+                for (int l = 0; l < lanes; l++)
+                {
+                    pe[l] += dot(ce_val, conv_weight_lanes(weight,
+                                (idxcg * 4 * prev_maps + first_pm + l) * recep_area
+                                    + ky * recep_size + kx,
+                                prev_maps * recep_area, cur_maps - idxcg * 4));
+                }
+            }
+        }
+    }
+
+    float4 pz_val = read_imagef(prev_z, sampler, in_pos);
+    float pe_val[4] = {0, 0, 0, 0};
+    for (int l = 0; l < lanes; l++)
+        pe_val[l] = pe[l] * conv_activation_prime(conv_lane(pz_val, l), func);
+    write_imagef(prev_e, in_pos, (float4)(pe_val[0], pe_val[1], pe_val[2], pe_val[3]));
+}
+
+/* the gradient of one weight over the batch, applied in place:
+ * w = decay * w + rate * sum(cur_e * prev_a), with rate = -learn_rate / train_num.
+ * runs after conv_backward_error(), which still reads the old weights */
+__kernel void conv_backward_weight(__read_only image3d_t cur_e,
+        __read_only image3d_t prev_a,
+        __global float *weight,
+        const int in_width,
+        const int in_height,
+        const int out_width,
+        const int out_height,
+        const int recep_size,
+        const int in_off,
+        const int train_num,
+        const float rate,
+        const float decay)
+{
+    const int k = get_global_id(0);
+    const int idxpm = get_global_id(1);
+    const int idxcm = get_global_id(2);
+    const int kx = k % recep_size;
+    const int ky = k / recep_size;
+
+    // the output pixels whose input at this kernel position is inside the image
+    const int min_x = max(0, kx - in_off), max_x = min(out_width, in_width + kx - in_off);
+    const int min_y = max(0, ky - in_off), max_y = min(out_height, in_height + ky - in_off);
+
+    float dw_val = 0;
+    for (int t = 0; t < train_num; t++)
+    {
+        for (int out_y = min_y; out_y < max_y; out_y++)
+        {
+            const int in_y = out_y + in_off - ky;
+            for (int out_x = min_x; out_x < max_x; out_x++)
+            {
+                const int in_x = out_x + in_off - kx;
+                dw_val += conv_read_map(cur_e, out_y * out_width + out_x, idxcm, t)
+                    * conv_read_map(prev_a, in_y * in_width + in_x, idxpm, t);
+            }
+        }
+    }
+
+    const int idx = (idxcm * get_global_size(1) + idxpm) * get_global_size(0) + k;
+    weight[idx] = decay * weight[idx] + rate * dw_val;
+}
+
+// bias += rate * (sum of cur_e over the batch), one output pixel each
+__kernel void conv_backward_bias(__read_only image3d_t cur_e,
+        __global float *bias,
+        const int train_num,
+        const float rate)
+{
+    const int out_pos = get_global_id(0);
+    const int idxcm = get_global_id(1);
+
+    float db_val = 0;
+    for (int t = 0; t < train_num; t++)
+        db_val += conv_read_map(cur_e, out_pos, idxcm, t);
+
+    bias[idxcm * get_global_size(0) + out_pos] += rate * db_val;
+}
+
+/* the kernels above for maps in CLBufferLayerData: rows of the maps of each sample,
+ * as on the host, for batches beyond the image limits of the device. the arguments
+ * and the global sizes are those of the image versions, with the ones below added */
+
+// z of one output pixel, as conv_z()
+float conv_buf_z(__global const float *prev_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int4 out_pos,
+        const int in_width,
+        const int in_height,
+        const int out_width,
+        const int recep_size,
+        const int in_off,
+        const int prev_maps)
+{
+    const int out_x = out_pos.x % out_width;
+    const int out_y = out_pos.x / out_width;
+
+    const int start_x = out_x + in_off - (recep_size - 1);
+    const int start_y = out_y + in_off - (recep_size - 1);
+    const int recep_area = recep_size * recep_size;
+
+    const int min_cx = max(0, -start_x);
+    const int max_cx = min(recep_size, in_width - start_x);
+    const int min_cy = max(0, -start_y);
+    const int max_cy = min(recep_size, in_height - start_y);
+
+    float cz_val = 0;
+    for (int idxpm = 0; idxpm < prev_maps; idxpm++)
+    {
+        __global const float *pa_map = prev_a
+            + (out_pos.z * prev_maps + idxpm) * in_width * in_height;
+        __global const float *w_map = weight + (out_pos.y * prev_maps + idxpm) * recep_area;
+        for (int conv_y = min_cy; conv_y < max_cy; conv_y++)
+        {
+            for (int conv_x = min_cx; conv_x < max_cx; conv_x++)
+            {
+                cz_val += pa_map[(start_y + conv_y) * in_width + start_x + conv_x]
+                    * w_map[recep_size - 1 - conv_x + (recep_size - 1 - conv_y) * recep_size];
+            }
+        }
+    }
+
+    return cz_val + bias[out_pos.y * get_global_size(0) + out_pos.x];
+}
+
+__kernel void conv_forward_buf(__global const float *prev_a,
+        __global float *cur_z,
+        __global float *cur_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int in_width,
+        const int in_height,
+        const int out_width,
+        const int recep_size,
+        const int in_off,
+        const int prev_maps,
+        const int func)
+{
+    const int4 out_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+    const int idx = (out_pos.z * get_global_size(1) + out_pos.y) * get_global_size(0)
+        + out_pos.x;
+
+    float cz_val = conv_buf_z(prev_a, weight, bias, out_pos, in_width, in_height,
+            out_width, recep_size, in_off, prev_maps);
+    cur_z[idx] = cz_val;
+    cur_a[idx] = conv_activation(cz_val, func);
+}
+
+// conv_forward_buf for inference-only data, which has no cur_z
+__kernel void conv_forward_buf_infer(__global const float *prev_a,
+        __global float *cur_a,
+        __global const float *weight,
+        __global const float *bias,
+        const int in_width,
+        const int in_height,
+        const int out_width,
+        const int recep_size,
+        const int in_off,
+        const int prev_maps,
+        const int func)
+{
+    const int4 out_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+    const int idx = (out_pos.z * get_global_size(1) + out_pos.y) * get_global_size(0)
+        + out_pos.x;
+
+    float cz_val = conv_buf_z(prev_a, weight, bias, out_pos, in_width, in_height,
+            out_width, recep_size, in_off, prev_maps);
+    cur_a[idx] = conv_activation(cz_val, func);
+}
+
+__kernel void conv_backward_error_buf(__global const float *cur_e,
+        __global const float *prev_z,
+        __global float *prev_e,
+        __global const float *weight,
+        const int in_width,
+        const int out_width,
+        const int out_height,
+        const int recep_size,
+        const int in_off,
+        const int cur_maps,
+        const int func)
+{
+    const int4 in_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+    const int prev_maps = get_global_size(1);
+    const int recep_area = recep_size * recep_size;
+    const int out_area = out_width * out_height;
+
+    const int in_x = in_pos.x % in_width;
+    const int in_y = in_pos.x / in_width;
+
+    float pe_val = 0;
+    for (int idxcm = 0; idxcm < cur_maps; idxcm++)
+    {
+        __global const float *ce_map = cur_e + (in_pos.z * cur_maps + idxcm) * out_area;
+        __global const float *w_map = weight + (idxcm * prev_maps + in_pos.y) * recep_area;
+        for (int ky = 0; ky < recep_size; ky++)
+        {
+            const int out_y = in_y - in_off + ky;
+            if (out_y < 0 || out_y >= out_height)
+                continue;
+
+            for (int kx = 0; kx < recep_size; kx++)
+            {
+                const int out_x = in_x - in_off + kx;
+                if (out_x < 0 || out_x >= out_width)
+                    continue;
+
+                pe_val += ce_map[out_y * out_width + out_x] * w_map[ky * recep_size + kx];
+            }
+        }
+    }
+
+    const int idx = (in_pos.z * prev_maps + in_pos.y) * get_global_size(0) + in_pos.x;
+    prev_e[idx] = pe_val * conv_activation_prime(prev_z[idx], func);
+}
+
+__kernel void conv_backward_weight_buf(__global const float *cur_e,
+        __global const float *prev_a,
+        __global float *weight,
+        const int in_width,
+        const int in_height,
+        const int out_width,
+        const int out_height,
+        const int recep_size,
+        const int in_off,
+        const int train_num,
+        const float rate,
+        const float decay)
+{
+    const int k = get_global_id(0);
+    const int idxpm = get_global_id(1);
+    const int idxcm = get_global_id(2);
+    const int prev_maps = get_global_size(1);
+    const int cur_maps = get_global_size(2);
+    const int kx = k % recep_size;
+    const int ky = k / recep_size;
+
+    const int min_x = max(0, kx - in_off), max_x = min(out_width, in_width + kx - in_off);
+    const int min_y = max(0, ky - in_off), max_y = min(out_height, in_height + ky - in_off);
+
+    float dw_val = 0;
+    for (int t = 0; t < train_num; t++)
+    {
+        __global const float *ce_map = cur_e
+            + (t * cur_maps + idxcm) * out_width * out_height;
+        __global const float *pa_map = prev_a
+            + (t * prev_maps + idxpm) * in_width * in_height;
+        for (int out_y = min_y; out_y < max_y; out_y++)
+        {
+            const int in_y = out_y + in_off - ky;
+            for (int out_x = min_x; out_x < max_x; out_x++)
+            {
+                const int in_x = out_x + in_off - kx;
+                dw_val += ce_map[out_y * out_width + out_x] * pa_map[in_y * in_width + in_x];
+            }
+        }
+    }
+
+    const int idx = (idxcm * prev_maps + idxpm) * get_global_size(0) + k;
+    weight[idx] = decay * weight[idx] + rate * dw_val;
+}
+
+__kernel void conv_backward_bias_buf(__global const float *cur_e,
+        __global float *bias,
+        const int train_num,
+        const float rate)
+{
+    const int out_pos = get_global_id(0);
+    const int idxcm = get_global_id(1);
+    const int map_size = get_global_size(0) * get_global_size(1);
+
+    float db_val = 0;
+    for (int t = 0; t < train_num; t++)
+        db_val += cur_e[t * map_size + idxcm * get_global_size(0) + out_pos];
+
+    bias[idxcm * get_global_size(0) + out_pos] += rate * db_val;
+}
@@ -15,3 +15,23 @@ __kernel void grayscale_img(__read_only image2d_t img_in,
     float vsum = val.x + val.y + val.z;
     write_imagef(img_out, pos, (float4)(vsum, vsum, vsum, val.w));
 }
+
+/* spreads the maps of an RGBA-packed image3d_t of (pixels, map groups, samples)
+ * into rows of map_num maps per sample, one texel each */
+__kernel void image_unpack_maps(__read_only image3d_t img,
+        __global float *rows,
+        const int map_num)
+{
+    const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    const int area = get_global_size(0);
+
+    sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
+            CLK_ADDRESS_CLAMP_TO_EDGE |
+            CLK_FILTER_NEAREST;
+
+    const float4 val = read_imagef(img, sampler, pos);
+    const float lanes[4] = {val.x, val.y, val.z, val.w};
+    __global float *row = rows + pos.z * map_num * area;
+    for (int l = 0; l < 4 && pos.y * 4 + l < map_num; l++)
+        row[(pos.y * 4 + l) * area + pos.x] = lanes[l];
+}
@@ -1,21 +1,19 @@
 // kernels for forward/backwarding in max pool layers
 
-__kernel void max_pool_forward(__read_only image3d_t prev_z,
-        __read_only image3d_t prev_a,
-        __write_only image3d_t cur_z,
-        __write_only image3d_t cur_a,
+/* pooling works on each lane of the texels alone, so the kernels take the maps in
+ * either layout of CLImageLayerData, with maps or groups of four maps in y */
+
+// maximum of the pooling window of one output pixel
+float4 max_pool_window(__read_only image3d_t prev,
+        const int4 out_pos,
         const int in_width,
         const int pool_width,
         const int pool_height,
         const int stride)
 {
-    const int4 out_pos = {get_global_id(0), get_global_id(1),
-        get_global_id(2), 0};
-
     int delta_w = pool_width - (stride - 1);
     int delta_h = pool_height - (stride - 1);
 
-    const int4 in_dim = get_image_dim(prev_z);
     int out_width = (in_width - pool_width) / delta_w + 1;
 
     const int out_x = out_pos.x % out_width;
@@ -25,10 +23,9 @@ __kernel void max_pool_forward(__read_only image3d_t prev_z,
             CLK_ADDRESS_CLAMP_TO_EDGE |
             CLK_FILTER_NEAREST;
 
-    // downsample cur_z
-    float maxv = read_imagef(prev_z, sampler,
+    float4 maxv = read_imagef(prev, sampler,
             (int4)(out_y * delta_h * in_width + out_x * delta_w,
-                out_pos.y, out_pos.z, 0)).x;
+                out_pos.y, out_pos.z, 0));
     for (int y = out_y * delta_h; y < out_y * delta_h + pool_height;
             y++)
     {
@@ -36,26 +33,232 @@ __kernel void max_pool_forward(__read_only image3d_t prev_z,
                 x++)
         {
             maxv = fmax(maxv,
-                    read_imagef(prev_z, sampler,
-                        (int4)(y*in_width + x, out_pos.y, out_pos.z, 0)).x);
+                    read_imagef(prev, sampler,
+                        (int4)(y*in_width + x, out_pos.y, out_pos.z, 0)));
         }
     }
-    write_imagef(cur_z, out_pos, (float4)(maxv, maxv, maxv, maxv));
+    return maxv;
+}
+
+__kernel void max_pool_forward(__read_only image3d_t prev_z,
+        __read_only image3d_t prev_a,
+        __write_only image3d_t cur_z,
+        __write_only image3d_t cur_a,
+        const int in_width,
+        const int pool_width,
+        const int pool_height,
+        const int stride)
+{
+    const int4 out_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+
+    // downsample cur_z
+    float4 maxv = max_pool_window(prev_z, out_pos, in_width, pool_width, pool_height,
+            stride);
+    write_imagef(cur_z, out_pos, maxv);
 
     // downsample cur_a
-    maxv = read_imagef(prev_a, sampler,
-            (int4)(out_y * delta_h * in_width + out_x * delta_w,
-                out_pos.y, out_pos.z, 0)).x;
-    for (int y = out_y * delta_h; y < out_y * delta_h + pool_height;
-            y++)
+    maxv = max_pool_window(prev_a, out_pos, in_width, pool_width, pool_height,
+            stride);
+    write_imagef(cur_a, out_pos, maxv);
+}
+
+// max_pool_forward for inference-only data, which has no z values
+__kernel void max_pool_forward_infer(__read_only image3d_t prev_a,
+        __write_only image3d_t cur_a,
+        const int in_width,
+        const int pool_width,
+        const int pool_height,
+        const int stride)
+{
+    const int4 out_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+
+    float4 maxv = max_pool_window(prev_a, out_pos, in_width, pool_width, pool_height,
+            stride);
+    write_imagef(cur_a, out_pos, maxv);
+}
+
+/* the error of one input pixel: that of the windows whose maximum it is, with
+ * the windows in the order upsample_max() visits them, where later ones overwrite
+ * earlier ones. every input pixel is written, so prev_e need not be cleared */
+__kernel void max_pool_backward(__read_only image3d_t cur_e,
+        __read_only image3d_t prev_a,
+        __write_only image3d_t prev_e,
+        const int in_width,
+        const int in_height,
+        const int pool_width,
+        const int pool_height,
+        const int stride)
+{
+    const int4 in_pos = {get_global_id(0), get_global_id(1),
+        get_global_id(2), 0};
+
+    const int delta_w = pool_width - (stride - 1);
+    const int delta_h = pool_height - (stride - 1);
+    const int out_width = (in_width - pool_width) / delta_w + 1;
+    const int out_height = (in_height - pool_height) / delta_h + 1;
+
+    const int in_x = in_pos.x % in_width;
+    const int in_y = in_pos.x / in_width;
+
+    sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
+            CLK_ADDRESS_CLAMP_TO_EDGE |
+            CLK_FILTER_NEAREST;
+
+    // the windows which contain the pixel
+    const int min_wx = max(0, (in_x - pool_width + delta_w) / delta_w);
+    const int max_wx = min(out_width - 1, in_x / delta_w);
+    const int min_wy = max(0, (in_y - pool_height + delta_h) / delta_h);
+    const int max_wy = min(out_height - 1, in_y / delta_h);
+
+    float4 pe_val = (float4)(0.0f);
+    for (int wy = min_wy; wy <= max_wy; wy++)
     {
-        for (int x = out_x * delta_w; x < out_x * delta_w + pool_width;
-                x++)
+        for (int wx = min_wx; wx <= max_wx; wx++)
         {
-            maxv = fmax(maxv,
-                    read_imagef(prev_a, sampler,
-                        (int4)(y*in_width + x, out_pos.y, out_pos.z, 0)).x);
+            // the first maximum of the window in each lane, as upsample_max() picks it
+            int4 max_pix = (int4)(wy * delta_h * in_width + wx * delta_w);
+            float4 vmax = read_imagef(prev_a, sampler,
+                    (int4)(max_pix.x, in_pos.y, in_pos.z, 0));
+            for (int y = wy * delta_h; y < wy * delta_h + pool_height; y++)
+            {
+                for (int x = wx * delta_w; x < wx * delta_w + pool_width; x++)
+                {
+                    float4 val = read_imagef(prev_a, sampler,
+                            (int4)(y * in_width + x, in_pos.y, in_pos.z, 0));
+                    const int4 larger = isless(vmax, val);
+                    vmax = select(vmax, val, larger);
+                    max_pix = select(max_pix, (int4)(y * in_width + x), larger);
+                }
+            }
+
+            float4 ce_val = read_imagef(cur_e, sampler,
+                    (int4)(wy * out_width + wx, in_pos.y, in_pos.z, 0));
+            pe_val = select(pe_val, ce_val, max_pix == (int4)(in_pos.x));
+        }
+    }
+
+    write_imagef(prev_e, in_pos, pe_val);
+}
+
+/* the kernels above for maps in CLBufferLayerData, rows of the maps of each sample
+ * as on the host. they take in_height after in_width; the global sizes are those
+ * of the image versions with the maps in y */
+
+// maximum of the pooling window of one output pixel in a map of in_width columns
+float max_pool_buf_window(__global const float *map,
+        const int out_pix,
+        const int in_width,
+        const int pool_width,
+        const int pool_height,
+        const int stride)
+{
+    const int delta_w = pool_width - (stride - 1);
+    const int delta_h = pool_height - (stride - 1);
+    const int out_width = (in_width - pool_width) / delta_w + 1;
+
+    const int out_x = out_pix % out_width;
+    const int out_y = out_pix / out_width;
+
+    float maxv = map[out_y * delta_h * in_width + out_x * delta_w];
+    for (int y = out_y * delta_h; y < out_y * delta_h + pool_height; y++)
+    {
+        for (int x = out_x * delta_w; x < out_x * delta_w + pool_width; x++)
+            maxv = fmax(maxv, map[y * in_width + x]);
+    }
+    return maxv;
+}
+
+__kernel void max_pool_forward_buf(__global const float *prev_z,
+        __global const float *prev_a,
+        __global float *cur_z,
+        __global float *cur_a,
+        const int in_width,
+        const int in_height,
+        const int pool_width,
+        const int pool_height,
+        const int stride)
+{
+    // the map of this work-item in the batch, then the pixel in it
+    const int map = get_global_id(2) * get_global_size(1) + get_global_id(1);
+    const int in_start = map * in_width * in_height;
+    const int idx = map * get_global_size(0) + get_global_id(0);
+
+    cur_z[idx] = max_pool_buf_window(prev_z + in_start, get_global_id(0), in_width,
+            pool_width, pool_height, stride);
+    cur_a[idx] = max_pool_buf_window(prev_a + in_start, get_global_id(0), in_width,
+            pool_width, pool_height, stride);
+}
+
+// max_pool_forward_buf for inference-only data, which has no z values
+__kernel void max_pool_forward_buf_infer(__global const float *prev_a,
+        __global float *cur_a,
+        const int in_width,
+        const int in_height,
+        const int pool_width,
+        const int pool_height,
+        const int stride)
+{
+    const int map = get_global_id(2) * get_global_size(1) + get_global_id(1);
+    const int idx = map * get_global_size(0) + get_global_id(0);
+
+    cur_a[idx] = max_pool_buf_window(prev_a + map * in_width * in_height,
+            get_global_id(0), in_width, pool_width, pool_height, stride);
+}
+
+// the error of one input pixel, as max_pool_backward()
+__kernel void max_pool_backward_buf(__global const float *cur_e,
+        __global const float *prev_a,
+        __global float *prev_e,
+        const int in_width,
+        const int in_height,
+        const int pool_width,
+        const int pool_height,
+        const int stride)
+{
+    const int in_pix = get_global_id(0);
+    const int map = get_global_id(2) * get_global_size(1) + get_global_id(1);
+
+    const int delta_w = pool_width - (stride - 1);
+    const int delta_h = pool_height - (stride - 1);
+    const int out_width = (in_width - pool_width) / delta_w + 1;
+    const int out_height = (in_height - pool_height) / delta_h + 1;
+
+    const int in_x = in_pix % in_width;
+    const int in_y = in_pix / in_width;
+    __global const float *pa_map = prev_a + map * in_width * in_height;
+    __global const float *ce_map = cur_e + map * out_width * out_height;
+
+    const int min_wx = max(0, (in_x - pool_width + delta_w) / delta_w);
+    const int max_wx = min(out_width - 1, in_x / delta_w);
+    const int min_wy = max(0, (in_y - pool_height + delta_h) / delta_h);
+    const int max_wy = min(out_height - 1, in_y / delta_h);
+
+    float pe_val = 0;
+    for (int wy = min_wy; wy <= max_wy; wy++)
+    {
+        for (int wx = min_wx; wx <= max_wx; wx++)
+        {
+            // the first maximum of the window, as upsample_max() picks it
+            int max_pix = wy * delta_h * in_width + wx * delta_w;
+            float vmax = pa_map[max_pix];
+            for (int y = wy * delta_h; y < wy * delta_h + pool_height; y++)
+            {
+                for (int x = wx * delta_w; x < wx * delta_w + pool_width; x++)
+                {
+                    if (vmax < pa_map[y * in_width + x])
+                    {
+                        vmax = pa_map[y * in_width + x];
+                        max_pix = y * in_width + x;
+                    }
+                }
+            }
+
+            if (max_pix == in_pix)
+                pe_val = ce_map[wy * out_width + wx];
         }
     }
-    write_imagef(cur_a, out_pos, (float4)(maxv, maxv, maxv, maxv));
+
+    prev_e[map * in_width * in_height + in_pix] = pe_val;
 }
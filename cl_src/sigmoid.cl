@@ -1,71 +1,348 @@
-// kernels for forward/backwarding in sigmiod layers
+// kernels for forward/backwarding in sigmiod layers.
+// the data of a fully-connected layer is a buffer of train_num rows of its neurons;
+// weight is the (cur_d x prev_d) matrix in rows.
+// the current data may be a slice of the rows of a merged layer: its neurons start
+// at cur_off in rows of cur_ld values (0 and cur_d for data of its own)
 
-__kernel void sigmoid_forward(__read_only image2d_t prev_a,
-        __read_only image2d_t weight,
+/* the forward kernels are a tiled GEMM, z = prev_a * W^T + b.
+ * a work-group covers (local size 0) neurons of (local size 1) samples. it walks
+ * prev_d in slices of SIGMOID_TILE_K4 float4s, loading the slice of its weight rows
+ * into w_tile and that of its input rows into a_tile, from where every work-item
+ * accumulates the dot product of its (neuron, sample) pair.
+ * global size is (neurons, samples) rounded up to whole work-groups */
+
+// the float4s of each row in a slice; SigmoidLayer::TILE_K4 on the host
+#define SIGMOID_TILE_K4 4
+
+// four values of row from k on, with zeros past len
+float4 sigmoid_load4(__global const float *row, const int k, const int len)
+{
+    if (k + 4 <= len)
+        return vload4(0, row + k);
+
+    float4 val = (float4)(0.0f);
+    if (k < len)
+        val.x = row[k];
+    if (k + 1 < len)
+        val.y = row[k + 1];
+    if (k + 2 < len)
+        val.z = row[k + 2];
+    return val;
+}
+
+// z of this work-item's neuron and sample; meaningless for the ones past the edges
+float sigmoid_tiled_z(__global const float *prev_a,
+        __global const float *weight,
         __constant float* bias,
-        __write_only image2d_t cur_z,
-        __write_only image2d_t cur_a,
+        const int prev_d,
+        const int cur_d,
+        const int train_num,
+        __local float4 *w_tile,
+        __local float4 *a_tile)
+{
+    const int lc = get_local_id(0), lt = get_local_id(1);
+    const int nc = get_local_size(0), nt = get_local_size(1);
+    const int lid = lt * nc + lc;
+    const int c_base = get_group_id(0) * nc;
+    const int t_base = get_group_id(1) * nt;
+
+    float4 acc = (float4)(0.0f);
+    for (int k_base = 0; k_base < prev_d; k_base += SIGMOID_TILE_K4 * 4)
+    {
+        // the previous slice is still read until every work-item is done
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (int i = lid; i < (nc + nt) * SIGMOID_TILE_K4; i += nc * nt)
+        {
+            const int row = i / SIGMOID_TILE_K4;
+            const int k = k_base + (i % SIGMOID_TILE_K4) * 4;
+            if (row < nc)
+            {
+                const int idxc = c_base + row;
+                w_tile[i] = (idxc < cur_d) ?
+                    sigmoid_load4(weight + idxc * prev_d, k, prev_d) : (float4)(0.0f);
+            }
+            else
+            {
+                const int idxt = t_base + row - nc;
+                a_tile[i - nc * SIGMOID_TILE_K4] = (idxt < train_num) ?
+                    sigmoid_load4(prev_a + idxt * prev_d, k, prev_d) : (float4)(0.0f);
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int j = 0; j < SIGMOID_TILE_K4; j++)
+            acc += w_tile[lc * SIGMOID_TILE_K4 + j] * a_tile[lt * SIGMOID_TILE_K4 + j];
+    }
+
+    const int idxc = c_base + lc;
+    return acc.x + acc.y + acc.z + acc.w + ((idxc < cur_d) ? bias[idxc] : 0.0f);
+}
+
+__kernel void sigmoid_forward(__global const float *prev_a,
+        __global const float *weight,
+        __constant float* bias,
+        __global float *cur_z,
+        __global float *cur_a,
         __constant float* dropout_coeffs,
         const int prev_d,
-        const int cur_d)
+        const int cur_d,
+        const int cur_off,
+        const int cur_ld,
+        const int train_num,
+        __local float4 *w_tile,
+        __local float4 *a_tile)
 {
-    int2 gpos = {get_global_id(0), get_global_id(1)};
-    int idxc = gpos.x;
-    int idxt = gpos.y;
+    const int idxc = get_global_id(0);
+    const int idxt = get_global_id(1);
+
+    float tmpz = sigmoid_tiled_z(prev_a, weight, bias, prev_d, cur_d, train_num,
+            w_tile, a_tile);
+    if (idxc >= cur_d || idxt >= train_num)
+        return;
+
+    cur_z[cur_off + idxt * cur_ld + idxc] = tmpz;
+    cur_a[cur_off + idxt * cur_ld + idxc] = (1.0f / (1.0f + exp(-tmpz)))
+        * dropout_coeffs[idxc];
+}
+
+// sigmoid_forward for inference-only data, which has no cur_z
+__kernel void sigmoid_forward_infer(__global const float *prev_a,
+        __global const float *weight,
+        __constant float* bias,
+        __global float *cur_a,
+        __constant float* dropout_coeffs,
+        const int prev_d,
+        const int cur_d,
+        const int cur_off,
+        const int cur_ld,
+        const int train_num,
+        __local float4 *w_tile,
+        __local float4 *a_tile)
+{
+    const int idxc = get_global_id(0);
+    const int idxt = get_global_id(1);
+
+    float tmpz = sigmoid_tiled_z(prev_a, weight, bias, prev_d, cur_d, train_num,
+            w_tile, a_tile);
+    if (idxc >= cur_d || idxt >= train_num)
+        return;
+
+    cur_a[cur_off + idxt * cur_ld + idxc] = (1.0f / (1.0f + exp(-tmpz)))
+        * dropout_coeffs[idxc];
+}
+
+/* backward kernels. the dropout coefficients scale cur_e as backward_cpu() does:
+ * they are the mask while dropout is enabled and the dropout rate otherwise.
+ * the _img versions take the previous layer's data as an image3d_t of maps, in
+ * either layout of CLImageLayerData except for the error, which has a _packed one */
+
+// lane l of a texel
+float sigmoid_lane(const float4 val, const int l)
+{
+    return (l == 0) ? val.x : (l == 1) ? val.y : (l == 2) ? val.z : val.w;
+}
+
+// the previous value of index idxp of sample idxt in an image3d_t of maps, which
+// may hold four maps to a texel
+float sigmoid_read_img(__read_only image3d_t img, const int idxp, const int idxt)
+{
+    const int4 dim = get_image_dim(img);
+    const int map = idxp / dim.x;
 
     sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
             CLK_ADDRESS_CLAMP_TO_EDGE |
             CLK_FILTER_NEAREST;
 
-    // matrix-vector multiplication
-    float tmpz = 0;
-    for (int idxp = 0; idxp < prev_d; idxp++)
-    {
-        float4 w_val = read_imagef(weight, sampler,
-                (int2)(idxp, idxc));
-        float4 pa_val = read_imagef(prev_a, sampler,
-                (int2)(idxp, idxt));
-        tmpz += w_val.x * pa_val.x;
-    }
-    tmpz += bias[idxc];
-    write_imagef(cur_z, gpos, tmpz);
+    if (get_image_channel_order(img) != CLK_RGBA)
+        return read_imagef(img, sampler, (int4)(idxp % dim.x, map, idxt, 0)).x;
+    return sigmoid_lane(read_imagef(img, sampler, (int4)(idxp % dim.x, map / 4, idxt, 0)),
+            map % 4);
+}
 
-    float tmpa = (1.0 / (1.0 + exp(-tmpz))) * dropout_coeffs[idxc];
-    write_imagef(cur_a, gpos, tmpa);
+// cur_e * W of index idxp for sample idxt
+float sigmoid_back_e(__global const float *cur_e,
+        __global const float *weight,
+        __constant float* dropout_coeffs,
+        const int idxp,
+        const int idxt,
+        const int prev_d,
+        const int cur_d,
+        const int cur_off,
+        const int cur_ld)
+{
+    __global const float *ce_row = cur_e + cur_off + idxt * cur_ld;
+
+    float tmpe = 0;
+    for (int idxc = 0; idxc < cur_d; idxc++)
+        tmpe += ce_row[idxc] * dropout_coeffs[idxc] * weight[idxc * prev_d + idxp];
+    return tmpe;
 }
 
-__kernel void sigmoid_forward_img(__read_only image3d_t prev_a,
-        __read_only image2d_t weight,
-        __constant float* bias,
-        __write_only image2d_t cur_z,
-        __write_only image2d_t cur_a,
+// prev_e = (cur_e * W) .* sigmoid'(prev_z), one previous neuron of one sample each
+__kernel void sigmoid_backward_error(__global const float *cur_e,
+        __global const float *prev_z,
+        __global float *prev_e,
+        __global const float *weight,
         __constant float* dropout_coeffs,
         const int prev_d,
-        const int cur_d)
+        const int cur_d,
+        const int cur_off,
+        const int cur_ld)
 {
-    int2 gpos = {get_global_id(0), get_global_id(1)};
-    int idxc = gpos.x;
-    int idxt = gpos.y;
-    const int4 pa_dim = get_image_dim(prev_a);
+    const int idxp = get_global_id(0);
+    const int idxt = get_global_id(1);
+
+    float tmpe = sigmoid_back_e(cur_e, weight, dropout_coeffs, idxp, idxt,
+            prev_d, cur_d, cur_off, cur_ld);
+    float s = 1.0 / (1.0 + exp(-prev_z[idxt * prev_d + idxp]));
+    prev_e[idxt * prev_d + idxp] = tmpe * s * (1.0 - s);
+}
+
+__kernel void sigmoid_backward_error_img(__global const float *cur_e,
+        __read_only image3d_t prev_z,
+        __write_only image3d_t prev_e,
+        __global const float *weight,
+        __constant float* dropout_coeffs,
+        const int prev_d,
+        const int cur_d,
+        const int cur_off,
+        const int cur_ld)
+{
+    const int idxp = get_global_id(0);
+    const int idxt = get_global_id(1);
+    const int4 dim = get_image_dim(prev_z);
+
+    float tmpe = sigmoid_back_e(cur_e, weight, dropout_coeffs, idxp, idxt,
+            prev_d, cur_d, cur_off, cur_ld);
+    float s = 1.0 / (1.0 + exp(-sigmoid_read_img(prev_z, idxp, idxt)));
+    write_imagef(prev_e, (int4)((idxp % dim.x), (idxp / dim.x) % dim.y, idxt, 0),
+            (float4)(tmpe * s * (1.0 - s)));
+}
+
+/* sigmoid_backward_error_img for maps packed four to a texel, which are written
+ * together: the errors of the maps of one texel each. global size is
+ * (pixels of a map, groups of maps, train_num) */
+__kernel void sigmoid_backward_error_packed(__global const float *cur_e,
+        __read_only image3d_t prev_z,
+        __write_only image3d_t prev_e,
+        __global const float *weight,
+        __constant float* dropout_coeffs,
+        const int prev_d,
+        const int cur_d,
+        const int cur_off,
+        const int cur_ld)
+{
+    const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    const int area = get_global_size(0);
 
     sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
             CLK_ADDRESS_CLAMP_TO_EDGE |
             CLK_FILTER_NEAREST;
 
-    // matrix-vector multiplication
-    float tmpz = 0;
-    for (int idxp = 0; idxp < prev_d; idxp++)
+    const float4 pz_val = read_imagef(prev_z, sampler, pos);
+    float pe[4] = {0, 0, 0, 0};
+    for (int l = 0; l < 4; l++)
+    {
+        const int idxp = (pos.y * 4 + l) * area + pos.x;
+        if (idxp >= prev_d)
+            break;
+
+        float tmpe = sigmoid_back_e(cur_e, weight, dropout_coeffs, idxp, pos.z,
+                prev_d, cur_d, cur_off, cur_ld);
+        float s = 1.0 / (1.0 + exp(-sigmoid_lane(pz_val, l)));
+        pe[l] = tmpe * s * (1.0 - s);
+    }
+    write_imagef(prev_e, pos, (float4)(pe[0], pe[1], pe[2], pe[3]));
+}
+
+/* the outer-product gradient of one weight over the batch, applied in place:
+ * w = decay * w + rate * sum(cur_e * prev_a), with rate = -learn_rate / train_num.
+ * runs after the error kernels, which still read the old weights */
+__kernel void sigmoid_backward_weight(__global const float *cur_e,
+        __global const float *prev_a,
+        __global float *weight,
+        __constant float* dropout_coeffs,
+        const int prev_d,
+        const int cur_d,
+        const int cur_off,
+        const int cur_ld,
+        const int train_num,
+        const float rate,
+        const float decay)
+{
+    const int idxp = get_global_id(0);
+    const int idxc = get_global_id(1);
+
+    float dw_val = 0;
+    for (int idxt = 0; idxt < train_num; idxt++)
+        dw_val += cur_e[cur_off + idxt * cur_ld + idxc] * prev_a[idxt * prev_d + idxp];
+
+    const int idx = idxc * prev_d + idxp;
+    weight[idx] = decay * weight[idx] + rate * dropout_coeffs[idxc] * dw_val;
+}
+
+__kernel void sigmoid_backward_weight_img(__global const float *cur_e,
+        __read_only image3d_t prev_a,
+        __global float *weight,
+        __constant float* dropout_coeffs,
+        const int prev_d,
+        const int cur_d,
+        const int cur_off,
+        const int cur_ld,
+        const int train_num,
+        const float rate,
+        const float decay)
+{
+    const int idxp = get_global_id(0);
+    const int idxc = get_global_id(1);
+
+    float dw_val = 0;
+    for (int idxt = 0; idxt < train_num; idxt++)
     {
-        float4 pa_val = read_imagef(prev_a, sampler,
-                (int4)((idxp % pa_dim.x), (idxp / pa_dim.x) % pa_dim.y,
-                    idxt, 0));
-        float4 w_val = read_imagef(weight, sampler,
-                (int2)(idxp, idxc));
-        tmpz += w_val.x * pa_val.x;
+        dw_val += cur_e[cur_off + idxt * cur_ld + idxc]
+            * sigmoid_read_img(prev_a, idxp, idxt);
     }
-    tmpz += bias[idxc];
-    write_imagef(cur_z, gpos, (float4)(tmpz));
 
-    float tmpa = (1.0 / (1.0 + exp(-tmpz))) * dropout_coeffs[idxc];
-    write_imagef(cur_a, gpos, (float4)(tmpa));
+    const int idx = idxc * prev_d + idxp;
+    weight[idx] = decay * weight[idx] + rate * dropout_coeffs[idxc] * dw_val;
+}
+
+// bias += rate * (sum of cur_e over the batch), one neuron each
+__kernel void sigmoid_backward_bias(__global const float *cur_e,
+        __global float *bias,
+        __constant float* dropout_coeffs,
+        const int cur_d,
+        const int cur_off,
+        const int cur_ld,
+        const int train_num,
+        const float rate)
+{
+    const int idxc = get_global_id(0);
+
+    float db_val = 0;
+    for (int idxt = 0; idxt < train_num; idxt++)
+        db_val += cur_e[cur_off + idxt * cur_ld + idxc];
+
+    bias[idxc] += rate * dropout_coeffs[idxc] * db_val;
+}
+
+// integer hash of the dropout mask (lowbias32)
+uint dropout_hash(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+// a new dropout mask: each neuron is kept with the probability rate
+__kernel void sigmoid_dropout_mask(__global float *dropout_coeffs,
+        const uint seed,
+        const float rate)
+{
+    const uint idxc = get_global_id(0);
+    const float u = (dropout_hash(idxc ^ dropout_hash(seed)) >> 8) * (1.0f / 16777216.0f);
+    dropout_coeffs[idxc] = (u < rate) ? 1.0f : 0.0f;
 }
@@ -0,0 +1,68 @@
+#ifndef __CALC_CPU_SIMD_HPP
+#define __CALC_CPU_SIMD_HPP
+
+#include <cstdlib>
+#include "calc/calc-cpu.hpp"
+
+namespace NeuralNet
+{
+    /**
+     * table of the vector primitives of calc-cpu.hpp.
+     * one table exists for each instruction set; the functions in calc-cpu.hpp
+     * forward their arguments to the table selected at startup.
+     */
+    struct CalcKernels
+    {
+        void (*add_vec)(const float *v1, const float *v2, float *vres, size_t dim);
+        void (*pmul_vec)(const float *v1, const float *v2, float *vres, size_t dim);
+        void (*mul_mat_vec)(const float *m, const float *v, float *vres,
+                size_t dim_r, size_t dim_c);
+        void (*copy_vec)(const float *v, float *vres, size_t dim);
+        void (*set_vec)(float *v, float val, size_t dim);
+        void (*const_mul_vec)(float *v, float val, size_t dim);
+        void (*transpose_mat)(const float *m, float *mres, size_t dim_r, size_t dim_c);
+        void (*sum_vec)(const float *vset, float *vres, size_t dim_v, size_t num_v);
+        void (*vec_outer_prod)(const float *v1, const float *v2, float *mres,
+                size_t dim_n, size_t dim_m);
+        void (*downsample_max)(const float *m, float *mres, size_t dim_w, size_t dim_h,
+                size_t pool_w, size_t pool_h, size_t stride);
+        void (*upsample_max)(const float *me, const float *ma, float *me_res,
+                size_t dim_w, size_t dim_h, size_t pool_w, size_t pool_h, size_t stride);
+        void (*flip_mat)(const float *m, float *mres, size_t dim_w, size_t dim_h);
+        void (*inflate_mats)(const float *m_in, float *m_res, size_t dim_w, size_t dim_h,
+                size_t pad, size_t num_m);
+        void (*convolution_mat)(const float *m_in, const float *m_conv, float *m_res,
+                int dim_w, int dim_h, int dim_conv_w, int dim_conv_h,
+                const MatrixRange& range);
+        void (*bias_activate_vec)(const float *v, const float *bias, float *z, float *a,
+                size_t dim, Activation func);
+        void (*activation_prime_mul_vec)(const float *z, float *e, size_t dim,
+                Activation func);
+
+        /* register-blocked SGEMM micro kernel (see gemm-cpu.cpp).
+         * computes c[MR x NR] += a_pack * b_pack, where a_pack holds kc columns of
+         * MR elements and b_pack holds kc rows of NR elements.
+         */
+        size_t sgemm_mr, sgemm_nr;
+        void (*sgemm_kernel)(size_t kc, const float *a_pack, const float *b_pack,
+                float *c, size_t ldc);
+    };
+
+    /* the reference implementation; always available */
+    const CalcKernels& scalar_kernels();
+
+    /* the table selected by set_simd_level() */
+    const CalcKernels& active_kernels();
+
+    /* x86 implementations, each compiled from calc-cpu-simd.cpp with its own
+     * instruction set flags. entries without a vectorized version are copied
+     * from the given scalar table.
+     */
+#if defined(__x86_64__) || defined(__i386__)
+    CalcKernels sse_kernels(const CalcKernels& base);
+    CalcKernels avx2_kernels(const CalcKernels& base);
+    CalcKernels avx512_kernels(const CalcKernels& base);
+#endif
+}
+
+#endif // __CALC_CPU_SIMD_HPP
@@ -6,6 +6,29 @@
 
 namespace NeuralNet
 {
+    /**
+     * instruction sets used by the vector primitives below.
+     * the best one supported by the CPU is selected at startup.
+     */
+    enum class SIMDLevel
+    {
+        SCALAR, SSE, AVX2, AVX512,
+    };
+
+    /* currently selected instruction set */
+    SIMDLevel get_simd_level();
+
+    /* best instruction set supported by both this CPU and this build */
+    SIMDLevel detect_simd_level();
+
+    /* force an instruction set (e.g. SCALAR for the reference results).
+     * levels above detect_simd_level() are lowered to it.
+     * not thread-safe; call this before any computation starts.
+     */
+    void set_simd_level(SIMDLevel level);
+
+    const char *simd_level_name(SIMDLevel level);
+
     /* addition of vectors */
     void add_vec(const float *v1, const float *v2, float *vres, size_t dim);
 
@@ -24,8 +47,31 @@ namespace NeuralNet
     // multiply each element of the vector to the given value
     void const_mul_vec(float *v, float val, size_t dim);
 
-    /* apply function to a vector */
-    void apply_vec(const float *v, float *vres, size_t dim, std::function<float(float)> func);
+    /* apply function to a vector. func is inlined into the loop, so pass a lambda
+     * or a functor rather than a std::function */
+    template <typename Func>
+    inline void apply_vec(const float *v, float *vres, size_t dim, Func func)
+    {
+        for (size_t i = 0; i < dim; i++)
+            vres[i] = func(v[i]);
+    }
+
+    /* activation functions with vectorized kernels */
+    enum class Activation
+    {
+        SIGMOID, RELU,
+    };
+
+    /* z = v + bias, a = f(z) in one pass.
+     * bias and z may be null (no bias, z not stored), and v may be z or a */
+    void bias_activate_vec(const float *v, const float *bias, float *z, float *a,
+            size_t dim, Activation func);
+
+    /* a = f(z) */
+    void activate_vec(const float *z, float *a, size_t dim, Activation func);
+
+    /* e = e .* f'(z), the error through the activation function */
+    void activation_prime_mul_vec(const float *z, float *e, size_t dim, Activation func);
 
     /* transpose a given matrix */
     void transpose_mat(const float *m, float *mres, size_t dim_r, size_t dim_c);
@@ -33,6 +79,9 @@ namespace NeuralNet
     /* sum up a set of vectors */
     void sum_vec(const float *vset, float *vres, size_t dim_v, size_t num_v);
 
+    /* the same for vectors which start stride floats apart */
+    void sum_vec(const float *vset, float *vres, size_t dim_v, size_t num_v, size_t stride);
+
     /* vector outer product */
     void vec_outer_prod(const float *v1, const float *v2, float *mres, size_t dim_n, size_t dim_m);
 
@@ -68,6 +117,26 @@ namespace NeuralNet
             int dim_w, int dim_h, int dim_conv_w, int dim_conv_h);
     void convolution_mat_wide_zeros(const float *m_in, const float *m_conv, float *m_res,
             int dim_w, int dim_h, int dim_conv_w, int dim_conv_h);
+
+    /* lower a batch of images into a column matrix so that convolution_mat() over the
+     * given range becomes a matrix product.
+     * m_in holds num_batch sets of num_m (dim_w x dim_h) maps. row (m, jj, ii) of m_col
+     * holds, for each batch b and output element (j, i) of range, the input value that
+     * convolution_mat() multiplies with m_conv[jj*dim_conv_w + ii].
+     * m_col has (num_m * dim_conv_h * dim_conv_w) rows of (num_batch * range.w * range.h)
+     * elements, which are ld_col elements apart (num_batch * range.w * range.h if 0);
+     * a part of a batch is lowered by offsetting m_in and m_col.
+     */
+    void im2col(const float *m_in, float *m_col, int dim_w, int dim_h, int num_m,
+            int dim_conv_w, int dim_conv_h, const MatrixRange& range, size_t num_batch,
+            size_t ld_col = 0);
+
+    /* the adjoint of im2col(): adds each element of m_col to the input element it was
+     * taken from. elements which im2col() filled with zero padding are dropped.
+     */
+    void col2im(const float *m_col, float *m_in, int dim_w, int dim_h, int num_m,
+            int dim_conv_w, int dim_conv_h, const MatrixRange& range, size_t num_batch,
+            size_t ld_col = 0);
 }
 
 #endif // __CALC_CPU_HPP
@@ -0,0 +1,40 @@
+#ifndef __GEMM_CPU_HPP
+#define __GEMM_CPU_HPP
+
+#include <cstdlib>
+
+namespace NeuralNet
+{
+    class ThreadPool;
+
+    /**
+     * post-processing of the result of sgemm().
+     * apply() is called once for each finished (rows x cols) block of C, which starts
+     * at element (row, col) of C, while the block is still in the cache.
+     */
+    class GemmEpilogue
+    {
+    public:
+        virtual ~GemmEpilogue() {}
+        virtual void apply(float *c, size_t ldc, size_t row, size_t col,
+                size_t rows, size_t cols) const = 0;
+    };
+
+    /* cache-blocked single precision matrix multiplication:
+     *   C = alpha * op(A) * op(B) + beta * C
+     * op(A) is (m x k) and op(B) is (k x n); all matrices are row-major.
+     * op(X) is X^T if the corresponding trans_* flag is set.
+     * the blocks of C are distributed over the threads of pool, if it is given;
+     * the epilogue may then be called from several threads at once.
+     */
+    void sgemm(bool trans_a, bool trans_b, size_t m, size_t n, size_t k,
+            float alpha, const float *a, size_t lda, const float *b, size_t ldb,
+            float beta, float *c, size_t ldc,
+            const GemmEpilogue *epilogue = nullptr, ThreadPool *pool = nullptr);
+
+    /* allocates the packing buffers which sgemm() keeps for the calling thread;
+     * sgemm() does so by itself on its first call in a thread otherwise */
+    void prepare_sgemm_buffers();
+}
+
+#endif // __GEMM_CPU_HPP
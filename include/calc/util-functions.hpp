@@ -1,19 +1,40 @@
 #ifndef __UTIL_FUNCTIONS_HPP
 #define __UTIL_FUNCTIONS_HPP
 
-#include <functional>
+#include <cmath>
 
 namespace NeuralNet
 {
+    /**
+     * activation functions as compile-time policies.
+     * f() is the function itself and prime() its derivative at the same input,
+     * so that templated loops inline both.
+     */
+    struct SigmoidActivation
+    {
+        static inline float f(float in) { return 1.0f / (1.0f + std::exp(-in)); }
+        static inline float prime(float in)
+        {
+            float s_in = f(in);
+            return s_in * (1.0f - s_in);
+        }
+    };
+
+    struct ReLUActivation
+    {
+        static inline float f(float in) { return (in > 0.0f) ? in : 0.0f; }
+        static inline float prime(float in) { return (in > 0.0f) ? 1.0f : 0.0f; }
+    };
+
     class ActivationFuncs
     {
     public:
-        static const std::function<float(float)> f_sigmoid;
-        static const std::function<float(float)> f_sigmoid_prime;
+        static inline float f_sigmoid(float in) { return SigmoidActivation::f(in); }
+        static inline float f_sigmoid_prime(float in) { return SigmoidActivation::prime(in); }
 
-        static const std::function<float(float)> f_relu;
-        static const std::function<float(float)> f_relu_prime;
+        static inline float f_relu(float in) { return ReLUActivation::f(in); }
+        static inline float f_relu_prime(float in) { return ReLUActivation::prime(in); }
     };
 }
 
-#endif // __UTIL_FUNCTIONS_HPP
\ No newline at end of file
+#endif // __UTIL_FUNCTIONS_HPP
@@ -0,0 +1,49 @@
+#ifndef __WINOGRAD_CPU_HPP
+#define __WINOGRAD_CPU_HPP
+
+#include <cstdlib>
+#include "calc/calc-cpu.hpp"
+
+namespace NeuralNet
+{
+    class ThreadPool;
+
+    /* Winograd minimal filtering F(2x2, r x r) for the receptive fields used by
+     * ConvLayer. the results are the same as those of convolution_mat(), computed
+     * with fewer multiplications: each 2x2 output block takes (r+1)^2 products
+     * instead of 4*r^2.
+     */
+
+    /* true if F(2x2, recep_size x recep_size) is implemented (3x3 and 5x5) */
+    bool winograd_supported(size_t recep_size);
+
+    /* number of elements of one transformed filter, (recep_size + 1)^2 */
+    size_t winograd_transformed_size(size_t recep_size);
+
+    /* transform the (num_cur x num_prev) filters of a convolution layer.
+     * weight holds the filters in the layout of ConvLayer, [cur][prev][r*r];
+     * weight_t receives winograd_transformed_size() matrices of (num_cur x num_prev).
+     */
+    void winograd_transform_weights(const float *weight, float *weight_t,
+            size_t num_cur, size_t num_prev, size_t recep_size);
+
+    /* multi-map convolution with transformed weights.
+     * m_in holds num_batch sets of num_prev (dim_w x dim_h) maps; m_res receives
+     * num_batch sets of num_cur (range.w x range.h) maps, each of which is the sum of
+     * convolution_mat() over the num_prev input maps.
+     * the transforms and products are distributed over the threads of pool, if given.
+     * the transformed tiles are kept in workspace, which holds at least
+     * winograd_workspace_size() floats; without it, in buffers of the calling thread.
+     * the sets of m_res start res_stride floats apart; 0 packs them.
+     */
+    void winograd_convolution(const float *m_in, const float *weight_t, float *m_res,
+            int dim_w, int dim_h, size_t num_prev, size_t num_cur, int recep_size,
+            const MatrixRange& range, size_t num_batch, ThreadPool *pool = nullptr,
+            float *workspace = nullptr, size_t res_stride = 0);
+
+    /* scratch size of winograd_convolution() in floats */
+    size_t winograd_workspace_size(size_t num_prev, size_t num_cur, int recep_size,
+            const MatrixRange& range, size_t num_batch);
+}
+
+#endif // __WINOGRAD_CPU_HPP
@@ -15,6 +15,7 @@ namespace NeuralNet
     {
     private:
         cl::CommandQueue queue;
+        cl::CommandQueue transfer_queue;
         cl::Program program;
         cl::Context context;
 
@@ -50,12 +51,32 @@ namespace NeuralNet
         }
 
         cl::CommandQueue getCommandQueue() { return queue; }
+
+        // a second in-order queue, for transfers overlapping the kernels of the first
+        cl::CommandQueue getTransferQueue() { return transfer_queue; }
         cl::Program getProgram() { return program; }
         cl::Context getContext() { return context; }
+        cl::Device getDevice() { return m_device; }
+
+        /* whether the maps of conv and pooling layers are packed four to a texel
+         * (CLImageLayerData::Channel::RGBA); chosen for devices sharing the host
+         * memory, i.e. integrated GPUs and CPU runtimes */
+        bool packsMaps() const { return m_packs_maps; }
+
+        /* whether conv layers stage their input in local memory (conv_forward_tiled);
+         * chosen for devices with dedicated local memory */
+        bool tilesConv() const { return m_tiles_conv; }
+
+        /* override the choices above for the layers and layer data created
+         * afterwards, e.g. to compare the kernels of each on one device */
+        void setPacksMaps(bool packs) { m_packs_maps = packs; }
+        void setTilesConv(bool tiles) { m_tiles_conv = tiles; }
 
     private:
         cl::Platform m_platform;
         cl::Device m_device;
+        bool m_packs_maps;
+        bool m_tiles_conv;
 
         std::string loadSources();
 
@@ -0,0 +1,50 @@
+#ifndef __CL_BOUND_LAYER_DATA_HPP
+#define __CL_BOUND_LAYER_DATA_HPP
+
+#include "layers/cl_layer_data.hpp"
+#include <stdexcept>
+
+#define __CL_ENABLE_EXCEPTIONS
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#include "CL/cl.hpp"
+
+namespace NeuralNet
+{
+    /**
+     * inference-only activations in a memory object of the caller, laid out as the
+     * CLBufferLayerData or CLImageLayerData the next layer reads.
+     * there is no host copy, so nothing is ever transferred.
+     */
+    class CLBoundLayerData: public CLLayerData
+    {
+    public:
+        CLBoundLayerData(size_t train_num, size_t data_num, const cl::Memory& mem)
+            : CLLayerData(train_num, data_num, static_cast<float *>(nullptr)), m_mem(mem) {}
+        virtual ~CLBoundLayerData() {}
+
+        // the caller's memory is the input of the network, which is never read back
+        virtual void copyToBuffer(DataIndex idx, const cl::Buffer& buf) const
+        {
+            throw std::logic_error("CLBoundLayerData::copyToBuffer(): bound data "
+                    "is input only");
+        }
+
+    protected:
+        virtual cl::Memory getCLMemory(LayerData::DataIndex data_idx) const
+        {
+            return m_mem;
+        }
+
+        virtual size_t uploadArray(DataIndex idx, cl::CommandQueue& queue,
+                cl::Event *done) const
+        {
+            return 0;
+        }
+        virtual size_t downloadArray(DataIndex idx) const { return 0; }
+
+    private:
+        cl::Memory m_mem;
+    };
+}
+
+#endif // __CL_BOUND_LAYER_DATA_HPP
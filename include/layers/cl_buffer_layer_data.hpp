@@ -10,20 +10,38 @@
 
 namespace NeuralNet
 {
+    /* each array is a buffer of train_num rows of data_num values, as on the host */
     class CLBufferLayerData: public CLLayerData
     {
     public:
-        CLBufferLayerData(size_t train_num, size_t data_num);
+        CLBufferLayerData(size_t train_num, size_t data_num, bool inference_only = false);
+
+        /* inference-only data over host activations and a buffer of the caller, e.g.
+         * parts of the arenas planned by MemoryPlanner */
+        CLBufferLayerData(size_t train_num, size_t data_num, float *activation,
+                const cl::Buffer& buffer);
+
+        /* data_num values at offset in every row of whole, on its buffers: a
+         * fully-connected layer writes its part of the rows of a merged layer there
+         * through getOffset() and getStride() */
+        CLBufferLayerData(const CLBufferLayerData& whole, size_t offset, size_t data_num);
         virtual ~CLBufferLayerData();
 
-        virtual void loadToCL(DataIndex idx);
-        virtual void getFromCL(DataIndex idx);
+        virtual void copyToBuffer(DataIndex idx, const cl::Buffer& buf) const;
 
+        // the first value of the data in each row of the buffers
+        size_t getOffset() const { return m_offset; }
+
+    protected:
         virtual cl::Memory getCLMemory(LayerData::DataIndex data_idx) const;
 
+        virtual size_t uploadArray(DataIndex idx, cl::CommandQueue& queue,
+                cl::Event *done) const;
+        virtual size_t downloadArray(DataIndex idx) const;
+
     private:
-        std::vector<cl::Image2D> m_imgbufs;
-        cl::size_t<3> m_origin, m_region;
+        std::vector<cl::Buffer> m_bufs;
+        size_t m_offset;
     };
 }
 
@@ -16,22 +16,57 @@ namespace NeuralNet
         enum class Channel
         {
             INTENSITY,
+
+            // four maps to a texel, in its lanes; those past the last map are zero
+            RGBA,
         };
 
         CLImageLayerData(size_t train_num, size_t width, size_t height,
-                size_t map_num, Channel ch);
+                size_t map_num, Channel ch, bool inference_only = false);
         virtual ~CLImageLayerData();
 
-        virtual void loadToCL(DataIndex idx);
-        virtual void getFromCL(DataIndex idx);
+        /* the channel of the maps of conv and pooling layers on the current device */
+        static Channel mapChannel();
+
+        /* the rows of texels holding map_num maps in channel ch */
+        static size_t mapRows(size_t map_num, Channel ch);
+
+        /* whether the images of train_num samples of map_num maps of width x height
+         * in channel ch fit the image limits of the device: a row of texels per map
+         * (or four in RGBA) as high as the maps, a sample deep. maps that do not fit
+         * are kept in CLBufferLayerData instead */
+        static bool holdsMaps(size_t train_num, size_t width, size_t height,
+                size_t map_num, Channel ch);
+
+        Channel getChannel() const { return m_ch; }
+        size_t getMapNum() const { return m_map; }
 
+        /* the images keep the capacity; only the transfers shrink */
+        virtual void setTrainNum(size_t train_num);
+
+        /* the rows are the layout of CLBufferLayerData */
+        virtual void copyToBuffer(DataIndex idx, const cl::Buffer& buf) const;
+
+    protected:
         virtual cl::Memory getCLMemory(LayerData::DataIndex data_idx) const;
 
+        virtual size_t uploadArray(DataIndex idx, cl::CommandQueue& queue,
+                cl::Event *done) const;
+        virtual size_t downloadArray(DataIndex idx) const;
+
     private:
         const size_t m_width, m_height, m_map;
         const Channel m_ch;
         cl::size_t<3> m_origin, m_region;
         std::vector<cl::Image3D> m_imgbuf;
+
+        // the host side of RGBA transfers, repacked from or into the maps
+        mutable std::vector<float> m_staging;
+        mutable cl::Kernel m_unpack_kernel;
+
+        // packs the maps of the samples into m_staging, or unpacks them from it
+        void packMaps(const float *maps) const;
+        void unpackMaps(float *maps) const;
     };
 }
 
@@ -2,6 +2,8 @@
 #define __CL_LAYER_DATA_HPP
 
 #include "layers/layer_data.hpp"
+#include <array>
+#include <atomic>
 #include <vector>
 
 #define __CL_ENABLE_EXCEPTIONS
@@ -10,18 +12,89 @@
 
 namespace NeuralNet
 {
+    /**
+     * layer data with a host copy and a device copy of every array.
+     * each array tracks which copy is up to date, and is transferred only when the
+     * other side asks for it: get() for the host, readCL() for kernels.
+     */
     class CLLayerData: public LayerData
     {
     public:
-        CLLayerData(size_t train_num, size_t data_num)
-            : LayerData(train_num, data_num) {}
+        /* the copies of one array which hold its latest values */
+        enum class Validity
+        {
+            HOST, DEVICE, BOTH
+        };
+
+        CLLayerData(size_t train_num, size_t data_num, bool inference_only = false);
+
+        /* inference-only data over host activations of the caller */
+        CLLayerData(size_t train_num, size_t data_num, float *activation);
         virtual ~CLLayerData() {}
 
-        virtual void loadToCL(DataIndex idx) = 0;
-        virtual void getFromCL(DataIndex idx) = 0;
+        /* the host array, downloaded first if the device one is newer. the pointer
+         * may be written through, so the device copy is stale afterwards */
+        virtual float *get(DataIndex idx) const;
+
+        /* the host array for reading, downloaded first if the device one is newer;
+         * both copies stay valid */
+        virtual const float *getRead(DataIndex idx) const;
+
+        /* the memory object for a kernel reading it, uploaded first if the host
+         * array is newer */
+        cl::Memory readCL(DataIndex idx) const;
+
+        /* the memory object for a kernel overwriting it; nothing is transferred */
+        cl::Memory writeCL(DataIndex idx);
+
+        /* explicit synchronization; each does nothing if that side is up to date */
+        void loadToCL(DataIndex idx) const;
+        void getFromCL(DataIndex idx) const;
+
+        /* loadToCL() on queue without waiting; returns the event of the upload, a
+         * null one if there was nothing to do. the host array is read until it
+         * completes, and kernels on other queues have to wait for it */
+        cl::Event loadToCLAsync(DataIndex idx, cl::CommandQueue& queue) const;
+
+        /* enqueues a copy of an array into buf as train_num rows of all its values,
+         * uploading it first if the host is newer */
+        virtual void copyToBuffer(DataIndex idx, const cl::Buffer& buf) const = 0;
+
+        Validity getValidity(DataIndex idx) const { return validity(idx); }
+
+        /* bytes moved by the transfers of this data so far */
+        size_t getUploadedBytes() const { return m_uploaded; }
+        size_t getDownloadedBytes() const { return m_downloaded; }
+
+        /* the same for all layer data of the process */
+        static size_t getTotalUploadedBytes() { return s_total_uploaded; }
+        static size_t getTotalDownloadedBytes() { return s_total_downloaded; }
+        static void resetTransferCounters();
+
+    protected:
+        /* data over data_num values at offset in every sample of whole, which keeps
+         * the copies: the validity and the transfers of each array are those of
+         * whole, so a kernel writing the slice leaves the rest of whole valid */
+        CLLayerData(const CLLayerData& whole, size_t offset, size_t data_num);
+
+        /* the raw memory object, without any synchronization */
+        virtual cl::Memory getCLMemory(DataIndex idx) const = 0;
+
+        /* transfers of the whole batch; they return the bytes moved. the upload
+         * blocks unless done is given, which receives its event on queue */
+        virtual size_t uploadArray(DataIndex idx, cl::CommandQueue& queue,
+                cl::Event *done) const = 0;
+        virtual size_t downloadArray(DataIndex idx) const = 0;
+
+    private:
+        // the validity of idx, kept by the whole data for slices
+        Validity& validity(DataIndex idx) const;
+
+        const CLLayerData *m_whole;
+        mutable std::array<Validity, DATA_COUNT> m_validity;
+        mutable size_t m_uploaded, m_downloaded;
 
-        virtual cl::Memory getCLMemory(LayerData::DataIndex data_idx)
-            const = 0;
+        static std::atomic<size_t> s_total_uploaded, s_total_downloaded;
     };
 }
 
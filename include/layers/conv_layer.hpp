@@ -3,9 +3,13 @@
 
 #include "layers/layer.hpp"
 #include "layers/layer_data.hpp"
+#include "layers/cl_image_layer_data.hpp"
+#include "calc/calc-cpu.hpp"
 #include "json/json.h"
 #include <cstdlib>
 #include <memory>
+#include <functional>
+#include <vector>
 
 #define __CL_ENABLE_EXCEPTIONS
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
@@ -16,6 +20,18 @@ namespace NeuralNet
     class ConvLayer: public Layer
     {
     public:
+        /* the way forward_cpu() computes the convolution.
+         * DIRECT convolves each pair of maps separately; GEMM lowers the whole batch
+         * with im2col() and multiplies it with the weight matrix.
+         * WINOGRAD uses F(2x2, r x r) minimal filtering; layers whose recep_size is not
+         * supported fall back to DIRECT.
+         * backward_cpu() of GEMM and WINOGRAD layers lowers the batch as GEMM does.
+         */
+        enum class Engine
+        {
+            DIRECT, GEMM, WINOGRAD,
+        };
+
         struct LayerSetting
         {
             size_t prev_map_num;
@@ -27,12 +43,10 @@ namespace NeuralNet
             bool enable_zero_pad;
             bool uses_gpu;
             float weight_decay;
+            Engine engine;
         };
 
-        enum class ActivationFunc
-        {
-            SIGMOID, RELU,
-        };
+        typedef Activation ActivationFunc;
 
         ConvLayer(const LayerSetting& setting, ActivationFunc func);
         virtual ~ConvLayer();
@@ -42,7 +56,9 @@ namespace NeuralNet
         virtual void backward_cpu(LayerData& prev, LayerData& current);
         virtual void backward_gpu(CLLayerData& prev, CLLayerData& current);
 
-        virtual std::unique_ptr<LayerData> createLayerData(size_t train_num);
+        virtual std::unique_ptr<LayerData> createLayerData(size_t train_num,
+                bool inference_only, bool maps_in_buffers = false);
+        virtual bool fitsImages(size_t train_num) const;
 
         virtual void importLayer(const Json::Value& coeffs);
         virtual Json::Value exportLayer();
@@ -50,15 +66,62 @@ namespace NeuralNet
         virtual std::string what() { return "convolution"; }
         virtual size_t getNeuronNum() const;
 
+        virtual size_t getWorkspaceSize(size_t train_num) const;
+
     private:
+        /* the parts of the workspace the engine of the layer uses */
+        struct Scratch
+        {
+            // DIRECT
+            float *temp_z, *temp_pe, *weight_flipped, *err_flipped, *delta_w, *temp_w;
+            // GEMM and WINOGRAD: im2col matrix, GEMM result and column errors
+            float *col, *gemm_out, *col_err;
+            // transformed tiles of winograd_convolution()
+            float *winograd;
+            float *delta_b;
+        };
+
+        /* lays out the scratch for train_num samples from base and returns its size;
+         * with a null base only the size is computed */
+        size_t layoutScratch(size_t train_num, float *base, Scratch& scratch) const;
+        Scratch getScratch(size_t train_num);
+
+        /* copy the weights and biases to the device, or back from it */
         void refreshCLLayerInfo();
 
+        /* switches the forward kernels to conv_forward_tiled if CLContext::tilesConv()
+         * and their tiles fit the local memory; returns whether it did. the maps must
+         * not be packed */
+        bool setupTiledKernels();
+
+        /* the kernels for maps in buffers, for batches beyond the image limits */
+        void setupBufferKernels();
+        void fetchCLLayerInfo();
+
+        /* the channel of the maps of the image kernels, chosen when it was created */
+        CLImageLayerData::Channel mapChannel() const;
+
+        void forward_direct(const LayerData& prev, LayerData& current);
+        void forward_gemm(const LayerData& prev, LayerData& current);
+        void forward_winograd(const LayerData& prev, LayerData& current);
+        void backward_direct(LayerData& prev, LayerData& current);
+        void backward_gemm(LayerData& prev, LayerData& current);
+        void refreshWinogradWeights();
+
+        /* the output range of convolution_mat() for the current padding mode */
+        MatrixRange convolutionRange() const;
+
+        /* in_off of the CL kernels for the same range: recep_size - 1 + its x */
+        int clInputOffset() const;
+
+        /* im2col() of a batch of input activations into col */
+        void lowerBatch(const float *prev_a, size_t train_num, float *col);
+
         LayerSetting m_set;
         float m_learn_rate;
         size_t m_output_width, m_output_height;
 
-        std::function<float(float)> f_activation;
-        std::function<float(float)> f_activation_prime;
+        ActivationFunc m_activation;
         void (*f_convolution)(const float *, const float *, float *,
                 int, int, int, int);
         void (*f_convol_back)(const float *, const float *, float *,
@@ -67,8 +130,26 @@ namespace NeuralNet
         float *m_weight;
         float *m_bias;
 
-        cl::Image3D m_imgbuf_w, m_imgbuf_b;
+        // weights transformed by winograd_transform_weights()
+        std::vector<float> m_weight_winograd;
+
+        cl::Buffer m_buf_w, m_buf_b;
         cl::Kernel m_fwd_kernel;
+        cl::Kernel m_infer_kernel;
+        cl::Kernel m_bwd_err_kernel, m_bwd_w_kernel, m_bwd_b_kernel;
+
+        // the same for maps in CLBufferLayerData
+        cl::Kernel m_fwd_buf_kernel, m_infer_buf_kernel;
+        cl::Kernel m_bwd_err_buf_kernel, m_bwd_w_buf_kernel, m_bwd_b_buf_kernel;
+
+        // output rows of each work-item of the tiled kernels, CONV_TILE_ROWS in conv.cl
+        static constexpr size_t TILE_ROWS = 4;
+
+        // work-group size of the tiled kernels; zero for the untiled ones
+        size_t m_tile_w = 0, m_tile_h = 0;
+
+        // whether the maps are packed four to a texel, for the _packed kernels
+        bool m_packed = false;
 
     public:
         virtual void setLearnRate(float rate) { m_learn_rate = rate; }
@@ -6,10 +6,13 @@
 #include <string>
 #include "layers/layer_data.hpp"
 #include "layers/cl_layer_data.hpp"
+#include "utils/workspace.hpp"
 #include "json/json.h"
 
 namespace NeuralNet
 {
+    class ThreadPool;
+
     /**
      * interface representing a layer.
      */
@@ -42,8 +45,26 @@ namespace NeuralNet
                 backward_cpu(prev, current);
         }
 
-        /* creation of appropriate layer data for the layer */
-        virtual std::unique_ptr<LayerData> createLayerData(size_t train_num) = 0;
+        /* forward() and backward() for data already known to be on the host or on
+         * the device, e.g. resolved once by the execution plan of Network */
+        void forward(const LayerData& prev, LayerData& current) { forward_cpu(prev, current); }
+        void forward(const CLLayerData& prev, CLLayerData& current)
+        {
+            forward_gpu(prev, current);
+        }
+        void backward(LayerData& prev, LayerData& current) { backward_cpu(prev, current); }
+        void backward(CLLayerData& prev, CLLayerData& current) { backward_gpu(prev, current); }
+
+        /* creation of appropriate layer data for the layer.
+         * forward() into inference-only data computes the activations alone.
+         * on the device, the maps of conv and pooling layers are kept in buffers
+         * rather than images if maps_in_buffers; the layers of one network agree */
+        virtual std::unique_ptr<LayerData> createLayerData(size_t train_num,
+                bool inference_only, bool maps_in_buffers = false) = 0;
+
+        /* whether the maps of train_num samples of the output fit the images of the
+         * device; layers without maps keep their data in buffers anyway */
+        virtual bool fitsImages(size_t train_num) const { return true; }
 
         /* import/export of layer coefficients.
          * importLayer() may emit Json::Exception during execution
@@ -59,6 +80,20 @@ namespace NeuralNet
         virtual void setLearnRate(float rate) = 0;
         virtual float getLearnRate() const = 0;
 
+        /* threads for the CPU versions; they run on the calling thread without a pool */
+        void setThreadPool(ThreadPool *pool) { m_pool = pool; }
+
+        /* floats of scratch the CPU versions need for batches of up to train_num */
+        virtual size_t getWorkspaceSize(size_t train_num) const { return 0; }
+
+        /* preallocated scratch of getWorkspaceSize() floats, aligned to
+         * Workspace::ALIGNMENT; without it the layer grows a workspace of its own */
+        void setWorkspace(float *workspace, size_t size)
+        {
+            m_workspace = workspace;
+            m_workspace_size = size;
+        }
+
     protected:
         /**
          * CPU and GPU versions of the forward() and backward() that child classes
@@ -68,6 +103,22 @@ namespace NeuralNet
         virtual void forward_gpu(const CLLayerData& prev, CLLayerData& current) = 0;
         virtual void backward_cpu(LayerData& prev, LayerData& current) = 0;
         virtual void backward_gpu(CLLayerData& prev, CLLayerData& current) = 0;
+
+        /* the scratch for the current call, from setWorkspace() if it is large enough */
+        float *getWorkspace(size_t size)
+        {
+            if (m_workspace && size <= m_workspace_size)
+                return m_workspace;
+            m_own_workspace.reserve(size);
+            return m_own_workspace.data();
+        }
+
+        ThreadPool *m_pool = nullptr;
+
+    private:
+        float *m_workspace = nullptr;
+        size_t m_workspace_size = 0;
+        Workspace m_own_workspace;
     };
 }
 
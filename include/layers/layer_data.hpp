@@ -2,6 +2,7 @@
 #define __LAYER_DATA_HPP
 
 #include <cstdlib>
+#include <stdexcept>
 
 namespace NeuralNet
 {
@@ -20,21 +21,55 @@ namespace NeuralNet
         static constexpr size_t DATA_COUNT = static_cast<int>(DataIndex::END)
                 - static_cast<int>(DataIndex::START) + 1;
 
-        LayerData(size_t train_num, size_t data_num);
+        /* train_num is also the capacity: the logical batch can be changed with
+         * setTrainNum() within it, without reallocating anything.
+         * inference-only data holds the activations alone; forward passes into it
+         * skip the inter values, and it cannot be used for backpropagation */
+        LayerData(size_t train_num, size_t data_num, bool inference_only = false);
+
+        /* inference-only data over train_num * data_num activations owned by the
+         * caller, e.g. a part of an arena planned by MemoryPlanner */
+        LayerData(size_t train_num, size_t data_num, float *activation);
+
+        /* a slice of data_num values at offset in every sample of whole, which still
+         * owns the arrays; a layer writing into it fills that part of whole in place */
+        LayerData(const LayerData& whole, size_t offset, size_t data_num);
         virtual ~LayerData();
 
+        /* copies always own their arrays, with the samples packed */
         LayerData(const LayerData& other);
         LayerData& operator=(const LayerData& other);
 
-        /* returns the desired array */
-        float *get(DataIndex idx) const;
+        /* returns the desired array, or nullptr if the data does not hold it */
+        virtual float *get(DataIndex idx) const;
+
+        /* the same for reading only; data with other copies keeps them valid */
+        virtual const float *getRead(DataIndex idx) const { return get(idx); }
 
         /* returns the dimensions */
         size_t getDataNum() const { return m_data_num; }
         size_t getTrainNum() const { return m_train_num; }
+        size_t getCapacity() const { return m_capacity; }
+
+        /* distance between two samples in each array; larger than getDataNum()
+         * only for slices */
+        size_t getStride() const { return m_stride; }
+
+        /* changes the logical batch size; layers only touch the first train_num
+         * entries of each array. throws std::length_error above the capacity */
+        virtual void setTrainNum(size_t train_num);
+
+        bool isInferenceOnly() const { return m_inference_only; }
+
+        /* number of arrays held, DATA_COUNT or 1 for inference-only data */
+        size_t getArrayNum() const { return m_inference_only ? 1 : DATA_COUNT; }
 
     private:
-        size_t m_train_num, m_data_num;
+        void copyFrom(const LayerData& other);
+
+        size_t m_train_num, m_capacity, m_data_num, m_stride;
+        bool m_inference_only;
+        bool m_owns_data;
         float *data;
     };
 }
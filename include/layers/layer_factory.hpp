@@ -5,6 +5,7 @@
 #include <vector>
 #include <memory>
 #include "layers/layer.hpp"
+#include "layers/conv_layer.hpp"
 
 namespace NeuralNet
 {
@@ -54,12 +55,14 @@ namespace NeuralNet
             bool enable_zero_pad, uses_gpu;
             size_t output_w, output_h;
             float weight_decay;
-            explicit ConvLayerSetting(size_t _m, size_t _r, size_t _iw, size_t _ih, float _l, bool _zeropad, bool _gpu, float _wdd)
+            ConvLayer::Engine engine;
+            explicit ConvLayerSetting(size_t _m, size_t _r, size_t _iw, size_t _ih, float _l, bool _zeropad, bool _gpu, float _wdd,
+                    ConvLayer::Engine _engine = ConvLayer::Engine::DIRECT)
                 : LayerSetting(), map_num(_m), recep_size(_r), input_w(_iw), input_h(_ih),
                 learn_rate(_l), enable_zero_pad(_zeropad), uses_gpu(_gpu),
                 output_w((enable_zero_pad)?(_iw):(_iw - (_r - 1))),
                 output_h((enable_zero_pad)?(_ih):(_ih - (_r - 1))),
-                weight_decay(_wdd) {}
+                weight_decay(_wdd), engine(_engine) {}
             virtual ~ConvLayerSetting() {}
         };
         struct MaxPoolLayerSetting: public LayerSetting
@@ -20,13 +20,24 @@ namespace NeuralNet
 
         void add(KeyType key, size_t num_neuron);
 
+        /* copy the batch of a parent with data of its own into its part of this_data,
+         * and the errors back. device data is copied through the host */
         void assign(const KeyType& key, const LayerData& parent_data,
                 LayerData& this_data);
 
         void distribute(std::map< KeyType, LayerData* >& parent_datas,
                 const LayerData& this_data);
 
-        std::unique_ptr<LayerData> createLayerData(size_t train_num);
+        /* rows of all parents, in buffers on the device if uses_gpu, which sigmoid
+         * layers read as their input */
+        std::unique_ptr<LayerData> createLayerData(size_t train_num, bool inference_only,
+                bool uses_gpu = false);
+
+        /* the data of parent key as a slice of this_data: the parent writes its
+         * outputs into the merged data directly, and nothing has to be copied.
+         * a slice of CLBufferLayerData is one as well */
+        std::unique_ptr<LayerData> createParentData(const KeyType& key,
+                const LayerData& this_data);
 
     private:
         size_t m_neuron_num;
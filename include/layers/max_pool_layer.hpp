@@ -34,7 +34,9 @@ namespace NeuralNet
         virtual void backward_cpu(LayerData& prev, LayerData& current);
         virtual void backward_gpu(CLLayerData& prev, CLLayerData& current);
 
-        virtual std::unique_ptr<LayerData> createLayerData(size_t train_num);
+        virtual std::unique_ptr<LayerData> createLayerData(size_t train_num,
+                bool inference_only, bool maps_in_buffers = false);
+        virtual bool fitsImages(size_t train_num) const;
 
         virtual void importLayer(const Json::Value& coeffs);
         virtual Json::Value exportLayer();
@@ -50,6 +52,11 @@ namespace NeuralNet
         const size_t m_output_width, m_output_height;
 
         cl::Kernel m_fwd_kernel;
+        cl::Kernel m_infer_kernel;
+        cl::Kernel m_bwd_kernel;
+
+        // the same for maps in CLBufferLayerData
+        cl::Kernel m_fwd_buf_kernel, m_infer_buf_kernel, m_bwd_buf_kernel;
     };
 }
 
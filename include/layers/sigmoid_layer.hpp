@@ -5,7 +5,7 @@
 #include "layers/cl_buffer_layer_data.hpp"
 #include "layers/cl_image_layer_data.hpp"
 #include "json/json.h"
-#include <functional>
+#include <vector>
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #include "CL/cl.hpp"
@@ -33,7 +33,8 @@ namespace NeuralNet
         virtual void backward_cpu(LayerData& prev, LayerData& current);
         virtual void backward_gpu(CLLayerData& prev, CLLayerData& current);
 
-        virtual std::unique_ptr<LayerData> createLayerData(size_t train_num);
+        virtual std::unique_ptr<LayerData> createLayerData(size_t train_num,
+                bool inference_only, bool maps_in_buffers = false);
 
         virtual void importLayer(const Json::Value& coeffs);
         virtual Json::Value exportLayer();
@@ -41,22 +42,23 @@ namespace NeuralNet
         virtual std::string what() { return "sigmoid"; }
         virtual size_t getNeuronNum() const;
 
-        void setDropout(bool enable);
+        virtual size_t getWorkspaceSize(size_t train_num) const { return m_current_d; }
 
-        static const std::function<float(float)> f_sigmoid;
-        static const std::function<float(float)> f_sigmoid_prime;
+        void setDropout(bool enable);
 
     private:
-        void forward_gpu(const CLImageLayerData& prev,
-                CLBufferLayerData& current);
-        void forward_gpu(const CLBufferLayerData& prev,
-                CLBufferLayerData& current);
-
+        /* copy the weights and biases to the device, or back from it */
         void refreshCLLayerInfo();
+        void fetchCLLayerInfo();
 
         void refreshDropout();
         void updateDOBuffer();
 
+        /* sets the offset and the leading dimension of the rows of current, which
+         * may be a slice of merged data, as arguments arg and arg + 1 of kernel */
+        static void setCurrentRows(cl::Kernel& kernel, cl_uint arg,
+                const CLLayerData& current);
+
         const size_t m_prev_d, m_current_d;
         float m_learn_rate;
 
@@ -71,10 +73,31 @@ namespace NeuralNet
         float *m_dropout_coeff;
 
         // OpenCL contexts
-        cl::Buffer m_buf_b, m_buf_do;
-        cl::Image2D m_imgbuf_w;
+        cl::Buffer m_buf_w, m_buf_b, m_buf_do;
+
+        // the tiled forward kernel, and the one without cur_z for inference-only data
         cl::Kernel m_fwd_kernel;
-        cl::Kernel m_fwd_img_kernel;
+        cl::Kernel m_infer_kernel;
+
+        // float4s of each row in a slice of the tiles, SIGMOID_TILE_K4 in sigmoid.cl
+        static constexpr size_t TILE_K4 = 4;
+
+        // the limits of the forward work-groups
+        size_t m_max_group = 0, m_local_mem = 0;
+
+        // the input rows of a previous layer of maps, for m_buf_pa_num samples
+        cl::Buffer m_buf_pa;
+        size_t m_buf_pa_num = 0;
+
+        // backward kernels, with _img ones for a previous layer of maps
+        // and a _packed one for the errors of packed maps
+        cl::Kernel m_bwd_err_kernel, m_bwd_err_img_kernel, m_bwd_err_packed_kernel;
+        cl::Kernel m_bwd_w_kernel, m_bwd_w_img_kernel;
+        cl::Kernel m_bwd_b_kernel;
+
+        // draws the dropout mask on the device; the seed advances with every mask
+        cl::Kernel m_dropout_kernel;
+        cl_uint m_dropout_seed;
 
     public:
         virtual void setLearnRate(float rate) { m_learn_rate = rate; }
@@ -0,0 +1,47 @@
+#ifndef __MEMORY_PLANNER_HPP
+#define __MEMORY_PLANNER_HPP
+
+#include <cstdlib>
+#include <vector>
+
+namespace NeuralNet
+{
+    /**
+     * places buffers with known lifetimes in one arena.
+     * a buffer is live from the step it is written at to the last step it is read at,
+     * both inclusive. buffers which are live at the same step never overlap in the
+     * arena, so the arena only needs to hold the largest set of simultaneously
+     * live buffers; for a chain of layers this is the largest pair of adjacent ones.
+     * the largest buffers are placed first, each one into the smallest gap between
+     * the buffers live with it which is large enough (best fit), or after them.
+     * offsets are sums of sizes, so sizes rounded up to an alignment keep it.
+     */
+    class MemoryPlanner
+    {
+    public:
+        /* registers a buffer of size elements and returns its index */
+        size_t addBuffer(size_t size, size_t first_step, size_t last_step);
+
+        /* computes the offsets of all buffers registered so far */
+        void plan();
+
+        size_t getOffset(size_t buffer) const { return m_buffers[buffer].offset; }
+        size_t getArenaSize() const { return m_arena_size; }
+
+        /* sum of the buffer sizes, i.e. the memory needed without planning */
+        size_t getTotalBufferSize() const;
+
+    private:
+        struct Buffer
+        {
+            size_t size;
+            size_t first_step, last_step;
+            size_t offset;
+        };
+
+        std::vector<Buffer> m_buffers;
+        size_t m_arena_size = 0;
+    };
+}
+
+#endif // __MEMORY_PLANNER_HPP
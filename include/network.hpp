@@ -13,9 +13,14 @@
 #include "layers/layer.hpp"
 #include "layers/layer_data.hpp"
 #include "layers/layer_factory.hpp"
+#include "utils/thread_pool.hpp"
+#include "utils/workspace.hpp"
 
 namespace NeuralNet
 {
+    class LayerMerger;
+    class SigmoidLayer;
+
     class Network
     {
     public:
@@ -50,6 +55,14 @@ namespace NeuralNet
                 std::unique_ptr<LayerFactory::LayerSetting>
         >;
 
+        /* num samples of the caller, the ith of which starts at data + i * stride */
+        struct InputSpan
+        {
+            const float *data;
+            size_t num;
+            size_t stride;
+        };
+
         /* an exception thrown when this class received invalid JSON data */
         class NetworkException: public std::exception
         {
@@ -90,12 +103,52 @@ namespace NeuralNet
         // returns classification values for a set of data
         std::vector< std::vector<int> > evaluateAll(const std::vector<float>& data);
 
+        // the same for samples of the caller; the CPU layers read contiguous ones in place
+        std::vector< std::vector<int> > evaluateAll(const InputSpan& input);
+
+        // the same for num_data samples already on the device, laid out as the input
+        // data of the network (a buffer of rows if inputInBuffer(num_data), an image
+        // of the input size per sample in CLImageLayerData::mapChannel() otherwise);
+        // needs uses_gpu
+        std::vector< std::vector<int> > evaluateAll(const cl::Memory& input,
+                size_t num_data);
+
+        // whether the device keeps the input of num_data samples in a buffer of rows:
+        // for vector input, or when the maps of any layer do not fit the images
+        bool inputInBuffer(size_t num_data) const;
+
     private:
         void insertLayerSetting(SettingMapType& prevSetting,
                 std::unique_ptr<LayerFactory::LayerSetting>& set,
                 NodeID id, NodeID child_id);
 
-        void prepareLayerData(size_t train_num);
+        /* (re)creates the data of all layers, unless the current ones have the capacity
+         * for train_num; inference-only data holds activations alone */
+        void prepareLayerData(size_t train_num, bool inference_only);
+
+        /* whether the input or the output of any layer for train_num samples is maps
+         * beyond the image limits of the device; then all of them are kept in buffers,
+         * as the kernels of a layer read and write the same layout */
+        bool mapsInBuffers(size_t train_num) const;
+
+        /* empty input data of the network for train_num samples */
+        std::unique_ptr<LayerData> createInputData(size_t train_num, bool inference_only);
+
+        /* evaluateAll() on the device with m_eval_slot_num chunks in flight: while
+         * one chunk is forwarded, the next one is uploaded and the activations of the
+         * output layers of the previous one are read back */
+        std::vector< std::vector<int> > evaluatePipelined(const InputSpan& input);
+
+        /* the slots of evaluatePipelined() for chunks of up to train_num samples */
+        void prepareEvalSlots(size_t train_num);
+
+        /* inference-only data: the activations of all nodes share m_arena, where the
+         * ones which are never live at the same time overlap. on the device, the ones
+         * in buffers share m_cl_arena the same way, and images are not planned */
+        void planInferenceData(size_t train_num);
+
+        /* hands every layer its part of m_workspace for batches of up to train_num */
+        void prepareWorkspace(size_t train_num);
 
         // returns classification value for one portion of data
         std::vector< int > evaluate(const std::vector<float>& data);
@@ -109,15 +162,32 @@ namespace NeuralNet
         /* helper function for propagation */
         void feedForward(const std::vector<float>& data,
                 const std::vector<size_t>& list_idx);
+        void feedForward(const LayerData& input);
         void backPropagate();
 
-        /* helper function for propagation of one layer */
-        std::vector<NodeID> feedForwardLayer(const NodeID& in_idx);
-        const NodeID backPropagateLayer(const NodeID& in_idx);
+        /* topological order of the nodes in levels of independent ones,
+         * fixed after construction; the levels only bound the memory plan and
+         * the number of steps running at once */
+        void sortNodes();
+
+        /* resolves the data of every node into m_plan; called whenever it is recreated */
+        void buildPlan();
 
         NodeID getParent(const NodeID& id) const;
 
-        std::vector<int> getCategory(const LayerData& data) const;
+        /* the merger a node writes its outputs into directly, as a slice of the merged
+         * data; null unless the merger is the only child, and on the device unless
+         * the node is a sigmoid layer. the other parents are copied in by
+         * LayerMerger::assign() */
+        MergerNode *getInPlaceMerger(const NodeID& id) const;
+
+        // appends the category of each sample of data
+        void getCategory(const LayerData& data, std::vector<int>& categories) const;
+
+        /* appends the categories of the last forward pass for each output layer */
+        void appendCategories(std::vector< std::vector<int> >& categories);
+
+        void setDropout(bool enable);
 
         void calcOutputErrors(
                 const std::vector< std::vector<int> >& category_list,
@@ -127,6 +197,47 @@ namespace NeuralNet
 
         void dropLearnRate(const std::vector<float>& total_errors);
 
+        /* one node of the execution plan with its data resolved; the CL pointers
+         * are the same data, cast once for the GPU path */
+        struct PlanStep
+        {
+            Layer *layer;
+            LayerData *data;
+            CLLayerData *cl_data;
+
+            // the data forward() reads; null for the input of the network
+            LayerData *prev;
+            CLLayerData *cl_prev;
+
+            // merging nodes fill prev from their parents first
+            LayerMerger *merger;
+            std::map<NodeID, LayerData *> merge_parents;
+
+            // the errors of inner nodes are cleared before backPropagate()
+            bool is_leaf;
+
+            /* the steps waiting for this one, and the number of steps this one
+             * waits for in feedForward() */
+            std::vector<size_t> successors;
+            size_t dependency_num;
+        };
+
+        /* the storage of one chunk in flight in evaluatePipelined(); each event
+         * completes the step of the chunk which used the slot last */
+        struct EvalSlot
+        {
+            std::unique_ptr<LayerData> input;
+
+            // the activations of each output layer, copied on the device and read back
+            std::vector<cl::Buffer> out_bufs;
+            std::vector< std::vector<float> > out_vals;
+
+            // the samples of the chunk uploaded last
+            size_t num;
+            cl::Event uploaded, computed;
+            std::vector<cl::Event> read;
+        };
+
         /* dimensions */
         InputType m_in_type;
         struct InputSize
@@ -136,18 +247,52 @@ namespace NeuralNet
         } m_in_dim;
         size_t m_unit_size, m_train_size, m_batch_size, m_epoch_num;
         size_t m_max_eval_patch;
+
+        // chunks of evaluateAll() in flight on the device; one runs them in turn
+        size_t m_eval_slot_num;
+        std::vector<EvalSlot> m_eval_slots;
+
         float m_learn_rate;
         LearnRateSetting m_learn_rate_set;
         bool m_uses_gpu;
         float m_weight_decay;
 
+        // the choice of mapsInBuffers() for the current layer data
+        bool m_maps_in_buffers;
+
         std::vector<NodeID> m_start_idxes;
         std::vector<NodeID> m_leaf_idx;
         std::map< NodeID, NodeUPtr > node_map;
         std::map< NodeID, MergerNodeUPtr> merger_map;
 
+        std::vector<NodeID> m_node_order;
+        // level i of m_node_order is [m_level_bounds[i], m_level_bounds[i + 1])
+        std::vector<size_t> m_level_bounds;
+        std::vector<PlanStep> m_plan;
+
+        /* pairs of nodes whose planned inference data overlap: the first one must be
+         * done before the second one writes */
+        std::vector< std::pair<NodeID, NodeID> > m_memory_deps;
+
+        // threads running the steps of feedForward() on the CPU, and their state
+        size_t m_lane_num;
+        std::vector<size_t> m_pending;
+        std::vector<size_t> m_ready;
+        std::vector<SigmoidLayer *> m_sigmoid_layers;
+
         std::unique_ptr<LayerData> m_input_data;
         std::vector< TestSet > m_list_testset;
+
+        // storage of the planned inference data, and its device copy for uses_gpu
+        std::vector<float> m_arena;
+        cl::Buffer m_cl_arena;
+
+        // scratch of the layers and of calcOutputErrors(), reused by every batch
+        Workspace m_workspace;
+        float *m_output_scratch = nullptr;
+
+        // shared by the CPU versions of all layers
+        std::unique_ptr<ThreadPool> m_thread_pool;
     };
 }
 
@@ -0,0 +1,111 @@
+#ifndef __THREAD_POOL_HPP
+#define __THREAD_POOL_HPP
+
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace NeuralNet
+{
+    /* non-owning reference to a callable taking (chunk_begin, chunk_end); unlike a
+     * std::function it never copies the callable, so it must outlive the reference */
+    class ChunkFunc
+    {
+    public:
+        template <typename Func>
+        ChunkFunc(const Func& func)
+            : m_obj(&func), m_call(&ChunkFunc::invoke<Func>) {}
+
+        void operator()(size_t begin, size_t end) const { m_call(m_obj, begin, end); }
+
+    private:
+        template <typename Func>
+        static void invoke(const void *obj, size_t begin, size_t end)
+        {
+            (*static_cast<const Func *>(obj))(begin, end);
+        }
+
+        const void *m_obj;
+        void (*m_call)(const void *, size_t, size_t);
+    };
+
+    /**
+     * work-stealing thread pool for the data-parallel loops of the CPU layers.
+     * each worker owns a queue of jobs; idle workers take the newest job of their own
+     * queue first and steal the oldest job of the other queues otherwise.
+     * a job is one parallelFor() call, split into chunks which are claimed one by one
+     * by every thread holding the job, so a job is shared by as many threads as
+     * there are chunks left.
+     * the job lives in the frame of its parallelFor() call and the queues keep
+     * their storage, so no call allocates once the queues have grown to the
+     * deepest nesting of calls.
+     */
+    class ThreadPool
+    {
+    public:
+        /* thread_num counts the threads calling parallelFor() as well;
+         * 0 selects the number of hardware threads */
+        explicit ThreadPool(size_t thread_num = 0);
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        size_t getThreadNum() const { return m_workers.size() + 1; }
+
+        /* calls func(chunk_begin, chunk_end) for disjoint chunks covering [begin, end)
+         * and returns when all of them are done. the calling thread works on the
+         * chunks as well, and func may call parallelFor() again.
+         * chunks hold at least min_chunk indices.
+         */
+        void parallelFor(size_t begin, size_t end, ChunkFunc func, size_t min_chunk = 1);
+
+        /* calls func(i, i + 1) once on every thread of the pool, the calling one
+         * included, e.g. to set up their thread-local buffers. it waits for all
+         * threads, so it must not be called while the pool works on other jobs */
+        void forEachThread(ChunkFunc func);
+
+    private:
+        struct Job;
+        struct Worker
+        {
+            std::thread thread;
+            std::mutex mutex;
+            // tickets of the jobs, the newest one at the back
+            std::vector<Job *> jobs;
+        };
+
+        void workerLoop(size_t idx);
+        Job *takeJob(size_t idx);
+
+        // removes the tickets of job which no worker has taken
+        void withdrawTickets(Job& job);
+
+        std::vector< std::unique_ptr<Worker> > m_workers;
+
+        // idle workers sleep on m_cv until a job is queued
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        size_t m_queued;
+        bool m_stop;
+
+        std::atomic<size_t> m_next_queue;
+    };
+
+    /* ThreadPool::parallelFor() if pool is given, a plain call of func otherwise */
+    template <typename Func>
+    inline void parallel_for(ThreadPool *pool, size_t begin, size_t end,
+            const Func& func, size_t min_chunk = 1)
+    {
+        if (pool)
+            pool->parallelFor(begin, end, func, min_chunk);
+        else if (begin < end)
+            func(begin, end);
+    }
+}
+
+#endif // __THREAD_POOL_HPP
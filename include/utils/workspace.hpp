@@ -0,0 +1,69 @@
+#ifndef __WORKSPACE_HPP
+#define __WORKSPACE_HPP
+
+#include <cstdlib>
+#include <memory>
+
+namespace NeuralNet
+{
+    /**
+     * grow-only scratch memory of the CPU layers, aligned to ALIGNMENT bytes.
+     * it is allocated once for the largest batch, so the forward and backward
+     * passes of smaller or equal batches run without heap allocations.
+     */
+    class Workspace
+    {
+    public:
+        static constexpr size_t ALIGNMENT = 64;
+
+        Workspace() : m_data(nullptr), m_size(0), m_alloc_count(0) {}
+
+        Workspace(const Workspace&) = delete;
+        Workspace& operator=(const Workspace&) = delete;
+
+        /* makes room for size floats; the contents are lost when it has to grow */
+        void reserve(size_t size);
+
+        float *data() const { return m_data; }
+        size_t size() const { return m_size; }
+
+        /* number of times reserve() allocated memory */
+        size_t getAllocCount() const { return m_alloc_count; }
+
+        /* size rounded up to keep the next part of a workspace aligned */
+        static size_t align(size_t size)
+        {
+            const size_t unit = ALIGNMENT / sizeof(float);
+            return (size + unit - 1) / unit * unit;
+        }
+
+    private:
+        std::unique_ptr<float[]> m_storage;
+        float *m_data;
+        size_t m_size;
+        size_t m_alloc_count;
+    };
+
+    /* splits a workspace into consecutive aligned parts.
+     * without a base it only sums up their sizes */
+    class WorkspaceParts
+    {
+    public:
+        explicit WorkspaceParts(float *base = nullptr) : m_base(base), m_size(0) {}
+
+        float *take(size_t size)
+        {
+            float *part = m_base ? m_base + m_size : nullptr;
+            m_size += Workspace::align(size);
+            return part;
+        }
+
+        size_t size() const { return m_size; }
+
+    private:
+        float *m_base;
+        size_t m_size;
+    };
+}
+
+#endif // __WORKSPACE_HPP
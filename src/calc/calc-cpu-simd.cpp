@@ -0,0 +1,762 @@
+/**
+ * vectorized versions of the calc-cpu primitives.
+ * this file is compiled once per instruction set (see the Makefile); the
+ * compiler flags of each compilation decide which vector type is used below.
+ * keep the includes minimal: inline functions of other headers instantiated
+ * here would be compiled with the extended instruction set.
+ */
+#include "calc/calc-cpu-simd.hpp"
+#include <immintrin.h>
+
+#if defined(__AVX512F__)
+#define CALC_SIMD_NS avx512
+#define CALC_SIMD_KERNELS avx512_kernels
+#elif defined(__AVX2__)
+#define CALC_SIMD_NS avx2
+#define CALC_SIMD_KERNELS avx2_kernels
+#elif defined(__SSE2__)
+#define CALC_SIMD_NS sse
+#define CALC_SIMD_KERNELS sse_kernels
+#else
+#error "calc-cpu-simd.cpp needs to be compiled with x86 SIMD flags"
+#endif
+
+namespace NeuralNet
+{
+    namespace { namespace CALC_SIMD_NS
+    {
+#if defined(__AVX512F__)
+        typedef __m512 vfloat;
+        const size_t VEC_WIDTH = 16;
+
+        /* the unmasked forms of some AVX-512 intrinsics merge into an undefined
+         * register, which GCC reports as uninitialized; their zero-masked forms
+         * with all lanes set compile to the same instructions */
+        const __mmask16 V_ALL = 0xFFFF;
+
+        inline vfloat v_load(const float *p) { return _mm512_loadu_ps(p); }
+        inline void v_store(float *p, vfloat v) { _mm512_storeu_ps(p, v); }
+        inline vfloat v_set1(float val) { return _mm512_set1_ps(val); }
+        inline vfloat v_zero() { return _mm512_setzero_ps(); }
+        inline vfloat v_add(vfloat a, vfloat b) { return _mm512_add_ps(a, b); }
+        inline vfloat v_mul(vfloat a, vfloat b) { return _mm512_mul_ps(a, b); }
+        inline vfloat v_max(vfloat a, vfloat b) { return _mm512_maskz_max_ps(V_ALL, a, b); }
+        inline vfloat v_fmadd(vfloat a, vfloat b, vfloat c) { return _mm512_fmadd_ps(a, b, c); }
+        inline float v_hsum(vfloat v)
+        {
+            const __m512d vd = _mm512_castps_pd(v);
+            __m256 half = _mm256_add_ps(
+                    _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, vd, 0)),
+                    _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, vd, 1)));
+            __m128 lo = _mm_add_ps(_mm256_castps256_ps128(half),
+                    _mm256_extractf128_ps(half, 1));
+            lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+            lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 0x55));
+            return _mm_cvtss_f32(lo);
+        }
+        inline vfloat v_sub(vfloat a, vfloat b) { return _mm512_sub_ps(a, b); }
+        inline vfloat v_div(vfloat a, vfloat b) { return _mm512_div_ps(a, b); }
+        inline vfloat v_min(vfloat a, vfloat b) { return _mm512_maskz_min_ps(V_ALL, a, b); }
+        inline vfloat v_round(vfloat v)
+        {
+            return _mm512_maskz_roundscale_ps(V_ALL, v,
+                    _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        }
+        // 2^n for integral n in [-126, 127]
+        inline vfloat v_pow2(vfloat n)
+        {
+            __m512i bits = _mm512_add_epi32(_mm512_maskz_cvtps_epi32(V_ALL, n),
+                    _mm512_set1_epi32(127));
+            return _mm512_castsi512_ps(_mm512_maskz_slli_epi32(V_ALL, bits, 23));
+        }
+        // b where a > 0, 0 elsewhere
+        inline vfloat v_where_positive(vfloat a, vfloat b)
+        {
+            return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(a, v_zero(), _CMP_GT_OQ), b);
+        }
+        // x where a > b, y elsewhere
+        inline vfloat v_select_gt(vfloat a, vfloat b, vfloat x, vfloat y)
+        {
+            return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_GT_OQ), y, x);
+        }
+        // the lanes in reverse order
+        inline vfloat v_reverse(vfloat v)
+        {
+            return _mm512_maskz_permutexvar_ps(V_ALL, _mm512_set_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                        8, 9, 10, 11, 12, 13, 14, 15), v);
+        }
+#elif defined(__AVX2__)
+        typedef __m256 vfloat;
+        const size_t VEC_WIDTH = 8;
+
+        inline vfloat v_load(const float *p) { return _mm256_loadu_ps(p); }
+        inline void v_store(float *p, vfloat v) { _mm256_storeu_ps(p, v); }
+        inline vfloat v_set1(float val) { return _mm256_set1_ps(val); }
+        inline vfloat v_zero() { return _mm256_setzero_ps(); }
+        inline vfloat v_add(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+        inline vfloat v_mul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+        inline vfloat v_max(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+        inline vfloat v_fmadd(vfloat a, vfloat b, vfloat c) { return _mm256_fmadd_ps(a, b, c); }
+        inline float v_hsum(vfloat v)
+        {
+            __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+            lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+            lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 0x55));
+            return _mm_cvtss_f32(lo);
+        }
+        inline vfloat v_sub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+        inline vfloat v_div(vfloat a, vfloat b) { return _mm256_div_ps(a, b); }
+        inline vfloat v_min(vfloat a, vfloat b) { return _mm256_min_ps(a, b); }
+        inline vfloat v_round(vfloat v)
+        {
+            return _mm256_round_ps(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        }
+        inline vfloat v_pow2(vfloat n)
+        {
+            __m256i bits = _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127));
+            return _mm256_castsi256_ps(_mm256_slli_epi32(bits, 23));
+        }
+        inline vfloat v_where_positive(vfloat a, vfloat b)
+        {
+            return _mm256_and_ps(_mm256_cmp_ps(a, v_zero(), _CMP_GT_OQ), b);
+        }
+        inline vfloat v_select_gt(vfloat a, vfloat b, vfloat x, vfloat y)
+        {
+            return _mm256_blendv_ps(y, x, _mm256_cmp_ps(a, b, _CMP_GT_OQ));
+        }
+        inline vfloat v_reverse(vfloat v)
+        {
+            return _mm256_permutevar8x32_ps(v, _mm256_set_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        }
+#else
+        typedef __m128 vfloat;
+        const size_t VEC_WIDTH = 4;
+
+        inline vfloat v_load(const float *p) { return _mm_loadu_ps(p); }
+        inline void v_store(float *p, vfloat v) { _mm_storeu_ps(p, v); }
+        inline vfloat v_set1(float val) { return _mm_set1_ps(val); }
+        inline vfloat v_zero() { return _mm_setzero_ps(); }
+        inline vfloat v_add(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+        inline vfloat v_mul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+        inline vfloat v_max(vfloat a, vfloat b) { return _mm_max_ps(a, b); }
+        inline vfloat v_fmadd(vfloat a, vfloat b, vfloat c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+        inline float v_hsum(vfloat v)
+        {
+            v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+            v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 0x55));
+            return _mm_cvtss_f32(v);
+        }
+        inline vfloat v_sub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+        inline vfloat v_div(vfloat a, vfloat b) { return _mm_div_ps(a, b); }
+        inline vfloat v_min(vfloat a, vfloat b) { return _mm_min_ps(a, b); }
+        // SSE2 has no rounding instruction; the conversion rounds to nearest
+        inline vfloat v_round(vfloat v) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(v)); }
+        inline vfloat v_pow2(vfloat n)
+        {
+            __m128i bits = _mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127));
+            return _mm_castsi128_ps(_mm_slli_epi32(bits, 23));
+        }
+        inline vfloat v_where_positive(vfloat a, vfloat b)
+        {
+            return _mm_and_ps(_mm_cmpgt_ps(a, v_zero()), b);
+        }
+        inline vfloat v_select_gt(vfloat a, vfloat b, vfloat x, vfloat y)
+        {
+            const vfloat mask = _mm_cmpgt_ps(a, b);
+            return _mm_or_ps(_mm_and_ps(mask, x), _mm_andnot_ps(mask, y));
+        }
+        inline vfloat v_reverse(vfloat v) { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 1, 2, 3)); }
+#endif
+
+        inline float s_max(float a, float b) { return (a < b) ? b : a; }
+        inline size_t s_min(size_t a, size_t b) { return (b < a) ? b : a; }
+
+        /* e^x with the range reduction and polynomial of cephes expf():
+         * x = n*ln2 + r, |r| <= ln2/2, e^x = 2^n * e^r. relative error ~2e-7 */
+        inline vfloat v_exp(vfloat x)
+        {
+            x = v_min(v_max(x, v_set1(-87.3f)), v_set1(88.3f));
+            const vfloat n = v_round(v_mul(x, v_set1(1.44269504089f)));
+            vfloat r = v_sub(x, v_mul(n, v_set1(0.693359375f)));
+            r = v_sub(r, v_mul(n, v_set1(-2.12194440e-4f)));
+
+            vfloat p = v_set1(1.9875691500e-4f);
+            p = v_fmadd(p, r, v_set1(1.3981999507e-3f));
+            p = v_fmadd(p, r, v_set1(8.3334519073e-3f));
+            p = v_fmadd(p, r, v_set1(4.1665795894e-2f));
+            p = v_fmadd(p, r, v_set1(1.6666665459e-1f));
+            p = v_fmadd(p, r, v_set1(5.0000001201e-1f));
+            p = v_fmadd(p, v_mul(r, r), v_add(r, v_set1(1.0f)));
+            return v_mul(p, v_pow2(n));
+        }
+
+        /* activation functions on whole vectors. the tails of the loops below go
+         * through padded copies, as scalar math functions instantiated here would be
+         * compiled with this instruction set */
+        struct VSigmoid
+        {
+            static inline vfloat f(vfloat z)
+            {
+                const vfloat one = v_set1(1.0f);
+                return v_div(one, v_add(one, v_exp(v_sub(v_zero(), z))));
+            }
+            static inline vfloat mul_prime(vfloat z, vfloat e)
+            {
+                const vfloat s = f(z);
+                return v_mul(e, v_mul(s, v_sub(v_set1(1.0f), s)));
+            }
+        };
+
+        struct VReLU
+        {
+            static inline vfloat f(vfloat z) { return v_max(z, v_zero()); }
+            static inline vfloat mul_prime(vfloat z, vfloat e) { return v_where_positive(z, e); }
+        };
+
+        template <typename Func>
+        void bias_activate(const float *v, const float *bias, float *z, float *a, size_t dim)
+        {
+            size_t i = 0;
+            for (; i + VEC_WIDTH <= dim; i += VEC_WIDTH)
+            {
+                vfloat val = v_load(v + i);
+                if (bias)
+                    val = v_add(val, v_load(bias + i));
+                if (z)
+                    v_store(z + i, val);
+                v_store(a + i, Func::f(val));
+            }
+
+            if (i < dim)
+            {
+                float tail[VEC_WIDTH] = {};
+                const size_t rest = dim - i;
+                for (size_t j = 0; j < rest; j++)
+                    tail[j] = bias ? v[i + j] + bias[i + j] : v[i + j];
+                if (z)
+                    for (size_t j = 0; j < rest; j++)
+                        z[i + j] = tail[j];
+                v_store(tail, Func::f(v_load(tail)));
+                for (size_t j = 0; j < rest; j++)
+                    a[i + j] = tail[j];
+            }
+        }
+
+        template <typename Func>
+        void activation_prime_mul(const float *z, float *e, size_t dim)
+        {
+            size_t i = 0;
+            for (; i + VEC_WIDTH <= dim; i += VEC_WIDTH)
+                v_store(e + i, Func::mul_prime(v_load(z + i), v_load(e + i)));
+
+            if (i < dim)
+            {
+                float tail_z[VEC_WIDTH] = {}, tail_e[VEC_WIDTH] = {};
+                const size_t rest = dim - i;
+                for (size_t j = 0; j < rest; j++)
+                {
+                    tail_z[j] = z[i + j];
+                    tail_e[j] = e[i + j];
+                }
+                v_store(tail_e, Func::mul_prime(v_load(tail_z), v_load(tail_e)));
+                for (size_t j = 0; j < rest; j++)
+                    e[i + j] = tail_e[j];
+            }
+        }
+
+        void bias_activate_vec(const float *v, const float *bias, float *z, float *a,
+                size_t dim, Activation func)
+        {
+            switch (func)
+            {
+            case Activation::SIGMOID:
+                bias_activate<VSigmoid>(v, bias, z, a, dim);
+                break;
+            case Activation::RELU:
+                bias_activate<VReLU>(v, bias, z, a, dim);
+                break;
+            }
+        }
+
+        void activation_prime_mul_vec(const float *z, float *e, size_t dim, Activation func)
+        {
+            switch (func)
+            {
+            case Activation::SIGMOID:
+                activation_prime_mul<VSigmoid>(z, e, dim);
+                break;
+            case Activation::RELU:
+                activation_prime_mul<VReLU>(z, e, dim);
+                break;
+            }
+        }
+
+        // vres[i] += val * v[i]
+        inline void axpy(float val, const float *v, float *vres, size_t dim)
+        {
+            const vfloat vv = v_set1(val);
+            size_t i = 0;
+            for (; i + VEC_WIDTH <= dim; i += VEC_WIDTH)
+                v_store(vres + i, v_fmadd(vv, v_load(v + i), v_load(vres + i)));
+            for (; i < dim; i++)
+                vres[i] += val * v[i];
+        }
+
+        void add_vec(const float *v1, const float *v2, float *vres, size_t dim)
+        {
+            size_t i = 0;
+            for (; i + VEC_WIDTH <= dim; i += VEC_WIDTH)
+                v_store(vres + i, v_add(v_load(v1 + i), v_load(v2 + i)));
+            for (; i < dim; i++)
+                vres[i] = v1[i] + v2[i];
+        }
+
+        void pmul_vec(const float *v1, const float *v2, float *vres, size_t dim)
+        {
+            size_t i = 0;
+            for (; i + VEC_WIDTH <= dim; i += VEC_WIDTH)
+                v_store(vres + i, v_mul(v_load(v1 + i), v_load(v2 + i)));
+            for (; i < dim; i++)
+                vres[i] = v1[i] * v2[i];
+        }
+
+        inline float dot(const float *v1, const float *v2, size_t dim)
+        {
+            vfloat acc0 = v_zero(), acc1 = v_zero();
+            size_t i = 0;
+            for (; i + 2*VEC_WIDTH <= dim; i += 2*VEC_WIDTH)
+            {
+                acc0 = v_fmadd(v_load(v1 + i), v_load(v2 + i), acc0);
+                acc1 = v_fmadd(v_load(v1 + i + VEC_WIDTH), v_load(v2 + i + VEC_WIDTH), acc1);
+            }
+            for (; i + VEC_WIDTH <= dim; i += VEC_WIDTH)
+                acc0 = v_fmadd(v_load(v1 + i), v_load(v2 + i), acc0);
+
+            float sum = v_hsum(v_add(acc0, acc1));
+            for (; i < dim; i++)
+                sum += v1[i] * v2[i];
+            return sum;
+        }
+
+        void mul_mat_vec(const float *m, const float *v, float *vres, size_t dim_r, size_t dim_c)
+        {
+            size_t r = 0;
+
+            // four rows at a time so that each load of v is used four times
+            for (; r + 4 <= dim_r; r += 4)
+            {
+                const float *m0 = m + r*dim_c;
+                const float *m1 = m0 + dim_c;
+                const float *m2 = m1 + dim_c;
+                const float *m3 = m2 + dim_c;
+                vfloat acc0 = v_zero(), acc1 = v_zero(), acc2 = v_zero(), acc3 = v_zero();
+
+                size_t c = 0;
+                for (; c + VEC_WIDTH <= dim_c; c += VEC_WIDTH)
+                {
+                    vfloat vv = v_load(v + c);
+                    acc0 = v_fmadd(v_load(m0 + c), vv, acc0);
+                    acc1 = v_fmadd(v_load(m1 + c), vv, acc1);
+                    acc2 = v_fmadd(v_load(m2 + c), vv, acc2);
+                    acc3 = v_fmadd(v_load(m3 + c), vv, acc3);
+                }
+
+                float s0 = v_hsum(acc0), s1 = v_hsum(acc1);
+                float s2 = v_hsum(acc2), s3 = v_hsum(acc3);
+                for (; c < dim_c; c++)
+                {
+                    s0 += m0[c] * v[c];
+                    s1 += m1[c] * v[c];
+                    s2 += m2[c] * v[c];
+                    s3 += m3[c] * v[c];
+                }
+                vres[r] = s0;
+                vres[r+1] = s1;
+                vres[r+2] = s2;
+                vres[r+3] = s3;
+            }
+
+            for (; r < dim_r; r++)
+                vres[r] = dot(m + r*dim_c, v, dim_c);
+        }
+
+        void copy_vec(const float *v, float *vres, size_t dim)
+        {
+            size_t i = 0;
+            for (; i + VEC_WIDTH <= dim; i += VEC_WIDTH)
+                v_store(vres + i, v_load(v + i));
+            for (; i < dim; i++)
+                vres[i] = v[i];
+        }
+
+        void set_vec(float *v, float val, size_t dim)
+        {
+            const vfloat vv = v_set1(val);
+            size_t i = 0;
+            for (; i + VEC_WIDTH <= dim; i += VEC_WIDTH)
+                v_store(v + i, vv);
+            for (; i < dim; i++)
+                v[i] = val;
+        }
+
+        void const_mul_vec(float *v, float val, size_t dim)
+        {
+            const vfloat vv = v_set1(val);
+            size_t i = 0;
+            for (; i + VEC_WIDTH <= dim; i += VEC_WIDTH)
+                v_store(v + i, v_mul(v_load(v + i), vv));
+            for (; i < dim; i++)
+                v[i] *= val;
+        }
+
+        void sum_vec(const float *vset, float *vres, size_t dim_v, size_t num_v)
+        {
+            if (num_v == 0)
+            {
+                set_vec(vres, 0, dim_v);
+                return;
+            }
+
+            copy_vec(vset, vres, dim_v);
+            for (size_t n = 1; n < num_v; n++)
+                add_vec(vres, vset + n*dim_v, vres, dim_v);
+        }
+
+        void vec_outer_prod(const float *v1, const float *v2, float *mres,
+                size_t dim_n, size_t dim_m)
+        {
+            for (size_t n = 0; n < dim_n; n++)
+            {
+                const vfloat vv = v_set1(v1[n]);
+                float *row = mres + n*dim_m;
+                size_t i = 0;
+                for (; i + VEC_WIDTH <= dim_m; i += VEC_WIDTH)
+                    v_store(row + i, v_mul(vv, v_load(v2 + i)));
+                for (; i < dim_m; i++)
+                    row[i] = v1[n] * v2[i];
+            }
+        }
+
+        /* the max pooling kernels keep one input row per pool row in these buffers.
+         * wider rows go in strips of whole windows; only windows wider than a
+         * buffer use the reference path */
+        const size_t POOL_ROW = 1024;
+
+        // windows [w_begin, w_end) of a pool row, whose inputs start at x_begin
+        struct PoolStrip
+        {
+            size_t w_begin, w_end, x_begin, width;
+        };
+
+        template <typename Func>
+        void for_pool_strips(size_t ratio_w, size_t pool_w, size_t delta_w, Func func)
+        {
+            const size_t strip_windows = (POOL_ROW - pool_w) / delta_w + 1;
+            for (size_t w = 0; w < ratio_w; w += strip_windows)
+            {
+                const size_t w_end = s_min(ratio_w, w + strip_windows);
+                func(PoolStrip{w, w_end, w * delta_w, (w_end - 1) * delta_w + pool_w
+                        - w * delta_w});
+            }
+        }
+
+        void downsample_max(const float *m, float *mres, size_t dim_w, size_t dim_h,
+                size_t pool_w, size_t pool_h, size_t stride)
+        {
+            if (pool_w > POOL_ROW)
+            {
+                scalar_kernels().downsample_max(m, mres, dim_w, dim_h, pool_w, pool_h, stride);
+                return;
+            }
+            float vmax_row[POOL_ROW];
+
+            const size_t delta_w = pool_w - (stride - 1);
+            const size_t delta_h = pool_h - (stride - 1);
+            const size_t ratio_w = (dim_w - pool_w) / delta_w + 1;
+            for (size_t i=0; i + pool_h <= dim_h; i += delta_h)
+            {
+                float *res_row = mres + (i/delta_h) * ratio_w;
+                for_pool_strips(ratio_w, pool_w, delta_w, [&](const PoolStrip& strip) {
+                    // vertical maximum over the pool rows
+                    const float *in = m + i*dim_w + strip.x_begin;
+                    copy_vec(in, vmax_row, strip.width);
+                    for (size_t y = 1; y < pool_h; y++)
+                    {
+                        const float *row = in + y*dim_w;
+                        size_t x = 0;
+                        for (; x + VEC_WIDTH <= strip.width; x += VEC_WIDTH)
+                            v_store(vmax_row + x, v_max(v_load(vmax_row + x), v_load(row + x)));
+                        for (; x < strip.width; x++)
+                            vmax_row[x] = s_max(vmax_row[x], row[x]);
+                    }
+
+                    // horizontal maximum over each pool window
+                    for (size_t w = strip.w_begin; w < strip.w_end; w++)
+                    {
+                        const float *window = vmax_row + w*delta_w - strip.x_begin;
+                        float vmax = window[0];
+                        for (size_t x = 1; x < pool_w; x++)
+                            vmax = s_max(vmax, window[x]);
+                        res_row[w] = vmax;
+                    }
+                });
+            }
+        }
+
+        /* the error of each window goes to its first maximum in row-major order, as in
+         * the reference: the column maxima keep the first row reaching them, then the
+         * window takes the first column of the smallest such row among its maxima */
+        void upsample_max(const float *me, const float *ma, float *me_res,
+                size_t dim_w, size_t dim_h, size_t pool_w, size_t pool_h, size_t stride)
+        {
+            if (pool_w > POOL_ROW)
+            {
+                scalar_kernels().upsample_max(me, ma, me_res, dim_w, dim_h,
+                        pool_w, pool_h, stride);
+                return;
+            }
+            float vmax_row[POOL_ROW], ymax_row[POOL_ROW];
+
+            const size_t delta_w = pool_w - (stride - 1);
+            const size_t delta_h = pool_h - (stride - 1);
+            const size_t ratio_w = (dim_w - pool_w) / delta_w + 1;
+            set_vec(me_res, 0, dim_w * dim_h);
+
+            for (size_t i=0; i + pool_h <= dim_h; i += delta_h)
+            {
+                const float *e_row = me + (i/delta_h) * ratio_w;
+                for_pool_strips(ratio_w, pool_w, delta_w, [&](const PoolStrip& strip) {
+                    const float *in = ma + i*dim_w + strip.x_begin;
+                    copy_vec(in, vmax_row, strip.width);
+                    set_vec(ymax_row, 0, strip.width);
+                    for (size_t y = 1; y < pool_h; y++)
+                    {
+                        const float *row = in + y*dim_w;
+                        const vfloat vy = v_set1(float(y));
+                        size_t x = 0;
+                        for (; x + VEC_WIDTH <= strip.width; x += VEC_WIDTH)
+                        {
+                            const vfloat cur = v_load(vmax_row + x), val = v_load(row + x);
+                            v_store(ymax_row + x, v_select_gt(val, cur, vy, v_load(ymax_row + x)));
+                            v_store(vmax_row + x, v_select_gt(val, cur, val, cur));
+                        }
+                        for (; x < strip.width; x++)
+                        {
+                            if (vmax_row[x] < row[x])
+                            {
+                                vmax_row[x] = row[x];
+                                ymax_row[x] = float(y);
+                            }
+                        }
+                    }
+
+                    for (size_t w = strip.w_begin; w < strip.w_end; w++)
+                    {
+                        const size_t first = w*delta_w - strip.x_begin;
+                        size_t best = first;
+                        for (size_t x = first + 1; x < first + pool_w; x++)
+                        {
+                            if (vmax_row[best] < vmax_row[x] || (vmax_row[best] == vmax_row[x]
+                                        && ymax_row[x] < ymax_row[best]))
+                                best = x;
+                        }
+                        const size_t max_y = i + static_cast<size_t>(ymax_row[best]);
+                        me_res[max_y*dim_w + strip.x_begin + best] = e_row[w];
+                    }
+                });
+            }
+        }
+
+        void transpose_mat(const float *m, float *mres, size_t dim_r, size_t dim_c)
+        {
+            // 4x4 blocks in registers, within tiles whose rows stay in the cache
+            const size_t TILE = 32;
+            for (size_t i0 = 0; i0 < dim_r; i0 += TILE)
+            {
+                const size_t i1 = s_min(dim_r, i0 + TILE);
+                for (size_t j0 = 0; j0 < dim_c; j0 += TILE)
+                {
+                    const size_t j1 = s_min(dim_c, j0 + TILE);
+                    size_t i = i0;
+                    for (; i + 4 <= i1; i += 4)
+                    {
+                        size_t j = j0;
+                        for (; j + 4 <= j1; j += 4)
+                        {
+                            __m128 r0 = _mm_loadu_ps(m + i*dim_c + j);
+                            __m128 r1 = _mm_loadu_ps(m + (i+1)*dim_c + j);
+                            __m128 r2 = _mm_loadu_ps(m + (i+2)*dim_c + j);
+                            __m128 r3 = _mm_loadu_ps(m + (i+3)*dim_c + j);
+                            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+                            _mm_storeu_ps(mres + j*dim_r + i, r0);
+                            _mm_storeu_ps(mres + (j+1)*dim_r + i, r1);
+                            _mm_storeu_ps(mres + (j+2)*dim_r + i, r2);
+                            _mm_storeu_ps(mres + (j+3)*dim_r + i, r3);
+                        }
+                        for (; j < j1; j++)
+                            for (size_t r = i; r < i + 4; r++)
+                                mres[j*dim_r + r] = m[r*dim_c + j];
+                    }
+                    for (; i < i1; i++)
+                        for (size_t j = j0; j < j1; j++)
+                            mres[j*dim_r + i] = m[i*dim_c + j];
+                }
+            }
+        }
+
+        void flip_mat(const float *m, float *mres, size_t dim_w, size_t dim_h)
+        {
+            // in place is left undone, as by the reference
+            if (m == mres)
+                return;
+
+            const size_t dim = dim_w * dim_h;
+            size_t i = 0;
+            for (; i + VEC_WIDTH <= dim; i += VEC_WIDTH)
+                v_store(mres + dim - i - VEC_WIDTH, v_reverse(v_load(m + i)));
+            for (; i < dim; i++)
+                mres[dim - i - 1] = m[i];
+        }
+
+        void inflate_mats(const float *m_in, float *m_res, size_t dim_w, size_t dim_h,
+                size_t pad, size_t num_m)
+        {
+            const size_t out_w = dim_w + pad*2;
+            const size_t out_h = dim_h + pad*2;
+
+            for (size_t n = 0; n < num_m; n++)
+            {
+                const float *in = m_in + dim_w * dim_h * n;
+                float *res = m_res + out_w * out_h * n;
+
+                // the top border runs into the left one of the first row
+                set_vec(res, 0, pad*out_w + pad);
+                for (size_t y = 0; y < dim_h; y++)
+                {
+                    float *row = res + (y + pad)*out_w + pad;
+                    copy_vec(in + y*dim_w, row, dim_w);
+                    // right border of this row and left border of the next one
+                    set_vec(row + dim_w, 0, (y + 1 < dim_h) ? pad*2 : pad);
+                }
+                set_vec(res + (dim_h + pad)*out_w, 0, pad*out_w);
+            }
+        }
+
+        void convolution_mat(const float *m_in, const float *m_conv, float *m_res,
+                int dim_w, int dim_h, int dim_conv_w, int dim_conv_h,
+                const MatrixRange& range)
+        {
+            // each kernel coefficient is applied to a contiguous run of an output row,
+            // so the bounds are resolved once per (row, coefficient) instead of per element
+            for (int j = 0; j < range.h; j++)
+            {
+                float *res_row = m_res + j*range.w;
+                set_vec(res_row, 0, range.w);
+
+                for (int jj = 0; jj < dim_conv_h; jj++)
+                {
+                    const int in_j = range.y + j + dim_conv_h - jj - 1;
+                    if (in_j < 0 || in_j >= dim_h)
+                        continue;
+                    const float *in_row = m_in + in_j*dim_w;
+
+                    for (int ii = 0; ii < dim_conv_w; ii++)
+                    {
+                        // in_i = off + i must lie within [0, dim_w)
+                        const int off = range.x + dim_conv_w - ii - 1;
+                        int i_begin = (off < 0) ? -off : 0;
+                        int i_end = dim_w - off;
+                        if (i_end > range.w)
+                            i_end = range.w;
+                        if (i_begin >= i_end)
+                            continue;
+
+                        axpy(m_conv[jj*dim_conv_w + ii], in_row + off + i_begin,
+                                res_row + i_begin, i_end - i_begin);
+                    }
+                }
+            }
+        }
+
+        const size_t SGEMM_MR = 6;
+        const size_t SGEMM_NR = 2 * VEC_WIDTH;
+
+        // 6 x (2 vectors) block: 12 accumulators, 2 loads of b and 1 broadcast of a
+        void sgemm_kernel(size_t kc, const float *a_pack, const float *b_pack,
+                float *c, size_t ldc)
+        {
+            vfloat c00 = v_zero(), c01 = v_zero(), c10 = v_zero(), c11 = v_zero();
+            vfloat c20 = v_zero(), c21 = v_zero(), c30 = v_zero(), c31 = v_zero();
+            vfloat c40 = v_zero(), c41 = v_zero(), c50 = v_zero(), c51 = v_zero();
+
+            for (size_t p = 0; p < kc; p++)
+            {
+                const vfloat b0 = v_load(b_pack);
+                const vfloat b1 = v_load(b_pack + VEC_WIDTH);
+                vfloat a;
+
+                a = v_set1(a_pack[0]);
+                c00 = v_fmadd(a, b0, c00);
+                c01 = v_fmadd(a, b1, c01);
+                a = v_set1(a_pack[1]);
+                c10 = v_fmadd(a, b0, c10);
+                c11 = v_fmadd(a, b1, c11);
+                a = v_set1(a_pack[2]);
+                c20 = v_fmadd(a, b0, c20);
+                c21 = v_fmadd(a, b1, c21);
+                a = v_set1(a_pack[3]);
+                c30 = v_fmadd(a, b0, c30);
+                c31 = v_fmadd(a, b1, c31);
+                a = v_set1(a_pack[4]);
+                c40 = v_fmadd(a, b0, c40);
+                c41 = v_fmadd(a, b1, c41);
+                a = v_set1(a_pack[5]);
+                c50 = v_fmadd(a, b0, c50);
+                c51 = v_fmadd(a, b1, c51);
+
+                a_pack += SGEMM_MR;
+                b_pack += SGEMM_NR;
+            }
+
+            float *c0 = c, *c1 = c0 + ldc, *c2 = c1 + ldc;
+            float *c3 = c2 + ldc, *c4 = c3 + ldc, *c5 = c4 + ldc;
+            v_store(c0, v_add(v_load(c0), c00));
+            v_store(c0 + VEC_WIDTH, v_add(v_load(c0 + VEC_WIDTH), c01));
+            v_store(c1, v_add(v_load(c1), c10));
+            v_store(c1 + VEC_WIDTH, v_add(v_load(c1 + VEC_WIDTH), c11));
+            v_store(c2, v_add(v_load(c2), c20));
+            v_store(c2 + VEC_WIDTH, v_add(v_load(c2 + VEC_WIDTH), c21));
+            v_store(c3, v_add(v_load(c3), c30));
+            v_store(c3 + VEC_WIDTH, v_add(v_load(c3 + VEC_WIDTH), c31));
+            v_store(c4, v_add(v_load(c4), c40));
+            v_store(c4 + VEC_WIDTH, v_add(v_load(c4 + VEC_WIDTH), c41));
+            v_store(c5, v_add(v_load(c5), c50));
+            v_store(c5 + VEC_WIDTH, v_add(v_load(c5 + VEC_WIDTH), c51));
+        }
+    } }
+
+    CalcKernels CALC_SIMD_KERNELS(const CalcKernels& base)
+    {
+        CalcKernels kernels = base;
+        kernels.add_vec = CALC_SIMD_NS::add_vec;
+        kernels.pmul_vec = CALC_SIMD_NS::pmul_vec;
+        kernels.mul_mat_vec = CALC_SIMD_NS::mul_mat_vec;
+        kernels.copy_vec = CALC_SIMD_NS::copy_vec;
+        kernels.set_vec = CALC_SIMD_NS::set_vec;
+        kernels.const_mul_vec = CALC_SIMD_NS::const_mul_vec;
+        kernels.sum_vec = CALC_SIMD_NS::sum_vec;
+        kernels.vec_outer_prod = CALC_SIMD_NS::vec_outer_prod;
+        kernels.transpose_mat = CALC_SIMD_NS::transpose_mat;
+        kernels.downsample_max = CALC_SIMD_NS::downsample_max;
+        kernels.upsample_max = CALC_SIMD_NS::upsample_max;
+        kernels.flip_mat = CALC_SIMD_NS::flip_mat;
+        kernels.inflate_mats = CALC_SIMD_NS::inflate_mats;
+        kernels.convolution_mat = CALC_SIMD_NS::convolution_mat;
+        kernels.bias_activate_vec = CALC_SIMD_NS::bias_activate_vec;
+        kernels.activation_prime_mul_vec = CALC_SIMD_NS::activation_prime_mul_vec;
+        kernels.sgemm_mr = CALC_SIMD_NS::SGEMM_MR;
+        kernels.sgemm_nr = CALC_SIMD_NS::SGEMM_NR;
+        kernels.sgemm_kernel = CALC_SIMD_NS::sgemm_kernel;
+        return kernels;
+    }
+}
@@ -1,270 +1,593 @@
 #include "calc/calc-cpu.hpp"
+#include "calc/calc-cpu-simd.hpp"
+#include "calc/util-functions.hpp"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 
 namespace NeuralNet
 {
-    void add_vec(const float *v1, const float *v2, float *vres, size_t dim)
+    /* reference implementations of the primitives */
+    namespace scalar
     {
-        float *pres = vres;
-        while (static_cast<size_t>(vres - pres) < dim)
+        void add_vec(const float *v1, const float *v2, float *vres, size_t dim)
         {
-            *vres = *v1 + *v2;
-            vres++;
-            v1++;
-            v2++;
-        }
-    }
-
-    void pmul_vec(const float *v1, const float *v2, float *vres, size_t dim)
-    {
-        float *pres = vres;
-        while (static_cast<size_t>(vres - pres) < dim)
-        {
-            *vres = *v1 * *v2;
-            vres++;
-            v1++;
-            v2++;
+            float *pres = vres;
+            while (static_cast<size_t>(vres - pres) < dim)
+            {
+                *vres = *v1 + *v2;
+                vres++;
+                v1++;
+                v2++;
+            }
         }
-    }
 
-    void mul_mat_vec(const float *m, const float *v, float *vres, size_t dim_r, size_t dim_c)
-    {
-        float *pres = vres;
-        const float *pv = v;
-        while (static_cast<size_t>(vres - pres) < dim_r)
+        void pmul_vec(const float *v1, const float *v2, float *vres, size_t dim)
         {
-            *vres = 0;
-            while (static_cast<size_t>(v - pv) < dim_c)
+            float *pres = vres;
+            while (static_cast<size_t>(vres - pres) < dim)
             {
-                *vres += (*m) * (*v);
-                m++;
-                v++;
+                *vres = *v1 * *v2;
+                vres++;
+                v1++;
+                v2++;
             }
-            vres++;
-            v = pv;
         }
-    }
 
-    void copy_vec(const float *v, float *vres, size_t dim)
-    {
-        const float *pres = v;
-        while (static_cast<size_t>(v - pres) < dim)
+        void mul_mat_vec(const float *m, const float *v, float *vres, size_t dim_r, size_t dim_c)
         {
-            *vres = *v;
-            v++;
-            vres++;
+            float *pres = vres;
+            const float *pv = v;
+            while (static_cast<size_t>(vres - pres) < dim_r)
+            {
+                *vres = 0;
+                while (static_cast<size_t>(v - pv) < dim_c)
+                {
+                    *vres += (*m) * (*v);
+                    m++;
+                    v++;
+                }
+                vres++;
+                v = pv;
+            }
         }
-    }
 
-    void set_vec(float *v, float val, size_t dim)
-    {
-        float *pv = v;
-        while (static_cast<size_t>(v - pv) < dim)
+        void copy_vec(const float *v, float *vres, size_t dim)
         {
-            *v = val;
-            v++;
+            const float *pres = v;
+            while (static_cast<size_t>(v - pres) < dim)
+            {
+                *vres = *v;
+                v++;
+                vres++;
+            }
         }
-    }
 
-    void const_mul_vec(float *v, float val, size_t dim)
-    {
-        float *pv = v;
-        while (static_cast<size_t>(v - pv) < dim)
+        void set_vec(float *v, float val, size_t dim)
         {
-            *v *= val;
-            v++;
+            float *pv = v;
+            while (static_cast<size_t>(v - pv) < dim)
+            {
+                *v = val;
+                v++;
+            }
         }
-    }
 
-    void apply_vec(const float *v, float *vres, size_t dim, std::function<float(float)> func)
-    {
-        const float *pres = v;
-        while (static_cast<size_t>(v - pres) < dim)
+        void const_mul_vec(float *v, float val, size_t dim)
         {
-            *vres = func(*v);
-            v++;
-            vres++;
+            float *pv = v;
+            while (static_cast<size_t>(v - pv) < dim)
+            {
+                *v *= val;
+                v++;
+            }
         }
-    }
 
-    void transpose_mat(const float *m, float *mres, size_t dim_r, size_t dim_c)
-    {
-        for (size_t i=0; i<dim_r; i++)
+        void transpose_mat(const float *m, float *mres, size_t dim_r, size_t dim_c)
         {
-            for (size_t j=0; j<dim_c; j++)
+            for (size_t i=0; i<dim_r; i++)
             {
-                mres[i+j*dim_r] = m[i*dim_c+j];
+                for (size_t j=0; j<dim_c; j++)
+                {
+                    mres[i+j*dim_r] = m[i*dim_c+j];
+                }
             }
         }
-    }
-
-    void sum_vec(const float *vset, float *vres, size_t dim_v, size_t num_v)
-    {
-        float *p_vres = vres;
-        const float *p_vset = vset;
 
-        /* initialize to zero before addition */
-        while (static_cast<size_t>(vres - p_vres) < dim_v)
+        void sum_vec(const float *vset, float *vres, size_t dim_v, size_t num_v)
         {
-            *vres = 0;
-            vres++;
-        }
-        vres = p_vres;
+            float *p_vres = vres;
+            const float *p_vset = vset;
 
-        while (static_cast<size_t>(vset - p_vset) < dim_v*num_v)
-        {
+            /* initialize to zero before addition */
             while (static_cast<size_t>(vres - p_vres) < dim_v)
             {
-                *vres += *vset;
+                *vres = 0;
                 vres++;
-                vset++;
             }
             vres = p_vres;
+
+            while (static_cast<size_t>(vset - p_vset) < dim_v*num_v)
+            {
+                while (static_cast<size_t>(vres - p_vres) < dim_v)
+                {
+                    *vres += *vset;
+                    vres++;
+                    vset++;
+                }
+                vres = p_vres;
+            }
         }
-    }
 
-    void vec_outer_prod(const float *v1, const float *v2, float *mres, size_t dim_n, size_t dim_m)
-    {
-        const float *p_v1 = v1;
-        const float *p_v2 = v2;
-        while (static_cast<size_t>(v1 - p_v1) < dim_n)
+        void vec_outer_prod(const float *v1, const float *v2, float *mres, size_t dim_n, size_t dim_m)
         {
-            while (static_cast<size_t>(v2 - p_v2) < dim_m)
+            const float *p_v1 = v1;
+            const float *p_v2 = v2;
+            while (static_cast<size_t>(v1 - p_v1) < dim_n)
             {
-                *mres = (*v1) * (*v2);
-                mres++;
-                v2++;
+                while (static_cast<size_t>(v2 - p_v2) < dim_m)
+                {
+                    *mres = (*v1) * (*v2);
+                    mres++;
+                    v2++;
+                }
+                v1++;
+                v2 = p_v2;
             }
-            v1++;
-            v2 = p_v2;
         }
-    }
 
-    void downsample_max(const float *m, float *mres, size_t dim_w, size_t dim_h, size_t pool_w,
-            size_t pool_h, size_t stride)
-    {
-        const size_t delta_w = pool_w - (stride - 1);
-        const size_t delta_h = pool_h - (stride - 1);
-        const size_t ratio_w = (dim_w - pool_w) / delta_w + 1;
-        for (size_t i=0; i + pool_h <= dim_h; i += delta_h)
+        void downsample_max(const float *m, float *mres, size_t dim_w, size_t dim_h, size_t pool_w,
+                size_t pool_h, size_t stride)
         {
-            for (size_t j=0; j + pool_w <= dim_w; j += delta_w)
+            const size_t delta_w = pool_w - (stride - 1);
+            const size_t delta_h = pool_h - (stride - 1);
+            const size_t ratio_w = (dim_w - pool_w) / delta_w + 1;
+            for (size_t i=0; i + pool_h <= dim_h; i += delta_h)
             {
-                float vmax = m[i*dim_w + j];
-                for (size_t y=i; y < i+pool_h; y++)
+                for (size_t j=0; j + pool_w <= dim_w; j += delta_w)
                 {
-                    for (size_t x=j; x < j+pool_w; x++)
+                    float vmax = m[i*dim_w + j];
+                    for (size_t y=i; y < i+pool_h; y++)
                     {
-                        vmax = std::max(vmax, m[y*dim_w + x]);
+                        for (size_t x=j; x < j+pool_w; x++)
+                        {
+                            vmax = std::max(vmax, m[y*dim_w + x]);
+                        }
                     }
+                    mres[(i/delta_h) * ratio_w + (j/delta_w)] = vmax;
                 }
-                mres[(i/delta_h) * ratio_w + (j/delta_w)] = vmax;
             }
         }
-    }
 
-    void upsample_max(const float *me, const float *ma, float *me_res,
-            size_t dim_w, size_t dim_h, size_t pool_w, size_t pool_h, size_t stride)
-    {
-        const size_t delta_w = pool_w - (stride - 1);
-        const size_t delta_h = pool_h - (stride - 1);
-        const size_t ratio_w = (dim_w - pool_w) / delta_w + 1;
+        void upsample_max(const float *me, const float *ma, float *me_res,
+                size_t dim_w, size_t dim_h, size_t pool_w, size_t pool_h, size_t stride)
+        {
+            const size_t delta_w = pool_w - (stride - 1);
+            const size_t delta_h = pool_h - (stride - 1);
+            const size_t ratio_w = (dim_w - pool_w) / delta_w + 1;
+
+            for (size_t i=0; i<dim_w * dim_h; i++)
+            {
+                me_res[i] = 0;
+            }
 
-        for (size_t i=0; i<dim_w * dim_h; i++)
+            for (size_t i=0; i + pool_h <= dim_h; i += delta_h)
+            {
+                for (size_t j=0; j + pool_w <= dim_w; j += delta_w)
+                {
+                    auto max_x = j, max_y = i;
+                    float vmax = ma[i*dim_w + j];
+                    for (size_t y=i; y < i+pool_h; y++)
+                    {
+                        for (size_t x=j; x < j+pool_w; x++)
+                        {
+                            if (vmax < ma[y*dim_w + x])
+                            {
+                                vmax = ma[y*dim_w + x];
+                                max_x = x;
+                                max_y = y;
+                            }
+                        }
+                    }
+                    me_res[max_y * dim_w + max_x] = me[(i/delta_h) * ratio_w + (j/delta_w)];
+                }
+            }
+        }
+
+        void flip_mat(const float *m, float *mres, size_t dim_w, size_t dim_h)
         {
-            me_res[i] = 0;
+            const float *pm = m;
+            float *pmres = mres + (dim_w*dim_h - 1);
+
+            if (m == mres)
+            {
+                /* TODO */
+            }
+            else
+            {
+                while (static_cast<size_t>(m - pm) < dim_w * dim_h)
+                {
+                    *pmres = *m;
+                    m++;
+                    pmres--;
+                }
+            }
         }
 
-        for (size_t i=0; i + pool_h <= dim_h; i += delta_h)
+        void inflate_mats(const float *m_in, float *m_res, size_t dim_w, size_t dim_h,
+                size_t pad, size_t num_m)
         {
-            for (size_t j=0; j + pool_w <= dim_w; j += delta_w)
+            const size_t out_w = dim_w + pad*2;
+            const size_t out_h = dim_h + pad*2;
+
+            for (size_t i=0; i<num_m; i++)
             {
-                auto max_x = j, max_y = i;
-                float vmax = ma[i*dim_w + j];
-                for (size_t y=i; y < i+pool_h; y++)
+                size_t in_off = dim_w * dim_h * i;
+                size_t res_off = out_w * out_h * i;
+
+                for (size_t y = 0; y < out_h; y++)
                 {
-                    for (size_t x=j; x < j+pool_w; x++)
+                    for (size_t x = 0; x < out_w; x++)
                     {
-                        if (vmax < ma[y*dim_w + x])
+                        if (x>=pad && x<pad+dim_w && y>=pad && y<pad+dim_h)
+                        {
+                            m_res[y*out_w + x + res_off] = m_in[(y-pad)*dim_w + (x-pad) + in_off];
+                        }
+                        else
                         {
-                            vmax = ma[y*dim_w + x];
-                            max_x = x;
-                            max_y = y;
+                            m_res[y*out_w + x + res_off] = 0;
                         }
                     }
                 }
-                me_res[max_y * dim_w + max_x] = me[(i/delta_h) * ratio_w + (j/delta_w)];
             }
         }
-    }
 
-    void flip_mat(const float *m, float *mres, size_t dim_w, size_t dim_h)
-    {
-        const float *pm = m;
-        float *pmres = mres + (dim_w*dim_h - 1);
+        void convolution_mat(const float *m_in, const float *m_conv, float *m_res,
+                int dim_w, int dim_h, int dim_conv_w, int dim_conv_h,
+                const MatrixRange& range)
+        {
+            const int i_dim_w = dim_w;
+            const int i_dim_h = dim_h;
+            for (int j=0;j<range.h;j++) {
+                for (int i=0;i<range.w;i++) {
+                    float sum=0;
+                    for (int jj=0;jj<dim_conv_h;jj++) {
+                        for (int ii=0;ii<dim_conv_w;ii++) {
+                            int in_i = range.x + i + dim_conv_w - ii - 1;
+                            int in_j = range.y + j + dim_conv_h - jj - 1;
+                            if (in_i >= 0 && in_i < i_dim_w && in_j >= 0 && in_j < i_dim_h)
+                                sum += m_conv[jj*dim_conv_w + ii] * m_in[in_j*dim_w + in_i];
+                        }
+                    }
+                    m_res[j*range.w + i] = sum;
+                }
+            }
+        }
+
+        template <typename Func>
+        void bias_activate(const float *v, const float *bias, float *z, float *a, size_t dim)
+        {
+            for (size_t i = 0; i < dim; i++)
+            {
+                float val = bias ? v[i] + bias[i] : v[i];
+                if (z)
+                    z[i] = val;
+                a[i] = Func::f(val);
+            }
+        }
 
-        if (m == mres)
+        template <typename Func>
+        void activation_prime_mul(const float *z, float *e, size_t dim)
         {
-            /* TODO */
+            for (size_t i = 0; i < dim; i++)
+                e[i] *= Func::prime(z[i]);
         }
-        else
+
+        void bias_activate_vec(const float *v, const float *bias, float *z, float *a,
+                size_t dim, Activation func)
         {
-            while (static_cast<size_t>(m - pm) < dim_w * dim_h)
+            switch (func)
             {
-                *pmres = *m;
-                m++;
-                pmres--;
+            case Activation::SIGMOID:
+                bias_activate<SigmoidActivation>(v, bias, z, a, dim);
+                break;
+            case Activation::RELU:
+                bias_activate<ReLUActivation>(v, bias, z, a, dim);
+                break;
             }
         }
+
+        void activation_prime_mul_vec(const float *z, float *e, size_t dim, Activation func)
+        {
+            switch (func)
+            {
+            case Activation::SIGMOID:
+                activation_prime_mul<SigmoidActivation>(z, e, dim);
+                break;
+            case Activation::RELU:
+                activation_prime_mul<ReLUActivation>(z, e, dim);
+                break;
+            }
+        }
+
+        const size_t SGEMM_MR = 4;
+        const size_t SGEMM_NR = 4;
+
+        void sgemm_kernel(size_t kc, const float *a_pack, const float *b_pack,
+                float *c, size_t ldc)
+        {
+            float acc[SGEMM_MR][SGEMM_NR] = {};
+            for (size_t p = 0; p < kc; p++)
+            {
+                for (size_t r = 0; r < SGEMM_MR; r++)
+                    for (size_t s = 0; s < SGEMM_NR; s++)
+                        acc[r][s] += a_pack[r] * b_pack[s];
+                a_pack += SGEMM_MR;
+                b_pack += SGEMM_NR;
+            }
+            for (size_t r = 0; r < SGEMM_MR; r++)
+                for (size_t s = 0; s < SGEMM_NR; s++)
+                    c[r*ldc + s] += acc[r][s];
+        }
     }
 
-    void inflate_mats(const float *m_in, float *m_res, size_t dim_w, size_t dim_h,
-            size_t pad, size_t num_m)
+    const CalcKernels& scalar_kernels()
     {
-        const size_t out_w = dim_w + pad*2;
-        const size_t out_h = dim_h + pad*2;
+        static const CalcKernels kernels = {
+            scalar::add_vec,
+            scalar::pmul_vec,
+            scalar::mul_mat_vec,
+            scalar::copy_vec,
+            scalar::set_vec,
+            scalar::const_mul_vec,
+            scalar::transpose_mat,
+            scalar::sum_vec,
+            scalar::vec_outer_prod,
+            scalar::downsample_max,
+            scalar::upsample_max,
+            scalar::flip_mat,
+            scalar::inflate_mats,
+            scalar::convolution_mat,
+            scalar::bias_activate_vec,
+            scalar::activation_prime_mul_vec,
+            scalar::SGEMM_MR,
+            scalar::SGEMM_NR,
+            scalar::sgemm_kernel,
+        };
+        return kernels;
+    }
 
-        for (size_t i=0; i<num_m; i++)
+    namespace
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        // checks whether the OS saves the given XCR0 state components on context switches
+        bool os_saves_state(unsigned int mask)
         {
-            size_t in_off = dim_w * dim_h * i;
-            size_t res_off = out_w * out_h * i;
+            unsigned int eax, ebx, ecx, edx;
+            if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+                return false;
 
-            for (size_t y = 0; y < out_h; y++)
+            unsigned int xcr0_lo, xcr0_hi;
+            __asm__ volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+            return (xcr0_lo & mask) == mask;
+        }
+#endif
+
+        SIMDLevel cpu_simd_level()
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            unsigned int eax, ebx, ecx, edx;
+            if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+                return SIMDLevel::SCALAR;
+            if (!(edx & bit_SSE2))
+                return SIMDLevel::SCALAR;
+
+            const bool has_fma = (ecx & bit_FMA);
+            unsigned int ebx7 = 0;
+            if (__get_cpuid_max(0, nullptr) >= 7)
             {
-                for (size_t x = 0; x < out_w; x++)
+                unsigned int eax7, ecx7, edx7;
+                __cpuid_count(7, 0, eax7, ebx7, ecx7, edx7);
+            }
+
+            // XCR0 bits: SSE(1) | AVX(2) for ymm, plus opmask/zmm (5-7) for AVX-512
+            if (has_fma && (ebx7 & bit_AVX512F) && os_saves_state(0xe6))
+                return SIMDLevel::AVX512;
+            if (has_fma && (ebx7 & bit_AVX2) && os_saves_state(0x06))
+                return SIMDLevel::AVX2;
+            return SIMDLevel::SSE;
+#else
+            return SIMDLevel::SCALAR;
+#endif
+        }
+
+        struct KernelSelection
+        {
+            SIMDLevel level;
+            CalcKernels kernels;
+
+            KernelSelection() { select(cpu_simd_level()); }
+
+            void select(SIMDLevel lv)
+            {
+                level = SIMDLevel::SCALAR;
+                kernels = scalar_kernels();
+#if defined(__x86_64__) || defined(__i386__)
+                switch (lv)
                 {
-                    if (x>=pad && x<pad+dim_w && y>=pad && y<pad+dim_h)
-                    {
-                        m_res[y*out_w + x + res_off] = m_in[(y-pad)*dim_w + (x-pad) + in_off];
-                    }
-                    else
-                    {
-                        m_res[y*out_w + x + res_off] = 0;
-                    }
+                case SIMDLevel::AVX512:
+                    kernels = avx512_kernels(scalar_kernels());
+                    break;
+                case SIMDLevel::AVX2:
+                    kernels = avx2_kernels(scalar_kernels());
+                    break;
+                case SIMDLevel::SSE:
+                    kernels = sse_kernels(scalar_kernels());
+                    break;
+                case SIMDLevel::SCALAR:
+                    break;
                 }
+                level = lv;
+#endif
             }
+        };
+
+        KernelSelection& selection()
+        {
+            static KernelSelection sel;
+            return sel;
         }
+
+        inline const CalcKernels& kernels()
+        {
+            return selection().kernels;
+        }
+    }
+
+    const CalcKernels& active_kernels()
+    {
+        return kernels();
+    }
+
+    SIMDLevel get_simd_level()
+    {
+        return selection().level;
+    }
+
+    SIMDLevel detect_simd_level()
+    {
+        return cpu_simd_level();
+    }
+
+    void set_simd_level(SIMDLevel level)
+    {
+        auto max_level = cpu_simd_level();
+        if (static_cast<int>(level) > static_cast<int>(max_level))
+            level = max_level;
+        selection().select(level);
+    }
+
+    const char *simd_level_name(SIMDLevel level)
+    {
+        switch (level)
+        {
+        case SIMDLevel::SCALAR:
+            return "scalar";
+        case SIMDLevel::SSE:
+            return "sse";
+        case SIMDLevel::AVX2:
+            return "avx2";
+        case SIMDLevel::AVX512:
+            return "avx512";
+        }
+        return "unknown";
+    }
+
+    void add_vec(const float *v1, const float *v2, float *vres, size_t dim)
+    {
+        kernels().add_vec(v1, v2, vres, dim);
+    }
+
+    void pmul_vec(const float *v1, const float *v2, float *vres, size_t dim)
+    {
+        kernels().pmul_vec(v1, v2, vres, dim);
+    }
+
+    void mul_mat_vec(const float *m, const float *v, float *vres, size_t dim_r, size_t dim_c)
+    {
+        kernels().mul_mat_vec(m, v, vres, dim_r, dim_c);
+    }
+
+    void copy_vec(const float *v, float *vres, size_t dim)
+    {
+        kernels().copy_vec(v, vres, dim);
+    }
+
+    void set_vec(float *v, float val, size_t dim)
+    {
+        kernels().set_vec(v, val, dim);
+    }
+
+    void const_mul_vec(float *v, float val, size_t dim)
+    {
+        kernels().const_mul_vec(v, val, dim);
+    }
+
+    void bias_activate_vec(const float *v, const float *bias, float *z, float *a,
+            size_t dim, Activation func)
+    {
+        kernels().bias_activate_vec(v, bias, z, a, dim, func);
+    }
+
+    void activate_vec(const float *z, float *a, size_t dim, Activation func)
+    {
+        kernels().bias_activate_vec(z, nullptr, nullptr, a, dim, func);
+    }
+
+    void activation_prime_mul_vec(const float *z, float *e, size_t dim, Activation func)
+    {
+        kernels().activation_prime_mul_vec(z, e, dim, func);
+    }
+
+    void transpose_mat(const float *m, float *mres, size_t dim_r, size_t dim_c)
+    {
+        kernels().transpose_mat(m, mres, dim_r, dim_c);
+    }
+
+    void sum_vec(const float *vset, float *vres, size_t dim_v, size_t num_v)
+    {
+        kernels().sum_vec(vset, vres, dim_v, num_v);
+    }
+
+    void sum_vec(const float *vset, float *vres, size_t dim_v, size_t num_v, size_t stride)
+    {
+        if (stride == dim_v)
+        {
+            sum_vec(vset, vres, dim_v, num_v);
+            return;
+        }
+
+        set_vec(vres, 0, dim_v);
+        for (size_t i = 0; i < num_v; i++)
+            add_vec(vres, vset + i * stride, vres, dim_v);
+    }
+
+    void vec_outer_prod(const float *v1, const float *v2, float *mres, size_t dim_n, size_t dim_m)
+    {
+        kernels().vec_outer_prod(v1, v2, mres, dim_n, dim_m);
+    }
+
+    void downsample_max(const float *m, float *mres, size_t dim_w, size_t dim_h, size_t pool_w,
+            size_t pool_h, size_t stride)
+    {
+        kernels().downsample_max(m, mres, dim_w, dim_h, pool_w, pool_h, stride);
+    }
+
+    void upsample_max(const float *me, const float *ma, float *me_res,
+            size_t dim_w, size_t dim_h, size_t pool_w, size_t pool_h, size_t stride)
+    {
+        kernels().upsample_max(me, ma, me_res, dim_w, dim_h, pool_w, pool_h, stride);
+    }
+
+    void flip_mat(const float *m, float *mres, size_t dim_w, size_t dim_h)
+    {
+        kernels().flip_mat(m, mres, dim_w, dim_h);
+    }
+
+    void inflate_mats(const float *m_in, float *m_res, size_t dim_w, size_t dim_h,
+            size_t pad, size_t num_m)
+    {
+        kernels().inflate_mats(m_in, m_res, dim_w, dim_h, pad, num_m);
     }
 
     void convolution_mat(const float *m_in, const float *m_conv, float *m_res,
             int dim_w, int dim_h, int dim_conv_w, int dim_conv_h,
             const MatrixRange& range)
     {
-        const int i_dim_w = dim_w;
-        const int i_dim_h = dim_h;
-        for (int j=0;j<range.h;j++) {
-            for (int i=0;i<range.w;i++) {
-                float sum=0;
-                for (int jj=0;jj<dim_conv_h;jj++) {
-                    for (int ii=0;ii<dim_conv_w;ii++) {
-                        int in_i = range.x + i + dim_conv_w - ii - 1;
-                        int in_j = range.y + j + dim_conv_h - jj - 1;
-                        if (in_i >= 0 && in_i < i_dim_w && in_j >= 0 && in_j < i_dim_h)
-                            sum += m_conv[jj*dim_conv_w + ii] * m_in[in_j*dim_w + in_i];
-                    }
-                }
-                m_res[j*range.w + i] = sum;
-            }
-        }
+        kernels().convolution_mat(m_in, m_conv, m_res, dim_w, dim_h, dim_conv_w, dim_conv_h,
+                range);
     }
 
     void convolution_mat_no_zeros(const float *m_in, const float *m_conv, float *m_res,
@@ -290,4 +613,99 @@ namespace NeuralNet
             -dim_conv_w+1, -dim_conv_h+1, dim_w+dim_conv_w-1, dim_h+dim_conv_h-1
         ));
     }
+
+    void im2col(const float *m_in, float *m_col, int dim_w, int dim_h, int num_m,
+            int dim_conv_w, int dim_conv_h, const MatrixRange& range, size_t num_batch,
+            size_t ld_col)
+    {
+        const size_t out_size = range.w * range.h;
+        if (ld_col == 0)
+            ld_col = num_batch * out_size;
+        const size_t in_size = dim_w * dim_h;
+
+        for (int m = 0; m < num_m; m++)
+        {
+            for (int jj = 0; jj < dim_conv_h; jj++)
+            {
+                for (int ii = 0; ii < dim_conv_w; ii++)
+                {
+                    float *col_row = m_col +
+                        ((m*dim_conv_h + jj)*dim_conv_w + ii) * ld_col;
+
+                    // the input column in_i = off_x + i is valid for i in [i_begin, i_end)
+                    const int off_x = range.x + dim_conv_w - ii - 1;
+                    const int i_begin = std::min(std::max(0, -off_x), range.w);
+                    const int i_end = std::max(std::min(range.w, dim_w - off_x), i_begin);
+
+                    for (size_t b = 0; b < num_batch; b++)
+                    {
+                        const float *in_map = m_in + (b*num_m + m) * in_size;
+                        float *col = col_row + b * out_size;
+
+                        for (int j = 0; j < range.h; j++)
+                        {
+                            float *col_line = col + j*range.w;
+                            const int in_j = range.y + j + dim_conv_h - jj - 1;
+                            if (in_j < 0 || in_j >= dim_h || i_begin == i_end)
+                            {
+                                set_vec(col_line, 0, range.w);
+                                continue;
+                            }
+
+                            set_vec(col_line, 0, i_begin);
+                            copy_vec(in_map + in_j*dim_w + off_x + i_begin,
+                                    col_line + i_begin, i_end - i_begin);
+                            set_vec(col_line + i_end, 0, range.w - i_end);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void col2im(const float *m_col, float *m_in, int dim_w, int dim_h, int num_m,
+            int dim_conv_w, int dim_conv_h, const MatrixRange& range, size_t num_batch,
+            size_t ld_col)
+    {
+        const size_t out_size = range.w * range.h;
+        if (ld_col == 0)
+            ld_col = num_batch * out_size;
+        const size_t in_size = dim_w * dim_h;
+
+        for (int m = 0; m < num_m; m++)
+        {
+            for (int jj = 0; jj < dim_conv_h; jj++)
+            {
+                for (int ii = 0; ii < dim_conv_w; ii++)
+                {
+                    const float *col_row = m_col +
+                        ((m*dim_conv_h + jj)*dim_conv_w + ii) * ld_col;
+
+                    // the same valid columns as im2col(); padded elements are dropped
+                    const int off_x = range.x + dim_conv_w - ii - 1;
+                    const int i_begin = std::min(std::max(0, -off_x), range.w);
+                    const int i_end = std::max(std::min(range.w, dim_w - off_x), i_begin);
+                    if (i_begin == i_end)
+                        continue;
+
+                    for (size_t b = 0; b < num_batch; b++)
+                    {
+                        float *in_map = m_in + (b*num_m + m) * in_size;
+                        const float *col = col_row + b * out_size;
+
+                        for (int j = 0; j < range.h; j++)
+                        {
+                            const int in_j = range.y + j + dim_conv_h - jj - 1;
+                            if (in_j < 0 || in_j >= dim_h)
+                                continue;
+
+                            float *in_line = in_map + in_j*dim_w + off_x;
+                            add_vec(in_line + i_begin, col + j*range.w + i_begin,
+                                    in_line + i_begin, i_end - i_begin);
+                        }
+                    }
+                }
+            }
+        }
+    }
 }
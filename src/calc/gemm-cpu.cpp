@@ -0,0 +1,209 @@
+#include "calc/gemm-cpu.hpp"
+#include "calc/calc-cpu.hpp"
+#include "calc/calc-cpu-simd.hpp"
+#include "utils/thread_pool.hpp"
+#include <algorithm>
+#include <vector>
+
+namespace NeuralNet
+{
+    namespace
+    {
+        /* block sizes: an (MC x KC) block of A stays in L2, a (KC x NC) block of B in L3.
+         * all of them are multiples of the micro kernel sizes of every instruction set.
+         */
+        const size_t GEMM_MC = 120;
+        const size_t GEMM_KC = 256;
+        const size_t GEMM_NC = 2048;
+
+        // largest micro kernel block of all instruction sets
+        const size_t GEMM_MAX_TILE = 6 * 32;
+
+        inline float elem(const float *x, size_t ld, bool trans, size_t row, size_t col)
+        {
+            return trans ? x[col*ld + row] : x[row*ld + col];
+        }
+
+        /* pack (mc x kc) of alpha * op(A) into panels of mr rows, column-major within
+         * each panel. rows beyond mc are filled with zeros.
+         */
+        void pack_a(const float *a, size_t lda, bool trans_a, size_t row, size_t col,
+                size_t mc, size_t kc, float alpha, size_t mr, float *a_pack)
+        {
+            for (size_t ir = 0; ir < mc; ir += mr)
+            {
+                const size_t rows = std::min(mr, mc - ir);
+                for (size_t p = 0; p < kc; p++)
+                {
+                    for (size_t r = 0; r < rows; r++)
+                        a_pack[r] = alpha * elem(a, lda, trans_a, row + ir + r, col + p);
+                    for (size_t r = rows; r < mr; r++)
+                        a_pack[r] = 0;
+                    a_pack += mr;
+                }
+            }
+        }
+
+        /* pack (kc x nc) of op(B) into panels of nr columns, row-major within each
+         * panel. columns beyond nc are filled with zeros.
+         */
+        void pack_b(const float *b, size_t ldb, bool trans_b, size_t row, size_t col,
+                size_t kc, size_t nc, size_t nr, float *b_pack)
+        {
+            for (size_t jr = 0; jr < nc; jr += nr)
+            {
+                const size_t cols = std::min(nr, nc - jr);
+                for (size_t p = 0; p < kc; p++)
+                {
+                    if (!trans_b && cols == nr)
+                    {
+                        copy_vec(b + (row + p)*ldb + col + jr, b_pack, nr);
+                    }
+                    else
+                    {
+                        for (size_t j = 0; j < cols; j++)
+                            b_pack[j] = elem(b, ldb, trans_b, row + p, col + jr + j);
+                        for (size_t j = cols; j < nr; j++)
+                            b_pack[j] = 0;
+                    }
+                    b_pack += nr;
+                }
+            }
+        }
+
+        /* packing buffers of the calling thread, sized for the largest blocks when
+         * the thread uses them first */
+        std::vector<float>& a_pack_buffer()
+        {
+            thread_local std::vector<float> a_pack(GEMM_MC * GEMM_KC);
+            return a_pack;
+        }
+
+        std::vector<float>& b_pack_buffer()
+        {
+            thread_local std::vector<float> b_pack(GEMM_KC * GEMM_NC);
+            return b_pack;
+        }
+
+        void scale_c(float *c, size_t ldc, size_t m, size_t n, float beta)
+        {
+            if (beta == 1)
+                return;
+            for (size_t i = 0; i < m; i++)
+            {
+                if (beta == 0)
+                    set_vec(c + i*ldc, 0, n);
+                else
+                    const_mul_vec(c + i*ldc, beta, n);
+            }
+        }
+    }
+
+    void sgemm(bool trans_a, bool trans_b, size_t m, size_t n, size_t k,
+            float alpha, const float *a, size_t lda, const float *b, size_t ldb,
+            float beta, float *c, size_t ldc, const GemmEpilogue *epilogue,
+            ThreadPool *pool)
+    {
+        if (m == 0 || n == 0)
+            return;
+
+        parallel_for(pool, 0, m, [&](size_t row_begin, size_t row_end) {
+            scale_c(c + row_begin*ldc, ldc, row_end - row_begin, n, beta);
+        });
+        if (k == 0 || alpha == 0)
+        {
+            if (epilogue)
+                epilogue->apply(c, ldc, 0, 0, m, n);
+            return;
+        }
+
+        const auto& kernels = active_kernels();
+        const size_t mr = kernels.sgemm_mr;
+        const size_t nr = kernels.sgemm_nr;
+        const size_t threads = pool ? pool->getThreadNum() : 1;
+
+        /* the packed B block is shared by all threads, and every thread packs its own
+         * blocks of A into the buffers it keeps */
+        float *b_packed = b_pack_buffer().data();
+
+        for (size_t jc = 0; jc < n; jc += GEMM_NC)
+        {
+            const size_t nc = std::min(GEMM_NC, n - jc);
+            const size_t panels = (nc + nr - 1) / nr;
+
+            /* the (ic, jr) blocks of C are split into tasks of a whole MC block of rows
+             * and a group of NR panels, so that short and wide products are split too */
+            const size_t row_blocks = (m + GEMM_MC - 1) / GEMM_MC;
+            const size_t groups = std::min(panels,
+                    std::max<size_t>(1, threads * 4 / row_blocks));
+            const size_t group_panels = (panels + groups - 1) / groups;
+
+            for (size_t pc = 0; pc < k; pc += GEMM_KC)
+            {
+                const size_t kc = std::min(GEMM_KC, k - pc);
+                const bool last_k = (pc + kc == k);
+
+                parallel_for(pool, 0, panels, [&](size_t p_begin, size_t p_end) {
+                    pack_b(b, ldb, trans_b, pc, jc + p_begin*nr, kc,
+                            std::min(nc, p_end*nr) - p_begin*nr, nr,
+                            b_packed + p_begin*nr*kc);
+                });
+
+                parallel_for(pool, 0, row_blocks * groups, [&](size_t t_begin, size_t t_end) {
+                    float *a_packed = a_pack_buffer().data();
+                    float tile[GEMM_MAX_TILE];
+
+                    for (size_t t = t_begin; t < t_end; t++)
+                    {
+                        const size_t ic = (t / groups) * GEMM_MC;
+                        const size_t mc = std::min(GEMM_MC, m - ic);
+                        const size_t jr_begin = (t % groups) * group_panels * nr;
+                        const size_t jr_end = std::min(nc, jr_begin + group_panels * nr);
+                        if (jr_begin >= jr_end)
+                            continue;
+
+                        pack_a(a, lda, trans_a, ic, pc, mc, kc, alpha, mr, a_packed);
+
+                        for (size_t jr = jr_begin; jr < jr_end; jr += nr)
+                        {
+                            const size_t cols = std::min(nr, nc - jr);
+                            const float *bp = b_packed + jr * kc;
+
+                            for (size_t ir = 0; ir < mc; ir += mr)
+                            {
+                                const size_t rows = std::min(mr, mc - ir);
+                                const float *ap = a_packed + ir * kc;
+                                float *cp = c + (ic + ir)*ldc + jc + jr;
+
+                                if (rows == mr && cols == nr)
+                                {
+                                    kernels.sgemm_kernel(kc, ap, bp, cp, ldc);
+                                }
+                                else
+                                {
+                                    // partial block: compute into a full tile and add back
+                                    set_vec(tile, 0, mr * nr);
+                                    kernels.sgemm_kernel(kc, ap, bp, tile, nr);
+                                    for (size_t r = 0; r < rows; r++)
+                                        add_vec(cp + r*ldc, tile + r*nr, cp + r*ldc, cols);
+                                }
+                            }
+                        }
+
+                        if (epilogue && last_k)
+                        {
+                            epilogue->apply(c + ic*ldc + jc + jr_begin, ldc, ic,
+                                    jc + jr_begin, mc, jr_end - jr_begin);
+                        }
+                    }
+                });
+            }
+        }
+    }
+
+    void prepare_sgemm_buffers()
+    {
+        a_pack_buffer();
+        b_pack_buffer();
+    }
+}
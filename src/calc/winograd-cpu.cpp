@@ -0,0 +1,262 @@
+#include "calc/winograd-cpu.hpp"
+#include "calc/gemm-cpu.hpp"
+#include "utils/thread_pool.hpp"
+#include <algorithm>
+#include <vector>
+
+namespace NeuralNet
+{
+    namespace
+    {
+        const int WINO_OUT = 2;
+        const int WINO_MAX_ALPHA = 6;
+
+        /* transform matrices of F(2, r) with the interpolation points 0, 1, -1 (and 2, -2)
+         * and infinity. the 1-D output is y = AT * ((G * g) .* (BT * d)).
+         */
+        const float AT_3[2 * 4] = {
+            1,  1,  1,  0,
+            0,  1, -1,  1,
+        };
+        const float G_3[4 * 3] = {
+            -1,    0,    0,
+            0.5,   0.5,  0.5,
+            0.5,  -0.5,  0.5,
+            0,     0,    1,
+        };
+        const float BT_3[4 * 4] = {
+            -1,  0,  1,  0,
+             0,  1,  1,  0,
+             0, -1,  1,  0,
+             0, -1,  0,  1,
+        };
+
+        const float AT_5[2 * 6] = {
+            1,  1,  1,  1,  1,  0,
+            0,  1, -1,  2, -2,  1,
+        };
+        const float G_5[6 * 5] = {
+            1/4.f,    0,        0,      0,        0,
+            -1/6.f,   -1/6.f,   -1/6.f, -1/6.f,   -1/6.f,
+            -1/6.f,   1/6.f,    -1/6.f, 1/6.f,    -1/6.f,
+            1/24.f,   1/12.f,   1/6.f,  1/3.f,    2/3.f,
+            1/24.f,   -1/12.f,  1/6.f,  -1/3.f,   2/3.f,
+            0,        0,        0,      0,        1,
+        };
+        const float BT_5[6 * 6] = {
+            4,  0, -5,  0,  1,  0,
+            0, -4, -4,  1,  1,  0,
+            0,  4, -4, -1,  1,  0,
+            0, -2, -1,  2,  1,  0,
+            0,  2, -1, -2,  1,  0,
+            0,  4,  0, -5,  0,  1,
+        };
+
+        struct WinogradMatrices
+        {
+            int alpha;
+            const float *at, *g, *bt;
+        };
+
+        WinogradMatrices get_matrices(int recep_size)
+        {
+            if (recep_size == 3)
+                return WinogradMatrices{4, AT_3, G_3, BT_3};
+            return WinogradMatrices{6, AT_5, G_5, BT_5};
+        }
+
+        /* mres = a * m * a^T, where a is (p x q) and m is (q x q) */
+        void sandwich(const float *a, const float *m, float *mres, int p, int q)
+        {
+            float temp[WINO_MAX_ALPHA * WINO_MAX_ALPHA];
+            for (int i = 0; i < p; i++)
+            {
+                for (int j = 0; j < q; j++)
+                {
+                    float sum = 0;
+                    for (int k = 0; k < q; k++)
+                        sum += a[i*q + k] * m[k*q + j];
+                    temp[i*q + j] = sum;
+                }
+            }
+            for (int i = 0; i < p; i++)
+            {
+                for (int j = 0; j < p; j++)
+                {
+                    float sum = 0;
+                    for (int k = 0; k < q; k++)
+                        sum += temp[i*q + k] * a[j*q + k];
+                    mres[i*p + j] = sum;
+                }
+            }
+        }
+    }
+
+    bool winograd_supported(size_t recep_size)
+    {
+        return (recep_size == 3 || recep_size == 5);
+    }
+
+    size_t winograd_transformed_size(size_t recep_size)
+    {
+        return (recep_size + WINO_OUT - 1) * (recep_size + WINO_OUT - 1);
+    }
+
+    void winograd_transform_weights(const float *weight, float *weight_t,
+            size_t num_cur, size_t num_prev, size_t recep_size)
+    {
+        const int r = recep_size;
+        const auto mats = get_matrices(r);
+        const size_t num_filters = num_cur * num_prev;
+
+        float g[WINO_MAX_ALPHA * WINO_MAX_ALPHA];
+        float u[WINO_MAX_ALPHA * WINO_MAX_ALPHA];
+        float g_t[WINO_MAX_ALPHA * WINO_MAX_ALPHA];
+        for (size_t f = 0; f < num_filters; f++)
+        {
+            /* convolution_mat() multiplies m_conv[jj][ii] with the input at
+             * (i + r-1-ii, j + r-1-jj), so the filter is flipped before the transform */
+            const float *filter = weight + f * r * r;
+            for (int jj = 0; jj < r; jj++)
+                for (int ii = 0; ii < r; ii++)
+                    g[jj*r + ii] = filter[(r-1-jj)*r + (r-1-ii)];
+
+            // u = G * g * G^T, where G is (alpha x r)
+            for (int i = 0; i < mats.alpha; i++)
+            {
+                for (int j = 0; j < r; j++)
+                {
+                    float sum = 0;
+                    for (int k = 0; k < r; k++)
+                        sum += mats.g[i*r + k] * g[k*r + j];
+                    g_t[i*r + j] = sum;
+                }
+            }
+            for (int i = 0; i < mats.alpha; i++)
+            {
+                for (int j = 0; j < mats.alpha; j++)
+                {
+                    float sum = 0;
+                    for (int k = 0; k < r; k++)
+                        sum += g_t[i*r + k] * mats.g[j*r + k];
+                    u[i*mats.alpha + j] = sum;
+                }
+            }
+
+            for (int xi = 0; xi < mats.alpha * mats.alpha; xi++)
+                weight_t[xi * num_filters + f] = u[xi];
+        }
+    }
+
+    size_t winograd_workspace_size(size_t num_prev, size_t num_cur, int recep_size,
+            const MatrixRange& range, size_t num_batch)
+    {
+        const size_t tiles_x = (range.w + WINO_OUT - 1) / WINO_OUT;
+        const size_t tiles_y = (range.h + WINO_OUT - 1) / WINO_OUT;
+        return winograd_transformed_size(recep_size) * (num_prev + num_cur)
+            * num_batch * tiles_x * tiles_y;
+    }
+
+    void winograd_convolution(const float *m_in, const float *weight_t, float *m_res,
+            int dim_w, int dim_h, size_t num_prev, size_t num_cur, int recep_size,
+            const MatrixRange& range, size_t num_batch, ThreadPool *pool,
+            float *workspace, size_t res_stride)
+    {
+        const auto mats = get_matrices(recep_size);
+        const int alpha = mats.alpha;
+        const int tiles_x = (range.w + WINO_OUT - 1) / WINO_OUT;
+        const int tiles_y = (range.h + WINO_OUT - 1) / WINO_OUT;
+        const size_t tiles_per_map = tiles_x * tiles_y;
+        const size_t num_tiles = num_batch * tiles_per_map;
+        const size_t in_size = dim_w * dim_h;
+        const size_t out_size = range.w * range.h;
+        if (res_stride == 0)
+            res_stride = num_cur * out_size;
+
+        // transformed input and output tiles
+        const size_t v_size = alpha * alpha * num_prev * num_tiles;
+        thread_local std::vector<float> tile_buf;
+        if (!workspace)
+        {
+            tile_buf.resize(winograd_workspace_size(num_prev, num_cur, recep_size,
+                        range, num_batch));
+            workspace = tile_buf.data();
+        }
+        float *v_data = workspace;
+        float *m_data = workspace + v_size;
+
+        /* input transform: v = BT * d * B for each (alpha x alpha) input tile.
+         * element xi of the tile goes to the (num_prev x num_tiles) matrix xi */
+        parallel_for(pool, 0, num_batch * num_prev, [&](size_t map_begin, size_t map_end) {
+            float d[WINO_MAX_ALPHA * WINO_MAX_ALPHA];
+            float v[WINO_MAX_ALPHA * WINO_MAX_ALPHA];
+            for (size_t map = map_begin; map < map_end; map++)
+            {
+                const size_t b = map / num_prev, np = map % num_prev;
+                const float *in_map = m_in + map * in_size;
+                for (int ty = 0; ty < tiles_y; ty++)
+                {
+                    for (int tx = 0; tx < tiles_x; tx++)
+                    {
+                        const int x0 = range.x + tx * WINO_OUT;
+                        const int y0 = range.y + ty * WINO_OUT;
+                        for (int j = 0; j < alpha; j++)
+                        {
+                            const int in_j = y0 + j;
+                            for (int i = 0; i < alpha; i++)
+                            {
+                                const int in_i = x0 + i;
+                                d[j*alpha + i] = (in_i >= 0 && in_i < dim_w && in_j >= 0
+                                        && in_j < dim_h) ? in_map[in_j*dim_w + in_i] : 0;
+                            }
+                        }
+                        sandwich(mats.bt, d, v, alpha, alpha);
+
+                        const size_t tile = b * tiles_per_map + ty * tiles_x + tx;
+                        for (int xi = 0; xi < alpha * alpha; xi++)
+                            v_data[(xi * num_prev + np) * num_tiles + tile] = v[xi];
+                    }
+                }
+            }
+        });
+
+        // element-wise products summed over the input maps, one GEMM per element
+        parallel_for(pool, 0, alpha * alpha, [&](size_t xi_begin, size_t xi_end) {
+            for (size_t xi = xi_begin; xi < xi_end; xi++)
+            {
+                sgemm(false, false, num_cur, num_tiles, num_prev,
+                        1.0f, weight_t + xi * num_cur * num_prev, num_prev,
+                        v_data + xi * num_prev * num_tiles, num_tiles,
+                        0.0f, m_data + xi * num_cur * num_tiles, num_tiles);
+            }
+        });
+
+        // output transform: y = AT * m * A, clipped at the edges of the range
+        parallel_for(pool, 0, num_batch * num_cur, [&](size_t map_begin, size_t map_end) {
+            float m[WINO_MAX_ALPHA * WINO_MAX_ALPHA];
+            float y[WINO_OUT * WINO_OUT];
+            for (size_t map = map_begin; map < map_end; map++)
+            {
+                const size_t b = map / num_cur, nc = map % num_cur;
+                float *out_map = m_res + b * res_stride + nc * out_size;
+                for (int ty = 0; ty < tiles_y; ty++)
+                {
+                    for (int tx = 0; tx < tiles_x; tx++)
+                    {
+                        const size_t tile = b * tiles_per_map + ty * tiles_x + tx;
+                        for (int xi = 0; xi < alpha * alpha; xi++)
+                            m[xi] = m_data[(xi * num_cur + nc) * num_tiles + tile];
+                        sandwich(mats.at, m, y, WINO_OUT, alpha);
+
+                        const int rows = std::min(WINO_OUT, range.h - ty * WINO_OUT);
+                        const int cols = std::min(WINO_OUT, range.w - tx * WINO_OUT);
+                        for (int j = 0; j < rows; j++)
+                            for (int i = 0; i < cols; i++)
+                                out_map[(ty*WINO_OUT + j) * range.w + tx*WINO_OUT + i]
+                                    = y[j*WINO_OUT + i];
+                    }
+                }
+            }
+        });
+    }
+}
@@ -41,6 +41,9 @@ namespace NeuralNet
         m_device = devices[m_default_dev_num];
         std::cout << "using device: " << m_device.getInfo<CL_DEVICE_NAME>() << std::endl;
 
+        m_packs_maps = (m_device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE);
+        m_tiles_conv = (m_device.getInfo<CL_DEVICE_LOCAL_MEM_TYPE>() == CL_LOCAL);
+
         auto sources = loadSources();
      
         context = cl::Context(m_device);
@@ -58,6 +61,7 @@ namespace NeuralNet
         }
 
         queue = cl::CommandQueue(context,m_device);
+        transfer_queue = cl::CommandQueue(context, m_device);
     }
 
     std::string CLContext::loadSources()
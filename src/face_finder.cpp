@@ -267,10 +267,12 @@ namespace NeuralNet
         in_region[1] = input_img->getHeight();
         in_region[2] = 1;
 
-        err = queue.enqueueWriteImage(in_img_buf, CL_TRUE, in_offset, in_region,
+        // the queue is in order, so the kernels below wait for the write themselves
+        cl::Event in_written;
+        err = queue.enqueueWriteImage(in_img_buf, CL_FALSE, in_offset, in_region,
                 img_w * 4 * sizeof(float), 0,
-                img_mixed_vals.data());
-        printError(err, "enqueueReadImage");
+                img_mixed_vals.data(), nullptr, &in_written);
+        printError(err, "enqueueWriteImage");
 
         // phase 1) grayscaling the input image
         if (m_config.grayscale)
@@ -328,15 +330,13 @@ namespace NeuralNet
             {
                 auto prep_buf = preprocessGrayscalePatches(patch_img_buf);
 
-                std::vector<float> patch_vals(i_patch * i_patch * patches_w *
-                        patches_h);
+                // read straight behind the patches of the previous levels
+                const size_t prev_size = patch_data.size();
+                patch_data.resize(prev_size + i_patch * i_patch * patches_w * patches_h);
                 err = queue.enqueueReadImage(prep_buf, CL_TRUE,
                         in_offset, patch_region,
-                        0, 0, patch_vals.data());
+                        0, 0, patch_data.data() + prev_size);
                 printError(err, "enqueueReadImage");
-
-                patch_data.insert(patch_data.end(),
-                        patch_vals.begin(), patch_vals.end());
             }
             else
             {
@@ -353,6 +353,9 @@ namespace NeuralNet
                         resolved_vals.begin(), resolved_vals.end());
             }
         }
+
+        // img_mixed_vals goes out of scope
+        in_written.wait();
     }
 
     void FaceFinder::cpuGetPatches(const std::unique_ptr<Image>& input_img,
@@ -4,58 +4,99 @@
 
 namespace NeuralNet
 {
-    CLBufferLayerData::CLBufferLayerData(size_t train_num, size_t data_num)
-        : CLLayerData(train_num, data_num)
+    CLBufferLayerData::CLBufferLayerData(size_t train_num, size_t data_num,
+            bool inference_only)
+        : CLLayerData(train_num, data_num, inference_only), m_offset(0)
     {
-        cl::ImageFormat imgfmt{CL_INTENSITY, CL_FLOAT};
         auto context = CLContext::getInstance().getContext();
 
-        for (size_t i = 0; i < LayerData::DATA_COUNT; i++)
+        for (size_t i = 0; i < getArrayNum(); i++)
         {
-            m_imgbufs.emplace_back(context, CL_MEM_READ_WRITE,
-                    imgfmt, data_num, train_num);
+            m_bufs.emplace_back(context, CL_MEM_READ_WRITE,
+                    sizeof(float) * data_num * train_num);
         }
+    }
+
+    CLBufferLayerData::CLBufferLayerData(size_t train_num, size_t data_num,
+            float *activation, const cl::Buffer& buffer)
+        : CLLayerData(train_num, data_num, activation), m_bufs{buffer}, m_offset(0)
+    {
+    }
 
-        m_origin[0] = m_origin[1] = m_origin[2] = 0;
-        m_region[0] = data_num;
-        m_region[1] = train_num;
-        m_region[2] = 1;
+    CLBufferLayerData::CLBufferLayerData(const CLBufferLayerData& whole, size_t offset,
+            size_t data_num)
+        : CLLayerData(whole, offset, data_num), m_bufs(whole.m_bufs),
+        m_offset(whole.m_offset + offset)
+    {
     }
 
     CLBufferLayerData::~CLBufferLayerData()
     {
     }
 
-    void CLBufferLayerData::loadToCL(DataIndex idx)
+    size_t CLBufferLayerData::uploadArray(DataIndex idx, cl::CommandQueue& queue,
+            cl::Event *done) const
     {
-        auto queue = CLContext::getInstance().getCommandQueue();
         cl_int err;
 
-        err = queue.enqueueWriteImage(
-                m_imgbufs[static_cast<int>(idx)],
-                CL_TRUE,
-                m_origin, m_region, 0, 0,
-                get(idx));
+        // the buffers keep the capacity; only the logical batch is transferred
+        const size_t bytes = sizeof(float) * getTrainNum() * getDataNum();
+        err = queue.enqueueWriteBuffer(
+                m_bufs.at(static_cast<int>(idx)),
+                done ? CL_FALSE : CL_TRUE, 0, bytes,
+                LayerData::get(idx), nullptr, done);
         printError(err, "Error at CommandQueue::enqueueWriteBuffer in "
-                "CLBufferLayerData::loadToCL");
+                "CLBufferLayerData::uploadArray");
+        return bytes;
     }
 
-    void CLBufferLayerData::getFromCL(DataIndex idx)
+    size_t CLBufferLayerData::downloadArray(DataIndex idx) const
     {
         auto queue = CLContext::getInstance().getCommandQueue();
         cl_int err;
 
-        err = queue.enqueueReadImage(
-                m_imgbufs[static_cast<int>(idx)],
-                CL_TRUE,
-                m_origin, m_region, 0, 0,
-                get(idx));
+        const size_t bytes = sizeof(float) * getTrainNum() * getDataNum();
+        err = queue.enqueueReadBuffer(
+                m_bufs.at(static_cast<int>(idx)),
+                CL_TRUE, 0, bytes,
+                LayerData::get(idx));
         printError(err, "Error at CommandQueue::enqueueReadBuffer in "
-                "CLBufferLayerData::getFromCL");
+                "CLBufferLayerData::downloadArray");
+        return bytes;
+    }
+
+    void CLBufferLayerData::copyToBuffer(DataIndex idx, const cl::Buffer& buf) const
+    {
+        auto queue = CLContext::getInstance().getCommandQueue();
+        loadToCL(idx);
+
+        cl_int err;
+        if (getStride() == getDataNum())
+        {
+            err = queue.enqueueCopyBuffer(m_bufs.at(static_cast<int>(idx)), buf, 0, 0,
+                    sizeof(float) * getTrainNum() * getDataNum());
+            printError(err, "Error at CommandQueue::enqueueCopyBuffer in "
+                    "CLBufferLayerData::copyToBuffer");
+            return;
+        }
+
+        // the rows of a slice are gathered out of the whole rows
+        cl::size_t<3> src_origin, dst_origin, region;
+        src_origin[1] = src_origin[2] = 0;
+        dst_origin[0] = dst_origin[1] = dst_origin[2] = 0;
+        src_origin[0] = sizeof(float) * m_offset;
+        region[0] = sizeof(float) * getDataNum();
+        region[1] = getTrainNum();
+        region[2] = 1;
+        err = queue.enqueueCopyBufferRect(m_bufs.at(static_cast<int>(idx)), buf,
+                src_origin, dst_origin, region, sizeof(float) * getStride(), 0,
+                sizeof(float) * getDataNum(), 0);
+        printError(err, "Error at CommandQueue::enqueueCopyBufferRect in "
+                "CLBufferLayerData::copyToBuffer");
     }
 
     cl::Memory CLBufferLayerData::getCLMemory(LayerData::DataIndex data_idx) const
     {
-        return m_imgbufs[static_cast<int>(data_idx)];
+        return m_bufs.at(static_cast<int>(data_idx));
     }
 }
@@ -6,8 +6,8 @@ namespace NeuralNet
 {
     CLImageLayerData::CLImageLayerData(size_t train_num,
             size_t width, size_t height, size_t map_num,
-            CLImageLayerData::Channel ch)
-        : CLLayerData(train_num, map_num*width*height),
+            CLImageLayerData::Channel ch, bool inference_only)
+        : CLLayerData(train_num, map_num*width*height, inference_only),
             m_width(width), m_height(height), m_map(map_num), m_ch(ch)
     {
         cl::ImageFormat imgfmt;
@@ -16,55 +16,176 @@ namespace NeuralNet
         case Channel::INTENSITY:
             imgfmt = {CL_INTENSITY, CL_FLOAT};
             break;
+        case Channel::RGBA:
+            imgfmt = {CL_RGBA, CL_FLOAT};
+            break;
         }
 
+        const size_t texel_rows = mapRows(m_map, m_ch);
+
         auto context = CLContext::getInstance().getContext();
-        for (size_t i = 0; i < LayerData::DATA_COUNT; i++)
+        for (size_t i = 0; i < getArrayNum(); i++)
         {
             m_imgbuf.emplace_back(context, CL_MEM_READ_WRITE,
-                    imgfmt, m_width*m_height, m_map, train_num);
+                    imgfmt, m_width*m_height, texel_rows, train_num);
         }
 
         m_origin[0] = m_origin[1] = m_origin[2] = 0;
         m_region[0] = m_width * m_height;
-        m_region[1] = m_map;
+        m_region[1] = texel_rows;
         m_region[2] = train_num;
     }
 
+    CLImageLayerData::Channel CLImageLayerData::mapChannel()
+    {
+        return CLContext::getInstance().packsMaps() ? Channel::RGBA : Channel::INTENSITY;
+    }
+
+    size_t CLImageLayerData::mapRows(size_t map_num, Channel ch)
+    {
+        return (ch == Channel::RGBA) ? (map_num + 3) / 4 : map_num;
+    }
+
+    bool CLImageLayerData::holdsMaps(size_t train_num, size_t width, size_t height,
+            size_t map_num, Channel ch)
+    {
+        // the pixels of a map are the width of the images, the samples their depth
+        auto device = CLContext::getInstance().getDevice();
+        return width * height <= device.getInfo<CL_DEVICE_IMAGE3D_MAX_WIDTH>()
+            && mapRows(map_num, ch) <= device.getInfo<CL_DEVICE_IMAGE3D_MAX_HEIGHT>()
+            && train_num <= device.getInfo<CL_DEVICE_IMAGE3D_MAX_DEPTH>();
+    }
+
     CLImageLayerData::~CLImageLayerData()
     {
     }
 
-    void CLImageLayerData::loadToCL(DataIndex idx)
+    void CLImageLayerData::packMaps(const float *maps) const
+    {
+        const size_t area = m_width * m_height;
+        const size_t groups = m_region[1];
+        m_staging.assign(4 * area * groups * getTrainNum(), 0.0f);
+
+        // map m of a sample goes to lane m % 4 of the texels of group m / 4
+        for (size_t t = 0; t < getTrainNum(); t++)
+        {
+            for (size_t m = 0; m < m_map; m++)
+            {
+                const float *map = maps + (t * m_map + m) * area;
+                float *texels = m_staging.data() + 4 * (t * groups + m / 4) * area + m % 4;
+                for (size_t i = 0; i < area; i++)
+                    texels[4 * i] = map[i];
+            }
+        }
+    }
+
+    void CLImageLayerData::unpackMaps(float *maps) const
+    {
+        const size_t area = m_width * m_height;
+        const size_t groups = m_region[1];
+        for (size_t t = 0; t < getTrainNum(); t++)
+        {
+            for (size_t m = 0; m < m_map; m++)
+            {
+                float *map = maps + (t * m_map + m) * area;
+                const float *texels = m_staging.data() + 4 * (t * groups + m / 4) * area + m % 4;
+                for (size_t i = 0; i < area; i++)
+                    map[i] = texels[4 * i];
+            }
+        }
+    }
+
+    size_t CLImageLayerData::uploadArray(DataIndex idx, cl::CommandQueue& queue,
+            cl::Event *done) const
     {
-        auto queue = CLContext::getInstance().getCommandQueue();
         cl_int err;
 
+        float *src = LayerData::get(idx);
+        size_t bytes = sizeof(float) * getTrainNum() * getDataNum();
+        if (m_ch == Channel::RGBA)
+        {
+            packMaps(src);
+            src = m_staging.data();
+            bytes = sizeof(float) * m_staging.size();
+        }
+
+        // a packed upload reads m_staging, which is only repacked by the next one
         err = queue.enqueueWriteImage(
-                m_imgbuf[static_cast<int>(idx)],
-                CL_TRUE,
+                m_imgbuf.at(static_cast<int>(idx)),
+                done ? CL_FALSE : CL_TRUE,
                 m_origin, m_region, 0, 0,
-                get(idx));
+                src, nullptr, done);
         printError(err, "Error at CommandQueue::enqueueWriteImage in "
-                "CLImageLayerData::loadToCL");
+                "CLImageLayerData::uploadArray");
+        return bytes;
     }
 
-    void CLImageLayerData::getFromCL(DataIndex idx)
+    size_t CLImageLayerData::downloadArray(DataIndex idx) const
     {
         auto queue = CLContext::getInstance().getCommandQueue();
         cl_int err;
 
+        float *dst = LayerData::get(idx);
+        size_t bytes = sizeof(float) * getTrainNum() * getDataNum();
+        if (m_ch == Channel::RGBA)
+        {
+            m_staging.resize(4 * m_region[0] * m_region[1] * getTrainNum());
+            bytes = sizeof(float) * m_staging.size();
+        }
+
         err = queue.enqueueReadImage(
-                m_imgbuf[static_cast<int>(idx)],
+                m_imgbuf.at(static_cast<int>(idx)),
                 CL_TRUE,
                 m_origin, m_region, 0, 0,
-                get(idx));
+                (m_ch == Channel::RGBA) ? m_staging.data() : dst);
         printError(err, "Error at CommandQueue::enqueueReadImage in "
-                "CLImageLayerData::loadToCL");
+                "CLImageLayerData::downloadArray");
+
+        if (m_ch == Channel::RGBA)
+            unpackMaps(dst);
+        return bytes;
+    }
+
+    void CLImageLayerData::setTrainNum(size_t train_num)
+    {
+        CLLayerData::setTrainNum(train_num);
+        m_region[2] = train_num;
+    }
+
+    void CLImageLayerData::copyToBuffer(DataIndex idx, const cl::Buffer& buf) const
+    {
+        auto queue = CLContext::getInstance().getCommandQueue();
+        loadToCL(idx);
+
+        // packed maps are spread back into rows by a kernel
+        if (m_ch == Channel::RGBA)
+        {
+            if (!m_unpack_kernel())
+            {
+                m_unpack_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                        "image_unpack_maps");
+            }
+
+            int map_num = m_map;
+            m_unpack_kernel.setArg(0, m_imgbuf.at(static_cast<int>(idx)));
+            m_unpack_kernel.setArg(1, buf);
+            m_unpack_kernel.setArg(2, sizeof(int), &map_num);
+            cl_int err = queue.enqueueNDRangeKernel(m_unpack_kernel, cl::NullRange,
+                    cl::NDRange(m_region[0], m_region[1], m_region[2]), cl::NullRange);
+            printError(err, "Error at CommandQueue::enqueNDRangeKernel in "
+                    "CLImageLayerData::copyToBuffer");
+            return;
+        }
+
+        // the maps of a sample follow each other, as do the samples
+        cl_int err = queue.enqueueCopyImageToBuffer(m_imgbuf.at(static_cast<int>(idx)),
+                buf, m_origin, m_region, 0);
+        printError(err, "Error at CommandQueue::enqueueCopyImageToBuffer in "
+                "CLImageLayerData::copyToBuffer");
     }
 
     cl::Memory CLImageLayerData::getCLMemory(LayerData::DataIndex data_idx) const
     {
-        return m_imgbuf[static_cast<int>(data_idx)];
+        return m_imgbuf.at(static_cast<int>(data_idx));
     }
 }
@@ -0,0 +1,128 @@
+#include "layers/cl_layer_data.hpp"
+#include "cl_context.hpp"
+
+namespace NeuralNet
+{
+    std::atomic<size_t> CLLayerData::s_total_uploaded(0);
+    std::atomic<size_t> CLLayerData::s_total_downloaded(0);
+
+    CLLayerData::CLLayerData(size_t train_num, size_t data_num, bool inference_only)
+        : LayerData(train_num, data_num, inference_only), m_whole(nullptr),
+        m_uploaded(0), m_downloaded(0)
+    {
+        // neither copy has been written yet
+        m_validity.fill(Validity::BOTH);
+    }
+
+    CLLayerData::CLLayerData(size_t train_num, size_t data_num, float *activation)
+        : LayerData(train_num, data_num, activation), m_whole(nullptr),
+        m_uploaded(0), m_downloaded(0)
+    {
+        m_validity.fill(Validity::BOTH);
+    }
+
+    CLLayerData::CLLayerData(const CLLayerData& whole, size_t offset, size_t data_num)
+        : LayerData(whole, offset, data_num), m_whole(&whole), m_uploaded(0),
+        m_downloaded(0)
+    {
+    }
+
+    CLLayerData::Validity& CLLayerData::validity(DataIndex idx) const
+    {
+        return (m_whole ? m_whole->m_validity : m_validity).at(static_cast<int>(idx));
+    }
+
+    float *CLLayerData::get(DataIndex idx) const
+    {
+        if (static_cast<size_t>(idx) >= getArrayNum())
+            return nullptr;
+
+        getFromCL(idx);
+        validity(idx) = Validity::HOST;
+        return LayerData::get(idx);
+    }
+
+    const float *CLLayerData::getRead(DataIndex idx) const
+    {
+        if (static_cast<size_t>(idx) >= getArrayNum())
+            return nullptr;
+
+        getFromCL(idx);
+        return LayerData::get(idx);
+    }
+
+    cl::Memory CLLayerData::readCL(DataIndex idx) const
+    {
+        loadToCL(idx);
+        return getCLMemory(idx);
+    }
+
+    cl::Memory CLLayerData::writeCL(DataIndex idx)
+    {
+        // the rest of the whole data stays as it is on the device
+        if (m_whole)
+            m_whole->loadToCL(idx);
+        validity(idx) = Validity::DEVICE;
+        return getCLMemory(idx);
+    }
+
+    void CLLayerData::loadToCL(DataIndex idx) const
+    {
+        if (m_whole)
+        {
+            m_whole->loadToCL(idx);
+            return;
+        }
+
+        auto& validity = m_validity.at(static_cast<int>(idx));
+        if (validity != Validity::HOST)
+            return;
+
+        auto queue = CLContext::getInstance().getCommandQueue();
+        const size_t bytes = uploadArray(idx, queue, nullptr);
+        m_uploaded += bytes;
+        s_total_uploaded += bytes;
+        validity = Validity::BOTH;
+    }
+
+    cl::Event CLLayerData::loadToCLAsync(DataIndex idx, cl::CommandQueue& queue) const
+    {
+        if (m_whole)
+            return m_whole->loadToCLAsync(idx, queue);
+
+        cl::Event done;
+        auto& validity = m_validity.at(static_cast<int>(idx));
+        if (validity != Validity::HOST)
+            return done;
+
+        const size_t bytes = uploadArray(idx, queue, &done);
+        m_uploaded += bytes;
+        s_total_uploaded += bytes;
+        validity = Validity::BOTH;
+        return done;
+    }
+
+    void CLLayerData::getFromCL(DataIndex idx) const
+    {
+        if (m_whole)
+        {
+            m_whole->getFromCL(idx);
+            return;
+        }
+
+        auto& validity = m_validity.at(static_cast<int>(idx));
+        if (validity != Validity::DEVICE)
+            return;
+
+        const size_t bytes = downloadArray(idx);
+        m_downloaded += bytes;
+        s_total_downloaded += bytes;
+        validity = Validity::BOTH;
+    }
+
+    void CLLayerData::resetTransferCounters()
+    {
+        s_total_uploaded = 0;
+        s_total_downloaded = 0;
+    }
+}
@@ -1,34 +1,27 @@
 #include "layers/conv_layer.hpp"
 #include "layers/cl_layer_data.hpp"
 #include "layers/cl_image_layer_data.hpp"
+#include "layers/cl_buffer_layer_data.hpp"
 #include "calc/calc-cpu.hpp"
-#include "calc/util-functions.hpp"
+#include "calc/gemm-cpu.hpp"
+#include "calc/winograd-cpu.hpp"
 #include "utils/make_unique.hpp"
+#include "utils/thread_pool.hpp"
 #include "utils/cl_exception.hpp"
 #include "cl_context.hpp"
 #include <random>
 #include <cstring>
 #include <cmath>
 #include <array>
+#include <algorithm>
 #include <iostream>
+#include <string>
 
 namespace NeuralNet
 {
     ConvLayer::ConvLayer(const LayerSetting& setting, ActivationFunc func)
-        : m_set(setting), m_learn_rate(setting.learn_rate)
+        : m_set(setting), m_learn_rate(setting.learn_rate), m_activation(func)
     {
-        switch (func)
-        {
-        case ActivationFunc::SIGMOID:
-            f_activation = ActivationFuncs::f_sigmoid;
-            f_activation_prime = ActivationFuncs::f_sigmoid_prime;
-            break;
-        case ActivationFunc::RELU:
-            f_activation = ActivationFuncs::f_relu;
-            f_activation_prime = ActivationFuncs::f_relu_prime;
-            break;
-        }
-
         if (m_set.enable_zero_pad)
         {
             f_convolution = convolution_mat_same_zeros;
@@ -44,6 +37,9 @@ namespace NeuralNet
             m_output_height = m_set.image_height - (m_set.recep_size - 1);
         }
 
+        if (m_set.engine == Engine::WINOGRAD && !winograd_supported(m_set.recep_size))
+            m_set.engine = Engine::DIRECT;
+
         const size_t num_weights = m_set.current_map_num * m_set.prev_map_num
                 * m_set.recep_size * m_set.recep_size;
         m_weight = new float[num_weights];
@@ -63,43 +59,225 @@ namespace NeuralNet
             m_weight[i] = dist_w(rgen);
         for (size_t i = 0; i < num_biases; i++)
             m_bias[i] = dist_b(rgen);
+        refreshWinogradWeights();
 
         if (m_set.uses_gpu)
         {
-            // initialize buffers
+            // the weights stay on the device, where backward_gpu() updates them
             cl::Context context = CLContext::getInstance().getContext();
-            cl::ImageFormat value_fmt{CL_INTENSITY, CL_FLOAT};
-
-            m_imgbuf_w = cl::Image3D(context, CL_MEM_READ_ONLY, value_fmt,
-                    m_set.recep_size * m_set.recep_size,
-                    m_set.prev_map_num,
-                    m_set.current_map_num);
-            m_imgbuf_b = cl::Image3D(context, CL_MEM_READ_ONLY, value_fmt,
-                    m_output_width,
-                    m_output_height,
-                    m_set.current_map_num);
-
-            // create kernel (TODO: non-ReLU activation function?)
-            if (m_set.enable_zero_pad)
+            m_buf_w = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * num_weights);
+            m_buf_b = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * num_biases);
+
+            // the forward kernels by activation function, or the ones of packed maps
+            // taking it as an argument; all handle either padding
+            m_packed = (CLImageLayerData::mapChannel() == CLImageLayerData::Channel::RGBA);
+            std::string fwd_name = (m_activation == Activation::SIGMOID) ?
+                "conv_forward_sigmoid" : "conv_forward_relu";
+            if (m_packed)
+                fwd_name = "conv_forward_packed";
+            m_fwd_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    fwd_name.c_str());
+            m_infer_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    (fwd_name + "_infer").c_str());
+
+            m_fwd_kernel.setArg(3, m_buf_w);
+            m_fwd_kernel.setArg(4, m_buf_b);
+
+            int i_in_width = m_set.image_width;
+            int i_in_height = m_set.image_height;
+            int i_out_width = m_output_width;
+            int i_out_height = m_output_height;
+            int i_recep_size = m_set.recep_size;
+            int in_off = clInputOffset();
+            m_fwd_kernel.setArg(5, sizeof(int), &i_in_width);
+            m_fwd_kernel.setArg(6, sizeof(int), &i_out_width);
+            m_fwd_kernel.setArg(7, sizeof(int), &i_recep_size);
+            m_fwd_kernel.setArg(8, sizeof(int), &in_off);
+
+            // the inference kernel takes the same arguments without cur_z
+            m_infer_kernel.setArg(2, m_buf_w);
+            m_infer_kernel.setArg(3, m_buf_b);
+            m_infer_kernel.setArg(4, sizeof(int), &i_in_width);
+            m_infer_kernel.setArg(5, sizeof(int), &i_out_width);
+            m_infer_kernel.setArg(6, sizeof(int), &i_recep_size);
+            m_infer_kernel.setArg(7, sizeof(int), &in_off);
+
+            int prev_maps = m_set.prev_map_num;
+            int cur_maps = m_set.current_map_num;
+            int func = static_cast<int>(m_activation);
+            if (m_packed)
+            {
+                m_fwd_kernel.setArg(9, sizeof(int), &prev_maps);
+                m_fwd_kernel.setArg(10, sizeof(int), &cur_maps);
+                m_fwd_kernel.setArg(11, sizeof(int), &func);
+                m_infer_kernel.setArg(8, sizeof(int), &prev_maps);
+                m_infer_kernel.setArg(9, sizeof(int), &cur_maps);
+                m_infer_kernel.setArg(10, sizeof(int), &func);
+            }
+
+            // backward kernels; the data and the learning rate are set per batch
+            m_bwd_err_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    m_packed ? "conv_backward_error_packed" : "conv_backward_error");
+            m_bwd_err_kernel.setArg(3, m_buf_w);
+            m_bwd_err_kernel.setArg(4, sizeof(int), &i_in_width);
+            m_bwd_err_kernel.setArg(5, sizeof(int), &i_out_width);
+            m_bwd_err_kernel.setArg(6, sizeof(int), &i_out_height);
+            m_bwd_err_kernel.setArg(7, sizeof(int), &i_recep_size);
+            m_bwd_err_kernel.setArg(8, sizeof(int), &in_off);
+            if (m_packed)
             {
-                m_fwd_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
-                    "conv_forward_relu_zeropad");
+                m_bwd_err_kernel.setArg(9, sizeof(int), &prev_maps);
+                m_bwd_err_kernel.setArg(10, sizeof(int), &cur_maps);
+                m_bwd_err_kernel.setArg(11, sizeof(int), &func);
             }
             else
             {
-                // TODO: non-zeropad case?
+                m_bwd_err_kernel.setArg(9, sizeof(int), &func);
             }
 
-            m_fwd_kernel.setArg(3, m_imgbuf_w);
-            m_fwd_kernel.setArg(4, m_imgbuf_b);
+            m_bwd_w_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "conv_backward_weight");
+            m_bwd_w_kernel.setArg(2, m_buf_w);
+            m_bwd_w_kernel.setArg(3, sizeof(int), &i_in_width);
+            m_bwd_w_kernel.setArg(4, sizeof(int), &i_in_height);
+            m_bwd_w_kernel.setArg(5, sizeof(int), &i_out_width);
+            m_bwd_w_kernel.setArg(6, sizeof(int), &i_out_height);
+            m_bwd_w_kernel.setArg(7, sizeof(int), &i_recep_size);
+            m_bwd_w_kernel.setArg(8, sizeof(int), &in_off);
+
+            m_bwd_b_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "conv_backward_bias");
+            m_bwd_b_kernel.setArg(1, m_buf_b);
+
+            if (!m_packed)
+                setupTiledKernels();
+            setupBufferKernels();
+            refreshCLLayerInfo();
+        }
+    }
 
-            int i_in_width = m_set.image_width;
-            int i_out_width = m_output_width;
-            m_fwd_kernel.setArg(5, sizeof(int), &i_in_width);
-            m_fwd_kernel.setArg(6, sizeof(int), &i_out_width);
+    void ConvLayer::setupBufferKernels()
+    {
+        auto program = CLContext::getInstance().getProgram();
+        m_fwd_buf_kernel = cl::Kernel(program, "conv_forward_buf");
+        m_infer_buf_kernel = cl::Kernel(program, "conv_forward_buf_infer");
+        m_bwd_err_buf_kernel = cl::Kernel(program, "conv_backward_error_buf");
+        m_bwd_w_buf_kernel = cl::Kernel(program, "conv_backward_weight_buf");
+        m_bwd_b_buf_kernel = cl::Kernel(program, "conv_backward_bias_buf");
+
+        int i_in_width = m_set.image_width;
+        int i_in_height = m_set.image_height;
+        int i_out_width = m_output_width;
+        int i_out_height = m_output_height;
+        int i_recep_size = m_set.recep_size;
+        int in_off = clInputOffset();
+        int prev_maps = m_set.prev_map_num;
+        int cur_maps = m_set.current_map_num;
+        int func = static_cast<int>(m_activation);
+
+        // the inference kernel takes the same arguments without cur_z
+        for (int skip = 0; skip < 2; skip++)
+        {
+            auto& kernel = skip ? m_infer_buf_kernel : m_fwd_buf_kernel;
+            const int base = 3 - skip;
+            kernel.setArg(base, m_buf_w);
+            kernel.setArg(base + 1, m_buf_b);
+            kernel.setArg(base + 2, sizeof(int), &i_in_width);
+            kernel.setArg(base + 3, sizeof(int), &i_in_height);
+            kernel.setArg(base + 4, sizeof(int), &i_out_width);
+            kernel.setArg(base + 5, sizeof(int), &i_recep_size);
+            kernel.setArg(base + 6, sizeof(int), &in_off);
+            kernel.setArg(base + 7, sizeof(int), &prev_maps);
+            kernel.setArg(base + 8, sizeof(int), &func);
+        }
 
-            refreshCLLayerInfo();
+        m_bwd_err_buf_kernel.setArg(3, m_buf_w);
+        m_bwd_err_buf_kernel.setArg(4, sizeof(int), &i_in_width);
+        m_bwd_err_buf_kernel.setArg(5, sizeof(int), &i_out_width);
+        m_bwd_err_buf_kernel.setArg(6, sizeof(int), &i_out_height);
+        m_bwd_err_buf_kernel.setArg(7, sizeof(int), &i_recep_size);
+        m_bwd_err_buf_kernel.setArg(8, sizeof(int), &in_off);
+        m_bwd_err_buf_kernel.setArg(9, sizeof(int), &cur_maps);
+        m_bwd_err_buf_kernel.setArg(10, sizeof(int), &func);
+
+        // the gradient kernels take the arguments of the image versions
+        m_bwd_w_buf_kernel.setArg(2, m_buf_w);
+        m_bwd_w_buf_kernel.setArg(3, sizeof(int), &i_in_width);
+        m_bwd_w_buf_kernel.setArg(4, sizeof(int), &i_in_height);
+        m_bwd_w_buf_kernel.setArg(5, sizeof(int), &i_out_width);
+        m_bwd_w_buf_kernel.setArg(6, sizeof(int), &i_out_height);
+        m_bwd_w_buf_kernel.setArg(7, sizeof(int), &i_recep_size);
+        m_bwd_w_buf_kernel.setArg(8, sizeof(int), &in_off);
+
+        m_bwd_b_buf_kernel.setArg(1, m_buf_b);
+    }
+
+    bool ConvLayer::setupTiledKernels()
+    {
+        if (!CLContext::getInstance().tilesConv())
+            return false;
+
+        auto device = CLContext::getInstance().getDevice();
+
+        cl::Kernel fwd_kernel(CLContext::getInstance().getProgram(), "conv_forward_tiled");
+        cl::Kernel infer_kernel(CLContext::getInstance().getProgram(),
+                "conv_forward_tiled_infer");
+
+        // 16 x 8 work-items at most, fewer for small outputs or devices
+        const size_t max_group = std::min(
+                fwd_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+                infer_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+        size_t tile_w = std::min<size_t>(16, m_output_width);
+        size_t tile_h = std::min<size_t>(8, (m_output_height + TILE_ROWS - 1) / TILE_ROWS);
+        while (tile_w * tile_h > max_group && tile_h > 1)
+            tile_h /= 2;
+        while (tile_w * tile_h > max_group && tile_w > 1)
+            tile_w /= 2;
+
+        // the input tile with its halo, and one kernel
+        const size_t recep_size = m_set.recep_size;
+        const size_t tile_size = sizeof(float) * (tile_w + recep_size - 1)
+            * (tile_h * TILE_ROWS + recep_size - 1);
+        const size_t w_tile_size = sizeof(float) * recep_size * recep_size;
+
+        const size_t local_used = std::max(
+                fwd_kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device),
+                infer_kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device));
+        if (tile_w * tile_h > max_group || tile_size + w_tile_size + local_used
+                > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>())
+            return false;
+
+        int i_in_width = m_set.image_width;
+        int i_out_width = m_output_width;
+        int i_out_height = m_output_height;
+        int i_recep_size = m_set.recep_size;
+        int in_off = clInputOffset();
+        int cur_maps = m_set.current_map_num;
+        int func = static_cast<int>(m_activation);
+
+        // the inference kernel takes the same arguments without cur_z
+        for (int skip = 0; skip < 2; skip++)
+        {
+            auto& kernel = skip ? infer_kernel : fwd_kernel;
+            const int base = 3 - skip;
+            kernel.setArg(base, m_buf_w);
+            kernel.setArg(base + 1, m_buf_b);
+            kernel.setArg(base + 2, sizeof(int), &i_in_width);
+            kernel.setArg(base + 3, sizeof(int), &i_out_width);
+            kernel.setArg(base + 4, sizeof(int), &i_out_height);
+            kernel.setArg(base + 5, sizeof(int), &i_recep_size);
+            kernel.setArg(base + 6, sizeof(int), &in_off);
+            kernel.setArg(base + 7, sizeof(int), &cur_maps);
+            kernel.setArg(base + 8, sizeof(int), &func);
+            kernel.setArg(base + 9, cl::Local(tile_size));
+            kernel.setArg(base + 10, cl::Local(w_tile_size));
         }
+
+        m_fwd_kernel = fwd_kernel;
+        m_infer_kernel = infer_kernel;
+        m_tile_w = tile_w;
+        m_tile_h = tile_h;
+        return true;
     }
 
     ConvLayer::~ConvLayer()
@@ -108,200 +286,526 @@ namespace NeuralNet
         delete [] m_weight;
     }
 
+    namespace
+    {
+        /* scatters the (map x (sample, pixel)) GEMM result into the (sample, map, pixel)
+         * layout of LayerData, whose samples start stride floats apart, adding the bias
+         * and applying the activation function. z is not stored if it is null.
+         */
+        class ConvGemmEpilogue: public GemmEpilogue
+        {
+        public:
+            ConvGemmEpilogue(const float *bias, float *z, float *a, size_t map_size,
+                    size_t stride, Activation func)
+                : m_bias(bias), m_z(z), m_a(a), m_map_size(map_size), m_stride(stride),
+                m_func(func) {}
+
+            virtual void apply(float *c, size_t ldc, size_t row, size_t col,
+                    size_t rows, size_t cols) const
+            {
+                for (size_t r = 0; r < rows; r++)
+                {
+                    const size_t map = row + r;
+                    size_t j = 0;
+                    while (j < cols)
+                    {
+                        // a run of pixels which belongs to one sample
+                        const size_t sample = (col + j) / m_map_size;
+                        const size_t pixel = (col + j) % m_map_size;
+                        const size_t len = std::min(cols - j, m_map_size - pixel);
+                        const size_t offset = sample * m_stride + map * m_map_size + pixel;
+
+                        bias_activate_vec(c + r*ldc + j, m_bias + map*m_map_size + pixel,
+                                m_z ? m_z + offset : nullptr, m_a + offset, len, m_func);
+                        j += len;
+                    }
+                }
+            }
+
+        private:
+            const float *m_bias;
+            float *m_z, *m_a;
+            size_t m_map_size, m_stride;
+            Activation m_func;
+        };
+    }
+
     void ConvLayer::forward_cpu(const LayerData& prev, LayerData& current)
+    {
+        switch (m_set.engine)
+        {
+        case Engine::DIRECT:
+            forward_direct(prev, current);
+            break;
+        case Engine::GEMM:
+            forward_gemm(prev, current);
+            break;
+        case Engine::WINOGRAD:
+            forward_winograd(prev, current);
+            break;
+        }
+    }
+
+    void ConvLayer::forward_direct(const LayerData& prev, LayerData& current)
     {
         auto train_num = current.getTrainNum();
-        auto prev_a = prev.get(LayerData::DataIndex::ACTIVATION);
+        const auto cur_stride = current.getStride();
+        auto prev_a = prev.getRead(LayerData::DataIndex::ACTIVATION);
         auto cur_a = current.get(LayerData::DataIndex::ACTIVATION);
         auto cur_z = current.get(LayerData::DataIndex::INTER_VALUE);
 
-        memset(cur_z, 0, sizeof(float) * train_num
-                * m_set.current_map_num * m_output_width * m_output_height);
-        float *temp_z = new float[m_output_width * m_output_height];
+        // inference-only data has no z; the sums are built up in the activations then
+        auto cur_sum = cur_z ? cur_z : cur_a;
 
-        for (size_t i=0; i<train_num; i++)
-        {
-            size_t w_offset = 0;
-            size_t prev_offset = 0;
-            size_t cur_offset = i * m_set.current_map_num * m_output_width
-                * m_output_height;
-            size_t bias_offset = 0;
+        // the samples are independent of each other; each chunk has its own temp_z
+        auto scratch = getScratch(train_num);
+        parallel_for(m_pool, 0, train_num, [&](size_t i_begin, size_t i_end) {
+            float *temp_z = scratch.temp_z + i_begin * m_output_width * m_output_height;
 
-            for (size_t ncur = 0; ncur < m_set.current_map_num; ncur++)
+            for (size_t i = i_begin; i < i_end; i++)
             {
-                prev_offset = i * m_set.prev_map_num * m_set.image_width * m_set.image_height;
-                for (size_t nprev = 0; nprev < m_set.prev_map_num; nprev++)
+                size_t w_offset = 0;
+                size_t prev_offset = 0;
+                size_t cur_offset = i * cur_stride;
+                size_t bias_offset = 0;
+                memset(cur_sum + cur_offset, 0, sizeof(float)
+                        * m_set.current_map_num * m_output_width * m_output_height);
+
+                for (size_t ncur = 0; ncur < m_set.current_map_num; ncur++)
                 {
-                    f_convolution(
-                        prev_a + prev_offset, m_weight + w_offset, temp_z,
-                        m_set.image_width, m_set.image_height, m_set.recep_size, m_set.recep_size
-                    );
-                    add_vec(cur_z + cur_offset, temp_z, cur_z + cur_offset, m_output_width * m_output_height);
+                    prev_offset = i * m_set.prev_map_num * m_set.image_width * m_set.image_height;
+                    for (size_t nprev = 0; nprev < m_set.prev_map_num; nprev++)
+                    {
+                        f_convolution(
+                            prev_a + prev_offset, m_weight + w_offset, temp_z,
+                            m_set.image_width, m_set.image_height, m_set.recep_size, m_set.recep_size
+                        );
+                        add_vec(cur_sum + cur_offset, temp_z, cur_sum + cur_offset,
+                                m_output_width * m_output_height);
+
+                        w_offset += (m_set.recep_size * m_set.recep_size);
+                        prev_offset += (m_set.image_width * m_set.image_height);
+                    }
 
-                    w_offset += (m_set.recep_size * m_set.recep_size);
-                    prev_offset += (m_set.image_width * m_set.image_height);
+                    bias_activate_vec(cur_sum + cur_offset, m_bias + bias_offset,
+                            cur_z ? cur_z + cur_offset : nullptr, cur_a + cur_offset,
+                            m_output_width * m_output_height, m_activation);
+
+                    cur_offset += (m_output_width * m_output_height);
+                    bias_offset += (m_output_width * m_output_height);
                 }
+            }
+        });
+    }
+
+    void ConvLayer::forward_gemm(const LayerData& prev, LayerData& current)
+    {
+        const auto train_num = current.getTrainNum();
+        auto prev_a = prev.getRead(LayerData::DataIndex::ACTIVATION);
+        auto cur_a = current.get(LayerData::DataIndex::ACTIVATION);
+        auto cur_z = current.get(LayerData::DataIndex::INTER_VALUE);
+
+        const size_t out_size = m_output_width * m_output_height;
+        const size_t col_rows = m_set.prev_map_num * m_set.recep_size * m_set.recep_size;
+        const size_t col_cols = train_num * out_size;
 
-                add_vec(cur_z + cur_offset, m_bias + bias_offset, cur_z + cur_offset,
-                        m_output_width * m_output_height);
-                apply_vec(cur_z + cur_offset, cur_a + cur_offset,
-                        m_output_width * m_output_height, f_activation);
+        auto scratch = getScratch(train_num);
+        lowerBatch(prev_a, train_num, scratch.col);
+
+        /* (current maps x col_rows) weights times (col_rows x col_cols) patches;
+         * the epilogue writes each finished block to cur_z and cur_a */
+        ConvGemmEpilogue epilogue(m_bias, cur_z, cur_a, out_size, current.getStride(),
+                m_activation);
+        sgemm(false, false, m_set.current_map_num, col_cols, col_rows,
+                1.0f, m_weight, col_rows, scratch.col, col_cols,
+                0.0f, scratch.gemm_out, col_cols, &epilogue, m_pool);
+    }
 
-                cur_offset += (m_output_width * m_output_height);
-                bias_offset += (m_output_width * m_output_height);
+    void ConvLayer::forward_winograd(const LayerData& prev, LayerData& current)
+    {
+        const auto train_num = current.getTrainNum();
+        const int i_recep_size = m_set.recep_size;
+        auto prev_a = prev.getRead(LayerData::DataIndex::ACTIVATION);
+        auto cur_a = current.get(LayerData::DataIndex::ACTIVATION);
+        auto cur_z = current.get(LayerData::DataIndex::INTER_VALUE);
+
+        const size_t map_size = m_set.current_map_num * m_output_width * m_output_height;
+        const size_t cur_stride = current.getStride();
+        const MatrixRange range = convolutionRange();
+
+        // without z, the activations are computed in place
+        auto cur_sum = cur_z ? cur_z : cur_a;
+        auto scratch = getScratch(train_num);
+        winograd_convolution(prev_a, m_weight_winograd.data(), cur_sum,
+                m_set.image_width, m_set.image_height, m_set.prev_map_num,
+                m_set.current_map_num, i_recep_size, range, train_num, m_pool,
+                scratch.winograd, cur_stride);
+
+        parallel_for(m_pool, 0, train_num, [&](size_t i_begin, size_t i_end) {
+            for (size_t i = i_begin; i < i_end; i++)
+            {
+                bias_activate_vec(cur_sum + i * cur_stride, m_bias,
+                        cur_z ? cur_z + i * cur_stride : nullptr,
+                        cur_a + i * cur_stride, map_size, m_activation);
             }
-        }
+        });
+    }
+
+    void ConvLayer::refreshWinogradWeights()
+    {
+        if (m_set.engine != Engine::WINOGRAD)
+            return;
 
-        delete [] temp_z;
+        m_weight_winograd.resize(winograd_transformed_size(m_set.recep_size)
+                * m_set.current_map_num * m_set.prev_map_num);
+        winograd_transform_weights(m_weight, m_weight_winograd.data(),
+                m_set.current_map_num, m_set.prev_map_num, m_set.recep_size);
     }
 
     void ConvLayer::forward_gpu(const CLLayerData& prev, CLLayerData& current)
     {
         auto queue = CLContext::getInstance().getCommandQueue();
 
-        auto m_buf_pa = prev.getCLMemory(
+        auto m_buf_pa = prev.readCL(
                 LayerData::DataIndex::ACTIVATION);
-        auto m_buf_cz = current.getCLMemory(
-                LayerData::DataIndex::INTER_VALUE);
-        auto m_buf_ca = current.getCLMemory(
+        auto m_buf_ca = current.writeCL(
                 LayerData::DataIndex::ACTIVATION);
-        m_fwd_kernel.setArg(0, m_buf_pa);
-        m_fwd_kernel.setArg(1, m_buf_cz);
-        m_fwd_kernel.setArg(2, m_buf_ca);
+
+        // the maps of batches beyond the image limits are in buffers
+        const bool buffered = (dynamic_cast<const CLBufferLayerData *>(&current) != nullptr);
+
+        auto *kernel = buffered ? &m_fwd_buf_kernel : &m_fwd_kernel;
+        if (current.isInferenceOnly())
+        {
+            kernel = buffered ? &m_infer_buf_kernel : &m_infer_kernel;
+            kernel->setArg(0, m_buf_pa);
+            kernel->setArg(1, m_buf_ca);
+        }
+        else
+        {
+            auto m_buf_cz = current.writeCL(
+                    LayerData::DataIndex::INTER_VALUE);
+            kernel->setArg(0, m_buf_pa);
+            kernel->setArg(1, m_buf_cz);
+            kernel->setArg(2, m_buf_ca);
+        }
 
         cl_int err = CL_SUCCESS;
-        err = queue.enqueueNDRangeKernel(m_fwd_kernel, cl::NullRange,
-                cl::NDRange(m_output_width * m_output_height,
-                    m_set.current_map_num,
-                    current.getTrainNum()),
-                cl::NullRange);
+        if (buffered)
+        {
+            err = queue.enqueueNDRangeKernel(*kernel, cl::NullRange,
+                    cl::NDRange(m_output_width * m_output_height,
+                        m_set.current_map_num,
+                        current.getTrainNum()),
+                    cl::NullRange);
+        }
+        else if (m_tile_w > 0)
+        {
+            // whole work-groups over the output, with the maps and samples in z
+            const size_t rows = m_tile_h * TILE_ROWS;
+            err = queue.enqueueNDRangeKernel(*kernel, cl::NullRange,
+                    cl::NDRange((m_output_width + m_tile_w - 1) / m_tile_w * m_tile_w,
+                        (m_output_height + rows - 1) / rows * m_tile_h,
+                        m_set.current_map_num * current.getTrainNum()),
+                    cl::NDRange(m_tile_w, m_tile_h, 1));
+        }
+        else
+        {
+            // the packed kernels write the four maps of a texel at once
+            err = queue.enqueueNDRangeKernel(*kernel, cl::NullRange,
+                    cl::NDRange(m_output_width * m_output_height,
+                        CLImageLayerData::mapRows(m_set.current_map_num,
+                            mapChannel()),
+                        current.getTrainNum()),
+                    cl::NullRange);
+        }
         printError(err, "Error at CommandQueue::enqueNDRangeKernel");
     }
 
     void ConvLayer::backward_cpu(LayerData& prev, LayerData& current)
+    {
+        switch (m_set.engine)
+        {
+        case Engine::DIRECT:
+            backward_direct(prev, current);
+            break;
+        case Engine::GEMM:
+        case Engine::WINOGRAD:
+            backward_gemm(prev, current);
+            break;
+        }
+
+        refreshWinogradWeights();
+    }
+
+    void ConvLayer::backward_direct(LayerData& prev, LayerData& current)
     {
         const auto train_num = current.getTrainNum();
         const auto learn_rate = m_learn_rate;
         const int i_recep_size = m_set.recep_size;
-        auto prev_a = prev.get(LayerData::DataIndex::ACTIVATION);
-        auto prev_z = prev.get(LayerData::DataIndex::INTER_VALUE);
+        const auto cur_stride = current.getStride();
+        const size_t out_size = m_output_width * m_output_height;
+        auto prev_a = prev.getRead(LayerData::DataIndex::ACTIVATION);
+        auto prev_z = prev.getRead(LayerData::DataIndex::INTER_VALUE);
         auto prev_e = prev.get(LayerData::DataIndex::ERROR);
-        auto cur_e = current.get(LayerData::DataIndex::ERROR);
+        auto cur_e = current.getRead(LayerData::DataIndex::ERROR);
 
         memset(prev_e, 0, sizeof(float) * train_num
                 * m_set.prev_map_num * m_set.image_width * m_set.image_height);
 
-        /* calculate error value for previous layer */
-        float *sprime_z = new float[m_set.image_width * m_set.image_height];
-        float *temp_w = new float[m_set.recep_size * m_set.recep_size];
-        float *temp_pe = new float[m_set.image_width * m_set.image_height];
-        for (size_t i=0; i<train_num; i++)
+        // flip every kernel once for this update
+        const size_t recep_area = m_set.recep_size * m_set.recep_size;
+        auto scratch = getScratch(train_num);
+        for (size_t i = 0; i < m_set.current_map_num * m_set.prev_map_num; i++)
         {
-            size_t w_offset = 0;
-            size_t cur_offset = 0;
-            size_t prev_offset = i * m_set.prev_map_num * m_set.image_width * m_set.image_height;
-            for (size_t nprev = 0; nprev < m_set.prev_map_num; nprev++)
-            {
-                cur_offset = i * m_set.current_map_num * m_output_width * m_output_height;
-                w_offset = nprev * m_set.recep_size * m_set.recep_size;
+            flip_mat(m_weight + i * recep_area, scratch.weight_flipped + i * recep_area,
+                    m_set.recep_size, m_set.recep_size);
+        }
 
-                for (size_t ncur = 0; ncur < m_set.current_map_num; ncur++)
+        /* calculate error value for previous layer, sample by sample */
+        parallel_for(m_pool, 0, train_num, [&](size_t i_begin, size_t i_end) {
+            float *temp_pe = scratch.temp_pe + i_begin * m_set.image_width * m_set.image_height;
+
+            for (size_t i = i_begin; i < i_end; i++)
+            {
+                size_t w_offset = 0;
+                size_t cur_offset = 0;
+                size_t prev_offset = i * m_set.prev_map_num * m_set.image_width * m_set.image_height;
+                for (size_t nprev = 0; nprev < m_set.prev_map_num; nprev++)
                 {
-                    flip_mat(m_weight + w_offset, temp_w, m_set.recep_size, m_set.recep_size);
-                    f_convol_back(
-                        cur_e + cur_offset, temp_w, temp_pe,
-                        m_output_width, m_output_height, m_set.recep_size, m_set.recep_size
-                    );
-                    add_vec(prev_e + prev_offset, temp_pe, prev_e + prev_offset,
-                            m_set.image_width * m_set.image_height);
-
-                    w_offset += (m_set.prev_map_num * m_set.recep_size * m_set.recep_size);
-                    cur_offset += (m_output_width * m_output_height);
-                }
+                    cur_offset = i * cur_stride;
+                    w_offset = nprev * m_set.recep_size * m_set.recep_size;
+
+                    for (size_t ncur = 0; ncur < m_set.current_map_num; ncur++)
+                    {
+                        f_convol_back(
+                            cur_e + cur_offset, scratch.weight_flipped + w_offset, temp_pe,
+                            m_output_width, m_output_height, m_set.recep_size, m_set.recep_size
+                        );
+                        add_vec(prev_e + prev_offset, temp_pe, prev_e + prev_offset,
+                                m_set.image_width * m_set.image_height);
+
+                        w_offset += (m_set.prev_map_num * m_set.recep_size * m_set.recep_size);
+                        cur_offset += (m_output_width * m_output_height);
+                    }
 
-                apply_vec(prev_z + prev_offset, sprime_z, m_set.image_width * m_set.image_height,
-                        f_activation_prime);
-                pmul_vec(prev_e + prev_offset, sprime_z, prev_e + prev_offset,
-                        m_set.image_width * m_set.image_height);
+                    activation_prime_mul_vec(prev_z + prev_offset, prev_e + prev_offset,
+                            m_set.image_width * m_set.image_height, m_activation);
 
-                prev_offset += (m_set.image_width * m_set.image_height);
+                    prev_offset += (m_set.image_width * m_set.image_height);
+                }
             }
-        }
+        });
 
         // add weight decay term
         const_mul_vec(m_weight, 1.0 - (m_set.learn_rate * m_set.weight_decay),
                 m_set.current_map_num * m_set.prev_map_num *
                 m_set.recep_size * m_set.recep_size);
 
-        /* calculate delta_w and update current weight */
-        float *delta_w = new float[m_set.recep_size * m_set.recep_size];
-        size_t dw_offset = 0;
-        for (size_t ncur = 0; ncur < m_set.current_map_num; ncur++)
-        {
-            for (size_t nprev = 0; nprev < m_set.prev_map_num; nprev++)
+        /* the tap (jj, ii) of a kernel sees the input at (y + jj', x + ii') for the
+         * output (y, x), with jj' = recep_size - 1 - jj. convolving the input with the
+         * flipped error map gives these sums for (jj', ii'), so the result is flipped
+         * back into kernel order */
+        parallel_for(m_pool, 0, train_num * m_set.current_map_num,
+                [&](size_t m_begin, size_t m_end) {
+            for (size_t map = m_begin; map < m_end; map++)
             {
-                size_t cur_offset = ncur * m_output_width * m_output_height;
+                const size_t i = map / m_set.current_map_num;
+                const size_t ncur = map % m_set.current_map_num;
+                flip_mat(cur_e + i * cur_stride + ncur * out_size,
+                        scratch.err_flipped + map * out_size,
+                        m_output_width, m_output_height);
+            }
+        });
+
+        /* calculate delta_w and update current weight, one kernel per (cur, prev) pair */
+        const MatrixRange range = convolutionRange();
+        const MatrixRange taps(range.x, range.y, i_recep_size, i_recep_size);
+        parallel_for(m_pool, 0, m_set.current_map_num * m_set.prev_map_num,
+                [&](size_t k_begin, size_t k_end) {
+            float *delta_w = scratch.delta_w + k_begin * recep_area;
+            float *temp_w = scratch.temp_w + k_begin * recep_area;
+
+            for (size_t kernel = k_begin; kernel < k_end; kernel++)
+            {
+                const size_t ncur = kernel / m_set.prev_map_num;
+                const size_t nprev = kernel % m_set.prev_map_num;
+                const size_t dw_offset = kernel * recep_area;
+                size_t cur_offset = ncur * out_size;
                 size_t prev_offset = (nprev * m_set.image_width * m_set.image_height);
 
-                memset(delta_w, 0, sizeof(float) * m_set.recep_size * m_set.recep_size);
+                set_vec(delta_w, 0, recep_area);
 
                 for (size_t i = 0; i < train_num; i++)
                 {
-                    if (m_set.enable_zero_pad)
-                    {
-                        convolution_mat(prev_a + prev_offset, cur_e + cur_offset, temp_w,
-                            m_set.image_width, m_set.image_height, m_output_width, m_output_height,
-                            MatrixRange(-(i_recep_size/2), -(i_recep_size/2), i_recep_size, i_recep_size));
-                    }
-                    else
-                    {
-                        convolution_mat_no_zeros(prev_a + prev_offset, cur_e + cur_offset, temp_w,
-                            m_set.image_width, m_set.image_height, m_output_width, m_output_height);
-                    }
-                    add_vec(delta_w, temp_w, delta_w, m_set.recep_size * m_set.recep_size);
+                    convolution_mat(prev_a + prev_offset, scratch.err_flipped + cur_offset,
+                            temp_w, m_set.image_width, m_set.image_height,
+                            m_output_width, m_output_height, taps);
+                    add_vec(delta_w, temp_w, delta_w, recep_area);
 
                     prev_offset += (m_set.prev_map_num * m_set.image_width * m_set.image_height);
-                    cur_offset += (m_set.current_map_num * m_output_width * m_output_height);
+                    cur_offset += m_set.current_map_num * out_size;
                 }
 
-                apply_vec(delta_w, delta_w, m_set.recep_size * m_set.recep_size,
-                    [train_num, learn_rate](float in) -> float {
-                        return -in*learn_rate/train_num;
-                });
-                add_vec(m_weight + dw_offset, delta_w, m_weight + dw_offset,
-                        m_set.recep_size * m_set.recep_size);
+                flip_mat(delta_w, temp_w, m_set.recep_size, m_set.recep_size);
+                const_mul_vec(temp_w, -learn_rate / train_num, recep_area);
+                add_vec(m_weight + dw_offset, temp_w, m_weight + dw_offset, recep_area);
+            }
+        });
+
+        // calculate delta_b and update current bias
+        const size_t map_size = m_set.current_map_num * m_output_width * m_output_height;
+        sum_vec(cur_e, scratch.delta_b, map_size, train_num, cur_stride);
+        const_mul_vec(scratch.delta_b, -learn_rate / train_num, map_size);
+        add_vec(m_bias, scratch.delta_b, m_bias, map_size);
+    }
 
-                dw_offset += (m_set.recep_size * m_set.recep_size);
+    void ConvLayer::backward_gemm(LayerData& prev, LayerData& current)
+    {
+        const auto train_num = current.getTrainNum();
+        const auto learn_rate = m_learn_rate;
+        const int i_recep_size = m_set.recep_size;
+        auto prev_a = prev.getRead(LayerData::DataIndex::ACTIVATION);
+        auto prev_z = prev.getRead(LayerData::DataIndex::INTER_VALUE);
+        auto prev_e = prev.get(LayerData::DataIndex::ERROR);
+        auto cur_e = current.getRead(LayerData::DataIndex::ERROR);
+
+        const size_t out_size = m_output_width * m_output_height;
+        const size_t map_size = m_set.current_map_num * out_size;
+        const size_t cur_stride = current.getStride();
+        const size_t prev_size = m_set.prev_map_num * m_set.image_width * m_set.image_height;
+        const size_t col_rows = m_set.prev_map_num * m_set.recep_size * m_set.recep_size;
+        const size_t col_cols = train_num * out_size;
+        const MatrixRange range = convolutionRange();
+
+        auto scratch = getScratch(train_num);
+
+        // the errors as a (current maps x (sample, pixel)) matrix
+        parallel_for(m_pool, 0, train_num, [&](size_t i_begin, size_t i_end) {
+            for (size_t i = i_begin; i < i_end; i++)
+            {
+                for (size_t ncur = 0; ncur < m_set.current_map_num; ncur++)
+                {
+                    copy_vec(cur_e + i * cur_stride + ncur * out_size,
+                            scratch.gemm_out + ncur * col_cols + i * out_size, out_size);
+                }
             }
-        }
+        });
+
+        /* calculate error value for previous layer:
+         * the column errors W^T * E are added back to the pixels they came from */
+        sgemm(true, false, col_rows, col_cols, m_set.current_map_num,
+                1.0f, m_weight, col_rows, scratch.gemm_out, col_cols,
+                0.0f, scratch.col_err, col_cols, nullptr, m_pool);
+
+        parallel_for(m_pool, 0, train_num, [&](size_t i_begin, size_t i_end) {
+            float *sample_e = prev_e + i_begin * prev_size;
+            set_vec(sample_e, 0, (i_end - i_begin) * prev_size);
+            col2im(scratch.col_err + i_begin * out_size, sample_e,
+                    m_set.image_width, m_set.image_height, m_set.prev_map_num,
+                    i_recep_size, i_recep_size, range, i_end - i_begin, col_cols);
+            activation_prime_mul_vec(prev_z + i_begin * prev_size, sample_e,
+                    (i_end - i_begin) * prev_size, m_activation);
+        });
 
         // calculate delta_b and update current bias
-        float *delta_b = new float[m_set.current_map_num * m_output_width *
-                m_output_height];
-        sum_vec(cur_e, delta_b, m_set.current_map_num * m_output_width * m_output_height,
-                train_num);
-        apply_vec(delta_b, delta_b,
-                m_set.current_map_num * m_output_width * m_output_height,
-                [train_num, learn_rate](float in) -> float {
-                    return -in*learn_rate/train_num;
-                });
-        add_vec(m_bias, delta_b, m_bias,
-                m_set.current_map_num * m_output_width * m_output_height);
-
-        delete [] delta_b;
-        delete [] delta_w;
-        delete [] temp_pe;
-        delete [] temp_w;
-        delete [] sprime_z;
+        sum_vec(cur_e, scratch.delta_b, map_size, train_num, cur_stride);
+        const_mul_vec(scratch.delta_b, -learn_rate / train_num, map_size);
+        add_vec(m_bias, scratch.delta_b, m_bias, map_size);
+
+        /* update current weight with the decay term and delta_w in one GEMM:
+         * W = (1 - lr*decay) * W - (lr/train_num) * E * col^T */
+        lowerBatch(prev_a, train_num, scratch.col);
+        sgemm(false, true, m_set.current_map_num, col_rows, col_cols,
+                -learn_rate / train_num, scratch.gemm_out, col_cols, scratch.col, col_cols,
+                1.0 - m_set.learn_rate * m_set.weight_decay, m_weight, col_rows,
+                nullptr, m_pool);
+    }
+
+    void ConvLayer::lowerBatch(const float *prev_a, size_t train_num, float *col)
+    {
+        const int i_recep_size = m_set.recep_size;
+        const size_t out_size = m_output_width * m_output_height;
+        const size_t prev_size = m_set.prev_map_num * m_set.image_width * m_set.image_height;
+        const size_t col_cols = train_num * out_size;
+        const MatrixRange range = convolutionRange();
+
+        // each group of samples fills its own columns
+        parallel_for(m_pool, 0, train_num, [&](size_t i_begin, size_t i_end) {
+            im2col(prev_a + i_begin * prev_size, col + i_begin * out_size,
+                    m_set.image_width, m_set.image_height, m_set.prev_map_num,
+                    i_recep_size, i_recep_size, range, i_end - i_begin, col_cols);
+        });
+    }
+
+    MatrixRange ConvLayer::convolutionRange() const
+    {
+        // the same ranges as convolution_mat_same_zeros() and convolution_mat_no_zeros()
+        const int i_recep_size = m_set.recep_size;
+        if (m_set.enable_zero_pad)
+        {
+            return MatrixRange(-(i_recep_size/2), -(i_recep_size/2),
+                    m_set.image_width, m_set.image_height);
+        }
+        return MatrixRange(0, 0, m_output_width, m_output_height);
+    }
+
+    CLImageLayerData::Channel ConvLayer::mapChannel() const
+    {
+        return m_packed ? CLImageLayerData::Channel::RGBA : CLImageLayerData::Channel::INTENSITY;
+    }
+
+    int ConvLayer::clInputOffset() const
+    {
+        return static_cast<int>(m_set.recep_size) - 1 + convolutionRange().x;
     }
 
     void ConvLayer::backward_gpu(CLLayerData& prev, CLLayerData& current)
     {
-        /* TODO: OpenCL intergration */
-        // not implemented yet, just use cpu temporarily
-        backward_cpu(prev, current);
+        auto queue = CLContext::getInstance().getCommandQueue();
+        cl_int err = CL_SUCCESS;
 
-        refreshCLLayerInfo();
+        const int train_num = current.getTrainNum();
+        const float rate = -m_learn_rate / train_num;
+        const float decay = 1.0 - m_set.learn_rate * m_set.weight_decay;
+
+        auto buf_ce = current.readCL(LayerData::DataIndex::ERROR);
+        const bool buffered = (dynamic_cast<const CLBufferLayerData *>(&current) != nullptr);
+
+        // error value for the previous layer, with the weights before the update
+        auto& err_kernel = buffered ? m_bwd_err_buf_kernel : m_bwd_err_kernel;
+        err_kernel.setArg(0, buf_ce);
+        err_kernel.setArg(1, prev.readCL(LayerData::DataIndex::INTER_VALUE));
+        err_kernel.setArg(2, prev.writeCL(LayerData::DataIndex::ERROR));
+        err = queue.enqueueNDRangeKernel(err_kernel, cl::NullRange,
+                cl::NDRange(m_set.image_width * m_set.image_height,
+                    buffered ? m_set.prev_map_num : CLImageLayerData::mapRows(
+                        m_set.prev_map_num, mapChannel()),
+                    train_num),
+                cl::NullRange);
+        printError(err, "Error at CommandQueue::enqueNDRangeKernel");
+
+        // delta_w with the decay term, then delta_b
+        auto& w_kernel = buffered ? m_bwd_w_buf_kernel : m_bwd_w_kernel;
+        w_kernel.setArg(0, buf_ce);
+        w_kernel.setArg(1, prev.readCL(LayerData::DataIndex::ACTIVATION));
+        w_kernel.setArg(9, sizeof(int), &train_num);
+        w_kernel.setArg(10, sizeof(float), &rate);
+        w_kernel.setArg(11, sizeof(float), &decay);
+        err = queue.enqueueNDRangeKernel(w_kernel, cl::NullRange,
+                cl::NDRange(m_set.recep_size * m_set.recep_size,
+                    m_set.prev_map_num, m_set.current_map_num),
+                cl::NullRange);
+        printError(err, "Error at CommandQueue::enqueNDRangeKernel");
+
+        auto& b_kernel = buffered ? m_bwd_b_buf_kernel : m_bwd_b_kernel;
+        b_kernel.setArg(0, buf_ce);
+        b_kernel.setArg(2, sizeof(int), &train_num);
+        b_kernel.setArg(3, sizeof(float), &rate);
+        err = queue.enqueueNDRangeKernel(b_kernel, cl::NullRange,
+                cl::NDRange(m_output_width * m_output_height, m_set.current_map_num),
+                cl::NullRange);
+        printError(err, "Error at CommandQueue::enqueNDRangeKernel");
     }
 
     void ConvLayer::refreshCLLayerInfo()
@@ -311,45 +815,118 @@ namespace NeuralNet
             auto queue = CLContext::getInstance().getCommandQueue();
             cl_int err = CL_SUCCESS;
 
-            cl::size_t<3> in_offset, in_region_w, in_region_b;
-            in_offset[0] = in_offset[1] = in_offset[2] = 0;
-            in_region_w[0] = m_set.recep_size * m_set.recep_size;
-            in_region_w[1] = m_set.prev_map_num;
-            in_region_w[2] = m_set.current_map_num;
-            in_region_b[0] = m_output_width;
-            in_region_b[1] = m_output_height;
-            in_region_b[2] = m_set.current_map_num;
-
-            err = queue.enqueueWriteImage(m_imgbuf_w, CL_TRUE, in_offset,
-                    in_region_w, 0, 0, m_weight);
+            err = queue.enqueueWriteBuffer(m_buf_w, CL_TRUE, 0, sizeof(float)
+                    * m_set.current_map_num * m_set.prev_map_num
+                    * m_set.recep_size * m_set.recep_size, m_weight);
             printError(err, "Error at CommandQueue::enqueueWriteBuffer for m_buf_w");
-            err = queue.enqueueWriteImage(m_imgbuf_b, CL_TRUE, in_offset,
-                    in_region_b, 0, 0, m_bias);
+            err = queue.enqueueWriteBuffer(m_buf_b, CL_TRUE, 0, sizeof(float)
+                    * getNeuronNum(), m_bias);
             printError(err, "Error at CommandQueue::enqueueWriteBuffer for m_buf_b");
         }
     }
 
-    std::unique_ptr<LayerData> ConvLayer::createLayerData(size_t train_num)
+    void ConvLayer::fetchCLLayerInfo()
     {
+        if (m_set.uses_gpu)
+        {
+            auto queue = CLContext::getInstance().getCommandQueue();
+            cl_int err = CL_SUCCESS;
+
+            err = queue.enqueueReadBuffer(m_buf_w, CL_TRUE, 0, sizeof(float)
+                    * m_set.current_map_num * m_set.prev_map_num
+                    * m_set.recep_size * m_set.recep_size, m_weight);
+            printError(err, "Error at CommandQueue::enqueueReadBuffer for m_buf_w");
+            err = queue.enqueueReadBuffer(m_buf_b, CL_TRUE, 0, sizeof(float)
+                    * getNeuronNum(), m_bias);
+            printError(err, "Error at CommandQueue::enqueueReadBuffer for m_buf_b");
+        }
+    }
+
+    std::unique_ptr<LayerData> ConvLayer::createLayerData(size_t train_num,
+            bool inference_only, bool maps_in_buffers)
+    {
+        if (m_set.uses_gpu && maps_in_buffers)
+        {
+            return std::make_unique<CLBufferLayerData>(
+                    train_num, getNeuronNum(), inference_only);
+        }
         if (m_set.uses_gpu)
         {
             return std::make_unique<CLImageLayerData>(
                     train_num,
                     m_output_width, m_output_height, m_set.current_map_num,
-                    CLImageLayerData::Channel::INTENSITY
+                    mapChannel(), inference_only
             );
         }
         return std::make_unique<LayerData>(
             train_num,
-            m_set.current_map_num * m_output_width * m_output_height
+            m_set.current_map_num * m_output_width * m_output_height,
+            inference_only
         );
     }
     
+    bool ConvLayer::fitsImages(size_t train_num) const
+    {
+        return CLImageLayerData::holdsMaps(train_num, m_output_width, m_output_height,
+                m_set.current_map_num, mapChannel());
+    }
+
     size_t ConvLayer::getNeuronNum() const
     {
         return m_set.current_map_num * m_output_width * m_output_height;
     }
 
+    size_t ConvLayer::getWorkspaceSize(size_t train_num) const
+    {
+        Scratch scratch;
+        return layoutScratch(train_num, nullptr, scratch);
+    }
+
+    size_t ConvLayer::layoutScratch(size_t train_num, float *base, Scratch& scratch) const
+    {
+        const size_t out_size = m_output_width * m_output_height;
+        const size_t map_size = m_set.current_map_num * out_size;
+        const size_t kernels = m_set.current_map_num * m_set.prev_map_num;
+        const size_t recep_area = m_set.recep_size * m_set.recep_size;
+        const size_t col_rows = m_set.prev_map_num * recep_area;
+        const size_t col_cols = train_num * out_size;
+
+        scratch = Scratch();
+        WorkspaceParts parts(base);
+        if (m_set.engine == Engine::DIRECT)
+        {
+            // one slot per sample or kernel, so that every chunk of a loop has its own
+            scratch.temp_z = parts.take(train_num * out_size);
+            scratch.temp_pe = parts.take(train_num * m_set.image_width * m_set.image_height);
+            scratch.weight_flipped = parts.take(kernels * recep_area);
+            scratch.err_flipped = parts.take(train_num * map_size);
+            scratch.delta_w = parts.take(kernels * recep_area);
+            scratch.temp_w = parts.take(kernels * recep_area);
+        }
+        else
+        {
+            if (m_set.engine == Engine::WINOGRAD)
+            {
+                scratch.winograd = parts.take(winograd_workspace_size(m_set.prev_map_num,
+                            m_set.current_map_num, m_set.recep_size, convolutionRange(),
+                            train_num));
+            }
+            scratch.col = parts.take(col_rows * col_cols);
+            scratch.gemm_out = parts.take(m_set.current_map_num * col_cols);
+            scratch.col_err = parts.take(col_rows * col_cols);
+        }
+        scratch.delta_b = parts.take(map_size);
+        return parts.size();
+    }
+
+    ConvLayer::Scratch ConvLayer::getScratch(size_t train_num)
+    {
+        Scratch scratch;
+        auto size = layoutScratch(train_num, nullptr, scratch);
+        layoutScratch(train_num, getWorkspace(size), scratch);
+        return scratch;
+    }
+
     void ConvLayer::importLayer(const Json::Value& coeffs)
     {
         auto coeff_dim = coeffs["dimension"];
@@ -394,11 +971,15 @@ namespace NeuralNet
             }
         }
 
+        refreshWinogradWeights();
         refreshCLLayerInfo();
     }
 
     Json::Value ConvLayer::exportLayer()
     {
+        // the device holds the trained coefficients
+        fetchCLLayerInfo();
+
         Json::Value coeff_value(Json::objectValue);
 
         Json::Value coeff_dim(Json::objectValue);
@@ -2,44 +2,87 @@
 
 namespace NeuralNet
 {
-    LayerData::LayerData(size_t train_num, size_t data_num)
-        : m_train_num(train_num), m_data_num(data_num)
+    LayerData::LayerData(size_t train_num, size_t data_num, bool inference_only)
+        : m_train_num(train_num), m_capacity(train_num), m_data_num(data_num),
+        m_stride(data_num), m_inference_only(inference_only), m_owns_data(true)
     {
         /* memory allocation */
-        data = new float[DATA_COUNT * train_num * data_num];
+        data = new float[getArrayNum() * m_capacity * data_num];
+    }
+
+    LayerData::LayerData(size_t train_num, size_t data_num, float *activation)
+        : m_train_num(train_num), m_capacity(train_num), m_data_num(data_num),
+        m_stride(data_num), m_inference_only(true), m_owns_data(false), data(activation)
+    {
+    }
+
+    LayerData::LayerData(const LayerData& whole, size_t offset, size_t data_num)
+        : m_train_num(whole.m_train_num), m_capacity(whole.m_capacity),
+        m_data_num(data_num), m_stride(whole.m_stride),
+        m_inference_only(whole.m_inference_only), m_owns_data(false),
+        data(whole.data + offset)
+    {
+        if (offset + data_num > whole.m_data_num)
+            throw std::out_of_range("LayerData: the slice exceeds the whole data");
     }
 
     LayerData::~LayerData()
     {
-        delete [] data;
+        if (m_owns_data)
+            delete [] data;
     }
 
     LayerData::LayerData(const LayerData& other)
-        : m_train_num(other.m_train_num), m_data_num(other.m_data_num)
+        : m_owns_data(false), data(nullptr)
     {
-        const size_t data_size = DATA_COUNT * other.m_train_num * other.m_data_num;
-        data = new float[data_size];
-        for (size_t i = 0; i < data_size; i++)
-        {
-            data[i] = other.data[i];
-        }
+        copyFrom(other);
     }
 
     LayerData& LayerData::operator=(const LayerData& other)
     {
-        delete [] data;
+        if (this == &other)
+            return *this;
+
+        copyFrom(other);
+        return *this;
+    }
+
+    void LayerData::copyFrom(const LayerData& other)
+    {
+        if (m_owns_data)
+            delete [] data;
+
+        m_owns_data = true;
+        m_train_num = other.m_train_num;
+        m_capacity = other.m_capacity;
+        m_data_num = other.m_data_num;
+        m_stride = other.m_data_num;
+        m_inference_only = other.m_inference_only;
 
-        const size_t data_size = DATA_COUNT * other.m_train_num * other.m_data_num;
-        data = new float[data_size];
-        for (size_t i = 0; i < data_size; i++)
+        data = new float[getArrayNum() * m_capacity * m_data_num];
+        for (size_t idx = 0; idx < getArrayNum(); idx++)
         {
-            data[i] = other.data[i];
+            const float *src = other.data + idx * m_capacity * other.m_stride;
+            float *dst = data + idx * m_capacity * m_data_num;
+            for (size_t t = 0; t < m_capacity; t++)
+            {
+                for (size_t i = 0; i < m_data_num; i++)
+                    dst[t * m_data_num + i] = src[t * other.m_stride + i];
+            }
         }
-        return *this;
     }
 
     float *LayerData::get(LayerData::DataIndex idx) const
     {
-        return data + (static_cast<int>(idx) * m_train_num * m_data_num);
+        if (static_cast<size_t>(idx) >= getArrayNum())
+            return nullptr;
+        return data + (static_cast<int>(idx) * m_capacity * m_stride);
+    }
+
+    void LayerData::setTrainNum(size_t train_num)
+    {
+        if (train_num > m_capacity)
+            throw std::length_error("LayerData::setTrainNum(): exceeds the capacity");
+        m_train_num = train_num;
     }
 }
@@ -145,7 +145,8 @@ namespace NeuralNet
                     cast_cur_set.learn_rate,
                     cast_cur_set.enable_zero_pad,
                     cast_cur_set.uses_gpu,
-                    cast_cur_set.weight_decay
+                    cast_cur_set.weight_decay,
+                    cast_cur_set.engine
                 }),
                 ConvLayer::ActivationFunc::RELU
         );
@@ -169,7 +170,8 @@ namespace NeuralNet
                     cast_cur_set.learn_rate,
                     cast_cur_set.enable_zero_pad,
                     cast_cur_set.uses_gpu,
-                    cast_cur_set.weight_decay
+                    cast_cur_set.weight_decay,
+                    cast_cur_set.engine
                 }),
                 ConvLayer::ActivationFunc::RELU
         );
@@ -193,7 +195,8 @@ namespace NeuralNet
                     cast_cur_set.learn_rate,
                     cast_cur_set.enable_zero_pad,
                     cast_cur_set.uses_gpu,
-                    cast_cur_set.weight_decay
+                    cast_cur_set.weight_decay,
+                    cast_cur_set.engine
                 }),
                 ConvLayer::ActivationFunc::RELU
         );
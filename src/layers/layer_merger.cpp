@@ -1,4 +1,5 @@
 #include "layers/layer_merger.hpp"
+#include "layers/cl_buffer_layer_data.hpp"
 #include "utils/make_unique.hpp"
 #include "calc/calc-cpu.hpp"
 
@@ -36,35 +37,67 @@ namespace NeuralNet
     {
         const auto offset = m_cumul_idxes[key];
         const auto data_d = m_parent_sizes[key];
-        auto parent_a = parent_data.get(LayerData::DataIndex::ACTIVATION);
-        auto parent_z = parent_data.get(LayerData::DataIndex::INTER_VALUE);
+        const auto parent_stride = parent_data.getStride();
+        const auto this_stride = this_data.getStride();
+        auto parent_a = parent_data.getRead(LayerData::DataIndex::ACTIVATION);
+        auto parent_z = parent_data.getRead(LayerData::DataIndex::INTER_VALUE);
         auto this_a = this_data.get(LayerData::DataIndex::ACTIVATION);
         auto this_z = this_data.get(LayerData::DataIndex::INTER_VALUE);
 
-        copy_vec(parent_a, this_a + offset, data_d);
-        copy_vec(parent_z, this_z + offset, data_d);
+        for (size_t t = 0; t < this_data.getTrainNum(); t++)
+        {
+            copy_vec(parent_a + t * parent_stride, this_a + t * this_stride + offset, data_d);
+            if (this_z)
+            {
+                copy_vec(parent_z + t * parent_stride, this_z + t * this_stride + offset,
+                        data_d);
+            }
+        }
     }
 
     void LayerMerger::distribute(
             std::map< KeyType, LayerData* >& parent_datas,
             const LayerData& this_data)
     {
-        auto this_e = this_data.get(LayerData::DataIndex::ERROR);
+        const auto this_stride = this_data.getStride();
+        auto this_e = this_data.getRead(LayerData::DataIndex::ERROR);
 
         for (auto& data_pair: parent_datas)
         {
             auto offset = m_cumul_idxes[data_pair.first];
             auto data_d = m_parent_sizes[data_pair.first];
+            auto parent_stride = data_pair.second->getStride();
             auto parent_e = data_pair.second->get(LayerData::DataIndex::ERROR);
 
-            copy_vec(this_e + offset, parent_e, data_d);
+            for (size_t t = 0; t < this_data.getTrainNum(); t++)
+            {
+                copy_vec(this_e + t * this_stride + offset, parent_e + t * parent_stride,
+                        data_d);
+            }
         }
     }
 
-    std::unique_ptr<LayerData> LayerMerger::createLayerData(size_t train_num)
+    std::unique_ptr<LayerData> LayerMerger::createLayerData(size_t train_num,
+            bool inference_only, bool uses_gpu)
     {
+        if (uses_gpu)
+            return std::make_unique<CLBufferLayerData>(train_num, m_neuron_num,
+                    inference_only);
         return std::make_unique<LayerData>(
-                train_num, m_neuron_num
+                train_num, m_neuron_num, inference_only
         );
     }
+
+    std::unique_ptr<LayerData> LayerMerger::createParentData(const KeyType& key,
+            const LayerData& this_data)
+    {
+        auto *cl_data = dynamic_cast<const CLBufferLayerData *>(&this_data);
+        if (cl_data)
+        {
+            return std::make_unique<CLBufferLayerData>(*cl_data, m_cumul_idxes.at(key),
+                    m_parent_sizes.at(key));
+        }
+        return std::make_unique<LayerData>(this_data, m_cumul_idxes.at(key),
+                m_parent_sizes.at(key));
+    }
 }
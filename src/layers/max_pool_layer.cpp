@@ -1,9 +1,11 @@
 #include "layers/max_pool_layer.hpp"
 #include "layers/cl_layer_data.hpp"
 #include "layers/cl_image_layer_data.hpp"
+#include "layers/cl_buffer_layer_data.hpp"
 #include "calc/calc-cpu.hpp"
 #include "utils/cl_exception.hpp"
 #include "utils/make_unique.hpp"
+#include "utils/thread_pool.hpp"
 #include "cl_context.hpp"
 
 namespace NeuralNet
@@ -19,6 +21,8 @@ namespace NeuralNet
         {
             // create kernel
             m_fwd_kernel = cl::Kernel(CLContext::getInstance().getProgram(), "max_pool_forward");
+            m_infer_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "max_pool_forward_infer");
 
             int i_in_width = m_dim.image_width;
             int pool_width = m_dim.pool_width;
@@ -28,56 +32,109 @@ namespace NeuralNet
             m_fwd_kernel.setArg(5, sizeof(int), &pool_width);
             m_fwd_kernel.setArg(6, sizeof(int), &pool_height);
             m_fwd_kernel.setArg(7, sizeof(int), &stride);
+
+            // the inference kernel takes the activations alone
+            m_infer_kernel.setArg(2, sizeof(int), &i_in_width);
+            m_infer_kernel.setArg(3, sizeof(int), &pool_width);
+            m_infer_kernel.setArg(4, sizeof(int), &pool_height);
+            m_infer_kernel.setArg(5, sizeof(int), &stride);
+
+            int i_in_height = m_dim.image_height;
+            m_bwd_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "max_pool_backward");
+            m_bwd_kernel.setArg(3, sizeof(int), &i_in_width);
+            m_bwd_kernel.setArg(4, sizeof(int), &i_in_height);
+            m_bwd_kernel.setArg(5, sizeof(int), &pool_width);
+            m_bwd_kernel.setArg(6, sizeof(int), &pool_height);
+            m_bwd_kernel.setArg(7, sizeof(int), &stride);
+
+            // the buffer versions take in_height after in_width
+            m_fwd_buf_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "max_pool_forward_buf");
+            m_infer_buf_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "max_pool_forward_buf_infer");
+            m_bwd_buf_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "max_pool_backward_buf");
+            for (auto& arg_kernel: {std::make_pair(&m_fwd_buf_kernel, 4),
+                    std::make_pair(&m_infer_buf_kernel, 2), std::make_pair(&m_bwd_buf_kernel, 3)})
+            {
+                auto *kernel = arg_kernel.first;
+                const int base = arg_kernel.second;
+                kernel->setArg(base, sizeof(int), &i_in_width);
+                kernel->setArg(base + 1, sizeof(int), &i_in_height);
+                kernel->setArg(base + 2, sizeof(int), &pool_width);
+                kernel->setArg(base + 3, sizeof(int), &pool_height);
+                kernel->setArg(base + 4, sizeof(int), &stride);
+            }
         }
     }
 
     void MaxPoolLayer::forward_cpu(const LayerData& prev, LayerData& current)
     {
         auto train_num = current.getTrainNum();
-        auto prev_a = prev.get(LayerData::DataIndex::ACTIVATION);
-        auto prev_z = prev.get(LayerData::DataIndex::INTER_VALUE);
+        const auto cur_stride = current.getStride();
+        auto prev_a = prev.getRead(LayerData::DataIndex::ACTIVATION);
+        auto prev_z = prev.getRead(LayerData::DataIndex::INTER_VALUE);
         auto cur_a = current.get(LayerData::DataIndex::ACTIVATION);
         auto cur_z = current.get(LayerData::DataIndex::INTER_VALUE);
 
-        for (size_t i=0; i<train_num; i++)
-        {
-            for (size_t j=0; j<m_dim.map_num; j++)
+        // every (sample, map) pair is pooled independently
+        parallel_for(m_pool, 0, train_num * m_dim.map_num, [&](size_t begin, size_t end) {
+            for (size_t map = begin; map < end; map++)
             {
-                size_t back_offset = (i * m_dim.map_num + j)
-                        * (m_dim.image_width * m_dim.image_height);
-                size_t front_offset = (i * m_dim.map_num + j)
-                        * (m_output_width * m_output_height);
-                downsample_max(prev_z + back_offset, cur_z + front_offset,
-                        m_dim.image_width, m_dim.image_height,
-                        m_dim.pool_width, m_dim.pool_height, m_dim.stride);
+                size_t back_offset = map * (m_dim.image_width * m_dim.image_height);
+                size_t front_offset = (map / m_dim.map_num) * cur_stride
+                    + (map % m_dim.map_num) * (m_output_width * m_output_height);
+                if (cur_z)
+                {
+                    downsample_max(prev_z + back_offset, cur_z + front_offset,
+                            m_dim.image_width, m_dim.image_height,
+                            m_dim.pool_width, m_dim.pool_height, m_dim.stride);
+                }
                 downsample_max(prev_a + back_offset, cur_a + front_offset,
                         m_dim.image_width, m_dim.image_height,
                         m_dim.pool_width, m_dim.pool_height, m_dim.stride);
             }
-        }
+        });
     }
 
     void MaxPoolLayer::forward_gpu(const CLLayerData& prev, CLLayerData& current)
     {
-        auto m_buf_pa = prev.getCLMemory(
+        auto m_buf_pa = prev.readCL(
                 LayerData::DataIndex::ACTIVATION);
-        auto m_buf_pz = prev.getCLMemory(
-                LayerData::DataIndex::INTER_VALUE);
-        auto m_buf_ca = current.getCLMemory(
+        auto m_buf_ca = current.writeCL(
                 LayerData::DataIndex::ACTIVATION);
-        auto m_buf_cz = current.getCLMemory(
-                LayerData::DataIndex::INTER_VALUE);
-        m_fwd_kernel.setArg(0, m_buf_pz);
-        m_fwd_kernel.setArg(1, m_buf_pa);
-        m_fwd_kernel.setArg(2, m_buf_cz);
-        m_fwd_kernel.setArg(3, m_buf_ca);
+
+        // the maps of batches beyond the image limits are in buffers
+        const bool buffered = (dynamic_cast<const CLBufferLayerData *>(&current) != nullptr);
+
+        auto *kernel = buffered ? &m_fwd_buf_kernel : &m_fwd_kernel;
+        if (current.isInferenceOnly())
+        {
+            kernel = buffered ? &m_infer_buf_kernel : &m_infer_kernel;
+            kernel->setArg(0, m_buf_pa);
+            kernel->setArg(1, m_buf_ca);
+        }
+        else
+        {
+            auto m_buf_pz = prev.readCL(
+                    LayerData::DataIndex::INTER_VALUE);
+            auto m_buf_cz = current.writeCL(
+                    LayerData::DataIndex::INTER_VALUE);
+            kernel->setArg(0, m_buf_pz);
+            kernel->setArg(1, m_buf_pa);
+            kernel->setArg(2, m_buf_cz);
+            kernel->setArg(3, m_buf_ca);
+        }
 
         auto queue = CLContext::getInstance().getCommandQueue();
         cl_int err = CL_SUCCESS;
 
-        err = queue.enqueueNDRangeKernel(m_fwd_kernel, cl::NullRange,
+        // the kernels pool all lanes of a texel, i.e. four maps when packed
+        err = queue.enqueueNDRangeKernel(*kernel, cl::NullRange,
                 cl::NDRange(m_output_width * m_output_height,
-                    m_dim.map_num,
+                    buffered ? m_dim.map_num : CLImageLayerData::mapRows(m_dim.map_num,
+                        static_cast<const CLImageLayerData&>(current).getChannel()),
                     current.getTrainNum()),
                 cl::NullRange);
         printError(err, "Error at CommandQueue::enqueNDRangeKernel");
@@ -86,50 +143,76 @@ namespace NeuralNet
     void MaxPoolLayer::backward_cpu(LayerData& prev, LayerData& current)
     {
         auto train_num = current.getTrainNum();
+        const auto cur_stride = current.getStride();
         auto prev_e = prev.get(LayerData::DataIndex::ERROR);
-        auto prev_a = prev.get(LayerData::DataIndex::ACTIVATION);
-        auto cur_e = current.get(LayerData::DataIndex::ERROR);
+        auto prev_a = prev.getRead(LayerData::DataIndex::ACTIVATION);
+        auto cur_e = current.getRead(LayerData::DataIndex::ERROR);
 
-        for (size_t i=0; i<train_num; i++)
-        {
-            for (size_t j=0; j<m_dim.map_num; j++)
+        parallel_for(m_pool, 0, train_num * m_dim.map_num, [&](size_t begin, size_t end) {
+            for (size_t map = begin; map < end; map++)
             {
-                size_t back_offset = (i * m_dim.map_num + j)
-                        * (m_dim.image_width * m_dim.image_height);
-                size_t front_offset = (i * m_dim.map_num + j)
-                        * (m_output_width * m_output_height);
+                size_t back_offset = map * (m_dim.image_width * m_dim.image_height);
+                size_t front_offset = (map / m_dim.map_num) * cur_stride
+                    + (map % m_dim.map_num) * (m_output_width * m_output_height);
 
                 upsample_max(cur_e + front_offset, prev_a + back_offset,
                         prev_e + back_offset,
                         m_dim.image_width, m_dim.image_height,
                         m_dim.pool_width, m_dim.pool_height, m_dim.stride);
             }
-        }
+        });
     }
 
     void MaxPoolLayer::backward_gpu(CLLayerData& prev, CLLayerData& current)
     {
-        /* TODO: OpenCL intergration */
-        // not implemented yet, just use cpu temporarily
-        backward_cpu(prev, current);
+        cl::CommandQueue queue = CLContext::getInstance().getCommandQueue();
+        cl_int err = CL_SUCCESS;
+
+        const bool buffered = (dynamic_cast<const CLBufferLayerData *>(&current) != nullptr);
+        auto& kernel = buffered ? m_bwd_buf_kernel : m_bwd_kernel;
+        kernel.setArg(0, current.readCL(LayerData::DataIndex::ERROR));
+        kernel.setArg(1, prev.readCL(LayerData::DataIndex::ACTIVATION));
+        kernel.setArg(2, prev.writeCL(LayerData::DataIndex::ERROR));
+
+        // one work item per input pixel
+        err = queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                cl::NDRange(m_dim.image_width * m_dim.image_height,
+                    buffered ? m_dim.map_num : CLImageLayerData::mapRows(m_dim.map_num,
+                        static_cast<const CLImageLayerData&>(current).getChannel()),
+                    current.getTrainNum()),
+                cl::NullRange);
+        printError(err, "Error at CommandQueue::enqueNDRangeKernel");
     }
 
-    std::unique_ptr<LayerData> MaxPoolLayer::createLayerData(size_t train_num)
+    std::unique_ptr<LayerData> MaxPoolLayer::createLayerData(size_t train_num,
+            bool inference_only, bool maps_in_buffers)
     {
+        if (m_dim.uses_gpu && maps_in_buffers)
+        {
+            return std::make_unique<CLBufferLayerData>(
+                train_num, getNeuronNum(), inference_only);
+        }
         if (m_dim.uses_gpu)
         {
             return std::make_unique<CLImageLayerData>(
                 train_num,
                 m_output_width, m_output_height, m_dim.map_num,
-                CLImageLayerData::Channel::INTENSITY
+                CLImageLayerData::mapChannel(), inference_only
             );
         }
         return std::make_unique<LayerData>(
             train_num,
-            m_dim.map_num * m_output_width * m_output_height
+            m_dim.map_num * m_output_width * m_output_height,
+            inference_only
         );
     }
 
+    bool MaxPoolLayer::fitsImages(size_t train_num) const
+    {
+        return CLImageLayerData::holdsMaps(train_num, m_output_width, m_output_height,
+                m_dim.map_num, CLImageLayerData::mapChannel());
+    }
+
     size_t MaxPoolLayer::getNeuronNum() const
     {
         return m_dim.map_num * m_output_width * m_output_height;
@@ -1,10 +1,12 @@
 #include "layers/sigmoid_layer.hpp"
 #include "calc/calc-cpu.hpp"
-#include "calc/util-functions.hpp"
+#include "calc/gemm-cpu.hpp"
 #include "utils/make_unique.hpp"
+#include "utils/thread_pool.hpp"
 #include "utils/cl_exception.hpp"
 #include "cl_context.hpp"
 #include <cstring>
+#include <algorithm>
 #include <random>
 #include <cmath>
 
@@ -47,36 +49,82 @@ namespace NeuralNet
 
         if (m_uses_gpu)
         {
-            // initialize buffers
+            // the weights and the dropout mask stay on the device, where the
+            // backward kernels and sigmoid_dropout_mask update them
             cl::Context context = CLContext::getInstance().getContext();
-            cl::ImageFormat weight_fmt{CL_INTENSITY, CL_FLOAT};
-            cl_int err;
+            m_buf_w = cl::Buffer(context, CL_MEM_READ_WRITE,
+                    sizeof(float) * m_current_d * m_prev_d);
+            m_buf_b = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * m_current_d);
+            m_buf_do = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * m_current_d);
 
-            m_imgbuf_w = cl::Image2D(context, CL_MEM_READ_ONLY, weight_fmt,
-                    m_prev_d, m_current_d, 0, nullptr, &err);
-            printError(err, "m_imgbuf_w in SigmoidLayer");
-
-            m_buf_b = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float) * m_current_d);
-            m_buf_do = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float) * m_current_d);
-
-            // create kernel
+            // create kernel; the input and the batch size are set per batch
             m_fwd_kernel = cl::Kernel(CLContext::getInstance().getProgram(), "sigmoid_forward");
-            m_fwd_img_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
-                    "sigmoid_forward_img");
-
-            m_fwd_kernel.setArg(1, m_imgbuf_w);
-            m_fwd_kernel.setArg(2, m_buf_b);
-            m_fwd_kernel.setArg(5, m_buf_do);
-            m_fwd_img_kernel.setArg(1, m_imgbuf_w);
-            m_fwd_img_kernel.setArg(2, m_buf_b);
-            m_fwd_img_kernel.setArg(5, m_buf_do);
+            m_infer_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "sigmoid_forward_infer");
 
             int i_prev_d = static_cast<int>(m_prev_d);
             int i_cur_d = static_cast<int>(m_current_d);
+            m_fwd_kernel.setArg(1, m_buf_w);
+            m_fwd_kernel.setArg(2, m_buf_b);
+            m_fwd_kernel.setArg(5, m_buf_do);
             m_fwd_kernel.setArg(6, sizeof(int), &i_prev_d);
             m_fwd_kernel.setArg(7, sizeof(int), &i_cur_d);
-            m_fwd_img_kernel.setArg(6, sizeof(int), &i_prev_d);
-            m_fwd_img_kernel.setArg(7, sizeof(int), &i_cur_d);
+
+            // the inference kernel takes the same arguments without cur_z
+            m_infer_kernel.setArg(1, m_buf_w);
+            m_infer_kernel.setArg(2, m_buf_b);
+            m_infer_kernel.setArg(4, m_buf_do);
+            m_infer_kernel.setArg(5, sizeof(int), &i_prev_d);
+            m_infer_kernel.setArg(6, sizeof(int), &i_cur_d);
+
+            // work-groups are bounded by both kernels and by the local memory
+            auto device = CLContext::getInstance().getDevice();
+            m_max_group = std::min(
+                    m_fwd_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+                    m_infer_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+            m_local_mem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() - std::max(
+                    m_fwd_kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device),
+                    m_infer_kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device));
+
+            // backward kernels; the data and the learning rate are set per batch
+            m_bwd_err_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "sigmoid_backward_error");
+            m_bwd_err_img_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "sigmoid_backward_error_img");
+            m_bwd_err_packed_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "sigmoid_backward_error_packed");
+            for (auto *kernel: {&m_bwd_err_kernel, &m_bwd_err_img_kernel,
+                    &m_bwd_err_packed_kernel})
+            {
+                kernel->setArg(3, m_buf_w);
+                kernel->setArg(4, m_buf_do);
+                kernel->setArg(5, sizeof(int), &i_prev_d);
+                kernel->setArg(6, sizeof(int), &i_cur_d);
+            }
+
+            m_bwd_w_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "sigmoid_backward_weight");
+            m_bwd_w_img_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "sigmoid_backward_weight_img");
+            for (auto *kernel: {&m_bwd_w_kernel, &m_bwd_w_img_kernel})
+            {
+                kernel->setArg(2, m_buf_w);
+                kernel->setArg(3, m_buf_do);
+                kernel->setArg(4, sizeof(int), &i_prev_d);
+                kernel->setArg(5, sizeof(int), &i_cur_d);
+            }
+
+            m_bwd_b_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "sigmoid_backward_bias");
+            m_bwd_b_kernel.setArg(1, m_buf_b);
+            m_bwd_b_kernel.setArg(2, m_buf_do);
+            m_bwd_b_kernel.setArg(3, sizeof(int), &i_cur_d);
+
+            m_dropout_kernel = cl::Kernel(CLContext::getInstance().getProgram(),
+                    "sigmoid_dropout_mask");
+            m_dropout_kernel.setArg(0, m_buf_do);
+            m_dropout_kernel.setArg(2, sizeof(float), &m_dropout_rate);
+            m_dropout_seed = rd();
 
             refreshCLLayerInfo();
             updateDOBuffer();
@@ -91,104 +139,177 @@ namespace NeuralNet
         delete [] m_weight;
     }
 
+    namespace
+    {
+        /* finishes a (samples x neurons) block of z in place and writes the activation:
+         * z += bias, a = sigmoid(z) (* dropout coefficient). the samples of a start
+         * stride floats apart. without z, the GEMM writes into a, which is finished
+         * in place */
+        class FullyConnectedEpilogue: public GemmEpilogue
+        {
+        public:
+            FullyConnectedEpilogue(const float *bias, float *a, const float *dropout,
+                    size_t stride)
+                : m_bias(bias), m_a(a), m_dropout(dropout), m_stride(stride) {}
+
+            virtual void apply(float *c, size_t ldc, size_t row, size_t col,
+                    size_t rows, size_t cols) const
+            {
+                for (size_t r = 0; r < rows; r++)
+                {
+                    float *z = c + r*ldc;
+                    float *a = m_a + (row + r)*m_stride + col;
+                    bias_activate_vec(z, m_bias + col, (z == a) ? nullptr : z, a, cols,
+                            Activation::SIGMOID);
+                    if (m_dropout)
+                        pmul_vec(a, m_dropout + col, a, cols);
+                }
+            }
+
+        private:
+            const float *m_bias;
+            float *m_a;
+            const float *m_dropout;
+            size_t m_stride;
+        };
+
+        /* multiplies a (samples x neurons) block of the propagated error by
+         * sigmoid'(z) of the previous layer */
+        class SigmoidPrimeEpilogue: public GemmEpilogue
+        {
+        public:
+            SigmoidPrimeEpilogue(const float *z, size_t neurons)
+                : m_z(z), m_neurons(neurons) {}
+
+            virtual void apply(float *c, size_t ldc, size_t row, size_t col,
+                    size_t rows, size_t cols) const
+            {
+                for (size_t r = 0; r < rows; r++)
+                {
+                    float *e = c + r*ldc;
+                    const float *z = m_z + (row + r)*m_neurons + col;
+                    activation_prime_mul_vec(z, e, cols, Activation::SIGMOID);
+                }
+            }
+
+        private:
+            const float *m_z;
+            size_t m_neurons;
+        };
+    }
+
     void SigmoidLayer::forward_cpu(const LayerData& prev, LayerData& current)
     {
         /* TODO: data correctness check? */
 
         auto m_train_num = current.getTrainNum();
-        auto prev_a = prev.get(LayerData::DataIndex::ACTIVATION);
+        const auto cur_stride = current.getStride();
+        auto prev_a = prev.getRead(LayerData::DataIndex::ACTIVATION);
         auto cur_z = current.get(LayerData::DataIndex::INTER_VALUE);
         auto cur_a = current.get(LayerData::DataIndex::ACTIVATION);
 
-        for (size_t i=0; i<m_train_num; i++)
-        {
-            mul_mat_vec(m_weight, prev_a + (i*m_prev_d), cur_z + (i*m_current_d),
-                    m_current_d, m_prev_d);
-            add_vec(cur_z + (i*m_current_d), m_bias,
-                    cur_z + (i*m_current_d), m_current_d);
-        }
-        apply_vec(cur_z, cur_a, m_current_d * m_train_num, ActivationFuncs::f_sigmoid);
+        // inference-only data has no z, so the sums go to the activations
+        auto cur_sum = cur_z ? cur_z : cur_a;
 
         refreshDropout();
 
-        if (m_uses_dropout)
+        if (m_train_num > 1)
         {
-            for (size_t m = 0; m < m_train_num; m++)
-            {
-                pmul_vec(cur_a + (m_current_d*m), m_dropout_coeff,
-                        cur_a + (m_current_d*m), m_current_d);
-            }
+            /* (samples x prev) activations times the transposed (current x prev) weights;
+             * bias, sigmoid and dropout are applied to each block as it is finished */
+            FullyConnectedEpilogue epilogue(m_bias, cur_a,
+                    m_uses_dropout ? m_dropout_coeff : nullptr, cur_stride);
+            sgemm(false, true, m_train_num, m_current_d, m_prev_d,
+                    1.0f, prev_a, m_prev_d, m_weight, m_prev_d,
+                    0.0f, cur_sum, cur_stride, &epilogue, m_pool);
+            return;
         }
+
+        // a single sample: the rows of the weight matrix are split among the threads
+        parallel_for(m_pool, 0, m_current_d, [&](size_t row_begin, size_t row_end) {
+            mul_mat_vec(m_weight + row_begin * m_prev_d, prev_a, cur_sum + row_begin,
+                    row_end - row_begin, m_prev_d);
+        }, 16);
+        bias_activate_vec(cur_sum, m_bias, cur_z, cur_a, m_current_d, Activation::SIGMOID);
+
+        if (m_uses_dropout)
+            pmul_vec(cur_a, m_dropout_coeff, cur_a, m_current_d);
     }
 
     void SigmoidLayer::forward_gpu(const CLLayerData& prev, CLLayerData& current)
     {
-        auto* prev_ptr = &prev;
-        auto* current_ptr = &current;
-        auto* cbptr = dynamic_cast<CLBufferLayerData*>(current_ptr);
-        
-        if (cbptr)
+        refreshDropout();
+
+        const size_t train_num = current.getTrainNum();
+        auto* piptr = dynamic_cast<const CLImageLayerData*>(&prev);
+
+        // the maps of a previous conv or pooling layer are copied into rows first
+        cl::Memory buf_pa;
+        if (piptr)
         {
-            auto* pbptr = dynamic_cast<const CLBufferLayerData*>(prev_ptr);
-            auto* piptr = dynamic_cast<const CLImageLayerData*>(prev_ptr);
-            if (pbptr)
-            {
-                forward_gpu(*pbptr, *cbptr);
-            }
-            else if (piptr)
+            if (m_buf_pa_num < train_num)
             {
-                forward_gpu(*piptr, *cbptr);
+                m_buf_pa = cl::Buffer(CLContext::getInstance().getContext(),
+                        CL_MEM_READ_WRITE, sizeof(float) * m_prev_d * train_num);
+                m_buf_pa_num = train_num;
             }
+            piptr->copyToBuffer(LayerData::DataIndex::ACTIVATION, m_buf_pa);
+            buf_pa = m_buf_pa;
+        }
+        else
+        {
+            buf_pa = prev.readCL(LayerData::DataIndex::ACTIVATION);
         }
-    }
-
-    void SigmoidLayer::forward_gpu(const CLImageLayerData& prev,
-            CLBufferLayerData& current)
-    {
-        refreshDropout();
-
-        cl::CommandQueue queue = CLContext::getInstance().getCommandQueue();
 
-        auto m_buf_pa = prev.getCLMemory(
+        auto m_buf_ca = current.writeCL(
                 LayerData::DataIndex::ACTIVATION);
-        auto m_buf_cz = current.getCLMemory(
-                LayerData::DataIndex::INTER_VALUE);
-        auto m_buf_ca = current.getCLMemory(
-                LayerData::DataIndex::ACTIVATION);
-
-        m_fwd_img_kernel.setArg(0, m_buf_pa);
-        m_fwd_img_kernel.setArg(3, m_buf_cz);
-        m_fwd_img_kernel.setArg(4, m_buf_ca);
 
-        cl_int err = CL_SUCCESS;
-        err = queue.enqueueNDRangeKernel(m_fwd_img_kernel, cl::NullRange,
-                cl::NDRange(m_current_d, current.getTrainNum()),
-                cl::NullRange);
-        printError(err, "Error at CommandQueue::enqueNDRangeKernel");
-    }
+        auto *kernel = &m_fwd_kernel;
+        int local_arg = 11;
+        if (current.isInferenceOnly())
+        {
+            kernel = &m_infer_kernel;
+            kernel->setArg(0, buf_pa);
+            kernel->setArg(3, m_buf_ca);
+            local_arg = 10;
+        }
+        else
+        {
+            auto m_buf_cz = current.writeCL(
+                    LayerData::DataIndex::INTER_VALUE);
+            kernel->setArg(0, buf_pa);
+            kernel->setArg(3, m_buf_cz);
+            kernel->setArg(4, m_buf_ca);
+        }
 
-    void SigmoidLayer::forward_gpu(const CLBufferLayerData& prev,
-            CLBufferLayerData& current)
-    {
-        refreshDropout();
+        /* up to 16 samples per work-group and as many neurons as fit next to them,
+         * so a small batch still reads each weight row once per work-group */
+        size_t group_t = 1, group_c = 1;
+        while (group_t < std::min<size_t>(train_num, 16))
+            group_t *= 2;
+        while (group_c < m_current_d && group_c * group_t < 256)
+            group_c *= 2;
+
+        const size_t row_bytes = TILE_K4 * sizeof(cl_float4);
+        while (group_c > 1 && (group_c * group_t > m_max_group
+                    || (group_c + group_t) * row_bytes > m_local_mem))
+            group_c /= 2;
+        while (group_t > 1 && (group_c * group_t > m_max_group
+                    || (group_c + group_t) * row_bytes > m_local_mem))
+            group_t /= 2;
+
+        int i_train_num = static_cast<int>(train_num);
+        setCurrentRows(*kernel, local_arg - 3, current);
+        kernel->setArg(local_arg - 1, sizeof(int), &i_train_num);
+        kernel->setArg(local_arg, cl::Local(group_c * row_bytes));
+        kernel->setArg(local_arg + 1, cl::Local(group_t * row_bytes));
 
         cl::CommandQueue queue = CLContext::getInstance().getCommandQueue();
-
-        auto m_buf_pa = prev.getCLMemory(
-                LayerData::DataIndex::ACTIVATION);
-        auto m_buf_cz = current.getCLMemory(
-                LayerData::DataIndex::INTER_VALUE);
-        auto m_buf_ca = current.getCLMemory(
-                LayerData::DataIndex::ACTIVATION);
-
-        m_fwd_kernel.setArg(0, m_buf_pa);
-        m_fwd_kernel.setArg(3, m_buf_cz);
-        m_fwd_kernel.setArg(4, m_buf_ca);
-
         cl_int err = CL_SUCCESS;
-        err = queue.enqueueNDRangeKernel(m_fwd_kernel, cl::NullRange,
-                cl::NDRange(m_current_d, current.getTrainNum()),
-                cl::NullRange);
+        err = queue.enqueueNDRangeKernel(*kernel, cl::NullRange,
+                cl::NDRange((m_current_d + group_c - 1) / group_c * group_c,
+                    (train_num + group_t - 1) / group_t * group_t),
+                cl::NDRange(group_c, group_t));
         printError(err, "Error at CommandQueue::enqueNDRangeKernel");
     }
 
@@ -198,9 +319,10 @@ namespace NeuralNet
         const auto m_train_num = current.getTrainNum();
         const auto train_num = m_train_num;
         const auto learn_rate = m_learn_rate;
+        const auto cur_stride = current.getStride();
         auto prev_e = prev.get(LayerData::DataIndex::ERROR);
-        auto prev_z = prev.get(LayerData::DataIndex::INTER_VALUE);
-        auto prev_a = prev.get(LayerData::DataIndex::ACTIVATION);
+        auto prev_z = prev.getRead(LayerData::DataIndex::INTER_VALUE);
+        auto prev_a = prev.getRead(LayerData::DataIndex::ACTIVATION);
         auto cur_e = current.get(LayerData::DataIndex::ERROR);
 
         if (m_uses_dropout)
@@ -211,68 +333,105 @@ namespace NeuralNet
             {
                 for (size_t m = 0; m < train_num; m++)
                 {
-                    pmul_vec(cur_e + (m_current_d*m), m_dropout_coeff,
-                            cur_e + (m_current_d*m), m_current_d);
+                    pmul_vec(cur_e + (cur_stride*m), m_dropout_coeff,
+                            cur_e + (cur_stride*m), m_current_d);
                 }
             }
             else
             {
-                const_mul_vec(cur_e, m_dropout_rate, m_train_num * m_current_d);
+                for (size_t m = 0; m < train_num; m++)
+                    const_mul_vec(cur_e + (cur_stride*m), m_dropout_rate, m_current_d);
             }
         }
 
-        /* calculate error value for previous layer */
-        float *sprime_z = new float[m_prev_d * m_train_num];
-        apply_vec(prev_z, sprime_z, m_prev_d * m_train_num, ActivationFuncs::f_sigmoid_prime);
-
-        float *temp_w = new float[m_prev_d * m_current_d];
-        transpose_mat(m_weight, temp_w, m_current_d, m_prev_d);
-
-        for (size_t i=0; i<m_train_num; i++)
-        {
-            mul_mat_vec(temp_w, cur_e + (i*m_current_d), prev_e + (i*m_prev_d), m_prev_d, m_current_d);
-        }
-        pmul_vec(prev_e, sprime_z, prev_e, m_prev_d * m_train_num);
+        /* calculate error value for previous layer:
+         * prev_e = (cur_e * W) .* sigmoid'(prev_z), with the weights before the update */
+        SigmoidPrimeEpilogue epilogue(prev_z, m_prev_d);
+        sgemm(false, false, m_train_num, m_prev_d, m_current_d,
+                1.0f, cur_e, cur_stride, m_weight, m_prev_d,
+                0.0f, prev_e, m_prev_d, &epilogue, m_pool);
 
         /* calculate delta_b and update current bias */
-        float *delta_b = new float[m_current_d];
-
-        sum_vec(cur_e, delta_b, m_current_d, m_train_num);
-        apply_vec(delta_b, delta_b, m_current_d, [train_num, learn_rate](float in) -> float {
+        auto delta_b = getWorkspace(m_current_d);
+        sum_vec(cur_e, delta_b, m_current_d, m_train_num, cur_stride);
+        apply_vec(delta_b, delta_b, m_current_d,
+                [train_num, learn_rate](float in) -> float {
             return -in*learn_rate/train_num;
         });
         add_vec(m_bias, delta_b, m_bias, m_current_d);
 
-        // add decay term
-        const_mul_vec(m_weight, 1.0 - m_learn_rate * m_weight_decay, m_prev_d * m_current_d);
+        /* update current weight with the decay term and delta_w in one pass:
+         * W = (1 - lr*decay) * W - (lr/train_num) * cur_e^T * prev_a */
+        sgemm(true, false, m_current_d, m_prev_d, m_train_num,
+                -learn_rate / train_num, cur_e, cur_stride, prev_a, m_prev_d,
+                1.0 - m_learn_rate * m_weight_decay, m_weight, m_prev_d,
+                nullptr, m_pool);
+    }
 
-        /* calculate delta_w and update current weight */
-        float *delta_w = new float[m_prev_d * m_current_d];
-        memset(delta_w, 0, sizeof(float) * m_prev_d * m_current_d);
+    void SigmoidLayer::backward_gpu(CLLayerData& prev, CLLayerData& current)
+    {
+        cl::CommandQueue queue = CLContext::getInstance().getCommandQueue();
+        cl_int err = CL_SUCCESS;
 
-        for (size_t i=0; i<m_train_num; i++)
+        const int train_num = current.getTrainNum();
+        const float rate = -m_learn_rate / train_num;
+        const float decay = 1.0 - m_learn_rate * m_weight_decay;
+
+        // the previous layer is either fully-connected or one of maps
+        auto *piptr = dynamic_cast<CLImageLayerData *>(&prev);
+        const bool prev_img = (piptr != nullptr);
+        const bool prev_packed = prev_img
+            && piptr->getChannel() == CLImageLayerData::Channel::RGBA;
+        auto buf_ce = current.readCL(LayerData::DataIndex::ERROR);
+
+        // error value for the previous layer, with the weights before the update;
+        // packed maps are written a texel of four maps at a time
+        auto& err_kernel = prev_packed ? m_bwd_err_packed_kernel
+            : (prev_img ? m_bwd_err_img_kernel : m_bwd_err_kernel);
+        err_kernel.setArg(0, buf_ce);
+        err_kernel.setArg(1, prev.readCL(LayerData::DataIndex::INTER_VALUE));
+        err_kernel.setArg(2, prev.writeCL(LayerData::DataIndex::ERROR));
+        setCurrentRows(err_kernel, 7, current);
+        cl::NDRange err_range(m_prev_d, train_num);
+        if (prev_packed)
         {
-            vec_outer_prod(cur_e, prev_a, temp_w, m_current_d, m_prev_d);
-            add_vec(delta_w, temp_w, delta_w, m_prev_d * m_current_d);
+            const size_t area = piptr->getDataNum() / piptr->getMapNum();
+            err_range = cl::NDRange(area, CLImageLayerData::mapRows(piptr->getMapNum(),
+                        CLImageLayerData::Channel::RGBA), train_num);
         }
-        apply_vec(delta_w, delta_w, m_prev_d * m_current_d, [train_num, learn_rate](float in) -> float {
-            return -in*learn_rate/train_num;
-        });
-        add_vec(m_weight, delta_w, m_weight, m_prev_d * m_current_d);
+        err = queue.enqueueNDRangeKernel(err_kernel, cl::NullRange, err_range,
+                cl::NullRange);
+        printError(err, "Error at CommandQueue::enqueNDRangeKernel");
 
+        // delta_w with the decay term, then delta_b
+        auto& w_kernel = prev_img ? m_bwd_w_img_kernel : m_bwd_w_kernel;
+        w_kernel.setArg(0, buf_ce);
+        w_kernel.setArg(1, prev.readCL(LayerData::DataIndex::ACTIVATION));
+        setCurrentRows(w_kernel, 6, current);
+        w_kernel.setArg(8, sizeof(int), &train_num);
+        w_kernel.setArg(9, sizeof(float), &rate);
+        w_kernel.setArg(10, sizeof(float), &decay);
+        err = queue.enqueueNDRangeKernel(w_kernel, cl::NullRange,
+                cl::NDRange(m_prev_d, m_current_d), cl::NullRange);
+        printError(err, "Error at CommandQueue::enqueNDRangeKernel");
 
-        delete [] delta_w;
-        delete [] delta_b;
-        delete [] temp_w;
-        delete [] sprime_z;
+        m_bwd_b_kernel.setArg(0, buf_ce);
+        setCurrentRows(m_bwd_b_kernel, 4, current);
+        m_bwd_b_kernel.setArg(6, sizeof(int), &train_num);
+        m_bwd_b_kernel.setArg(7, sizeof(float), &rate);
+        err = queue.enqueueNDRangeKernel(m_bwd_b_kernel, cl::NullRange,
+                cl::NDRange(m_current_d), cl::NullRange);
+        printError(err, "Error at CommandQueue::enqueNDRangeKernel");
     }
 
-    void SigmoidLayer::backward_gpu(CLLayerData& prev, CLLayerData& current)
+    void SigmoidLayer::setCurrentRows(cl::Kernel& kernel, cl_uint arg,
+            const CLLayerData& current)
     {
-        /* TODO */
-        // not implemented yet, just use cpu temporarily
-        backward_cpu(prev, current);
-        refreshCLLayerInfo();
+        auto *cbptr = dynamic_cast<const CLBufferLayerData *>(&current);
+        int cur_off = cbptr ? static_cast<int>(cbptr->getOffset()) : 0;
+        int cur_ld = static_cast<int>(current.getStride());
+        kernel.setArg(arg, sizeof(int), &cur_off);
+        kernel.setArg(arg + 1, sizeof(int), &cur_ld);
     }
 
     void SigmoidLayer::setDropout(bool enable)
@@ -298,7 +457,18 @@ namespace NeuralNet
 
     void SigmoidLayer::refreshDropout()
     {
-        if (m_uses_dropout && m_dropout_enabled)
+        if (m_uses_dropout && m_dropout_enabled && m_uses_gpu)
+        {
+            // a new mask on the device, from the next seed
+            cl::CommandQueue queue = CLContext::getInstance().getCommandQueue();
+            cl_uint seed = m_dropout_seed++;
+            m_dropout_kernel.setArg(1, sizeof(cl_uint), &seed);
+
+            cl_int err = queue.enqueueNDRangeKernel(m_dropout_kernel, cl::NullRange,
+                    cl::NDRange(m_current_d), cl::NullRange);
+            printError(err, "Error at CommandQueue::enqueNDRangeKernel");
+        }
+        else if (m_uses_dropout && m_dropout_enabled)
         {
             std::random_device rd;
             std::mt19937 rgen(rd());
@@ -335,14 +505,9 @@ namespace NeuralNet
             cl::CommandQueue queue = CLContext::getInstance().getCommandQueue();
             cl_int err = CL_SUCCESS;
 
-            cl::size_t<3> in_offset, in_region;
-            in_region[0] = m_prev_d;
-            in_region[1] = m_current_d;
-            in_region[2] = 1;
-
-            err = queue.enqueueWriteImage(m_imgbuf_w, CL_TRUE, in_offset,
-                    in_region, 0, 0, m_weight);
-            printError(err, "Error at CommandQueue::enqueWriteBuffer for m_imgbuf_w");
+            err = queue.enqueueWriteBuffer(m_buf_w, CL_TRUE, 0,
+                    sizeof(float) * m_current_d * m_prev_d, m_weight);
+            printError(err, "Error at CommandQueue::enqueWriteBuffer for m_buf_w");
             
             err = queue.enqueueWriteBuffer(m_buf_b, CL_TRUE, 0, sizeof(float) * m_current_d,
                     m_bias);
@@ -350,18 +515,38 @@ namespace NeuralNet
         }
     }
 
-    std::unique_ptr<LayerData> SigmoidLayer::createLayerData(size_t train_num)
+    void SigmoidLayer::fetchCLLayerInfo()
+    {
+        if (m_uses_gpu)
+        {
+            cl::CommandQueue queue = CLContext::getInstance().getCommandQueue();
+            cl_int err = CL_SUCCESS;
+
+            err = queue.enqueueReadBuffer(m_buf_w, CL_TRUE, 0,
+                    sizeof(float) * m_current_d * m_prev_d, m_weight);
+            printError(err, "Error at CommandQueue::enqueReadBuffer for m_buf_w");
+
+            err = queue.enqueueReadBuffer(m_buf_b, CL_TRUE, 0, sizeof(float) * m_current_d,
+                    m_bias);
+            printError(err, "Error at CommandQueue::enqueReadBuffer for m_buf_b");
+        }
+    }
+
+    std::unique_ptr<LayerData> SigmoidLayer::createLayerData(size_t train_num,
+            bool inference_only, bool maps_in_buffers)
     {
         if (m_uses_gpu)
         {
             return std::make_unique<CLBufferLayerData>(
                     train_num,
-                    m_current_d
+                    m_current_d,
+                    inference_only
             );
         }
         return std::make_unique<LayerData>(
             train_num,
-            m_current_d
+            m_current_d,
+            inference_only
         );
     }
 
@@ -397,6 +582,9 @@ namespace NeuralNet
 
     Json::Value SigmoidLayer::exportLayer()
     {
+        // the device holds the trained coefficients
+        fetchCLLayerInfo();
+
         Json::Value coeff_value(Json::objectValue);
         coeff_value["neurons"] = Json::Value(static_cast<Json::UInt>(m_current_d));
 
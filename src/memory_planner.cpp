@@ -0,0 +1,68 @@
+#include "memory_planner.hpp"
+#include <algorithm>
+#include <limits>
+
+namespace NeuralNet
+{
+    size_t MemoryPlanner::addBuffer(size_t size, size_t first_step, size_t last_step)
+    {
+        m_buffers.push_back(Buffer{size, first_step, std::max(first_step, last_step), 0});
+        return m_buffers.size() - 1;
+    }
+
+    void MemoryPlanner::plan()
+    {
+        std::vector<size_t> order(m_buffers.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [this](size_t b1, size_t b2) {
+            return m_buffers[b1].size > m_buffers[b2].size;
+        });
+
+        m_arena_size = 0;
+        std::vector<size_t> placed;
+        for (auto idx: order)
+        {
+            auto& buf = m_buffers[idx];
+
+            // the placed buffers which are live together with this one, by offset
+            std::vector<const Buffer *> conflicts;
+            for (auto other_idx: placed)
+            {
+                const auto& other = m_buffers[other_idx];
+                if (other.first_step <= buf.last_step && buf.first_step <= other.last_step)
+                    conflicts.push_back(&other);
+            }
+            std::sort(conflicts.begin(), conflicts.end(),
+                    [](const Buffer *b1, const Buffer *b2) { return b1->offset < b2->offset; });
+
+            // the smallest gap between them which is large enough, or the end
+            size_t best_offset = 0, best_gap = std::numeric_limits<size_t>::max();
+            size_t gap_begin = 0;
+            bool found = false;
+            for (auto other: conflicts)
+            {
+                if (other->offset >= gap_begin + buf.size
+                        && other->offset - gap_begin < best_gap)
+                {
+                    best_offset = gap_begin;
+                    best_gap = other->offset - gap_begin;
+                    found = true;
+                }
+                gap_begin = std::max(gap_begin, other->offset + other->size);
+            }
+            buf.offset = found ? best_offset : gap_begin;
+
+            m_arena_size = std::max(m_arena_size, buf.offset + buf.size);
+            placed.push_back(idx);
+        }
+    }
+
+    size_t MemoryPlanner::getTotalBufferSize() const
+    {
+        size_t total = 0;
+        for (auto& buf: m_buffers)
+            total += buf.size;
+        return total;
+    }
+}
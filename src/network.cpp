@@ -8,15 +8,23 @@
 #include <cstring>
 #include <random>
 #include <cmath>
+#include <numeric>
+#include <mutex>
+#include <condition_variable>
 #include "network.hpp"
+#include "memory_planner.hpp"
+#include "cl_context.hpp"
 #include "calc/calc-cpu.hpp"
-#include "calc/util-functions.hpp"
+#include "calc/gemm-cpu.hpp"
+#include "layers/cl_bound_layer_data.hpp"
 #include "layers/cl_buffer_layer_data.hpp"
 #include "layers/cl_image_layer_data.hpp"
 #include "layers/layer_factory.hpp"
 #include "layers/sigmoid_layer.hpp"
 #include "layers/layer_merger.hpp"
 #include "utils/make_unique.hpp"
+#include "utils/thread_pool.hpp"
+#include "utils/cl_exception.hpp"
 
 namespace NeuralNet
 {
@@ -65,6 +73,10 @@ namespace NeuralNet
 
         m_max_eval_patch = setting["max_eval_patch"].asUInt();
 
+        // two chunks in flight by default, so transfers overlap the kernels
+        auto slots_value = setting["eval_slots"];
+        m_eval_slot_num = slots_value.isNull() ? 2 : std::max(1u, slots_value.asUInt());
+
         // learn rate setting
         m_learn_rate = setting["learn_rate"].asDouble();
 
@@ -79,8 +91,17 @@ namespace NeuralNet
                 lr_drop_value["halt_thresh_rate"].asDouble();
         }
 
+        // threads for the CPU layers; all hardware threads by default
+        m_thread_pool = std::make_unique<ThreadPool>(setting["thread_num"].asUInt());
+
         // additional learning setting
         m_uses_gpu = setting["uses_gpu"].asBool();
+        m_maps_in_buffers = false;
+
+        /* the GEMM packing buffers of every thread exist up front, so the passes
+         * never allocate them, whichever threads their chunks land on */
+        if (!m_uses_gpu)
+            m_thread_pool->forEachThread([](size_t, size_t) { prepare_sgemm_buffers(); });
         auto wd_value = setting["weight_decay"];
         if (!wd_value.isNull())
         {
@@ -160,6 +181,14 @@ namespace NeuralNet
                 return (id1 < id2);
             }
         );
+
+        sortNodes();
+        for (auto& node_pair: node_map)
+        {
+            auto* sigmoid_ptr = dynamic_cast<SigmoidLayer *>(node_pair.second->layer.get());
+            if (sigmoid_ptr)
+                m_sigmoid_layers.push_back(sigmoid_ptr);
+        }
     }
 
     // the given setting may be "moved"
@@ -202,6 +231,9 @@ namespace NeuralNet
             else
             {
                 // update the merger node
+                auto& prev_id = merger_map[child_id]->prev_id;
+                if (std::find(prev_id.begin(), prev_id.end(), id) == prev_id.end())
+                    prev_id.push_back(id);
                 merger_map[child_id]->merger->add(id,
                         node_map[id]->layer->getNeuronNum());
 
@@ -251,12 +283,22 @@ namespace NeuralNet
             bool zeropad = layer_dim["enable_zero_pad"].asBool();
             size_t input_w = 0, input_h = 0;
 
+            // convolution engine of the CPU path; "direct" by default
+            auto engine = ConvLayer::Engine::DIRECT;
+            auto engine_str = layer_dim["engine"].asString();
+            if (!engine_str.compare("gemm"))
+                engine = ConvLayer::Engine::GEMM;
+            else if (!engine_str.compare("winograd"))
+                engine = ConvLayer::Engine::WINOGRAD;
+            else if (!engine_str.empty() && engine_str.compare("direct"))
+                throw Json::LogicError("invalid convolution engine string");
+
             LayerFactory::getInstance().getOutputDimension(prevSetting[layer_id].get(),
                     input_w, input_h);
 
             cur_setting = std::make_unique<LayerFactory::ConvLayerSetting>(maps,
                     recep, input_w, input_h, m_learn_rate, zeropad, m_uses_gpu,
-                    m_weight_decay);
+                    m_weight_decay, engine);
         }
         else if (!layer_type.compare("maxpool"))
         {
@@ -278,6 +320,7 @@ namespace NeuralNet
 
         node_map[layer_id]->layer = LayerFactory::getInstance().makeLayer(
                 prevSetting[layer_id].get(), cur_setting.get());
+        node_map[layer_id]->layer->setThreadPool(m_thread_pool.get());
 
         for (auto& id: node_map[layer_id]->next_id)
         {
@@ -285,6 +328,20 @@ namespace NeuralNet
         }
     }
 
+    Network::MergerNode *Network::getInPlaceMerger(const NodeID& id) const
+    {
+        auto& next_id = node_map.at(id)->next_id;
+        if (next_id.size() != 1)
+            return nullptr;
+
+        // on the device, only the kernels of sigmoid layers write into slices
+        if (m_uses_gpu && !dynamic_cast<SigmoidLayer *>(node_map.at(id)->layer.get()))
+            return nullptr;
+
+        auto it = merger_map.find(next_id[0]);
+        return (it == merger_map.end()) ? nullptr : it->second.get();
+    }
+
     /* returns itself if the given node ID indicates the root node
      * returns -1 if an invalid id is given
      */
@@ -386,51 +443,240 @@ namespace NeuralNet
             throw NetworkException("evaluate(): size of data does not match with that "
                     "of the network");
         }
-        size_t num_data = data.size() / m_unit_size;
+        return evaluateAll(InputSpan{data.data(), data.size() / m_unit_size, m_unit_size});
+    }
+
+    std::vector< std::vector<int> > Network::evaluateAll(const InputSpan& input)
+    {
+        if (input.stride < m_unit_size)
+        {
+            throw NetworkException("evaluateAll(): stride of the input is smaller than "
+                    "the size of data of the network");
+        }
 
         // disable dropout of sigmoid layers for evaluation
-        for (auto& node_pair: node_map)
+        setDropout(false);
+
+        if (m_uses_gpu && m_eval_slot_num > 1 && input.num > m_max_eval_patch)
+            return evaluatePipelined(input);
+
+        std::vector< std::vector<int> > retval(m_leaf_idx.size());
+        for (auto& categories: retval)
+            categories.reserve(input.num);
+
+        for (size_t idx_d = 0; idx_d < input.num; idx_d += m_max_eval_patch)
         {
-            auto* layer_ptr = node_pair.second->layer.get();
-            auto* sigmoid_ptr = dynamic_cast<SigmoidLayer *>(layer_ptr);
-            if (sigmoid_ptr)
+            size_t test_data_num = std::min(m_max_eval_patch, input.num - idx_d);
+            const float *chunk = input.data + idx_d * input.stride;
+
+            // only the activations are read back, so no z or error storage is needed
+            prepareLayerData(test_data_num, true);
+
+            if (!m_uses_gpu && input.stride == m_unit_size)
             {
-                sigmoid_ptr->setDropout(false);
+                // the first layers only read their input, so it is bound in place
+                LayerData bound_input(test_data_num, m_unit_size,
+                        const_cast<float *>(chunk));
+                feedForward(bound_input);
             }
+            else
+            {
+                auto input_a = m_input_data->get(LayerData::DataIndex::ACTIVATION);
+                for (size_t i = 0; i < test_data_num; i++)
+                {
+                    copy_vec(chunk + i * input.stride, input_a + i * m_unit_size,
+                            m_unit_size);
+                }
+
+                feedForward(*m_input_data);
+            }
+
+            appendCategories(retval);
         }
 
-        std::vector< std::vector<int> > retval(m_leaf_idx.size());
-        for (size_t idx_d = 0; idx_d < num_data; idx_d += m_max_eval_patch)
-        {
-            size_t test_data_num = std::min(m_max_eval_patch, num_data - idx_d);
+        return retval;
+    }
+
+    std::vector< std::vector<int> > Network::evaluatePipelined(const InputSpan& input)
+    {
+        auto queue = CLContext::getInstance().getCommandQueue();
+        auto transfer = CLContext::getInstance().getTransferQueue();
+        cl_int err = CL_SUCCESS;
 
-            std::vector<size_t> lst_idxes;
-            for (size_t i = idx_d; i < idx_d + test_data_num; i++)
+        const size_t chunk_num = (input.num + m_max_eval_patch - 1) / m_max_eval_patch;
+        prepareLayerData(m_max_eval_patch, true);
+        prepareEvalSlots(m_max_eval_patch);
+
+        std::vector< std::vector<int> > retval(m_leaf_idx.size());
+        for (auto& categories: retval)
+            categories.reserve(input.num);
+
+        auto chunk_size = [&](size_t c) {
+            return std::min(m_max_eval_patch, input.num - c * m_max_eval_patch);
+        };
+
+        /* uploads chunk c into its slot, once the forward pass of the slot's last
+         * chunk is done with the input */
+        auto upload = [&](size_t c) {
+            auto& slot = m_eval_slots[c % m_eval_slots.size()];
+            if (slot.uploaded())
+                slot.uploaded.wait();
+
+            slot.num = chunk_size(c);
+            slot.input->setTrainNum(slot.num);
+            const float *chunk = input.data + c * m_max_eval_patch * input.stride;
+            auto input_a = slot.input->get(LayerData::DataIndex::ACTIVATION);
+            for (size_t i = 0; i < slot.num; i++)
+                copy_vec(chunk + i * input.stride, input_a + i * m_unit_size, m_unit_size);
+
+            if (slot.computed())
             {
-                lst_idxes.push_back(i);
+                std::vector<cl::Event> wait{slot.computed};
+                err = transfer.enqueueBarrierWithWaitList(&wait);
+                printError(err, "Error at CommandQueue::enqueueBarrierWithWaitList");
             }
 
-            prepareLayerData(test_data_num);
-            feedForward(data, lst_idxes);
+            auto& cl_input = dynamic_cast<CLLayerData&>(*slot.input);
+            slot.uploaded = cl_input.loadToCLAsync(LayerData::DataIndex::ACTIVATION,
+                    transfer);
+            transfer.flush();
+        };
+
+        // forwards chunk c after its upload, once the slot's last chunk has been read
+        auto compute = [&](size_t c) {
+            auto& slot = m_eval_slots[c % m_eval_slots.size()];
+            prepareLayerData(slot.num, true);
+
+            std::vector<cl::Event> wait(slot.read);
+            if (slot.uploaded())
+                wait.push_back(slot.uploaded);
+            if (!wait.empty())
+            {
+                err = queue.enqueueBarrierWithWaitList(&wait);
+                printError(err, "Error at CommandQueue::enqueueBarrierWithWaitList");
+            }
 
-            // return value generation
+            feedForward(*slot.input);
             for (size_t i = 0; i < m_leaf_idx.size(); i++)
             {
-                auto* cl_data_ptr = dynamic_cast<CLLayerData *>(node_map[m_leaf_idx[i]]->data.get());
-                if (cl_data_ptr)
-                {
-                    cl_data_ptr->getFromCL(LayerData::DataIndex::ACTIVATION);
-                }
+                auto& leaf = dynamic_cast<CLLayerData&>(*node_map[m_leaf_idx[i]]->data);
+                leaf.copyToBuffer(LayerData::DataIndex::ACTIVATION, slot.out_bufs[i]);
+            }
+            err = queue.enqueueMarkerWithWaitList(nullptr, &slot.computed);
+            printError(err, "Error at CommandQueue::enqueueMarkerWithWaitList");
+            queue.flush();
+        };
+
+        // reads the outputs of chunk c back after its forward pass
+        auto read_back = [&](size_t c) {
+            auto& slot = m_eval_slots[c % m_eval_slots.size()];
+            std::vector<cl::Event> computed{slot.computed};
+            slot.read.resize(m_leaf_idx.size());
+            for (size_t i = 0; i < m_leaf_idx.size(); i++)
+            {
+                const size_t leaf_size = node_map[m_leaf_idx[i]]->data->getDataNum();
+                err = transfer.enqueueReadBuffer(slot.out_bufs[i], CL_FALSE, 0,
+                        sizeof(float) * chunk_size(c) * leaf_size, slot.out_vals[i].data(),
+                        &computed, &slot.read[i]);
+                printError(err, "Error at CommandQueue::enqueueReadBuffer");
+            }
+            transfer.flush();
+        };
+
+        /* appends the categories of chunk c once its outputs are on the host. the
+         * upload of a later chunk may have taken the slot's input already, so the
+         * size of the chunk is not that of the slot */
+        auto collect = [&](size_t c) {
+            auto& slot = m_eval_slots[c % m_eval_slots.size()];
+            cl::Event::waitForEvents(slot.read);
+            for (size_t i = 0; i < m_leaf_idx.size(); i++)
+            {
+                LayerData out(chunk_size(c), node_map[m_leaf_idx[i]]->data->getDataNum(),
+                        slot.out_vals[i].data());
+                getCategory(out, retval[i]);
+            }
+        };
+
+        /* the next upload is queued before the readback of the current chunk, so the
+         * transfer queue works on both while the following chunk is forwarded. the
+         * host takes the categories as late as the slots allow */
+        const size_t lag = m_eval_slots.size() - 1;
+        upload(0);
+        for (size_t c = 0; c < chunk_num; c++)
+        {
+            compute(c);
+            if (c + 1 < chunk_num)
+                upload(c + 1);
+            read_back(c);
+            if (c >= lag)
+                collect(c - lag);
+        }
+        for (size_t c = (chunk_num > lag) ? chunk_num - lag : 0; c < chunk_num; c++)
+            collect(c);
+
+        return retval;
+    }
 
-                auto category_list = getCategory(*(node_map[m_leaf_idx[i]]->data));
-                retval[i].insert(retval[i].end(), category_list.begin(),
-                        category_list.end());
+    void Network::prepareEvalSlots(size_t train_num)
+    {
+        if (!m_eval_slots.empty() && m_eval_slots[0].input->getCapacity() >= train_num)
+            return;
+
+        auto context = CLContext::getInstance().getContext();
+        m_eval_slots.clear();
+        m_eval_slots.resize(m_eval_slot_num);
+        for (auto& slot: m_eval_slots)
+        {
+            slot.input = createInputData(train_num, true);
+            for (auto& leaf_id: m_leaf_idx)
+            {
+                const size_t leaf_size = node_map[leaf_id]->data->getDataNum();
+                slot.out_bufs.emplace_back(context, CL_MEM_WRITE_ONLY,
+                        sizeof(float) * train_num * leaf_size);
+                slot.out_vals.emplace_back(train_num * leaf_size);
             }
+            slot.num = 0;
         }
+    }
+
+    std::vector< std::vector<int> > Network::evaluateAll(const cl::Memory& input,
+            size_t num_data)
+    {
+        if (!m_uses_gpu)
+            throw NetworkException("evaluateAll(): OpenCL input needs uses_gpu");
+
+        setDropout(false);
+
+        std::vector< std::vector<int> > retval(m_leaf_idx.size());
+
+        /* the memory object holds the whole batch, so it is forwarded at once. it is
+         * laid out for num_data samples alone, which data kept for a larger batch
+         * may not be */
+        if (m_input_data && m_maps_in_buffers != mapsInBuffers(num_data))
+            m_input_data.reset();
+        prepareLayerData(num_data, true);
+        CLBoundLayerData bound_input(num_data, m_unit_size, input);
+        feedForward(bound_input);
+        appendCategories(retval);
 
         return retval;
     }
 
+    void Network::appendCategories(std::vector< std::vector<int> >& categories)
+    {
+        for (size_t i = 0; i < m_leaf_idx.size(); i++)
+        {
+            // CLLayerData downloads the activations when getCategory() reads them
+            getCategory(*(node_map[m_leaf_idx[i]]->data), categories[i]);
+        }
+    }
+
+    void Network::setDropout(bool enable)
+    {
+        for (auto* sigmoid_ptr: m_sigmoid_layers)
+            sigmoid_ptr->setDropout(enable);
+    }
+
     // evaluate for a single data
     std::vector<int> Network::evaluate(const std::vector<float>& data)
     {
@@ -467,26 +713,105 @@ namespace NeuralNet
                     m_unit_size);
         }
 
-        auto* cl_data_ptr = dynamic_cast<CLLayerData *>(m_input_data.get());
-        if (cl_data_ptr)
+        // uploaded by the first kernel reading it
+        feedForward(*m_input_data);
+    }
+
+    void Network::feedForward(const LayerData& input)
+    {
+        if (m_uses_gpu)
         {
-            cl_data_ptr->loadToCL(LayerData::DataIndex::ACTIVATION);
+            /* the kernels of all steps go to the one in-order queue in plan order,
+             * without the host waiting in between; branches do not overlap on the
+             * device */
+            auto& cl_input = dynamic_cast<const CLLayerData&>(input);
+            for (auto& step: m_plan)
+            {
+                if (step.merger)
+                {
+                    for (auto& parent: step.merge_parents)
+                        step.merger->assign(parent.first, *parent.second, *step.prev);
+                }
+                step.layer->forward(step.cl_prev ? *step.cl_prev : cl_input, *step.cl_data);
+            }
+            return;
         }
 
-        // forward the input
-        for (auto& node_pair: node_map)
+        auto forward_step = [&input](PlanStep& step) {
+            if (step.merger)
+            {
+                for (auto& parent: step.merge_parents)
+                    step.merger->assign(parent.first, *parent.second, *step.prev);
+            }
+            step.layer->forward(step.prev ? *step.prev : input, *step.data);
+        };
+
+        // a chain of layers runs in plan order; the layers split their own loops
+        if (m_lane_num == 1)
         {
-            feedForwardLayer(node_pair.first);
+            for (auto& step: m_plan)
+                forward_step(step);
+            return;
         }
+
+        /* m_lane_num threads of the pool take the ready steps, and each finished step
+         * releases the ones which only waited for it, so a branch never waits for a
+         * slower one at the same depth of the graph */
+        std::mutex mutex;
+        std::condition_variable ready_cv;
+        size_t next_ready = 0, done = 0;
+        bool failed = false;
+
+        m_ready.clear();
+        for (size_t i = 0; i < m_plan.size(); i++)
+        {
+            m_pending[i] = m_plan[i].dependency_num;
+            if (m_pending[i] == 0)
+                m_ready.push_back(i);
+        }
+
+        parallel_for(m_thread_pool.get(), 0, m_lane_num, [&](size_t, size_t) {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                ready_cv.wait(lock, [&]() {
+                    return next_ready < m_ready.size() || done == m_plan.size() || failed;
+                });
+                if (done == m_plan.size() || failed)
+                    return;
+
+                // in the order the steps became ready; each one is queued once
+                const size_t s = m_ready[next_ready++];
+                lock.unlock();
+                try
+                {
+                    forward_step(m_plan[s]);
+                }
+                catch (...)
+                {
+                    lock.lock();
+                    failed = true;
+                    ready_cv.notify_all();
+                    throw;
+                }
+                lock.lock();
+
+                done++;
+                for (auto& next: m_plan[s].successors)
+                {
+                    if (--m_pending[next] == 0)
+                        m_ready.push_back(next);
+                }
+                ready_cv.notify_all();
+            }
+        });
     }
 
-    std::vector<int> Network::getCategory(const LayerData& data) const
+    void Network::getCategory(const LayerData& data, std::vector<int>& categories) const
     {
-        std::vector<int> retval;
-
         for (size_t t = 0; t < data.getTrainNum(); t++)
         {
-            const float* out = data.get(LayerData::DataIndex::ACTIVATION)
+            const float* out = data.getRead(LayerData::DataIndex::ACTIVATION)
                     + (t * data.getDataNum());
             int maxi=0;
 
@@ -496,68 +821,454 @@ namespace NeuralNet
                     maxi = i;
             }
 
-            retval.push_back(maxi);
+            categories.push_back(maxi);
         }
-
-        return retval;
     }
 
     void Network::backPropagate()
     {
-        /* error value initialization of non-output layers at the beginning of the calculation */
+        /* error value initialization of non-output layers at the beginning of the calculation.
+         * the backward kernels overwrite the errors on the device, and the ones of the
+         * output layers are uploaded when the first kernel reads them */
+        for (auto& step: m_plan)
+        {
+            if (!m_uses_gpu && !step.is_leaf)
+            {
+                // parents of a merger only clear their own slice of its errors
+                auto& data = *step.data;
+                for (size_t t = 0; t < data.getTrainNum(); t++)
+                {
+                    memset(data.get(LayerData::DataIndex::ERROR) + t * data.getStride(), 0,
+                            sizeof(float) * data.getDataNum());
+                }
+            }
+        }
+
+        // traverse the plan backwards; the GPU versions run on the same data
+        auto* cl_input = dynamic_cast<CLLayerData *>(m_input_data.get());
+        for (auto it = m_plan.rbegin(); it != m_plan.rend(); it++)
+        {
+            auto& step = *it;
+            if (m_uses_gpu)
+                step.layer->backward(step.cl_prev ? *step.cl_prev : *cl_input, *step.cl_data);
+            else
+                step.layer->backward(step.prev ? *step.prev : *m_input_data, *step.data);
+
+            if (step.merger)
+                step.merger->distribute(step.merge_parents, *step.prev);
+        }
+    }
+
+    void Network::sortNodes()
+    {
+        /* Kahn's algorithm, one level of ready nodes at a time: a node is at the
+         * level after the last one of its parents, so the nodes of one level never
+         * depend on each other */
+        std::map<NodeID, size_t> in_degree;
+        for (auto& node_pair: node_map)
+            in_degree[node_pair.first];
         for (auto& node_pair: node_map)
         {
-            if (std::find(m_leaf_idx.begin(), m_leaf_idx.end(), node_pair.first)
-                    == m_leaf_idx.end())
+            for (auto& next_id: node_pair.second->next_id)
+                in_degree[next_id]++;
+        }
+
+        std::vector<NodeID> ready;
+        for (auto& degree_pair: in_degree)
+        {
+            if (degree_pair.second == 0)
+                ready.push_back(degree_pair.first);
+        }
+
+        m_node_order.clear();
+        m_level_bounds.assign(1, 0);
+        while (!ready.empty())
+        {
+            std::sort(ready.begin(), ready.end());
+            m_node_order.insert(m_node_order.end(), ready.begin(), ready.end());
+            m_level_bounds.push_back(m_node_order.size());
+
+            std::vector<NodeID> next_ready;
+            for (auto& id: ready)
             {
-                auto& node_data = *(node_pair.second->data);
-                memset(node_data.get(LayerData::DataIndex::ERROR), 0,
-                        sizeof(node_data.getDataNum() * node_data.getTrainNum() * sizeof(float)));
+                for (auto& next_id: node_map[id]->next_id)
+                {
+                    if (--in_degree[next_id] == 0)
+                        next_ready.push_back(next_id);
+                }
             }
+            ready.swap(next_ready);
         }
 
-        // traverse the nodes for back propagation
-        for (auto it_pair = node_map.rbegin(); it_pair != node_map.rend(); it_pair++)
+        if (m_node_order.size() != node_map.size())
+            throw NetworkException("the layers do not form an acyclic graph");
+    }
+
+    void Network::buildPlan()
+    {
+        m_plan.clear();
+        for (auto& id: m_node_order)
         {
-            backPropagateLayer(it_pair->first);
+            auto& node = *(node_map[id]);
+
+            PlanStep step;
+            step.layer = node.layer.get();
+            step.data = node.data.get();
+            step.prev = nullptr;
+            step.merger = nullptr;
+            step.is_leaf = node.next_id.empty();
+
+            if (std::find(m_start_idxes.begin(), m_start_idxes.end(), id)
+                    != m_start_idxes.end())
+            {
+                // the node is an input node; it reads the input given to feedForward()
+            }
+            else if (merger_map.find(id) != merger_map.end())
+            {
+                // the node is a merging node
+                auto& merge_node = *(merger_map[id]);
+                step.merger = merge_node.merger.get();
+                step.prev = merge_node.data.get();
+                for (auto& p_idx: merge_node.prev_id)
+                {
+                    // the others already wrote into the merged data
+                    if (!getInPlaceMerger(p_idx))
+                        step.merge_parents[p_idx] = node_map[p_idx]->data.get();
+                }
+            }
+            else
+            {
+                step.prev = node_map[node.prev_id]->data.get();
+            }
+
+            step.cl_data = dynamic_cast<CLLayerData *>(step.data);
+            step.cl_prev = dynamic_cast<CLLayerData *>(step.prev);
+            if (m_uses_gpu && (!step.cl_data || (step.prev && !step.cl_prev)))
+                throw NetworkException("layer data of the device path is not on the device");
+
+            step.dependency_num = 0;
+            m_plan.push_back(std::move(step));
+        }
+
+        /* a step depends on its parents and on the users of memory it reuses;
+         * the widest level bounds the number of steps which run at once */
+        std::map<NodeID, size_t> plan_idx;
+        for (size_t i = 0; i < m_node_order.size(); i++)
+            plan_idx[m_node_order[i]] = i;
+
+        auto add_dependency = [&](NodeID from, NodeID to) {
+            auto& successors = m_plan[plan_idx[from]].successors;
+            if (from == to || std::find(successors.begin(), successors.end(), plan_idx[to])
+                    != successors.end())
+                return;
+            successors.push_back(plan_idx[to]);
+            m_plan[plan_idx[to]].dependency_num++;
+        };
+        for (auto& id: m_node_order)
+        {
+            for (auto& next_id: node_map[id]->next_id)
+                add_dependency(id, next_id);
         }
+        for (auto& dep: m_memory_deps)
+            add_dependency(dep.first, dep.second);
+
+        m_lane_num = 1;
+        for (size_t level = 0; level + 1 < m_level_bounds.size(); level++)
+        {
+            m_lane_num = std::max(m_lane_num,
+                    m_level_bounds[level + 1] - m_level_bounds[level]);
+        }
+        m_lane_num = std::min(m_lane_num, m_thread_pool->getThreadNum());
+        m_pending.resize(m_plan.size());
+        m_ready.reserve(m_plan.size());
     }
 
-    void Network::prepareLayerData(size_t train_num)
+    void Network::prepareLayerData(size_t train_num, bool inference_only)
     {
-        if (m_input_data && train_num == m_input_data->getTrainNum())
+        /* a smaller batch only shrinks the logical size, so the tail chunk of
+         * evaluateAll() and the next full one reuse the same data, in the layout
+         * chosen for the capacity */
+        if (m_input_data && train_num <= m_input_data->getCapacity()
+                && inference_only == m_input_data->isInferenceOnly())
+        {
+            m_input_data->setTrainNum(train_num);
+            for (auto& node_pair: node_map)
+                node_pair.second->data->setTrainNum(train_num);
+            for (auto& node_pair: merger_map)
+                node_pair.second->data->setTrainNum(train_num);
             return;
+        }
 
-        if (m_uses_gpu)
+        prepareWorkspace(train_num);
+        m_maps_in_buffers = m_uses_gpu && mapsInBuffers(train_num);
+        if (inference_only)
         {
-            if (m_in_type == InputType::VECTOR)
+            planInferenceData(train_num);
+            buildPlan();
+            return;
+        }
+        m_arena.clear();
+        m_arena.shrink_to_fit();
+        m_cl_arena = cl::Buffer();
+        m_memory_deps.clear();
+
+        m_input_data = createInputData(train_num, inference_only);
+
+        for (auto& node_pair: merger_map)
+        {
+            node_pair.second->data = std::move(
+                    node_pair.second->merger->createLayerData(train_num, inference_only,
+                        m_uses_gpu));
+        }
+        for (auto& node_pair: node_map)
+        {
+            auto* merger_node = getInPlaceMerger(node_pair.first);
+            if (merger_node)
             {
-                m_input_data = std::make_unique<CLBufferLayerData>(
-                        train_num, m_unit_size);
+                node_pair.second->data = merger_node->merger->createParentData(
+                        node_pair.first, *merger_node->data);
             }
             else
             {
-                m_input_data = std::make_unique<CLImageLayerData>(
-                        train_num,
-                        m_in_dim.width, m_in_dim.height, m_in_dim.channel_num,
-                        CLImageLayerData::Channel::INTENSITY);
+                node_pair.second->data = std::move(node_pair.second->layer->createLayerData(
+                            train_num, inference_only, m_maps_in_buffers));
             }
         }
-        else
+        buildPlan();
+    }
+
+    bool Network::inputInBuffer(size_t num_data) const
+    {
+        return m_in_type == InputType::VECTOR || mapsInBuffers(num_data);
+    }
+
+    bool Network::mapsInBuffers(size_t train_num) const
+    {
+        if (m_in_type == InputType::IMAGE && !CLImageLayerData::holdsMaps(train_num,
+                    m_in_dim.width, m_in_dim.height, m_in_dim.channel_num,
+                    CLImageLayerData::mapChannel()))
+            return true;
+
+        for (auto& node_pair: node_map)
+        {
+            if (!node_pair.second->layer->fitsImages(train_num))
+                return true;
+        }
+        return false;
+    }
+
+    std::unique_ptr<LayerData> Network::createInputData(size_t train_num,
+            bool inference_only)
+    {
+        if (!m_uses_gpu)
+            return std::make_unique<LayerData>(train_num, m_unit_size, inference_only);
+
+        if (m_in_type == InputType::VECTOR || m_maps_in_buffers)
+            return std::make_unique<CLBufferLayerData>(train_num, m_unit_size, inference_only);
+
+        return std::make_unique<CLImageLayerData>(
+                train_num,
+                m_in_dim.width, m_in_dim.height, m_in_dim.channel_num,
+                CLImageLayerData::mapChannel(), inference_only);
+    }
+
+    void Network::planInferenceData(size_t train_num)
+    {
+        /* step 0 fills the input; the levels of the plan are forwarded from step 1 on,
+         * reading their parents' data (or that of their merger). the nodes of a level
+         * may run at the same time, so they share their step */
+        std::map<NodeID, size_t> steps;
+        size_t num_steps = 1;
+        for (; num_steps < m_level_bounds.size(); num_steps++)
+        {
+            for (size_t i = m_level_bounds[num_steps - 1]; i < m_level_bounds[num_steps]; i++)
+                steps[m_node_order[i]] = num_steps;
+        }
+
+        /* on the device, the rows of buffers are planned in m_cl_arena as sub-buffers,
+         * whose origins keep the base address alignment of the device; the host
+         * copies share the same offsets in m_arena. images of maps have their own */
+        size_t align = 1;
+        if (m_uses_gpu)
+        {
+            auto device = CLContext::getInstance().getDevice();
+            align = std::max<size_t>(1,
+                    device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8 / sizeof(float));
+        }
+        auto in_rows = [this](const NodeID& id) {
+            return !m_uses_gpu || m_maps_in_buffers
+                || dynamic_cast<SigmoidLayer *>(node_map[id]->layer.get());
+        };
+        const bool input_in_rows = !m_uses_gpu || m_in_type == InputType::VECTOR
+            || m_maps_in_buffers;
+
+        MemoryPlanner planner;
+
+        /* the nodes writing into each buffer and all nodes using it; the merged node
+         * both reads its merger and copies the other parents into it */
+        struct BufferUse
+        {
+            size_t buffer, size, first_step, last_step;
+            std::vector<NodeID> writers, users;
+        };
+        std::vector<BufferUse> uses;
+        auto add_buffer = [&](size_t size, size_t first_step, size_t last_step,
+                std::vector<NodeID> writers, std::vector<NodeID> users) {
+            size = (size + align - 1) / align * align;
+            const size_t buffer = planner.addBuffer(size, first_step, last_step);
+            uses.push_back(BufferUse{buffer, size, first_step, last_step,
+                    std::move(writers), std::move(users)});
+            return buffer;
+        };
+
+        size_t input_last = 0;
+        for (auto& start_id: m_start_idxes)
+            input_last = std::max(input_last, steps[start_id]);
+        size_t input_buf = 0;
+        if (input_in_rows)
         {
-            m_input_data = std::make_unique<LayerData>(train_num, m_unit_size);
+            input_buf = add_buffer(train_num * m_unit_size, 0, input_last, {},
+                    m_start_idxes);
         }
 
+        // the outputs are read after the last step
+        std::map<NodeID, size_t> node_bufs, merger_bufs;
         for (auto& node_pair: node_map)
         {
-            node_pair.second->data =
-                    std::move(node_pair.second->layer->createLayerData(train_num));
+            if (getInPlaceMerger(node_pair.first) || !in_rows(node_pair.first))
+                continue;
+
+            size_t last_step = node_pair.second->next_id.empty() ? num_steps : 0;
+            for (auto& next_id: node_pair.second->next_id)
+                last_step = std::max(last_step, steps[next_id]);
+
+            std::vector<NodeID> users = node_pair.second->next_id;
+            users.push_back(node_pair.first);
+            node_bufs[node_pair.first] = add_buffer(
+                    train_num * node_pair.second->layer->getNeuronNum(),
+                    steps[node_pair.first], last_step, {node_pair.first}, users);
         }
-        for (auto& node_pair: merger_map)
+        for (auto& merger_pair: merger_map)
+        {
+            // read at the step of the merged node, and written from that of the first
+            // parent which writes into it in place
+            size_t first_step = steps[merger_pair.first];
+            std::vector<NodeID> writers = {merger_pair.first};
+            for (auto& p_idx: merger_pair.second->prev_id)
+            {
+                if (getInPlaceMerger(p_idx))
+                {
+                    first_step = std::min(first_step, steps[p_idx]);
+                    writers.push_back(p_idx);
+                }
+            }
+            merger_bufs[merger_pair.first] = add_buffer(
+                    train_num * merger_pair.second->merger->getNeuronNum(),
+                    first_step, steps[merger_pair.first], writers, writers);
+        }
+
+        planner.plan();
+        m_arena.resize(planner.getArenaSize());
+        m_cl_arena = cl::Buffer();
+        if (m_uses_gpu && planner.getArenaSize() > 0)
         {
-            node_pair.second->data =
-                    std::move(node_pair.second->merger->createLayerData(train_num));
+            m_cl_arena = cl::Buffer(CLContext::getInstance().getContext(), CL_MEM_READ_WRITE,
+                    sizeof(float) * planner.getArenaSize());
         }
+
+        /* feedForward() starts a node as soon as the nodes it depends on are done,
+         * not at its level. a node writing into memory of a buffer of earlier steps
+         * therefore waits for every node using that buffer as well */
+        m_memory_deps.clear();
+        for (auto& earlier: uses)
+        {
+            const size_t begin = planner.getOffset(earlier.buffer);
+            for (auto& later: uses)
+            {
+                const size_t offset = planner.getOffset(later.buffer);
+                if (earlier.last_step >= later.first_step
+                        || offset >= begin + earlier.size || begin >= offset + later.size)
+                    continue;
+
+                for (auto& user: earlier.users)
+                {
+                    for (auto& writer: later.writers)
+                        m_memory_deps.emplace_back(user, writer);
+                }
+            }
+        }
+
+        // data_num values of every sample in buffer of the arenas
+        auto planned_data = [&](size_t data_num, size_t buffer) -> std::unique_ptr<LayerData> {
+            float *activation = m_arena.data() + planner.getOffset(buffer);
+            if (!m_uses_gpu)
+                return std::make_unique<LayerData>(train_num, data_num, activation);
+
+            cl_buffer_region region{sizeof(float) * planner.getOffset(buffer),
+                sizeof(float) * train_num * data_num};
+            cl_int err;
+            cl::Buffer rows = m_cl_arena.createSubBuffer(CL_MEM_READ_WRITE,
+                    CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+            printError(err, "Error at Buffer::createSubBuffer in "
+                    "Network::planInferenceData");
+            return std::make_unique<CLBufferLayerData>(train_num, data_num, activation,
+                    rows);
+        };
+
+        m_input_data = input_in_rows ? planned_data(m_unit_size, input_buf)
+            : createInputData(train_num, true);
+        for (auto& merger_pair: merger_map)
+        {
+            merger_pair.second->data = planned_data(merger_pair.second->merger->getNeuronNum(),
+                    merger_bufs[merger_pair.first]);
+        }
+        for (auto& node_pair: node_map)
+        {
+            auto* merger_node = getInPlaceMerger(node_pair.first);
+            if (merger_node)
+            {
+                node_pair.second->data = merger_node->merger->createParentData(
+                        node_pair.first, *merger_node->data);
+                continue;
+            }
+            if (!in_rows(node_pair.first))
+            {
+                node_pair.second->data = node_pair.second->layer->createLayerData(
+                        train_num, true, m_maps_in_buffers);
+                continue;
+            }
+            node_pair.second->data = planned_data(node_pair.second->layer->getNeuronNum(),
+                    node_bufs[node_pair.first]);
+        }
+    }
+
+    void Network::prepareWorkspace(size_t train_num)
+    {
+        std::vector<size_t> layer_sizes;
+        WorkspaceParts parts;
+        for (auto& node_pair: node_map)
+        {
+            layer_sizes.push_back(node_pair.second->layer->getWorkspaceSize(train_num));
+            parts.take(layer_sizes.back());
+        }
+
+        // deriv_cost, softmax_output and batch_errors of the largest output layer
+        size_t max_output = 0;
+        for (auto& leaf_id: m_leaf_idx)
+            max_output = std::max(max_output, node_map[leaf_id]->layer->getNeuronNum());
+        parts.take(3 * train_num * max_output);
+
+        m_workspace.reserve(parts.size());
+
+        WorkspaceParts layer_parts(m_workspace.data());
+        size_t i = 0;
+        for (auto& node_pair: node_map)
+        {
+            node_pair.second->layer->setWorkspace(layer_parts.take(layer_sizes[i]),
+                    layer_sizes[i]);
+            i++;
+        }
+        m_output_scratch = layer_parts.take(3 * train_num * max_output);
     }
 
     // returns list of error values for each test case
@@ -573,14 +1284,11 @@ namespace NeuralNet
             auto& leaf_node = *(node_map[leaf_id]);
             auto output_nodes = leaf_node.data->getDataNum();
 
-            std::vector<float> sprime_z(m_batch_size * output_nodes, 0);
-            copy_vec(leaf_node.data->get(LayerData::DataIndex::INTER_VALUE),
-                    sprime_z.data(),
-                    output_nodes * m_batch_size);
-            apply_vec(sprime_z.data(), sprime_z.data(), output_nodes * m_batch_size,
-                    ActivationFuncs::f_sigmoid_prime);
+            const size_t out_num = output_nodes * m_batch_size;
+            float *deriv_cost = m_output_scratch;
+            float *softmax_output = deriv_cost + out_num;
+            float *batch_errors = softmax_output + out_num;
 
-            std::vector<float> deriv_cost(m_batch_size * output_nodes, 0);
             for (size_t j = 0; j < m_batch_size; j++)
             {
                 for (size_t k = 0; k < output_nodes; k++)
@@ -591,9 +1299,8 @@ namespace NeuralNet
             }
 
             // softmax output value calculation
-            std::vector<float> softmax_output(m_batch_size * output_nodes, 0);
-            apply_vec(leaf_node.data->get(LayerData::DataIndex::ACTIVATION),
-                    softmax_output.data(), output_nodes * m_batch_size,
+            apply_vec(leaf_node.data->getRead(LayerData::DataIndex::ACTIVATION),
+                    softmax_output, output_nodes * m_batch_size,
                     [](float in) -> float {
                         return std::exp(in);
                     });
@@ -611,13 +1318,12 @@ namespace NeuralNet
             }
 
             // error value calculation
-            std::vector<float> batch_errors(m_batch_size * output_nodes, 0);
-            apply_vec(softmax_output.data(), batch_errors.data(),
+            apply_vec(softmax_output, batch_errors,
                     output_nodes * m_batch_size,
                     [](float in) -> float {
                         return std::log(in);
                     });
-            pmul_vec(batch_errors.data(), deriv_cost.data(), batch_errors.data(),
+            pmul_vec(batch_errors, deriv_cost, batch_errors,
                     output_nodes * m_batch_size);
             for (size_t j = 0; j < m_batch_size; j++)
             {
@@ -629,14 +1335,16 @@ namespace NeuralNet
                 error_vals[batch_num*m_batch_size + j] += errorsum;
             }
 
-            add_vec(softmax_output.data(),
-                    deriv_cost.data(),
-                    deriv_cost.data(),
+            add_vec(softmax_output,
+                    deriv_cost,
+                    deriv_cost,
                     output_nodes * m_batch_size);
 
-            pmul_vec(sprime_z.data(), deriv_cost.data(),
-                    leaf_node.data->get(LayerData::DataIndex::ERROR),
-                    output_nodes * m_batch_size);
+            // error of the output layer = deriv_cost .* sigmoid'(z)
+            auto leaf_e = leaf_node.data->get(LayerData::DataIndex::ERROR);
+            copy_vec(deriv_cost, leaf_e, output_nodes * m_batch_size);
+            activation_prime_mul_vec(leaf_node.data->getRead(LayerData::DataIndex::INTER_VALUE),
+                    leaf_e, output_nodes * m_batch_size, Activation::SIGMOID);
         }
     }
 
@@ -673,9 +1381,8 @@ namespace NeuralNet
     void Network::train(const std::vector<float>& data,
             const std::vector< std::vector<int> >& category_list)
     {
-        std::vector<size_t> data_idxes;
-        for (size_t i=0; i<m_train_size; i++)
-            data_idxes.push_back(i);
+        std::vector<size_t> data_idxes(m_train_size);
+        std::iota(data_idxes.begin(), data_idxes.end(), 0);
 
         std::vector<size_t> batch_idxes(m_batch_size);
 
@@ -686,21 +1393,14 @@ namespace NeuralNet
 
         for (size_t epoch = 0; epoch < m_epoch_num; epoch++)
         {
-            prepareLayerData(m_batch_size);
+            prepareLayerData(m_batch_size, false);
             std::shuffle(data_idxes.begin(), data_idxes.end(), rgen);
 
             // enable dropout of sigmoid layers for training
-            for (auto& node_pair: node_map)
-            {
-                auto* layer_ptr = node_pair.second->layer.get();
-                auto* sigmoid_ptr = dynamic_cast<SigmoidLayer *>(layer_ptr);
-                if (sigmoid_ptr)
-                {
-                    sigmoid_ptr->setDropout(true);
-                }
-            }
+            setDropout(true);
 
             std::vector<float> error_vals(m_train_size, 0);
+            CLLayerData::resetTransferCounters();
 
             for (size_t batch_num = 0; batch_num * m_batch_size < m_train_size; batch_num++)
             {
@@ -709,18 +1409,9 @@ namespace NeuralNet
                     batch_idxes[i] = data_idxes[i + batch_num * m_batch_size];
                 }
 
+                /* every layer trains on the device; the arrays of the outputs which
+                 * calcOutputErrors() reads are the only ones coming back */
                 feedForward(data, batch_idxes);
-
-                for (auto& node_pair: node_map)
-                {
-                    auto* cl_layer_data = dynamic_cast<CLLayerData *>(node_pair.second->data.get());
-                    if (cl_layer_data)
-                    {
-                        cl_layer_data->getFromCL(LayerData::DataIndex::ACTIVATION);
-                        cl_layer_data->getFromCL(LayerData::DataIndex::INTER_VALUE);
-                    }
-                }
-
                 calcOutputErrors(category_list, batch_idxes, error_vals, batch_num);
                 backPropagate();
             }
@@ -736,6 +1427,13 @@ namespace NeuralNet
                 total_error += error;
             }
             std::cout << "total error = " << total_error << std::endl;
+            if (m_uses_gpu)
+            {
+                std::cout << "layer data transfers: " <<
+                    CLLayerData::getTotalUploadedBytes() << " bytes to the device, " <<
+                    CLLayerData::getTotalDownloadedBytes() << " bytes to the host" <<
+                    std::endl;
+            }
 
             total_errors.push_back(total_error);
             
@@ -775,66 +1473,4 @@ namespace NeuralNet
 
         std::cout << std::endl;
     }
-
-    std::vector<Network::NodeID> Network::feedForwardLayer(const Network::NodeID& in_idx)
-    {
-        auto& in_node = *(node_map[in_idx]);
-
-        if (std::find(m_start_idxes.begin(), m_start_idxes.end(), in_idx)
-                != m_start_idxes.end())
-        {
-            // the node is an input node
-            in_node.layer->forward(*(m_input_data), *(in_node.data), m_uses_gpu);
-        }
-        else if (merger_map.find(in_idx) != merger_map.end())
-        {
-            // the node is a merging node
-            auto& merge_node = *(merger_map[in_idx]);
-            for (auto& p_idx: merge_node.prev_id)
-            {
-                merge_node.merger->assign(p_idx, *(node_map[p_idx]->data),
-                        *(merge_node.data));
-            }
-            in_node.layer->forward(*(merge_node.data), *(in_node.data), m_uses_gpu);
-        }
-        else
-        {
-            auto& prev_node = *(node_map[in_node.prev_id]);
-            in_node.layer->forward(*(prev_node.data), *(in_node.data), m_uses_gpu);
-        }
-
-        return in_node.next_id;
-    }
-
-    const Network::NodeID Network::backPropagateLayer(const Network::NodeID& in_idx)
-    {
-        auto& in_node = *(node_map[in_idx]);
-
-        if (std::find(m_start_idxes.begin(), m_start_idxes.end(), in_idx)
-                != m_start_idxes.end())
-        {
-            // the node is an input node
-            in_node.layer->backward(*(m_input_data), *(in_node.data), m_uses_gpu);
-        }
-        else if (merger_map.find(in_idx) != merger_map.end())
-        {
-            // the node is a merging node
-            auto& merge_node = *(merger_map[in_idx]);
-            in_node.layer->backward(*(merge_node.data), *(in_node.data), m_uses_gpu);
-
-            std::map< NodeID, LayerData* > parent_datas;
-            for (auto& p_idx: merge_node.prev_id)
-            {
-                parent_datas[p_idx] = (node_map[p_idx]->data).get();
-            }
-            merge_node.merger->distribute(parent_datas, *(merge_node.data));
-        }
-        else
-        {
-            auto& prev_node = *(node_map[in_node.prev_id]);
-            in_node.layer->backward(*(prev_node.data), *(in_node.data), m_uses_gpu);
-        }
-
-        return in_node.prev_id;
-    }
 }
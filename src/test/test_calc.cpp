@@ -0,0 +1,1280 @@
+#include "calc/calc-cpu.hpp"
+#include "calc/gemm-cpu.hpp"
+#include "calc/winograd-cpu.hpp"
+#include "layers/sigmoid_layer.hpp"
+#include "layers/layer_data.hpp"
+#include "layers/cl_layer_data.hpp"
+#include "layers/conv_layer.hpp"
+#include "layers/max_pool_layer.hpp"
+#include "calc/util-functions.hpp"
+#include "utils/thread_pool.hpp"
+#include "memory_planner.hpp"
+#include "network.hpp"
+#include "test_utils.hpp"
+#include <iostream>
+#include <vector>
+#include <random>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <new>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace
+{
+    // every heap allocation of the program, see operator new below
+    std::atomic<size_t> heap_allocs(0);
+}
+
+void *operator new(size_t size)
+{
+    heap_allocs++;
+    if (void *ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    heap_allocs++;
+    return std::malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    operator delete(ptr);
+}
+
+namespace
+{
+    // runs the given computation with the scalar reference and with the given level
+    template <typename Func>
+    void compare(const std::string& name, NeuralNet::SIMDLevel level,
+            size_t res_dim, Func func, float tolerance = 1e-4)
+    {
+        std::vector<float> expected(res_dim, 0), actual(res_dim, 0);
+
+        NeuralNet::set_simd_level(NeuralNet::SIMDLevel::SCALAR);
+        func(expected.data());
+        NeuralNet::set_simd_level(level);
+        func(actual.data());
+
+        check(name, expected, actual, tolerance);
+    }
+
+    // C = alpha * op(A) * op(B) + beta * C, computed naively
+    void naive_sgemm(bool trans_a, bool trans_b, size_t m, size_t n, size_t k,
+            float alpha, const float *a, const float *b, float beta, float *c)
+    {
+        for (size_t i = 0; i < m; i++)
+        {
+            for (size_t j = 0; j < n; j++)
+            {
+                double sum = 0;
+                for (size_t p = 0; p < k; p++)
+                {
+                    float va = trans_a ? a[p*m + i] : a[i*k + p];
+                    float vb = trans_b ? b[j*k + p] : b[p*n + j];
+                    sum += va * vb;
+                }
+                c[i*n + j] = alpha * sum + beta * c[i*n + j];
+            }
+        }
+    }
+
+    std::vector<float> conv_weights(NeuralNet::ConvLayer& layer)
+    {
+        return coeff_values(layer.exportLayer()["weight"]);
+    }
+
+    std::vector<float> conv_biases(NeuralNet::ConvLayer& layer)
+    {
+        return coeff_values(layer.exportLayer()["bias"]);
+    }
+
+    std::string engine_name(NeuralNet::ConvLayer::Engine engine)
+    {
+        switch (engine)
+        {
+        case NeuralNet::ConvLayer::Engine::DIRECT:
+            return "direct";
+        case NeuralNet::ConvLayer::Engine::GEMM:
+            return "gemm";
+        case NeuralNet::ConvLayer::Engine::WINOGRAD:
+            return "winograd";
+        }
+        return "";
+    }
+
+    /* calls func with a layer of every kind on maps x img_w x img_h inputs: ConvLayer
+     * with each engine, with and without zero padding, MaxPoolLayer and SigmoidLayer */
+    void for_each_layer(size_t maps, size_t img_w, size_t img_h,
+            const std::function<void(const std::string&, NeuralNet::Layer&)>& func)
+    {
+        using namespace NeuralNet;
+
+        for (auto engine: {ConvLayer::Engine::DIRECT, ConvLayer::Engine::GEMM,
+                ConvLayer::Engine::WINOGRAD})
+        {
+            for (bool zero_pad: {true, false})
+            {
+                ConvLayer layer(ConvLayer::LayerSetting{maps, 3, img_w, img_h, 3,
+                        0.1, zero_pad, false, 0.01, engine}, ConvLayer::ActivationFunc::RELU);
+                func("ConvLayer " + engine_name(engine) + (zero_pad ? " zero pad" : " no pad"),
+                        layer);
+            }
+        }
+
+        MaxPoolLayer pool(MaxPoolLayer::Dimension{maps, img_w, img_h, 2, 2, 1, false});
+        func("MaxPoolLayer", pool);
+
+        SigmoidLayer sigmoid(SigmoidLayer::Setting({maps * img_w * img_h, 11, 0.01, 1.0,
+                    false, false, 0.01}));
+        func("SigmoidLayer", sigmoid);
+    }
+
+    // the categories of every output for the samples of unit values evaluated one by one
+    std::vector< std::vector<float> > evaluate_one_by_one(NeuralNet::Network& network,
+            const std::vector<float>& data, size_t unit)
+    {
+        std::vector< std::vector<float> > expected;
+        for (size_t i = 0; i < data.size() / unit; i++)
+        {
+            std::vector<float> sample(data.begin() + i * unit, data.begin() + (i + 1) * unit);
+            auto result = network.evaluateAll(sample);
+            expected.resize(result.size());
+            for (size_t out = 0; out < result.size(); out++)
+                expected[out].push_back(result[out][0]);
+        }
+        return expected;
+    }
+
+    void test_sgemm(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        // sizes crossing the micro kernel and cache block boundaries
+        const size_t sizes[][3] = { {1, 1, 1}, {7, 13, 5}, {16, 576, 25}, {131, 2100, 300} };
+        for (auto& sz: sizes)
+        {
+            const size_t m = sz[0], n = sz[1], k = sz[2];
+            auto a = random_vec(m * k, rgen);
+            auto b = random_vec(k * n, rgen);
+            auto c0 = random_vec(m * n, rgen);
+
+            for (int trans = 0; trans < 4; trans++)
+            {
+                const bool ta = trans & 1, tb = trans & 2;
+                auto expected = c0, actual = c0;
+                naive_sgemm(ta, tb, m, n, k, 0.7, a.data(), b.data(), 0.3, expected.data());
+                sgemm(ta, tb, m, n, k, 0.7, a.data(), ta ? m : k, b.data(), tb ? k : n,
+                        0.3, actual.data(), n);
+                check("sgemm " + std::to_string(m) + "x" + std::to_string(n) + "x"
+                        + std::to_string(k) + (ta ? " A^T" : "") + (tb ? " B^T" : ""),
+                        expected, actual, 1e-3);
+            }
+        }
+    }
+
+    // im2col + sgemm must match the per-map convolution_mat() loop of ConvLayer
+    void test_im2col_gemm(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const int img_w = 13, img_h = 11, recep = 5;
+        const size_t prev_maps = 3, cur_maps = 4, batch = 2;
+        auto img = random_vec(batch * prev_maps * img_w * img_h, rgen);
+        auto weight = random_vec(cur_maps * prev_maps * recep * recep, rgen);
+
+        for (bool zero_pad: {true, false})
+        {
+            const MatrixRange range = zero_pad ?
+                MatrixRange(-(recep/2), -(recep/2), img_w, img_h) :
+                MatrixRange(0, 0, img_w - recep + 1, img_h - recep + 1);
+            const size_t out_size = range.w * range.h;
+            const size_t col_rows = prev_maps * recep * recep;
+
+            std::vector<float> expected(batch * cur_maps * out_size, 0);
+            std::vector<float> temp(out_size);
+            for (size_t b = 0; b < batch; b++)
+            {
+                for (size_t nc = 0; nc < cur_maps; nc++)
+                {
+                    float *res = expected.data() + (b*cur_maps + nc) * out_size;
+                    for (size_t np = 0; np < prev_maps; np++)
+                    {
+                        convolution_mat(img.data() + (b*prev_maps + np) * img_w * img_h,
+                                weight.data() + (nc*prev_maps + np) * recep * recep,
+                                temp.data(), img_w, img_h, recep, recep, range);
+                        add_vec(res, temp.data(), res, out_size);
+                    }
+                }
+            }
+
+            std::vector<float> col(col_rows * batch * out_size);
+            std::vector<float> prod(cur_maps * batch * out_size);
+            im2col(img.data(), col.data(), img_w, img_h, prev_maps, recep, recep,
+                    range, batch);
+            sgemm(false, false, cur_maps, batch * out_size, col_rows, 1, weight.data(),
+                    col_rows, col.data(), batch * out_size, 0, prod.data(), batch * out_size);
+
+            // (map, sample, pixel) -> (sample, map, pixel)
+            std::vector<float> actual(expected.size());
+            for (size_t nc = 0; nc < cur_maps; nc++)
+                for (size_t b = 0; b < batch; b++)
+                    copy_vec(prod.data() + (nc*batch + b) * out_size,
+                            actual.data() + (b*cur_maps + nc) * out_size, out_size);
+
+            check(std::string("im2col + sgemm") + (zero_pad ? " zero pad" : " no pad"),
+                    expected, actual, 1e-4);
+        }
+    }
+
+    // winograd_convolution() must match the direct convolution_mat() loop
+    void test_winograd(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const int img_w = 13, img_h = 10;
+        const size_t prev_maps = 3, cur_maps = 5, batch = 2;
+        auto img = random_vec(batch * prev_maps * img_w * img_h, rgen);
+
+        for (int recep: {3, 5})
+        {
+            auto weight = random_vec(cur_maps * prev_maps * recep * recep, rgen);
+            std::vector<float> weight_t(winograd_transformed_size(recep)
+                    * cur_maps * prev_maps);
+            winograd_transform_weights(weight.data(), weight_t.data(),
+                    cur_maps, prev_maps, recep);
+
+            for (bool zero_pad: {true, false})
+            {
+                const MatrixRange range = zero_pad ?
+                    MatrixRange(-(recep/2), -(recep/2), img_w, img_h) :
+                    MatrixRange(0, 0, img_w - recep + 1, img_h - recep + 1);
+                const size_t out_size = range.w * range.h;
+
+                std::vector<float> expected(batch * cur_maps * out_size, 0);
+                std::vector<float> temp(out_size);
+                for (size_t b = 0; b < batch; b++)
+                {
+                    for (size_t nc = 0; nc < cur_maps; nc++)
+                    {
+                        float *res = expected.data() + (b*cur_maps + nc) * out_size;
+                        for (size_t np = 0; np < prev_maps; np++)
+                        {
+                            convolution_mat(img.data() + (b*prev_maps + np) * img_w * img_h,
+                                    weight.data() + (nc*prev_maps + np) * recep * recep,
+                                    temp.data(), img_w, img_h, recep, recep, range);
+                            add_vec(res, temp.data(), res, out_size);
+                        }
+                    }
+                }
+
+                std::vector<float> actual(expected.size());
+                winograd_convolution(img.data(), weight_t.data(), actual.data(),
+                        img_w, img_h, prev_maps, cur_maps, recep, range, batch);
+
+                check("winograd " + std::to_string(recep) + "x" + std::to_string(recep)
+                        + (zero_pad ? " zero pad" : " no pad"), expected, actual, 1e-3);
+            }
+        }
+    }
+
+    // the batched forward pass of SigmoidLayer must match the per-sample one
+    void test_sigmoid_forward(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t prev_d = 301, cur_d = 67, batch = 9;
+        SigmoidLayer layer(SigmoidLayer::Setting({prev_d, cur_d, 0.01, 1.0, false, false, 0}));
+
+        LayerData prev(batch, prev_d), current(batch, cur_d);
+        auto input = random_vec(batch * prev_d, rgen);
+        copy_vec(input.data(), prev.get(LayerData::DataIndex::ACTIVATION), batch * prev_d);
+        layer.forward_cpu(prev, current);
+
+        std::vector<float> expected(batch * cur_d), actual(batch * cur_d);
+        copy_vec(current.get(LayerData::DataIndex::ACTIVATION), actual.data(), batch * cur_d);
+
+        LayerData prev_one(1, prev_d), current_one(1, cur_d);
+        for (size_t i = 0; i < batch; i++)
+        {
+            copy_vec(input.data() + i * prev_d,
+                    prev_one.get(LayerData::DataIndex::ACTIVATION), prev_d);
+            layer.forward_cpu(prev_one, current_one);
+            copy_vec(current_one.get(LayerData::DataIndex::ACTIVATION),
+                    expected.data() + i * cur_d, cur_d);
+        }
+
+        check("SigmoidLayer batched forward", expected, actual);
+    }
+
+    // SigmoidLayer::backward_cpu against a naive per-sample computation
+    void test_sigmoid_backward(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t prev_d = 83, cur_d = 29, batch = 7;
+        const float learn_rate = 0.1, decay = 0.01;
+        SigmoidLayer layer(SigmoidLayer::Setting({prev_d, cur_d, learn_rate, 1.0, false,
+                    false, decay}));
+
+        RandomData prev(batch, prev_d, rgen), current(batch, cur_d, rgen);
+        const auto& prev_a = prev.values[0];
+        const auto& prev_z = prev.values[1];
+        const auto& cur_e = current.values[2];
+        auto weight = coeff_values(layer.exportLayer()["weight"]);
+
+        std::vector<float> expected_e(batch * prev_d), expected_w(cur_d * prev_d);
+        for (size_t b = 0; b < batch; b++)
+        {
+            for (size_t j = 0; j < prev_d; j++)
+            {
+                float sum = 0;
+                for (size_t i = 0; i < cur_d; i++)
+                    sum += cur_e[b*cur_d + i] * weight[i*prev_d + j];
+                expected_e[b*prev_d + j] = sum
+                    * ActivationFuncs::f_sigmoid_prime(prev_z[b*prev_d + j]);
+            }
+        }
+        for (size_t i = 0; i < cur_d; i++)
+        {
+            for (size_t j = 0; j < prev_d; j++)
+            {
+                float grad = 0;
+                for (size_t b = 0; b < batch; b++)
+                    grad += cur_e[b*cur_d + i] * prev_a[b*prev_d + j];
+                expected_w[i*prev_d + j] = weight[i*prev_d + j] * (1 - learn_rate * decay)
+                    - learn_rate * grad / batch;
+            }
+        }
+
+        auto prev_data = prev.layerData();
+        auto cur_data = current.layerData();
+        layer.backward_cpu(*prev_data, *cur_data);
+
+        check("SigmoidLayer backward error", expected_e,
+                values_of(*prev_data, LayerData::DataIndex::ERROR));
+        check("SigmoidLayer backward weight", expected_w,
+                coeff_values(layer.exportLayer()["weight"]));
+    }
+
+    /* ConvLayer backward pass of every engine: the errors must match each other and
+     * the updated weights and biases a naive gradient of the forward convolution, so
+     * that the engine setting never changes what training converges to */
+    void test_conv_backward(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t prev_maps = 2, cur_maps = 3, batch = 3;
+        const int img_w = 9, img_h = 7, recep = 3;
+        const float learn_rate = 0.1, decay = 0.01;
+        const ConvLayer::Engine engines[] = {ConvLayer::Engine::DIRECT,
+            ConvLayer::Engine::GEMM, ConvLayer::Engine::WINOGRAD};
+
+        for (bool zero_pad: {true, false})
+        {
+            ConvLayer::LayerSetting set{prev_maps, cur_maps, size_t(img_w), size_t(img_h),
+                size_t(recep), learn_rate, zero_pad, false, decay, ConvLayer::Engine::GEMM};
+            std::vector<std::unique_ptr<ConvLayer>> layers;
+            for (auto engine: engines)
+            {
+                set.engine = engine;
+                layers.emplace_back(new ConvLayer(set, ConvLayer::ActivationFunc::RELU));
+            }
+
+            auto coeffs = layers[0]->exportLayer();
+            for (auto& layer: layers)
+                layer->importLayer(coeffs);
+            auto weight = conv_weights(*layers[0]);
+            auto bias = conv_biases(*layers[0]);
+
+            const MatrixRange range = zero_pad ?
+                MatrixRange(-(recep/2), -(recep/2), img_w, img_h) :
+                MatrixRange(0, 0, img_w - recep + 1, img_h - recep + 1);
+            const size_t in_size = img_w * img_h, out_size = range.w * range.h;
+            RandomData prev(batch, prev_maps * in_size, rgen);
+            RandomData current(batch, cur_maps * out_size, rgen);
+            const auto& prev_a = prev.values[0];
+            const auto& cur_e = current.values[2];
+
+            // dW[c][n][jj][ii] = sum over samples and outputs of e * (input under the tap)
+            std::vector<float> expected_w(weight.size());
+            for (size_t c = 0; c < cur_maps; c++)
+            for (size_t n = 0; n < prev_maps; n++)
+            for (int jj = 0; jj < recep; jj++)
+            for (int ii = 0; ii < recep; ii++)
+            {
+                float grad = 0;
+                for (size_t b = 0; b < batch; b++)
+                for (int j = 0; j < range.h; j++)
+                for (int i = 0; i < range.w; i++)
+                {
+                    int in_i = range.x + i + recep - ii - 1;
+                    int in_j = range.y + j + recep - jj - 1;
+                    if (in_i >= 0 && in_i < img_w && in_j >= 0 && in_j < img_h)
+                        grad += cur_e[(b*cur_maps + c)*out_size + j*range.w + i]
+                            * prev_a[(b*prev_maps + n)*in_size + in_j*img_w + in_i];
+                }
+                const size_t idx = ((c*prev_maps + n)*recep + jj)*recep + ii;
+                expected_w[idx] = weight[idx] * (1 - learn_rate * decay)
+                    - learn_rate * grad / batch;
+            }
+
+            std::vector<float> expected_b(bias);
+            for (size_t b = 0; b < batch; b++)
+                for (size_t k = 0; k < bias.size(); k++)
+                    expected_b[k] -= learn_rate * cur_e[b * bias.size() + k] / batch;
+
+            const std::string suffix = zero_pad ? " zero pad" : " no pad";
+            std::vector<float> direct_e;
+            for (size_t l = 0; l < layers.size(); l++)
+            {
+                auto prev_data = prev.layerData();
+                auto cur_data = current.layerData();
+                layers[l]->backward_cpu(*prev_data, *cur_data);
+
+                const std::string name = "ConvLayer " + engine_name(engines[l]) + " backward";
+                auto errors = values_of(*prev_data, LayerData::DataIndex::ERROR);
+                if (l == 0)
+                    direct_e = errors;
+                else
+                    check(name + " error" + suffix, direct_e, errors);
+                check(name + " weight" + suffix, expected_w, conv_weights(*layers[l]));
+                check(name + " bias" + suffix, expected_b, conv_biases(*layers[l]));
+            }
+        }
+    }
+
+    // forward passes into inference-only data must give the activations of the full data
+    void test_inference_data(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t maps = 3, img_w = 10, img_h = 8, batch = 4;
+        RandomData input(batch, maps * img_w * img_h, rgen);
+
+        auto run = [&](const std::string& name, Layer& layer, size_t train_num) {
+            auto prev = input.layerData(false, train_num);
+            auto prev_infer = input.layerData(true, train_num);
+            auto current = layer.createLayerData(train_num, false);
+            auto current_infer = layer.createLayerData(train_num, true);
+            layer.forward(*prev, *current, false);
+            layer.forward(*prev_infer, *current_infer, false);
+
+            check(name + " inference-only forward",
+                    values_of(*current, LayerData::DataIndex::ACTIVATION),
+                    values_of(*current_infer, LayerData::DataIndex::ACTIVATION));
+            check_true(name + " inference-only storage",
+                    !current_infer->get(LayerData::DataIndex::INTER_VALUE)
+                    && !current_infer->get(LayerData::DataIndex::ERROR));
+        };
+
+        for_each_layer(maps, img_w, img_h, [&](const std::string& name, Layer& layer) {
+            run(name, layer, batch);
+            run(name + " single", layer, 1);
+        });
+    }
+
+    // a smaller logical batch must not reallocate nor change the results
+    void test_layer_data_capacity(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t maps = 2, img_w = 9, img_h = 7, capacity = 5, batch = 3;
+        RandomData input(capacity, maps * img_w * img_h, rgen);
+
+        for (bool inference_only: {false, true})
+        {
+            const std::string mode = inference_only ? " inference" : " train";
+            for_each_layer(maps, img_w, img_h, [&](const std::string& name, Layer& layer) {
+                auto prev = input.layerData(inference_only);
+                auto current = layer.createLayerData(capacity, inference_only);
+                const float *a_before = current->get(LayerData::DataIndex::ACTIVATION);
+                prev->setTrainNum(batch);
+                current->setTrainNum(batch);
+
+                auto prev_exact = input.layerData(inference_only, batch);
+                auto current_exact = layer.createLayerData(batch, inference_only);
+                layer.forward(*prev, *current, false);
+                layer.forward(*prev_exact, *current_exact, false);
+
+                check(name + mode + " logical batch forward",
+                        values_of(*current_exact, LayerData::DataIndex::ACTIVATION),
+                        values_of(*current, LayerData::DataIndex::ACTIVATION));
+
+                current->setTrainNum(capacity);
+                bool thrown = false;
+                try
+                {
+                    current->setTrainNum(capacity + 1);
+                }
+                catch (const std::length_error&)
+                {
+                    thrown = true;
+                }
+                check_true(name + mode + " capacity kept",
+                        current->get(LayerData::DataIndex::ACTIVATION) == a_before
+                        && current->getCapacity() == capacity && thrown);
+            });
+        }
+    }
+
+    /* CLLayerData without a device: the transfers only count their bytes, so the
+     * bookkeeping of the two copies can be checked on any machine */
+    class HostCLLayerData: public NeuralNet::CLLayerData
+    {
+    public:
+        HostCLLayerData(size_t train_num, size_t data_num)
+            : CLLayerData(train_num, data_num) {}
+
+        virtual void copyToBuffer(DataIndex, const cl::Buffer&) const {}
+
+    protected:
+        virtual cl::Memory getCLMemory(DataIndex) const { return cl::Memory(); }
+        virtual size_t uploadArray(DataIndex, cl::CommandQueue&, cl::Event *) const
+        {
+            return bytes();
+        }
+        virtual size_t downloadArray(DataIndex) const { return bytes(); }
+
+    private:
+        size_t bytes() const { return sizeof(float) * getTrainNum() * getDataNum(); }
+    };
+
+    // host reads of device results must download once and keep the device copy valid
+    void test_cl_layer_data_reads()
+    {
+        using namespace NeuralNet;
+
+        const auto idx = LayerData::DataIndex::ACTIVATION;
+        HostCLLayerData data(3, 10);
+
+        // a kernel writes the activations, the host reads them twice, a kernel reads them
+        data.writeCL(idx);
+        const float *first = data.getRead(idx);
+        const float *second = data.getRead(idx);
+        data.readCL(idx);
+        check("CLLayerData repeated host reads",
+                {float(sizeof(float) * 3 * 10), 0, 1, 1},
+                {float(data.getDownloadedBytes()), float(data.getUploadedBytes()),
+                float(first == second),
+                float(data.getValidity(idx) == CLLayerData::Validity::BOTH)}, 0);
+
+        // a host write makes the device copy stale
+        data.get(idx);
+        check_true("CLLayerData host write",
+                data.getValidity(idx) == CLLayerData::Validity::HOST);
+    }
+
+    // with a workspace, the passes of the CPU layers must not touch the heap
+    void test_workspace(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t maps = 2, img_w = 10, img_h = 8, batch = 4;
+        RandomData input(batch, maps * img_w * img_h, rgen);
+
+        for_each_layer(maps, img_w, img_h, [&](const std::string& name, Layer& layer) {
+            Workspace workspace;
+            workspace.reserve(layer.getWorkspaceSize(batch));
+            layer.setWorkspace(workspace.data(), workspace.size());
+
+            auto prev = input.layerData();
+            auto current = layer.createLayerData(batch, false);
+            RandomData(batch, current->getDataNum(), rgen).fill(*current);
+
+            // the first passes may set up buffers of the calling thread
+            layer.forward(*prev, *current, false);
+            layer.backward(*prev, *current, false);
+
+            const size_t allocs_before = heap_allocs;
+            layer.forward(*prev, *current, false);
+            layer.backward(*prev, *current, false);
+            const size_t allocs = heap_allocs - allocs_before;
+
+            // a single allocation, or none for layers without scratch
+            const bool aligned = reinterpret_cast<std::uintptr_t>(workspace.data())
+                % Workspace::ALIGNMENT == 0;
+            check(name + " heap allocations", {0}, {float(allocs)}, 0);
+            check(name + " workspace", {float(workspace.size() > 0), 1},
+                    {float(workspace.getAllocCount()), float(aligned)}, 0);
+        });
+    }
+
+    // a small image network: GEMM convolution, max pooling and a sigmoid output
+    Json::Value small_network_setting(size_t img_w, size_t img_h, size_t max_eval_patch)
+    {
+        Json::Value setting;
+        setting["train_num"] = 0;
+        setting["batch_size"] = 1;
+        setting["epoch_num"] = 0;
+        setting["max_eval_patch"] = Json::UInt(max_eval_patch);
+        setting["learn_rate"] = 0.1;
+        setting["learn_rate_drop"]["enable"] = false;
+        setting["thread_num"] = 1;
+        setting["uses_gpu"] = false;
+        setting["input"]["type"] = "image";
+        setting["input"]["size"]["width"] = Json::UInt(img_w);
+        setting["input"]["size"]["height"] = Json::UInt(img_h);
+        setting["input"]["size"]["channel_num"] = 1;
+        setting["start_id"].append(0);
+
+        Json::Value conv;
+        conv["type"] = "convolution";
+        conv["id"] = 0;
+        conv["child"].append(1);
+        conv["dimensions"]["map_num"] = 3;
+        conv["dimensions"]["recep_size"] = 3;
+        conv["dimensions"]["enable_zero_pad"] = true;
+        conv["dimensions"]["engine"] = "gemm";
+        setting["layers"].append(conv);
+
+        Json::Value pool;
+        pool["type"] = "maxpool";
+        pool["id"] = 1;
+        pool["child"].append(2);
+        pool["dimensions"]["pool_width"] = 2;
+        pool["dimensions"]["pool_height"] = 2;
+        pool["dimensions"]["stride"] = 1;
+        setting["layers"].append(pool);
+
+        Json::Value sigmoid;
+        sigmoid["type"] = "sigmoid";
+        sigmoid["id"] = 2;
+        sigmoid["child"] = Json::Value(Json::arrayValue);
+        sigmoid["dimensions"]["size"] = 7;
+        setting["layers"].append(sigmoid);
+
+        return setting;
+    }
+
+    // bound, gathered and one-by-one inputs must be classified alike
+    void test_network_input(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t img_w = 8, img_h = 6, unit = img_w * img_h, num = 7, pad = 5;
+        Network network(small_network_setting(img_w, img_h, 3));
+
+        auto data = random_vec(num * unit, rgen);
+        std::vector<float> strided(num * (unit + pad));
+        for (size_t i = 0; i < num; i++)
+            copy_vec(data.data() + i * unit, strided.data() + i * (unit + pad), unit);
+
+        auto expected = evaluate_one_by_one(network, data, unit);
+        check("Network bound input", expected[0], to_float(network.evaluateAll(data)[0]), 0);
+        check("Network strided input", expected[0], to_float(network.evaluateAll(
+                        Network::InputSpan{strided.data(), num, unit + pad})[0]), 0);
+    }
+
+    // two branches on the same input, e.g. a coarse and a fine detector
+    Json::Value branch_network_setting(size_t img_w, size_t img_h, size_t thread_num)
+    {
+        auto setting = small_network_setting(img_w, img_h, 4);
+        setting["thread_num"] = Json::UInt(thread_num);
+        setting["start_id"].append(1);
+        setting["layers"] = Json::Value(Json::arrayValue);
+
+        for (int branch = 0; branch < 2; branch++)
+        {
+            Json::Value conv;
+            conv["type"] = "convolution";
+            conv["id"] = branch;
+            conv["child"].append(branch + 2);
+            conv["dimensions"]["map_num"] = 2 + branch;
+            conv["dimensions"]["recep_size"] = 3 + 2 * branch;
+            conv["dimensions"]["enable_zero_pad"] = true;
+            conv["dimensions"]["engine"] = branch ? "direct" : "gemm";
+            setting["layers"].append(conv);
+        }
+        for (int branch = 0; branch < 2; branch++)
+        {
+            Json::Value sigmoid;
+            sigmoid["type"] = "sigmoid";
+            sigmoid["id"] = branch + 2;
+            sigmoid["child"] = Json::Value(Json::arrayValue);
+            sigmoid["dimensions"]["size"] = 5 + branch;
+            setting["layers"].append(sigmoid);
+        }
+
+        return setting;
+    }
+
+    // concurrent branches must give the results of one-by-one evaluation
+    void test_network_branches(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t img_w = 9, img_h = 7, unit = img_w * img_h, num = 10;
+        Network network(branch_network_setting(img_w, img_h, 4));
+
+        auto data = random_vec(num * unit, rgen);
+        auto expected = evaluate_one_by_one(network, data, unit);
+        auto result = network.evaluateAll(data);
+        for (int branch = 0; branch < 2; branch++)
+        {
+            check("Network concurrent branch " + std::to_string(branch), expected[branch],
+                    to_float(result[branch]), 0);
+        }
+    }
+
+    /* two branches on the same input merged into one output; the first one writes
+     * into the merged data in place, the second one is copied as it feeds another
+     * output as well */
+    Json::Value merger_network_setting(size_t img_w, size_t img_h, size_t train_num)
+    {
+        auto setting = small_network_setting(img_w, img_h, 4);
+        setting["train_num"] = Json::UInt(train_num);
+        setting["batch_size"] = Json::UInt(train_num);
+        setting["epoch_num"] = 1;
+        setting["start_id"].append(1);
+        setting["layers"] = Json::Value(Json::arrayValue);
+
+        Json::Value conv;
+        conv["type"] = "convolution";
+        conv["id"] = 0;
+        conv["child"].append(2);
+        conv["dimensions"]["map_num"] = 2;
+        conv["dimensions"]["recep_size"] = 3;
+        conv["dimensions"]["enable_zero_pad"] = true;
+        conv["dimensions"]["engine"] = "gemm";
+        setting["layers"].append(conv);
+
+        Json::Value conv_direct;
+        conv_direct["type"] = "convolution";
+        conv_direct["id"] = 1;
+        conv_direct["child"].append(2);
+        conv_direct["child"].append(3);
+        conv_direct["dimensions"]["map_num"] = 3;
+        conv_direct["dimensions"]["recep_size"] = 5;
+        conv_direct["dimensions"]["enable_zero_pad"] = false;
+        setting["layers"].append(conv_direct);
+
+        for (int id = 2; id < 4; id++)
+        {
+            Json::Value sigmoid;
+            sigmoid["type"] = "sigmoid";
+            sigmoid["id"] = id;
+            sigmoid["child"] = Json::Value(Json::arrayValue);
+            sigmoid["dimensions"]["size"] = 3 + id;
+            setting["layers"].append(sigmoid);
+        }
+
+        return setting;
+    }
+
+    // a merged batch must give the results of one-by-one evaluation, before and after training
+    void test_network_merger(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t img_w = 8, img_h = 6, unit = img_w * img_h, num = 6;
+        Network network(merger_network_setting(img_w, img_h, num));
+        auto data = random_vec(num * unit, rgen);
+
+        auto check_batch = [&](const std::string& name) {
+            auto expected = evaluate_one_by_one(network, data, unit);
+            auto result = network.evaluateAll(data);
+            for (int out = 0; out < 2; out++)
+                check(name + " output " + std::to_string(out), expected[out],
+                        to_float(result[out]), 0);
+        };
+
+        check_batch("Network merger");
+
+        std::vector< std::vector<int> > categories(2);
+        for (size_t i = 0; i < num; i++)
+        {
+            for (int out = 0; out < 2; out++)
+            {
+                for (int k = 0; k < 5 + out; k++)
+                    categories[out].push_back(k == static_cast<int>(i) % (5 + out));
+            }
+        }
+        network.train(data, categories);
+        check_batch("Network merger trained");
+    }
+
+    /* a short and a long branch on the same input, merged into one output: the short
+     * one runs ahead of the levels of the long one, whose layers may reuse the memory
+     * the short one still reads */
+    Json::Value uneven_network_setting(size_t img_w, size_t img_h, size_t train_num)
+    {
+        auto setting = small_network_setting(img_w, img_h, 5);
+        setting["train_num"] = Json::UInt(train_num);
+        setting["batch_size"] = Json::UInt(train_num);
+        setting["epoch_num"] = 1;
+        setting["thread_num"] = 4;
+        setting["start_id"].append(1);
+        setting["layers"] = Json::Value(Json::arrayValue);
+
+        auto conv = [&](int id, std::vector<int> children, int map_num, int recep_size,
+                const char *engine) {
+            Json::Value layer;
+            layer["type"] = "convolution";
+            layer["id"] = id;
+            for (int child: children)
+                layer["child"].append(child);
+            layer["dimensions"]["map_num"] = map_num;
+            layer["dimensions"]["recep_size"] = recep_size;
+            layer["dimensions"]["enable_zero_pad"] = true;
+            layer["dimensions"]["engine"] = engine;
+            setting["layers"].append(layer);
+        };
+        // the short branch is the slow one
+        conv(0, {6}, 8, 7, "direct");
+        conv(1, {2}, 1, 3, "gemm");
+
+        Json::Value pool;
+        pool["type"] = "maxpool";
+        pool["id"] = 2;
+        pool["child"].append(3);
+        pool["dimensions"]["pool_width"] = 2;
+        pool["dimensions"]["pool_height"] = 2;
+        pool["dimensions"]["stride"] = 1;
+        setting["layers"].append(pool);
+
+        conv(3, {5, 6}, 2, 3, "winograd");
+
+        for (int id: {5, 6})
+        {
+            Json::Value sigmoid;
+            sigmoid["type"] = "sigmoid";
+            sigmoid["id"] = id;
+            sigmoid["child"] = Json::Value(Json::arrayValue);
+            sigmoid["dimensions"]["size"] = id - 1;
+            setting["layers"].append(sigmoid);
+        }
+
+        return setting;
+    }
+
+    // steps started as soon as their inputs are ready must give the results of one-by-one evaluation
+    void test_network_uneven_branches(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t img_w = 24, img_h = 18, unit = img_w * img_h, num = 10;
+        Network network(uneven_network_setting(img_w, img_h, num));
+        auto data = random_vec(num * unit, rgen);
+
+        // strided, so that the input is copied into the planned memory
+        const size_t pad = 3;
+        std::vector<float> strided(num * (unit + pad));
+        for (size_t i = 0; i < num; i++)
+            copy_vec(data.data() + i * unit, strided.data() + i * (unit + pad), unit);
+
+        auto check_batch = [&](const std::string& name) {
+            // repeated, as the order of the steps changes from run to run
+            auto single = evaluate_one_by_one(network, data, unit);
+            std::vector<float> expected[2], actual[2];
+            for (int rep = 0; rep < 10; rep++)
+            {
+                auto result = network.evaluateAll(
+                        Network::InputSpan{strided.data(), num, unit + pad});
+                for (int out = 0; out < 2; out++)
+                {
+                    expected[out].insert(expected[out].end(), single[out].begin(),
+                            single[out].end());
+                    auto categories = to_float(result[out]);
+                    actual[out].insert(actual[out].end(), categories.begin(), categories.end());
+                }
+            }
+            for (int out = 0; out < 2; out++)
+                check(name + " output " + std::to_string(out), expected[out], actual[out], 0);
+        };
+
+        check_batch("Network uneven branches");
+
+        std::vector< std::vector<int> > categories(2);
+        for (size_t i = 0; i < num; i++)
+        {
+            for (int out = 0; out < 2; out++)
+            {
+                for (int k = 0; k < 4 + out; k++)
+                    categories[out].push_back(k == static_cast<int>(i) % (4 + out));
+            }
+        }
+        network.train(data, categories);
+        check_batch("Network uneven branches trained");
+    }
+
+    /* with a thread pool, the steps of training and the chunks of evaluation must not
+     * touch the heap: a run of four of them allocates as much as a run of one */
+    void test_network_allocations(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t img_w = 8, img_h = 6, unit = img_w * img_h, batch = 4, steps = 4;
+        auto data = random_vec(batch * steps * unit, rgen);
+        std::vector< std::vector<int> > categories(2);
+        for (size_t i = 0; i < batch * steps; i++)
+        {
+            for (int out = 0; out < 2; out++)
+            {
+                for (int k = 0; k < 5 + out; k++)
+                    categories[out].push_back(k == static_cast<int>(i) % (5 + out));
+            }
+        }
+        const std::vector<float> chunk(data.begin(), data.begin() + batch * unit);
+
+        size_t train_allocs[2], eval_allocs[2];
+        for (int run = 0; run < 2; run++)
+        {
+            auto setting = merger_network_setting(img_w, img_h, batch);
+            setting["train_num"] = Json::UInt(run ? batch * steps : batch);
+            setting["thread_num"] = 4;
+            Network network(setting);
+
+            // the first passes create the data, the workspace and the queues of the pool
+            network.train(data, categories);
+            network.evaluateAll(data);
+
+            size_t allocs_before = heap_allocs;
+            network.train(data, categories);
+            train_allocs[run] = heap_allocs - allocs_before;
+
+            allocs_before = heap_allocs;
+            network.evaluateAll(run ? data : chunk);
+            eval_allocs[run] = heap_allocs - allocs_before;
+        }
+
+        check("Network train step allocations", {float(train_allocs[0])},
+                {float(train_allocs[1])}, 0);
+        check("Network evaluateAll chunk allocations", {float(eval_allocs[0])},
+                {float(eval_allocs[1])}, 0);
+    }
+
+    // buffers which are live at the same step must not share memory
+    void test_memory_planner(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        // a chain of layers only needs its largest pair of neighbours
+        const std::vector<size_t> sizes = {300, 500, 100, 700, 200, 50};
+        MemoryPlanner chain;
+        for (size_t i = 0; i < sizes.size(); i++)
+            chain.addBuffer(sizes[i], i, i + 1);
+        chain.plan();
+        check("MemoryPlanner chain arena", {900},
+                {float(chain.getArenaSize())}, 0);
+
+        struct Interval { size_t size, first, last; };
+        std::vector<Interval> intervals;
+        std::uniform_int_distribution<size_t> size_dist(1, 1000), step_dist(0, 20);
+        MemoryPlanner planner;
+        for (int i = 0; i < 40; i++)
+        {
+            size_t s1 = step_dist(rgen), s2 = step_dist(rgen);
+            intervals.push_back({size_dist(rgen), std::min(s1, s2), std::max(s1, s2)});
+            planner.addBuffer(intervals.back().size, intervals.back().first,
+                    intervals.back().last);
+        }
+        planner.plan();
+
+        bool disjoint = planner.getArenaSize() <= planner.getTotalBufferSize();
+        for (size_t i = 0; i < intervals.size(); i++)
+        {
+            for (size_t j = i + 1; j < intervals.size(); j++)
+            {
+                if (intervals[i].last < intervals[j].first
+                        || intervals[j].last < intervals[i].first)
+                    continue;
+                size_t off_i = planner.getOffset(i), off_j = planner.getOffset(j);
+                disjoint = disjoint && (off_i + intervals[i].size <= off_j
+                        || off_j + intervals[j].size <= off_i);
+            }
+        }
+        check("MemoryPlanner random lifetimes", {1}, {float(disjoint)}, 0);
+
+        // layers work on views into an arena
+        const size_t in_dim = 40, out_dim = 13, batch = 3;
+        SigmoidLayer sigmoid(SigmoidLayer::Setting({in_dim, out_dim, 0.01, 1.0, false, false, 0}));
+        std::vector<float> arena(batch * (in_dim + out_dim));
+        LayerData prev_view(batch, in_dim, arena.data());
+        LayerData current_view(batch, out_dim, arena.data() + batch * in_dim);
+        RandomData input(batch, in_dim, rgen);
+        auto prev = input.layerData(true);
+        auto current = sigmoid.createLayerData(batch, true);
+        input.fill(prev_view);
+        sigmoid.forward(*prev, *current, false);
+        sigmoid.forward(prev_view, current_view, false);
+
+        check("LayerData arena view forward",
+                values_of(*current, LayerData::DataIndex::ACTIVATION),
+                std::vector<float>(arena.begin() + batch * in_dim, arena.end()));
+    }
+
+    // every layer must give the same results with and without a thread pool
+    void test_thread_pool(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        // more threads than cores, so that the chunks really interleave
+        ThreadPool pool(4);
+
+        {
+            const size_t num = 1000;
+            std::vector<std::atomic<int>> hits(num * num / 100);
+            for (auto& h: hits)
+                h = 0;
+            pool.parallelFor(0, num / 10, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++)
+                    pool.parallelFor(0, num / 10, [&](size_t b2, size_t e2) {
+                        for (size_t j = b2; j < e2; j++)
+                            hits[i * (num / 10) + j]++;
+                    });
+            });
+            std::vector<float> expected(hits.size(), 1), actual;
+            for (auto& h: hits)
+                actual.push_back(h);
+            check("ThreadPool nested parallelFor coverage", expected, actual, 0);
+
+            bool thrown = false;
+            try
+            {
+                pool.parallelFor(0, 100, [](size_t begin, size_t) {
+                    if (begin == 0)
+                        throw std::runtime_error("chunk error");
+                });
+            }
+            catch (const std::runtime_error&)
+            {
+                thrown = true;
+            }
+            check("ThreadPool exception propagation", {1}, {float(thrown)}, 0);
+        }
+
+        {
+            const size_t m = 131, n = 2100, k = 300;
+            auto a = random_vec(m * k, rgen);
+            auto b = random_vec(k * n, rgen);
+            auto expected = random_vec(m * n, rgen);
+            auto actual = expected;
+            sgemm(false, true, m, n, k, 0.7, a.data(), k, b.data(), k, 0.3, expected.data(), n);
+            sgemm(false, true, m, n, k, 0.7, a.data(), k, b.data(), k, 0.3, actual.data(), n,
+                    nullptr, &pool);
+            check("sgemm with thread pool", expected, actual, 1e-5);
+        }
+
+        // the same layer once on the calling thread and once on the pool
+        const size_t maps = 3, img_w = 10, img_h = 9, batch = 5;
+        RandomData input(batch, maps * img_w * img_h, rgen);
+        for_each_layer(maps, img_w, img_h, [&](const std::string& name, Layer& layer) {
+            const auto coeffs = layer.exportLayer();
+            std::unique_ptr<RandomData> errors;
+            std::vector<float> results[2][3];
+            for (int l = 0; l < 2; l++)
+            {
+                layer.importLayer(coeffs);
+                layer.setThreadPool(l ? &pool : nullptr);
+
+                auto prev = input.layerData();
+                auto current = layer.createLayerData(batch, false);
+                layer.forward(*prev, *current, false);
+                results[l][0] = values_of(*current, LayerData::DataIndex::ACTIVATION);
+
+                if (!errors)
+                    errors.reset(new RandomData(batch, current->getDataNum(), rgen));
+                errors->fill(*current);
+                layer.backward(*prev, *current, false);
+                results[l][1] = values_of(*prev, LayerData::DataIndex::ERROR);
+                results[l][2] = coeff_values(layer.exportLayer());
+            }
+            layer.setThreadPool(nullptr);
+
+            check(name + " forward with thread pool", results[0][0], results[1][0]);
+            check(name + " backward with thread pool", results[0][1], results[1][1]);
+            check(name + " update with thread pool", results[0][2], results[1][2]);
+        });
+    }
+
+    void test_simd_level(NeuralNet::SIMDLevel level)
+    {
+        using namespace NeuralNet;
+        std::mt19937 rgen(1234);
+
+        std::cout << "SIMD level: " << simd_level_name(level) << std::endl;
+
+        // odd sizes exercise the remainder loops
+        const size_t dim = 1027;
+        auto v1 = random_vec(dim, rgen);
+        auto v2 = random_vec(dim, rgen);
+
+        compare("add_vec", level, dim, [&](float *res) {
+            add_vec(v1.data(), v2.data(), res, dim);
+        });
+        compare("pmul_vec", level, dim, [&](float *res) {
+            pmul_vec(v1.data(), v2.data(), res, dim);
+        });
+        compare("copy_vec", level, dim, [&](float *res) {
+            copy_vec(v1.data(), res, dim);
+        });
+        compare("set_vec", level, dim, [&](float *res) {
+            set_vec(res, 0.5, dim);
+        });
+        compare("const_mul_vec", level, dim, [&](float *res) {
+            copy_vec(v1.data(), res, dim);
+            const_mul_vec(res, -0.3, dim);
+        });
+
+        // wide inputs reach the saturated ends of the sigmoid
+        auto wide = v1;
+        const_mul_vec(wide.data(), 40, dim);
+        for (auto func: {Activation::SIGMOID, Activation::RELU})
+        {
+            const std::string suffix = (func == Activation::SIGMOID) ? " sigmoid" : " relu";
+            compare("bias_activate_vec" + suffix, level, 2 * dim, [&](float *res) {
+                bias_activate_vec(wide.data(), v2.data(), res, res + dim, dim, func);
+            });
+            compare("activate_vec" + suffix, level, dim, [&](float *res) {
+                activate_vec(wide.data(), res, dim, func);
+            });
+            compare("activation_prime_mul_vec" + suffix, level, dim, [&](float *res) {
+                copy_vec(v2.data(), res, dim);
+                activation_prime_mul_vec(wide.data(), res, dim, func);
+            });
+        }
+
+        const size_t rows = 131, cols = 2309;
+        auto mat = random_vec(rows * cols, rgen);
+        auto vec = random_vec(cols, rgen);
+        compare("mul_mat_vec", level, rows, [&](float *res) {
+            mul_mat_vec(mat.data(), vec.data(), res, rows, cols);
+        });
+        compare("sum_vec", level, cols, [&](float *res) {
+            sum_vec(mat.data(), res, cols, rows);
+        });
+        compare("vec_outer_prod", level, rows * cols, [&](float *res) {
+            vec_outer_prod(mat.data(), vec.data(), res, rows, cols);
+        });
+
+        const size_t img_w = 24, img_h = 24;
+        auto img = random_vec(img_w * img_h, rgen);
+        compare("downsample_max 2x2", level, 12 * 12, [&](float *res) {
+            downsample_max(img.data(), res, img_w, img_h, 2, 2, 1);
+        });
+        compare("downsample_max 3x3/2", level, 11 * 11, [&](float *res) {
+            downsample_max(img.data(), res, img_w, img_h, 3, 3, 2);
+        });
+
+        // ties decide where upsample_max puts the errors
+        auto ties = random_vec(img_w * img_h, rgen);
+        for (auto& val: ties)
+            val = std::round(val * 2) / 2;
+        auto pool_e = random_vec(12 * 12, rgen);
+        compare("upsample_max 2x2", level, img_w * img_h, [&](float *res) {
+            upsample_max(pool_e.data(), ties.data(), res, img_w, img_h, 2, 2, 1);
+        });
+        compare("upsample_max 3x3/2", level, img_w * img_h, [&](float *res) {
+            upsample_max(pool_e.data(), ties.data(), res, img_w, img_h, 3, 3, 2);
+        });
+
+        // rows wider than the row buffers of the pooling kernels
+        const size_t long_w = 5003, long_h = 5;
+        auto long_img = random_vec(long_w * long_h, rgen);
+        for (auto& val: long_img)
+            val = std::round(val * 2) / 2;
+        compare("downsample_max wide 3x3/2", level, 2501 * 2, [&](float *res) {
+            downsample_max(long_img.data(), res, long_w, long_h, 3, 3, 2);
+        });
+        auto long_e = random_vec(2501 * 2, rgen);
+        compare("upsample_max wide 3x3/2", level, long_w * long_h, [&](float *res) {
+            upsample_max(long_e.data(), long_img.data(), res, long_w, long_h, 3, 3, 2);
+        });
+
+        compare("transpose_mat", level, 37 * 71, [&](float *res) {
+            transpose_mat(mat.data(), res, 37, 71);
+        });
+        compare("flip_mat", level, img_w * img_h, [&](float *res) {
+            flip_mat(img.data(), res, img_w, img_h);
+        });
+        compare("inflate_mats", level, 3 * 28 * 28, [&](float *res) {
+            inflate_mats(mat.data(), res, img_w, img_h, 2, 3);
+        });
+
+        for (int recep: {3, 5})
+        {
+            auto kernel = random_vec(recep * recep, rgen);
+            const std::string suffix = " " + std::to_string(recep) + "x" + std::to_string(recep);
+
+            compare("convolution_mat_same_zeros" + suffix, level, img_w * img_h,
+                    [&](float *res) {
+                convolution_mat_same_zeros(img.data(), kernel.data(), res,
+                        img_w, img_h, recep, recep);
+            });
+
+            const size_t valid_w = img_w - recep + 1, valid_h = img_h - recep + 1;
+            compare("convolution_mat_no_zeros" + suffix, level, valid_w * valid_h,
+                    [&](float *res) {
+                convolution_mat_no_zeros(img.data(), kernel.data(), res,
+                        img_w, img_h, recep, recep);
+            });
+
+            const size_t wide_w = img_w + recep - 1, wide_h = img_h + recep - 1;
+            compare("convolution_mat_wide_zeros" + suffix, level, wide_w * wide_h,
+                    [&](float *res) {
+                convolution_mat_wide_zeros(img.data(), kernel.data(), res,
+                        img_w, img_h, recep, recep);
+            });
+        }
+
+        set_simd_level(level);
+        test_sgemm(rgen);
+        test_im2col_gemm(rgen);
+        test_winograd(rgen);
+        test_sigmoid_forward(rgen);
+        test_sigmoid_backward(rgen);
+        test_conv_backward(rgen);
+        test_thread_pool(rgen);
+        test_inference_data(rgen);
+        test_memory_planner(rgen);
+        test_layer_data_capacity(rgen);
+        test_cl_layer_data_reads();
+        test_workspace(rgen);
+        test_network_input(rgen);
+        test_network_branches(rgen);
+        test_network_merger(rgen);
+        test_network_uneven_branches(rgen);
+        test_network_allocations(rgen);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    using namespace NeuralNet;
+
+    auto max_level = detect_simd_level();
+    std::cout << "detected SIMD level: " << simd_level_name(max_level) << std::endl;
+
+    for (int lv = static_cast<int>(SIMDLevel::SCALAR);
+            lv <= static_cast<int>(max_level); lv++)
+    {
+        test_simd_level(static_cast<SIMDLevel>(lv));
+    }
+    set_simd_level(max_level);
+
+    if (failures > 0)
+    {
+        std::cout << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
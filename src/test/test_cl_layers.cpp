@@ -0,0 +1,801 @@
+#include "calc/calc-cpu.hpp"
+#include "layers/layer_data.hpp"
+#include "layers/cl_layer_data.hpp"
+#include "layers/cl_image_layer_data.hpp"
+#include "layers/cl_buffer_layer_data.hpp"
+#include "layers/conv_layer.hpp"
+#include "layers/max_pool_layer.hpp"
+#include "layers/sigmoid_layer.hpp"
+#include "cl_context.hpp"
+#include "network.hpp"
+#include "test_utils.hpp"
+#include <iostream>
+#include <vector>
+#include <random>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <numeric>
+#include <exception>
+#include <memory>
+#include <utility>
+#include <cstdio>
+
+/* the OpenCL versions of the layers against their CPU versions on random data.
+ * needs an OpenCL device, e.g. a CPU runtime such as PoCL, and the kernels in
+ * ../cl_src; without a device every test is skipped */
+
+namespace
+{
+    // the same array of host data and device data
+    void check_array(const std::string& name, const NeuralNet::LayerData& expected,
+            const NeuralNet::LayerData& actual, NeuralNet::LayerData::DataIndex idx)
+    {
+        check(name, values_of(expected, idx), values_of(actual, idx));
+    }
+
+    /* a CPU layer and a device layer with the same coefficients on the same data:
+     * the forward pass, the errors of the previous layer, the coefficients updated on
+     * the device as exportLayer() fetches them, and a second forward pass with them */
+    void compare_passes(const std::string& name, NeuralNet::Layer& cpu,
+            NeuralNet::Layer& gpu, const RandomData& prev, NeuralNet::LayerData& prev_cpu,
+            NeuralNet::CLLayerData& prev_gpu, NeuralNet::CLLayerData& cur_gpu,
+            std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+        using Index = LayerData::DataIndex;
+
+        gpu.importLayer(cpu.exportLayer());
+        prev.fill(prev_cpu);
+        prev.fill(prev_gpu);
+        auto cur_cpu = cpu.createLayerData(prev.train_num, false);
+
+        cpu.forward(prev_cpu, *cur_cpu, false);
+        gpu.forward(prev_gpu, cur_gpu, true);
+        check_array(name + " forward z", *cur_cpu, cur_gpu, Index::INTER_VALUE);
+        check_array(name + " forward", *cur_cpu, cur_gpu, Index::ACTIVATION);
+
+        // the errors of the current layer come from the host on both
+        const size_t cur_num = prev.train_num * cpu.getNeuronNum();
+        auto cur_e = random_vec(cur_num, rgen);
+        copy_vec(cur_e.data(), cur_cpu->get(Index::ERROR), cur_num);
+        copy_vec(cur_e.data(), cur_gpu.get(Index::ERROR), cur_num);
+        cpu.backward(prev_cpu, *cur_cpu, false);
+        gpu.backward(prev_gpu, cur_gpu, true);
+        check_array(name + " backward error", prev_cpu, prev_gpu, Index::ERROR);
+        check(name + " backward coefficients", coeff_values(cpu.exportLayer()),
+                coeff_values(gpu.exportLayer()));
+
+        // the device keeps the updated coefficients for the next batch
+        cpu.forward(prev_cpu, *cur_cpu, false);
+        gpu.forward(prev_gpu, cur_gpu, true);
+        check_array(name + " forward after update", *cur_cpu, cur_gpu, Index::ACTIVATION);
+    }
+
+    // the forward pass of both layers into inference-only data, by the _infer kernels
+    void compare_inference(const std::string& name, NeuralNet::Layer& cpu,
+            NeuralNet::Layer& gpu, const NeuralNet::LayerData& prev_cpu,
+            const NeuralNet::CLLayerData& prev_gpu, NeuralNet::CLLayerData& cur_gpu)
+    {
+        using namespace NeuralNet;
+
+        auto cur_cpu = cpu.createLayerData(prev_cpu.getTrainNum(), true);
+        cpu.forward(prev_cpu, *cur_cpu, false);
+        gpu.forward(prev_gpu, cur_gpu, true);
+        check_array(name + " inference", *cur_cpu, cur_gpu, LayerData::DataIndex::ACTIVATION);
+    }
+
+    /* maps of train_num samples on the device: in images, in the layout of conv and
+     * pooling layers, or in buffers, as batches beyond the image limits are */
+    std::unique_ptr<NeuralNet::CLLayerData> device_maps(size_t train_num, size_t width,
+            size_t height, size_t map_num, bool buffered)
+    {
+        using namespace NeuralNet;
+        if (buffered)
+            return std::unique_ptr<CLLayerData>(new CLBufferLayerData(train_num,
+                        width * height * map_num));
+        return std::unique_ptr<CLLayerData>(new CLImageLayerData(train_num, width, height,
+                    map_num, CLImageLayerData::mapChannel()));
+    }
+
+    // the data of a device layer, with its maps in buffers if buffered
+    std::unique_ptr<NeuralNet::CLLayerData> device_data(NeuralNet::Layer& gpu,
+            size_t train_num, bool buffered, bool inference_only)
+    {
+        using namespace NeuralNet;
+        return std::unique_ptr<CLLayerData>(&dynamic_cast<CLLayerData&>(
+                    *gpu.createLayerData(train_num, inference_only, buffered).release()));
+    }
+
+    /* the kernels of conv and pooling layers on maps, as CLContext chooses them for
+     * the layers and data created afterwards, or the _buf ones for maps in buffers */
+    struct MapKernels
+    {
+        std::string name;
+        bool packs, tiles, buffers;
+    };
+
+    const MapKernels map_kernels[] = {
+        {"", false, false, false},
+        {" tiled", false, true, false},
+        {" packed", true, false, false},
+        {" buffered", false, false, true},
+    };
+
+    /* device data of random values through the device: uploaded by readCL(), made
+     * stale on the host by writeCL() and downloaded by getRead(), for every array;
+     * the activations also through copyToBuffer(), which must give the rows of
+     * CLBufferLayerData */
+    void check_round_trip(const std::string& name, NeuralNet::CLLayerData& data,
+            std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+        using Index = LayerData::DataIndex;
+
+        const size_t dim = data.getDataNum();
+        RandomData values(data.getTrainNum(), dim, rgen);
+        values.fill(data);
+
+        for (size_t i = 0; i < data.getArrayNum(); i++)
+        {
+            auto idx = static_cast<Index>(i);
+            data.readCL(idx);
+            data.writeCL(idx);
+            check(name + " round trip " + std::to_string(i), values.values[i],
+                    values_of(data, idx));
+        }
+
+        auto& context = CLContext::getInstance();
+        std::vector<float> rows(data.getTrainNum() * dim);
+        cl::Buffer buf(context.getContext(), CL_MEM_READ_WRITE, sizeof(float) * rows.size());
+        data.copyToBuffer(Index::ACTIVATION, buf);
+        context.getCommandQueue().enqueueReadBuffer(buf, CL_TRUE, 0,
+                sizeof(float) * rows.size(), rows.data());
+        check(name + " copyToBuffer",
+                values.values[static_cast<size_t>(Index::ACTIVATION)], rows);
+    }
+
+    /* CLImageLayerData in either channel, with map counts that fill the texels of
+     * packed maps or leave lanes of the last one empty */
+    void test_image_data(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+        using Channel = CLImageLayerData::Channel;
+
+        const size_t img_w = 7, img_h = 5, batch = 3;
+        for (auto ch: {Channel::INTENSITY, Channel::RGBA})
+        for (size_t maps: {1, 3, 4, 5, 8})
+        {
+            CLImageLayerData data(batch, img_w, img_h, maps, ch);
+            check_round_trip(std::string(ch == Channel::RGBA ? "CLImageLayerData packed "
+                        : "CLImageLayerData ") + std::to_string(maps) + " maps", data, rgen);
+        }
+    }
+
+    // CLBufferLayerData of training data and inference-only data
+    void test_buffer_data(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        for (bool inference_only: {false, true})
+        for (size_t dim: {1, 37, 256})
+        {
+            CLBufferLayerData data(5, dim, inference_only);
+            check_round_trip("CLBufferLayerData " + std::to_string(dim)
+                    + (inference_only ? " inference-only" : ""), data, rgen);
+        }
+
+        // a slice goes through the copies of the whole data, which keeps the rest
+        const size_t whole_d = 40, offset = 7, slice_d = 20;
+        for (bool inference_only: {false, true})
+        {
+            const std::string name = std::string("CLBufferLayerData slice")
+                + (inference_only ? " inference-only" : "");
+            CLBufferLayerData whole(5, whole_d, inference_only);
+            RandomData values(5, whole_d, rgen);
+            values.fill(whole);
+
+            CLBufferLayerData slice(whole, offset, slice_d);
+            check_round_trip(name, slice, rgen);
+            for (size_t i = 0; i < whole.getArrayNum(); i++)
+            {
+                auto idx = static_cast<LayerData::DataIndex>(i);
+                auto expected = values.values[i];
+                auto part = values_of(slice, idx);
+                for (size_t t = 0; t < 5; t++)
+                {
+                    std::copy(part.begin() + t * slice_d, part.begin() + (t + 1) * slice_d,
+                            expected.begin() + t * whole_d + offset);
+                }
+                check(name + " whole " + std::to_string(i), expected,
+                        values_of(whole, idx));
+            }
+        }
+    }
+
+    /* ConvLayer on the device against its direct engine, with either padding and
+     * activation function and each kernel variant. the maps are wider than a
+     * work-group of the tiled kernels, and neither side is a multiple of it */
+    void test_conv(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t prev_maps = 3, cur_maps = 5, batch = 3;
+        const size_t img_w = 21, img_h = 11;
+
+        auto& context = CLContext::getInstance();
+        const bool packs = context.packsMaps(), tiles = context.tilesConv();
+
+        for (auto& kernels: map_kernels)
+        for (size_t recep: {3, 5})
+        for (bool zero_pad: {true, false})
+        for (auto func: {ConvLayer::ActivationFunc::RELU, ConvLayer::ActivationFunc::SIGMOID})
+        {
+            context.setPacksMaps(kernels.packs);
+            context.setTilesConv(kernels.tiles);
+
+            ConvLayer::LayerSetting set{prev_maps, cur_maps, img_w, img_h, recep,
+                0.1, zero_pad, false, 0.01, ConvLayer::Engine::DIRECT};
+            ConvLayer cpu(set, func);
+            set.uses_gpu = true;
+            ConvLayer gpu(set, func);
+
+            RandomData prev(batch, prev_maps * img_w * img_h, rgen);
+            LayerData prev_cpu(batch, prev.dim);
+            auto prev_gpu = device_maps(batch, img_w, img_h, prev_maps, kernels.buffers);
+            auto cur_gpu = device_data(gpu, batch, kernels.buffers, false);
+            auto infer_gpu = device_data(gpu, batch, kernels.buffers, true);
+            const std::string name = "ConvLayer" + kernels.name + " " + std::to_string(recep)
+                    + "x" + std::to_string(recep) + (zero_pad ? " zero pad" : " no pad")
+                    + (func == ConvLayer::ActivationFunc::RELU ? " relu" : " sigmoid");
+            compare_passes(name, cpu, gpu, prev, prev_cpu, *prev_gpu, *cur_gpu, rgen);
+            compare_inference(name, cpu, gpu, prev_cpu, *prev_gpu, *infer_gpu);
+        }
+
+        context.setPacksMaps(packs);
+        context.setTilesConv(tiles);
+    }
+
+    // MaxPoolLayer on the device, with windows that do and do not cover the maps
+    void test_max_pool(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t maps = 5, img_w = 11, img_h = 8, batch = 3;
+
+        auto& context = CLContext::getInstance();
+        const bool packs = context.packsMaps();
+
+        for (auto& kernels: map_kernels)
+        for (size_t pool: {2, 3})
+        {
+            // pooling has no tiled kernels
+            if (kernels.tiles)
+                continue;
+            context.setPacksMaps(kernels.packs);
+
+            MaxPoolLayer::Dimension dim{maps, img_w, img_h, pool, pool, 1, false};
+            MaxPoolLayer cpu(dim);
+            dim.uses_gpu = true;
+            MaxPoolLayer gpu(dim);
+
+            RandomData prev(batch, maps * img_w * img_h, rgen);
+            LayerData prev_cpu(batch, prev.dim);
+            auto prev_gpu = device_maps(batch, img_w, img_h, maps, kernels.buffers);
+            auto cur_gpu = device_data(gpu, batch, kernels.buffers, false);
+            auto infer_gpu = device_data(gpu, batch, kernels.buffers, true);
+            const std::string name = "MaxPoolLayer" + kernels.name + " "
+                    + std::to_string(pool) + "x" + std::to_string(pool);
+            compare_passes(name, cpu, gpu, prev, prev_cpu, *prev_gpu, *cur_gpu, rgen);
+            compare_inference(name, cpu, gpu, prev_cpu, *prev_gpu, *infer_gpu);
+        }
+
+        context.setPacksMaps(packs);
+    }
+
+    /* SigmoidLayer on the device, after a fully-connected layer, whose data are rows
+     * in a buffer, and after maps in images of either channel, which the _img kernels
+     * read and the forward pass copies to rows; image_unpack_maps for packed ones */
+    void test_sigmoid(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t maps = 5, img_w = 6, img_h = 4, cur_d = 37, batch = 5;
+        const size_t prev_d = maps * img_w * img_h;
+        SigmoidLayer::Setting set{prev_d, cur_d, 0.1, 1.0, false, false, 0.01};
+        SigmoidLayer cpu(set);
+        set.uses_gpu = true;
+        SigmoidLayer gpu(set);
+
+        RandomData prev(batch, prev_d, rgen);
+        LayerData prev_cpu(batch, prev_d);
+        CLBufferLayerData prev_rows(batch, prev_d);
+        CLImageLayerData prev_maps(batch, img_w, img_h, maps,
+                CLImageLayerData::Channel::INTENSITY);
+        CLImageLayerData prev_packed(batch, img_w, img_h, maps,
+                CLImageLayerData::Channel::RGBA);
+        auto cur_gpu = gpu.createLayerData(batch, false);
+        compare_passes("SigmoidLayer", cpu, gpu, prev, prev_cpu, prev_rows,
+                dynamic_cast<CLLayerData&>(*cur_gpu), rgen);
+        compare_passes("SigmoidLayer after maps", cpu, gpu, prev, prev_cpu, prev_maps,
+                dynamic_cast<CLLayerData&>(*cur_gpu), rgen);
+        compare_passes("SigmoidLayer after packed maps", cpu, gpu, prev, prev_cpu,
+                prev_packed, dynamic_cast<CLLayerData&>(*cur_gpu), rgen);
+    }
+
+    /* the tiled sigmoid_forward on batches and layers that fill its work-groups and
+     * tiles partly or not at all, for training data and inference-only data, whose
+     * forward pass is sigmoid_forward_infer */
+    void test_sigmoid_shapes(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const std::pair<size_t, size_t> dims[] = {{13, 1}, {50, 37}, {70, 300}};
+        for (auto& dim: dims)
+        for (size_t batch: {1, 17, 33})
+        {
+            const size_t prev_d = dim.first, cur_d = dim.second;
+            const std::string name = "SigmoidLayer " + std::to_string(prev_d) + " to "
+                    + std::to_string(cur_d) + " batch " + std::to_string(batch);
+            SigmoidLayer::Setting set{prev_d, cur_d, 0.1, 1.0, false, false, 0.01};
+            SigmoidLayer cpu(set);
+            set.uses_gpu = true;
+            SigmoidLayer gpu(set);
+
+            RandomData prev(batch, prev_d, rgen);
+            LayerData prev_cpu(batch, prev_d);
+            CLBufferLayerData prev_gpu(batch, prev_d);
+            auto cur_gpu = gpu.createLayerData(batch, false);
+            compare_passes(name, cpu, gpu, prev, prev_cpu, prev_gpu,
+                    dynamic_cast<CLLayerData&>(*cur_gpu), rgen);
+
+            auto infer_gpu = gpu.createLayerData(batch, true);
+            compare_inference(name, cpu, gpu, prev_cpu, prev_gpu,
+                    dynamic_cast<CLLayerData&>(*infer_gpu));
+        }
+    }
+
+    /* dropout on the device: sigmoid_dropout_mask keeps about the given rate of the
+     * neurons and drops the others for the whole batch, with a new mask every batch.
+     * the backward pass must match the CPU one with the errors of the same mask */
+    void test_sigmoid_dropout(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+        using Index = LayerData::DataIndex;
+
+        const size_t prev_d = 50, cur_d = 400, batch = 4;
+        const float rate = 0.5;
+        SigmoidLayer cpu(SigmoidLayer::Setting{prev_d, cur_d, 0.1, 1.0, false, false, 0.01});
+        SigmoidLayer gpu(SigmoidLayer::Setting{prev_d, cur_d, 0.1, rate, true, true, 0.01});
+        gpu.importLayer(cpu.exportLayer());
+        gpu.setDropout(true);
+
+        RandomData prev(batch, prev_d, rgen);
+        LayerData prev_cpu(batch, prev_d);
+        CLBufferLayerData prev_gpu(batch, prev_d);
+        prev.fill(prev_cpu);
+        prev.fill(prev_gpu);
+        auto cur_cpu = cpu.createLayerData(batch, false);
+        auto cur_gpu = gpu.createLayerData(batch, false);
+
+        // the mask of a forward pass, from the activations dropped to zero
+        auto mask_of = [&](const std::vector<float>& expected, const std::vector<float>& a) {
+            std::vector<float> mask(cur_d);
+            bool consistent = true;
+            for (size_t c = 0; c < cur_d; c++)
+            {
+                mask[c] = (a[c] == 0) ? 0 : 1;
+                for (size_t t = 0; t < batch; t++)
+                {
+                    const float val = a[t * cur_d + c];
+                    consistent = consistent && (mask[c] == 0 ? val == 0
+                        : std::fabs(val - expected[t * cur_d + c]) <= 1e-4);
+                }
+            }
+            check_true("SigmoidLayer dropout mask", consistent);
+            return mask;
+        };
+
+        cpu.forward(prev_cpu, *cur_cpu, false);
+        const auto expected = values_of(*cur_cpu, Index::ACTIVATION);
+        gpu.forward(prev_gpu, *cur_gpu, true);
+        const auto mask = mask_of(expected, values_of(*cur_gpu, Index::ACTIVATION));
+        gpu.forward(prev_gpu, *cur_gpu, true);
+        const auto next_mask = mask_of(expected, values_of(*cur_gpu, Index::ACTIVATION));
+
+        const float kept = std::accumulate(mask.begin(), mask.end(), 0.0f) / cur_d;
+        check("SigmoidLayer dropout rate", {rate}, {kept}, 0.1);
+        check_true("SigmoidLayer dropout new mask", mask != next_mask);
+
+        // the dropped neurons pass no error back and keep their coefficients
+        auto cur_e = random_vec(batch * cur_d, rgen);
+        copy_vec(cur_e.data(), cur_gpu->get(Index::ERROR), batch * cur_d);
+        for (size_t t = 0; t < batch; t++)
+            pmul_vec(cur_e.data() + t * cur_d, next_mask.data(), cur_e.data() + t * cur_d, cur_d);
+        copy_vec(cur_e.data(), cur_cpu->get(Index::ERROR), batch * cur_d);
+        cpu.backward(prev_cpu, *cur_cpu, false);
+        gpu.backward(prev_gpu, *cur_gpu, true);
+        check_array("SigmoidLayer dropout backward error", prev_cpu, prev_gpu, Index::ERROR);
+        check("SigmoidLayer dropout backward coefficients", coeff_values(cpu.exportLayer()),
+                coeff_values(gpu.exportLayer()));
+    }
+
+    /* a sigmoid layer on the device writing its part of the rows of merged data, as
+     * the parent of a merger does: the forward pass fills that slice alone, and the
+     * backward pass reads the errors of the layer there */
+    void test_sigmoid_slice(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+        using Index = LayerData::DataIndex;
+
+        const size_t prev_d = 30, cur_d = 13, whole_d = 24, offset = 5, batch = 7;
+        SigmoidLayer cpu(SigmoidLayer::Setting{prev_d, cur_d, 0.1, 1.0, false, false, 0.01});
+        SigmoidLayer gpu(SigmoidLayer::Setting{prev_d, cur_d, 0.1, 1.0, false, true, 0.01});
+        gpu.importLayer(cpu.exportLayer());
+
+        RandomData prev(batch, prev_d, rgen), rest(batch, whole_d, rgen);
+        LayerData prev_cpu(batch, prev_d);
+        CLBufferLayerData prev_gpu(batch, prev_d);
+        prev.fill(prev_cpu);
+        prev.fill(prev_gpu);
+        CLBufferLayerData whole(batch, whole_d);
+        rest.fill(whole);
+        CLBufferLayerData cur_gpu(whole, offset, cur_d);
+        auto cur_cpu = cpu.createLayerData(batch, false);
+
+        cpu.forward(prev_cpu, *cur_cpu, false);
+        gpu.forward(prev_gpu, cur_gpu, true);
+        check_array("SigmoidLayer slice forward z", *cur_cpu, cur_gpu, Index::INTER_VALUE);
+        check_array("SigmoidLayer slice forward", *cur_cpu, cur_gpu, Index::ACTIVATION);
+
+        auto expected = rest.values[static_cast<size_t>(Index::ACTIVATION)];
+        auto cur_a = values_of(*cur_cpu, Index::ACTIVATION);
+        for (size_t t = 0; t < batch; t++)
+        {
+            std::copy(cur_a.begin() + t * cur_d, cur_a.begin() + (t + 1) * cur_d,
+                    expected.begin() + t * whole_d + offset);
+        }
+        check("SigmoidLayer slice whole rows", expected,
+                values_of(whole, Index::ACTIVATION));
+
+        auto cur_e = random_vec(batch * cur_d, rgen);
+        float *slice_e = cur_gpu.get(Index::ERROR);
+        copy_vec(cur_e.data(), cur_cpu->get(Index::ERROR), batch * cur_d);
+        for (size_t t = 0; t < batch; t++)
+            copy_vec(cur_e.data() + t * cur_d, slice_e + t * cur_gpu.getStride(), cur_d);
+        cpu.backward(prev_cpu, *cur_cpu, false);
+        gpu.backward(prev_gpu, cur_gpu, true);
+        check_array("SigmoidLayer slice backward error", prev_cpu, prev_gpu, Index::ERROR);
+        check("SigmoidLayer slice backward coefficients", coeff_values(cpu.exportLayer()),
+                coeff_values(gpu.exportLayer()));
+    }
+
+    /* a network on the device, or on the CPU, with two branches on the same input,
+     * one of them pooled, evaluated max_eval_patch samples at a time in eval_slots
+     * slots. the coefficients of every layer are kept in a file named after prefix */
+    Json::Value network_setting(size_t img_w, size_t img_h, size_t max_eval_patch,
+            size_t eval_slots, const std::string& prefix, bool uses_gpu = true)
+    {
+        Json::Value setting;
+        setting["train_num"] = 0;
+        setting["batch_size"] = 1;
+        setting["epoch_num"] = 0;
+        setting["max_eval_patch"] = Json::UInt(max_eval_patch);
+        setting["eval_slots"] = Json::UInt(eval_slots);
+        setting["learn_rate"] = 0.1;
+        setting["learn_rate_drop"]["enable"] = false;
+        setting["thread_num"] = 1;
+        setting["uses_gpu"] = uses_gpu;
+        setting["input"]["type"] = "image";
+        setting["input"]["size"]["width"] = Json::UInt(img_w);
+        setting["input"]["size"]["height"] = Json::UInt(img_h);
+        setting["input"]["size"]["channel_num"] = 1;
+        setting["start_id"].append(0);
+        setting["start_id"].append(1);
+
+        auto add_layer = [&](Json::Value layer, int id, int child) {
+            layer["id"] = id;
+            layer["child"] = Json::Value(Json::arrayValue);
+            if (child >= 0)
+                layer["child"].append(child);
+            layer["data_location"] = prefix + std::to_string(id) + ".json";
+            setting["layers"].append(layer);
+        };
+
+        // conv 0 -> maxpool 2 -> sigmoid 4 and conv 1 -> sigmoid 3
+        for (int branch = 0; branch < 2; branch++)
+        {
+            Json::Value conv;
+            conv["type"] = "convolution";
+            conv["dimensions"]["map_num"] = 3 + branch;
+            conv["dimensions"]["recep_size"] = 3 + 2 * branch;
+            conv["dimensions"]["enable_zero_pad"] = true;
+            conv["dimensions"]["engine"] = "direct";
+            add_layer(conv, branch, branch ? 3 : 2);
+        }
+
+        Json::Value pool;
+        pool["type"] = "maxpool";
+        pool["dimensions"]["pool_width"] = 2;
+        pool["dimensions"]["pool_height"] = 2;
+        pool["dimensions"]["stride"] = 1;
+        add_layer(pool, 2, 4);
+
+        for (int branch = 0; branch < 2; branch++)
+        {
+            Json::Value sigmoid;
+            sigmoid["type"] = "sigmoid";
+            sigmoid["dimensions"]["size"] = 7 + branch;
+            add_layer(sigmoid, 3 + branch, -1);
+        }
+
+        return setting;
+    }
+
+    /* evaluatePipelined() with two and three chunks in flight against the serial
+     * chunks of evaluateAll() with one slot, on the same coefficients, for a number
+     * of samples that leaves the last chunk partial */
+    void test_network_pipeline(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t img_w = 10, img_h = 8, num = 23, max_eval_patch = 4;
+        const std::string prefix = "test_cl_layers_network_";
+
+        Network serial(network_setting(img_w, img_h, max_eval_patch, 1, prefix));
+        serial.storeIntoFiles();
+
+        auto data = random_vec(num * img_w * img_h, rgen);
+        auto expected = serial.evaluateAll(data);
+        for (size_t slots: {2, 3})
+        {
+            Network pipelined(network_setting(img_w, img_h, max_eval_patch, slots,
+                        prefix));
+            pipelined.loadFromFiles();
+            auto result = pipelined.evaluateAll(data);
+            for (size_t out = 0; out < expected.size(); out++)
+            {
+                check("Network " + std::to_string(slots) + " eval slots output "
+                        + std::to_string(out),
+                        std::vector<float>(expected[out].begin(), expected[out].end()),
+                        std::vector<float>(result[out].begin(), result[out].end()), 0);
+            }
+        }
+
+        for (int id = 0; id < 5; id++)
+            std::remove((prefix + std::to_string(id) + ".json").c_str());
+    }
+
+    /* evaluateAll() on num_data samples on the device, uploaded through input,
+     * against evaluateAll() on the same samples on the host */
+    void check_bound_input(const std::string& name, NeuralNet::Network& network,
+            NeuralNet::CLLayerData& input, const std::vector<float>& data,
+            size_t num_data)
+    {
+        using namespace NeuralNet;
+        using Index = LayerData::DataIndex;
+
+        const size_t unit = input.getDataNum();
+        std::vector<float> samples(data.begin(), data.begin() + num_data * unit);
+        auto expected = network.evaluateAll(samples);
+
+        input.setTrainNum(num_data);
+        copy_vec(samples.data(), input.get(Index::ACTIVATION), samples.size());
+        auto result = network.evaluateAll(input.readCL(Index::ACTIVATION), num_data);
+        for (size_t out = 0; out < expected.size(); out++)
+        {
+            check(name + " output " + std::to_string(out), to_float(expected[out]),
+                    to_float(result[out]), 0);
+        }
+    }
+
+    /* input already on the device: an image of maps for the network of maps, and
+     * rows for a network of vector input, for a full and a smaller batch */
+    void test_network_bound_input(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t img_w = 10, img_h = 8, num = 7;
+        const std::string prefix = "test_cl_layers_bound_";
+        auto data = random_vec(num * img_w * img_h, rgen);
+
+        Network maps(network_setting(img_w, img_h, num, 1, prefix));
+        check_true("Network bound image input", !maps.inputInBuffer(num));
+        CLImageLayerData image(num, img_w, img_h, 1, CLImageLayerData::mapChannel());
+        for (size_t n: {num, num - 2})
+        {
+            check_bound_input("Network bound image " + std::to_string(n), maps, image,
+                    data, n);
+        }
+
+        // sigmoid 0 -> sigmoid 1 on the samples as vectors
+        auto setting = network_setting(img_w, img_h, num, 1, prefix);
+        setting["input"] = Json::Value();
+        setting["input"]["type"] = "vector";
+        setting["input"]["size"] = Json::UInt(img_w * img_h);
+        setting["start_id"] = Json::Value(Json::arrayValue);
+        setting["start_id"].append(0);
+        setting["layers"] = Json::Value(Json::arrayValue);
+        for (int id = 0; id < 2; id++)
+        {
+            Json::Value sigmoid;
+            sigmoid["type"] = "sigmoid";
+            sigmoid["id"] = id;
+            sigmoid["child"] = Json::Value(Json::arrayValue);
+            if (id == 0)
+                sigmoid["child"].append(1);
+            sigmoid["dimensions"]["size"] = 9 - 4 * id;
+            setting["layers"].append(sigmoid);
+        }
+
+        Network rows(setting);
+        check_true("Network bound vector input", rows.inputInBuffer(num));
+        CLBufferLayerData buffer(num, img_w * img_h);
+        for (size_t n: {num, num - 2})
+        {
+            check_bound_input("Network bound vector " + std::to_string(n), rows, buffer,
+                    data, n);
+        }
+    }
+
+    /* three parents merged into one output on the device: a sigmoid layer writing
+     * into the merged data in place, and a conv layer and a sigmoid layer which are
+     * copied in as they feed another output as well */
+    Json::Value merger_network_setting(size_t img_w, size_t img_h, size_t train_num,
+            const std::string& prefix, bool uses_gpu)
+    {
+        auto setting = network_setting(img_w, img_h, train_num, 1, prefix, uses_gpu);
+        setting["train_num"] = Json::UInt(train_num);
+        setting["batch_size"] = Json::UInt(train_num);
+        setting["epoch_num"] = 1;
+        setting["layers"] = Json::Value(Json::arrayValue);
+
+        auto add_layer = [&](Json::Value layer, int id, std::vector<int> children) {
+            layer["id"] = id;
+            layer["child"] = Json::Value(Json::arrayValue);
+            for (int child: children)
+                layer["child"].append(child);
+            layer["data_location"] = prefix + std::to_string(id) + ".json";
+            setting["layers"].append(layer);
+        };
+
+        // conv 0 -> sigmoid 2 -> 5, conv 1 -> 5 and sigmoid 3 -> 4 and 5
+        for (int branch = 0; branch < 2; branch++)
+        {
+            Json::Value conv;
+            conv["type"] = "convolution";
+            conv["dimensions"]["map_num"] = 3 - branch;
+            conv["dimensions"]["recep_size"] = 3;
+            conv["dimensions"]["enable_zero_pad"] = true;
+            conv["dimensions"]["engine"] = "direct";
+            add_layer(conv, branch, branch ? std::vector<int>{3, 5} : std::vector<int>{2});
+        }
+
+        const int sizes[] = {6, 4, 5, 7};
+        for (int id = 2; id < 6; id++)
+        {
+            Json::Value sigmoid;
+            sigmoid["type"] = "sigmoid";
+            sigmoid["dimensions"]["size"] = sizes[id - 2];
+            add_layer(sigmoid, id, (id == 2) ? std::vector<int>{5}
+                    : (id == 3) ? std::vector<int>{4, 5} : std::vector<int>{});
+        }
+
+        return setting;
+    }
+
+    /* the merger network on the device against the same one on the CPU, before and
+     * after a batch of training */
+    void test_network_merger(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t img_w = 8, img_h = 6, num = 6;
+        const std::string prefix = "test_cl_layers_merger_";
+
+        Network gpu(merger_network_setting(img_w, img_h, num, prefix, true));
+        gpu.storeIntoFiles();
+        Network cpu(merger_network_setting(img_w, img_h, num, prefix, false));
+        cpu.loadFromFiles();
+
+        auto data = random_vec(num * img_w * img_h, rgen);
+        auto check_outputs = [&](const std::string& name) {
+            auto expected = cpu.evaluateAll(data);
+            auto result = gpu.evaluateAll(data);
+            for (size_t out = 0; out < expected.size(); out++)
+            {
+                check(name + " output " + std::to_string(out), to_float(expected[out]),
+                        to_float(result[out]), 0);
+            }
+        };
+        check_outputs("Network merger");
+
+        std::vector< std::vector<int> > categories(2);
+        for (size_t i = 0; i < num; i++)
+        {
+            for (int out = 0; out < 2; out++)
+            {
+                for (int k = 0; k < 5 + 2 * out; k++)
+                    categories[out].push_back(k == static_cast<int>(i) % (5 + 2 * out));
+            }
+        }
+        gpu.train(data, categories);
+        cpu.train(data, categories);
+        check_outputs("Network merger trained");
+
+        for (int id = 0; id < 6; id++)
+            std::remove((prefix + std::to_string(id) + ".json").c_str());
+    }
+
+    /* maps of more pixels than the width of the device images: the network keeps
+     * all of its maps in buffers, and evaluates as the CPU does */
+    void test_network_large_maps(std::mt19937& rgen)
+    {
+        using namespace NeuralNet;
+
+        const size_t max_width = CLContext::getInstance().getDevice()
+            .getInfo<CL_DEVICE_IMAGE3D_MAX_WIDTH>();
+        const size_t img_w = static_cast<size_t>(std::sqrt(float(max_width))) + 1;
+        const size_t img_h = img_w, num = 3;
+        const std::string prefix = "test_cl_layers_large_maps_";
+
+        Network gpu(network_setting(img_w, img_h, num, 1, prefix));
+        check_true("Network large maps input in buffer", gpu.inputInBuffer(num));
+        gpu.storeIntoFiles();
+        Network cpu(network_setting(img_w, img_h, num, 1, prefix, false));
+        cpu.loadFromFiles();
+
+        auto data = random_vec(num * img_w * img_h, rgen);
+        auto expected = cpu.evaluateAll(data);
+        auto result = gpu.evaluateAll(data);
+        for (size_t out = 0; out < expected.size(); out++)
+        {
+            check("Network large maps output " + std::to_string(out),
+                    to_float(expected[out]), to_float(result[out]), 0);
+        }
+
+        // the rows of the same samples bound on the device
+        CLBufferLayerData input(num, img_w * img_h);
+        check_bound_input("Network large maps bound", gpu, input, data, num);
+
+        for (int id = 0; id < 5; id++)
+            std::remove((prefix + std::to_string(id) + ".json").c_str());
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    using namespace NeuralNet;
+
+    try
+    {
+        CLContext::getInstance();
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "no OpenCL device (" << e.what() << "), skipped" << std::endl;
+        return 0;
+    }
+
+    std::mt19937 rgen(1234);
+    test_image_data(rgen);
+    test_buffer_data(rgen);
+    test_conv(rgen);
+    test_max_pool(rgen);
+    test_sigmoid(rgen);
+    test_sigmoid_shapes(rgen);
+    test_sigmoid_dropout(rgen);
+    test_sigmoid_slice(rgen);
+    test_network_pipeline(rgen);
+    test_network_bound_input(rgen);
+    test_network_merger(rgen);
+    test_network_large_maps(rgen);
+
+    if (failures > 0)
+    {
+        std::cout << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
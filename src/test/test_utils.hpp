@@ -0,0 +1,133 @@
+#ifndef __TEST_UTILS_HPP
+#define __TEST_UTILS_HPP
+
+#include "calc/calc-cpu.hpp"
+#include "layers/layer_data.hpp"
+#include "json/json.h"
+#include <iostream>
+#include <vector>
+#include <random>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+
+/* the checks and random layer data shared by the test programs; each program
+ * includes this once and reports failures at the end of main() */
+
+namespace
+{
+    size_t failures = 0;
+
+    inline std::vector<float> random_vec(size_t dim, std::mt19937& rgen)
+    {
+        std::uniform_real_distribution<float> dis(-1, 1);
+        std::vector<float> v(dim);
+        for (auto& val: v)
+            val = dis(rgen);
+        return v;
+    }
+
+    // relative errors up to tolerance pass; a NaN or a size mismatch fails
+    inline void check(const std::string& name, const std::vector<float>& expected,
+            const std::vector<float>& actual, float tolerance = 1e-4)
+    {
+        float max_err = 0;
+        for (size_t i = 0; i < expected.size() && i < actual.size(); i++)
+        {
+            float err = std::fabs(expected[i] - actual[i])
+                    / std::max(1.0f, std::fabs(expected[i]));
+            max_err = std::max(max_err, err);
+        }
+
+        if (expected.size() != actual.size() || !(max_err <= tolerance))
+        {
+            std::cout << "  FAIL " << name << " (max error " << max_err << ")" << std::endl;
+            failures++;
+        }
+        else
+        {
+            std::cout << "  ok   " << name << std::endl;
+        }
+    }
+
+    inline void check_true(const std::string& name, bool condition)
+    {
+        check(name, {1}, {float(condition)}, 0);
+    }
+
+    inline std::vector<float> to_float(const std::vector<int>& categories)
+    {
+        return std::vector<float>(categories.begin(), categories.end());
+    }
+
+    /* random values for every array of train_num samples of dim values.
+     * layerData() gives fresh host data of the first train_num samples (0 for all
+     * of them) holding these values, fill() copies them into existing data, which
+     * may be device data */
+    struct RandomData
+    {
+        RandomData(size_t train_num, size_t dim, std::mt19937& rgen)
+            : train_num(train_num), dim(dim)
+        {
+            for (auto& array: values)
+                array = random_vec(train_num * dim, rgen);
+        }
+
+        std::unique_ptr<NeuralNet::LayerData> layerData(bool inference_only = false,
+                size_t num = 0) const
+        {
+            std::unique_ptr<NeuralNet::LayerData> data(new NeuralNet::LayerData(
+                        num ? num : train_num, dim, inference_only));
+            fill(*data);
+            return data;
+        }
+
+        void fill(NeuralNet::LayerData& data) const
+        {
+            for (size_t i = 0; i < data.getArrayNum(); i++)
+            {
+                float *array = data.get(static_cast<NeuralNet::LayerData::DataIndex>(i));
+                for (size_t t = 0; t < data.getTrainNum(); t++)
+                {
+                    NeuralNet::copy_vec(values[i].data() + t * dim,
+                            array + t * data.getStride(), dim);
+                }
+            }
+        }
+
+        size_t train_num, dim;
+        std::vector<float> values[NeuralNet::LayerData::DATA_COUNT];
+    };
+
+    // one array of the samples of data, downloaded first for device data
+    inline std::vector<float> values_of(const NeuralNet::LayerData& data,
+            NeuralNet::LayerData::DataIndex idx)
+    {
+        std::vector<float> values;
+        const float *array = data.getRead(idx);
+        for (size_t i = 0; i < data.getTrainNum(); i++)
+        {
+            values.insert(values.end(), array + i * data.getStride(),
+                    array + i * data.getStride() + data.getDataNum());
+        }
+        return values;
+    }
+
+    // all numbers of exported coefficients, in order
+    inline std::vector<float> coeff_values(const Json::Value& coeffs)
+    {
+        if (coeffs.isNumeric())
+            return {coeffs.asFloat()};
+
+        std::vector<float> values;
+        for (auto& coeff: coeffs)
+        {
+            auto part = coeff_values(coeff);
+            values.insert(values.end(), part.begin(), part.end());
+        }
+        return values;
+    }
+}
+
+#endif // __TEST_UTILS_HPP
@@ -0,0 +1,253 @@
+#include "utils/thread_pool.hpp"
+#include <algorithm>
+#include <exception>
+
+namespace NeuralNet
+{
+    namespace
+    {
+        // the pool and queue index of the current thread, if it is a worker
+        thread_local const ThreadPool *t_pool = nullptr;
+        thread_local size_t t_worker = 0;
+    }
+
+    struct ThreadPool::Job
+    {
+        explicit Job(ChunkFunc func) : func(func) {}
+
+        ChunkFunc func;
+        size_t end, chunk;
+        std::atomic<size_t> next;
+        std::atomic<size_t> remaining;
+
+        /* tickets still queued and workers holding a taken one; the caller may only
+         * leave parallelFor() once both are 0, as the job lives in its frame */
+        std::atomic<size_t> queued;
+        size_t holders = 0;
+
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr error;
+
+        // claims and runs chunks until none is left
+        void run()
+        {
+            while (true)
+            {
+                const size_t chunk_begin = next.fetch_add(chunk);
+                if (chunk_begin >= end)
+                    break;
+
+                try
+                {
+                    func(chunk_begin, std::min(end, chunk_begin + chunk));
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error)
+                        error = std::current_exception();
+                }
+
+                if (remaining.fetch_sub(1) == 1)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    done.notify_all();
+                }
+            }
+        }
+
+        // run() by a worker which took a ticket; the job is not touched afterwards
+        void runTicket()
+        {
+            run();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--holders == 0)
+                done.notify_all();
+        }
+    };
+
+    ThreadPool::ThreadPool(size_t thread_num)
+        : m_queued(0), m_stop(false), m_next_queue(0)
+    {
+        if (thread_num == 0)
+            thread_num = std::max(1u, std::thread::hardware_concurrency());
+
+        // room for the tickets of a few levels of nested calls in every queue
+        for (size_t i = 1; i < thread_num; i++)
+        {
+            m_workers.push_back(std::unique_ptr<Worker>(new Worker()));
+            m_workers.back()->jobs.reserve(thread_num * 4);
+        }
+        for (size_t i = 0; i < m_workers.size(); i++)
+            m_workers[i]->thread = std::thread(&ThreadPool::workerLoop, this, i);
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+
+        for (auto& worker: m_workers)
+            worker->thread.join();
+    }
+
+    void ThreadPool::parallelFor(size_t begin, size_t end, ChunkFunc func,
+            size_t min_chunk)
+    {
+        if (end <= begin)
+            return;
+
+        const size_t num = end - begin;
+        min_chunk = std::max(min_chunk, static_cast<size_t>(1));
+        if (m_workers.empty() || num <= min_chunk)
+        {
+            func(begin, end);
+            return;
+        }
+
+        // a few chunks per thread, so that threads finishing early can help others
+        const size_t per_chunk = std::max(min_chunk,
+                (num + getThreadNum() * 4 - 1) / (getThreadNum() * 4));
+        const size_t num_chunks = (num + per_chunk - 1) / per_chunk;
+
+        Job job(func);
+        job.end = end;
+        job.chunk = per_chunk;
+        job.next = begin;
+        job.remaining = num_chunks;
+
+        /* one ticket for each thread which may join. a worker queues its tickets in
+         * its own queue, where the others steal them from */
+        const size_t tickets = std::min(m_workers.size(), num_chunks - 1);
+        job.queued = tickets;
+        const bool from_worker = (t_pool == this);
+        for (size_t i = 0; i < tickets; i++)
+        {
+            const size_t queue = from_worker ? t_worker
+                : (m_next_queue.fetch_add(1) % m_workers.size());
+            std::lock_guard<std::mutex> lock(m_workers[queue]->mutex);
+            m_workers[queue]->jobs.push_back(&job);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queued += tickets;
+        }
+        m_cv.notify_all();
+
+        /* the caller only works on its own job while waiting, so the thread-local
+         * state of an outer loop is never touched by an unrelated one */
+        job.run();
+        {
+            std::unique_lock<std::mutex> lock(job.mutex);
+            job.done.wait(lock, [&job]() { return job.remaining == 0; });
+        }
+
+        // the tickets left would point into this frame once it is gone
+        if (job.queued > 0)
+            withdrawTickets(job);
+        {
+            std::unique_lock<std::mutex> lock(job.mutex);
+            job.done.wait(lock, [&job]() { return job.holders == 0; });
+        }
+
+        if (job.error)
+            std::rethrow_exception(job.error);
+    }
+
+    void ThreadPool::forEachThread(ChunkFunc func)
+    {
+        /* one chunk per thread. a thread holding a chunk waits for all the others,
+         * so it cannot take a second one and each chunk lands on another thread */
+        const size_t thread_num = getThreadNum();
+        std::mutex mutex;
+        std::condition_variable all_arrived;
+        size_t arrived = 0;
+
+        parallelFor(0, thread_num, [&](size_t begin, size_t end) {
+            func(begin, end);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if (++arrived == thread_num)
+                all_arrived.notify_all();
+            all_arrived.wait(lock, [&]() { return arrived == thread_num; });
+        });
+    }
+
+    void ThreadPool::withdrawTickets(Job& job)
+    {
+        size_t withdrawn = 0;
+        for (auto& worker: m_workers)
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            auto it = std::remove(worker->jobs.begin(), worker->jobs.end(), &job);
+            withdrawn += worker->jobs.end() - it;
+            worker->jobs.erase(it, worker->jobs.end());
+        }
+
+        job.queued -= withdrawn;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queued -= withdrawn;
+    }
+
+    void ThreadPool::workerLoop(size_t idx)
+    {
+        t_pool = this;
+        t_worker = idx;
+
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this]() { return m_stop || m_queued > 0; });
+                if (m_stop && m_queued == 0)
+                    return;
+            }
+
+            auto job = takeJob(idx);
+            if (job)
+                job->runTicket();
+        }
+    }
+
+    ThreadPool::Job *ThreadPool::takeJob(size_t idx)
+    {
+        Job *job = nullptr;
+
+        // the newest job of the own queue, then the oldest one of the others
+        for (size_t i = 0; i < m_workers.size() && !job; i++)
+        {
+            auto& worker = *m_workers[(idx + i) % m_workers.size()];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (worker.jobs.empty())
+                continue;
+
+            if (i == 0)
+            {
+                job = worker.jobs.back();
+                worker.jobs.pop_back();
+            }
+            else
+            {
+                job = worker.jobs.front();
+                worker.jobs.erase(worker.jobs.begin());
+            }
+
+            /* counted as a holder before the ticket leaves the queue lock, so the
+             * caller sees either the ticket or the holder */
+            std::lock_guard<std::mutex> job_lock(job->mutex);
+            job->holders++;
+            job->queued--;
+        }
+
+        if (job)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queued--;
+        }
+        return job;
+    }
+}
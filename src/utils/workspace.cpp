@@ -0,0 +1,21 @@
+#include "utils/workspace.hpp"
+#include <cstdint>
+
+namespace NeuralNet
+{
+    void Workspace::reserve(size_t size)
+    {
+        if (size <= m_size)
+            return;
+
+        // new[] only aligns to the fundamental alignment, so over-allocate
+        const size_t pad = ALIGNMENT / sizeof(float);
+        m_storage.reset(new float[size + pad]);
+
+        auto addr = reinterpret_cast<std::uintptr_t>(m_storage.get());
+        auto aligned = (addr + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        m_data = reinterpret_cast<float *>(aligned);
+        m_size = size;
+        m_alloc_count++;
+    }
+}